@@ -0,0 +1,434 @@
+#include <sys/stat.h>
+
+#define ACCESS_LOG_RING   1024        // Entries buffered per thread before new ones are dropped
+#define ACCESS_LOG_URI    512         // Longest request target kept
+#define ACCESS_LOG_FIELD  192         // Longest Referer and User-Agent kept
+#define ACCESS_LOG_BUFFER (256 << 10) // Lines written per write()
+#define ACCESS_LOG_IDLE_MS 20         // Writer's nap when every ring is empty
+
+/**
+ * One access log line, before formatting. Requests fill one in as they
+ * are routed, and hand it to their thread's ring once the response has
+ * been sent.
+ */
+typedef struct _access_entry_t {
+  long long time_ms;                  // Wall clock when the request arrived
+  long long start_us;                 // Monotonic clock when the request arrived
+  long long first_us;                 // Until the first byte was sent, -1 before
+  long long latency_us;               // Until the last byte was sent
+  unsigned long long offset;          // Where the response starts in the connection's output
+  unsigned long long length;          // Length of the response
+  unsigned long long head;            // Length of its status line and headers
+  unsigned long long bytes;           // Bytes of it actually sent
+  int status;                         // 0 until the response is staged
+  char client_ip[INET6_ADDRSTRLEN];
+  char method[16];
+  char protocol[16];
+  char uri[ACCESS_LOG_URI];
+  char referer[ACCESS_LOG_FIELD];
+  char user_agent[ACCESS_LOG_FIELD];
+} access_entry_t;
+
+/**
+ * Single producer, single consumer ring: the I/O thread that owns it
+ * appends, the writer thread consumes. Neither ever waits for the other,
+ * a full ring drops the entry and counts it.
+ */
+typedef struct _access_ring_t {
+  _Alignas(64) atomic_size_t head;    // Written by the I/O thread
+  _Alignas(64) atomic_size_t tail;    // Written by the writer
+  atomic_ulong dropped;
+  struct _access_ring_t *next;
+  access_entry_t entries[ACCESS_LOG_RING];
+} access_ring_t;
+
+_Atomic(access_ring_t *) access_rings;
+__thread access_ring_t *access_ring;
+atomic_ullong access_log_written;
+int access_log_fd = -1;
+
+/**
+ * Copy part of the receive buffer into a fixed size field
+ * @param out  Field
+ * @param cap  Size of the field
+ * @param buf  Receive buffer
+ * @param view Part to copy, truncated to fit
+ */
+void access_copy(char out[], size_t cap, const char *buf, http_view_t view) {
+  size_t len = view.length < cap - 1 ? view.length : cap - 1;
+  memcpy(out, buf + view.offset, len);
+  out[len] = '\0';
+}
+
+/**
+ * Start the access log entry for the request just parsed. Entries are
+ * kept for the latency and status metrics even when there is no log.
+ * @param conn Client connection, with its request parsed
+ * @see metrics.h
+ */
+void access_log_begin(connection_t *conn) {
+  if (conn->log_count == conn->log_cap) {
+    int cap = conn->log_cap ? conn->log_cap * 2 : 4;
+    access_entry_t *grown = realloc(conn->log_pending, sizeof(access_entry_t) * cap);
+    if (grown == NULL) return;
+    conn->log_pending = grown;
+    conn->log_cap = cap;
+  }
+  access_entry_t *entry = &conn->log_pending[conn->log_count++];
+  http_request_t *rq = &conn->request;
+  long long now = now_us();
+  entry->start_us = conn->request_us ? conn->request_us : now;
+  entry->first_us = -1;
+  entry->status = 0;
+  entry->length = entry->head = entry->bytes = 0;
+  entry->offset = conn->log_staged;
+  metrics_observe(HIST_PARSE, now - entry->start_us);
+  if (access_log_fd < 0) return;
+
+  struct timespec wall;
+  clock_gettime(CLOCK_REALTIME, &wall);
+  entry->time_ms = (long long)wall.tv_sec * 1000 + wall.tv_nsec / 1000000;
+  memcpy(entry->client_ip, conn->client_ip, sizeof(entry->client_ip));
+  access_copy(entry->method, sizeof(entry->method), conn->in, rq->method);
+  access_copy(entry->protocol, sizeof(entry->protocol), conn->in, rq->protocol);
+  access_copy(entry->uri, sizeof(entry->uri), conn->in, rq->uri);
+
+  http_header_t *header = http_find_header(conn->in, rq, "Referer");
+  entry->referer[0] = '\0';
+  if (header) access_copy(entry->referer, sizeof(entry->referer), conn->in, header->value);
+  header = http_find_header(conn->in, rq, "User-Agent");
+  entry->user_agent[0] = '\0';
+  if (header) access_copy(entry->user_agent, sizeof(entry->user_agent), conn->in, header->value);
+}
+
+/**
+ * Note the status and length of the response just staged, read back
+ * from its headers
+ * @param conn Client connection
+ */
+void access_log_staged(connection_t *conn) {
+  if (conn->log_count == 0) return;
+  access_entry_t *entry = &conn->log_pending[conn->log_count - 1];
+  if (entry->status != 0) return;
+
+  const char *start = conn->out + conn->response_start;
+  size_t len = conn->out_len - conn->response_start;
+  const char *end = memmem(start, len, "\r\n\r\n", 4);
+  if (len < 12 || end == NULL) return;
+  entry->status = atoi(start + 9);
+  entry->offset = conn->log_staged;
+  entry->length = entry->head = end + 4 - start;
+
+  /**
+   * Bodies that aren't in the output buffer are counted from
+   * Content-Length, HEAD and 304 responses have none
+   */
+  const char *length = memmem(start, end - start, "\r\nContent-Length: ", 18);
+  if (length != NULL && !conn->head_only && entry->status != 304) {
+    entry->length += strtoull(length + 18, NULL, 10);
+  }
+  conn->log_staged += entry->length;
+}
+
+/**
+ * Note when responses start going out, called as the bytes sent pass
+ * the start of the oldest response that hadn't
+ * @param conn Client connection
+ */
+void access_log_first_byte(connection_t *conn) {
+  long long now = 0;
+  while (conn->log_first < conn->log_count) {
+    access_entry_t *entry = &conn->log_pending[conn->log_first];
+    if (entry->status == 0 || conn->bytes_sent <= entry->offset) return;
+    if (now == 0) now = now_us();
+    entry->first_us = now - entry->start_us;
+    conn->log_first++;
+  }
+}
+
+/**
+ * Register this thread's ring with the writer
+ * @return Ring, NULL if out of memory
+ */
+access_ring_t *access_ring_create() {
+  access_ring_t *ring = calloc(1, sizeof(access_ring_t));
+  if (ring == NULL) return NULL;
+  ring->next = atomic_load(&access_rings);
+  while (!atomic_compare_exchange_weak(&access_rings, &ring->next, ring));
+  return ring;
+}
+
+/**
+ * Count every response that has gone out, or that never will because
+ * the connection is closing, and hand their entries to this thread's
+ * ring
+ * @param conn Client connection
+ */
+void access_log_sent(connection_t *conn) {
+  if (conn->log_count == 0) return;
+  long long now = now_us();
+  for (int i = 0; i < conn->log_count; i++) {
+    access_entry_t *entry = &conn->log_pending[i];
+    unsigned long long sent = conn->bytes_sent > entry->offset ? conn->bytes_sent - entry->offset : 0;
+    entry->bytes = sent < entry->length ? sent : entry->length;
+    entry->latency_us = now - entry->start_us;
+    if (entry->status == 0) entry->status = 499;  // Closed before the response was ready
+    metrics_response(entry->status, entry->bytes, entry->first_us, entry->latency_us);
+  }
+  conn->log_first = 0;
+  if (access_log_fd < 0 ||
+      (access_ring == NULL && (access_ring = access_ring_create()) == NULL)) {
+    conn->log_count = 0;
+    return;
+  }
+
+  access_ring_t *ring = access_ring;
+  for (int i = 0; i < conn->log_count; i++) {
+    access_entry_t *entry = &conn->log_pending[i];
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= ACCESS_LOG_RING) {
+      atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+      continue;
+    }
+    ring->entries[head % ACCESS_LOG_RING] = *entry;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  }
+  conn->log_count = 0;
+}
+
+/**
+ * Append a string to a log line, escaped for a quoted CLF field or a
+ * JSON string
+ * @param  p    Where to write, at least 6 bytes per input byte
+ * @param  str  String
+ * @param  json Escape for JSON
+ * @return End of what was written
+ */
+char *access_escape(char *p, const char *str, int json) {
+  for (; *str; str++) {
+    unsigned char c = *str;
+    if (c == '"' || c == '\\') {
+      *p++ = '\\';
+      *p++ = c;
+    }else if (c < 0x20 || c == 0x7f) {
+      p += sprintf(p, json ? "\\u%04x" : "\\x%02X", c);
+    }else{
+      *p++ = c;
+    }
+  }
+  return p;
+}
+
+/**
+ * Format one entry as a line of the configured format
+ * @param  out   Output, room for the longest line
+ * @param  entry Access log entry
+ * @return Length of the line
+ */
+size_t access_format(char *out, access_entry_t *entry) {
+  static time_t cached_sec = -1;
+  static char clf_time[40], iso_time[32];
+  time_t sec = entry->time_ms / 1000;
+  if (sec != cached_sec) {
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    strftime(clf_time, sizeof(clf_time), "%d/%b/%Y:%H:%M:%S %z", &tm);
+    gmtime_r(&sec, &tm);
+    strftime(iso_time, sizeof(iso_time), "%Y-%m-%dT%H:%M:%S", &tm);
+    cached_sec = sec;
+  }
+
+  /**
+   * The size logged is the body sent, as in CLF's %b. JSON also has the
+   * bytes sent with the headers.
+   */
+  unsigned long long body = entry->bytes > entry->head ? entry->bytes - entry->head : 0;
+  char *p = out;
+  if (ACCESS_LOG_FORMAT == LOG_FORMAT_JSON) {
+    p += sprintf(p, "{\"time\":\"%s.%03lldZ\",\"client\":\"%s\",\"method\":\"", iso_time,
+      entry->time_ms % 1000, entry->client_ip);
+    p = access_escape(p, entry->method, 1);
+    p = stpcpy(p, "\",\"uri\":\"");
+    p = access_escape(p, entry->uri, 1);
+    p = stpcpy(p, "\",\"protocol\":\"");
+    p = access_escape(p, entry->protocol, 1);
+    p += sprintf(p, "\",\"status\":%d,\"bytes\":%llu,\"sent\":%llu,\"latency_us\":%lld,\"referer\":\"",
+      entry->status, body, entry->bytes, entry->latency_us);
+    p = access_escape(p, entry->referer, 1);
+    p = stpcpy(p, "\",\"user_agent\":\"");
+    p = access_escape(p, entry->user_agent, 1);
+    p = stpcpy(p, "\"}\n");
+    return p - out;
+  }
+
+  /**
+   * Common Log Format, Combined adds Referer and User-Agent. Both end
+   * with the latency in microseconds.
+   */
+  p += sprintf(p, "%s - - [%s] \"", entry->client_ip, clf_time);
+  p = access_escape(p, entry->method, 0);
+  *p++ = ' ';
+  p = access_escape(p, entry->uri, 0);
+  if (entry->protocol[0]) *p++ = ' ';
+  p = access_escape(p, entry->protocol, 0);
+  if (body) {
+    p += sprintf(p, "\" %d %llu", entry->status, body);
+  }else{
+    p += sprintf(p, "\" %d -", entry->status);
+  }
+  if (ACCESS_LOG_FORMAT == LOG_FORMAT_COMBINED) {
+    p = stpcpy(p, " \"");
+    p = access_escape(p, entry->referer[0] ? entry->referer : "-", 0);
+    p = stpcpy(p, "\" \"");
+    p = access_escape(p, entry->user_agent[0] ? entry->user_agent : "-", 0);
+    *p++ = '"';
+  }
+  p += sprintf(p, " %lld\n", entry->latency_us);
+  return p - out;
+}
+
+/**
+ * Write a whole buffer, retrying short writes
+ * @param fd   File
+ * @param data Bytes
+ * @param len  Number of bytes
+ */
+void access_write(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return;
+    data += n;
+    len -= n;
+  }
+}
+
+/**
+ * Open the log file for appending
+ * @return File descriptor, -1 on error
+ */
+int access_log_open() {
+  if (strcmp(ACCESS_LOG, "-") == 0) return STDOUT_FILENO;
+  return open(ACCESS_LOG, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+}
+
+/**
+ * Move the log aside as FILE.YYYYmmdd-HHMMSS and start a new one
+ */
+void access_log_rotate() {
+  char rotated[strlen(ACCESS_LOG) + 48];
+  time_t now = time(NULL);
+  struct tm tm;
+  localtime_r(&now, &tm);
+  int len = snprintf(rotated, sizeof(rotated), "%s.", ACCESS_LOG);
+  len += strftime(rotated + len, sizeof(rotated) - len, "%Y%m%d-%H%M%S", &tm);
+
+  /**
+   * Size based rotation can come round twice in a second
+   */
+  for (int i = 1; access(rotated, F_OK) == 0 && i < 1000; i++) {
+    snprintf(rotated + len, sizeof(rotated) - len, ".%d", i);
+  }
+  if (rename(ACCESS_LOG, rotated) < 0) {
+    perror("Could not rotate access log");
+    return;
+  }
+  int fd = access_log_open();
+  if (fd < 0) {
+    perror("Could not reopen access log");
+    return;
+  }
+  close(access_log_fd);
+  access_log_fd = fd;
+}
+
+/**
+ * Writer thread: drain every ring into a buffer, write it with one
+ * call, and rotate the file when it is due
+ * @param arg Unused
+ */
+void *access_log_writer(void *arg) {
+  char *buf = malloc(ACCESS_LOG_BUFFER);
+  if (buf == NULL) return NULL;
+  size_t max_line = sizeof(access_entry_t) * 6 + 256;
+  struct stat st;
+  unsigned long long file_size = fstat(access_log_fd, &st) == 0 ? st.st_size : 0;
+  time_t next_rotation = ACCESS_LOG_ROTATE_SECS > 0 ?
+    (time(NULL) / ACCESS_LOG_ROTATE_SECS + 1) * ACCESS_LOG_ROTATE_SECS : 0;
+  int rotating = access_log_fd != STDOUT_FILENO;
+
+  while (1) {
+    size_t len = 0;
+    unsigned long long lines = 0;
+    for (access_ring_t *ring = atomic_load(&access_rings); ring; ring = ring->next) {
+      size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+      size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      for (; tail != head; tail++) {
+        if (len + max_line > ACCESS_LOG_BUFFER) {
+          access_write(access_log_fd, buf, len);
+          file_size += len;
+          len = 0;
+        }
+        len += access_format(buf + len, &ring->entries[tail % ACCESS_LOG_RING]);
+        lines++;
+      }
+      atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    if (len > 0) {
+      access_write(access_log_fd, buf, len);
+      file_size += len;
+    }
+    atomic_fetch_add(&access_log_written, lines);
+
+    if (rotating && ACCESS_LOG_ROTATE_SIZE > 0 && file_size >= ACCESS_LOG_ROTATE_SIZE) {
+      access_log_rotate();
+      file_size = 0;
+    }
+    if (rotating && next_rotation && time(NULL) >= next_rotation) {
+      access_log_rotate();
+      file_size = 0;
+      next_rotation += ACCESS_LOG_ROTATE_SECS;
+    }
+
+    if (lines == 0) {
+      struct timespec nap = { 0, ACCESS_LOG_IDLE_MS * 1000000L };
+      nanosleep(&nap, NULL);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Open the access log and start its writer
+ * @return 0 on success, -1 if the log could not be opened
+ */
+int start_access_log() {
+  if (ACCESS_LOG == NULL) return 0;
+  int fd = access_log_open();
+  if (fd < 0) {
+    perror("Could not open access log");
+    return -1;
+  }
+  access_log_fd = fd;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, access_log_writer, NULL) != 0) {
+    perror("Could not start access log writer");
+    access_log_fd = -1;
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+/**
+ * Print how many lines were logged and dropped
+ * @param out Stream
+ */
+void access_log_report(FILE *out) {
+  if (access_log_fd < 0) return;
+  unsigned long long dropped = 0;
+  for (access_ring_t *ring = atomic_load(&access_rings); ring; ring = ring->next) {
+    dropped += atomic_load(&ring->dropped);
+  }
+  fprintf(out, "Access log: %llu lines written, %llu dropped\n", atomic_load(&access_log_written), dropped);
+}
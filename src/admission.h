@@ -0,0 +1,148 @@
+#include <limits.h>
+
+/**
+ * Admission control for the pool queue, after CoDel (RFC 8289). Queue
+ * depth alone can't tell a burst the workers will soon absorb from a
+ * standing queue that only adds delay, but the time connections spend
+ * waiting can: once even the shortest wait over an interval is above
+ * --queue-target, the queue is standing and the acceptor starts
+ * shedding. While it is, an arrival whose estimated wait (the
+ * connections ahead of it times how long a worker keeps a connection)
+ * is above the target is turned away at once, and the rest at CoDel's
+ * rising rate, until the shortest wait drops back under the target.
+ *
+ * Shed clients get a canned 503 with Retry-After written by the
+ * acceptor itself, so they hear back at once instead of timing out, and
+ * connections that are admitted keep a short wait however hard the
+ * server is pushed.
+ */
+typedef struct {
+  atomic_llong min_wait;    // Shortest queue wait this interval, in us, lowered by workers
+  atomic_llong service_us;  // Moving average of how long a worker keeps a connection
+  // Acceptor only
+  long long interval_end;
+  long long drop_next;
+  unsigned int count;       // Sheds since dropping started, sets the rate
+  int dropping;
+} admission_t;
+
+#define ADMIT 0
+#define SHED_FULL 1
+#define SHED_WAIT 2
+
+admission_t admission = { .min_wait = LLONG_MAX };
+
+/**
+ * Connections shed because the queue was full, or because their wait
+ * would have been too long
+ * @see stats.h
+ */
+atomic_ullong socket_queue_full, socket_queue_shed;
+
+/**
+ * The canned response shed clients get
+ */
+char shed_response[256];
+size_t shed_response_len;
+
+/**
+ * Build the canned 503 from the status table
+ * @see status_table.h
+ */
+void admission_init() {
+  int index = 503 - STATUS_CODE_MIN;
+  shed_response_len = snprintf(shed_response, sizeof(shed_response),
+    "%.*sRetry-After: %d\r\nConnection: close\r\n\r\n%.*s",
+    (int)error_heads[index].len, error_heads[index].data, SHED_RETRY_AFTER,
+    (int)error_bodies[index].len, error_bodies[index].data);
+}
+
+/**
+ * Note how long a connection waited in the queue, from a worker
+ * @param wait Microseconds between accept and dequeue
+ */
+void admission_waited(long long wait) {
+  long long min = atomic_load_explicit(&admission.min_wait, memory_order_relaxed);
+  while (wait < min && !atomic_compare_exchange_weak_explicit(&admission.min_wait, &min, wait,
+    memory_order_relaxed, memory_order_relaxed));
+}
+
+/**
+ * Note how long a worker kept a connection, from a worker. Lost updates
+ * between workers only make the average a little less smooth.
+ * @param us Microseconds between dequeue and close
+ */
+void admission_served(long long us) {
+  long long average = atomic_load_explicit(&admission.service_us, memory_order_relaxed);
+  atomic_store_explicit(&admission.service_us, average + (us - average) / 8, memory_order_relaxed);
+}
+
+/**
+ * CoDel's control law: the time between sheds shrinks with the square
+ * root of how many there have been
+ */
+long long admission_next(long long now) {
+  unsigned int root = 1;
+  while ((root + 1) * (root + 1) <= admission.count) root++;
+  return now + (long long)QUEUE_INTERVAL * 1000 / root;
+}
+
+/**
+ * Decide whether the acceptor should queue a new connection
+ * @param  depth Connections already waiting
+ * @param  now   now_us()
+ * @return ADMIT, SHED_FULL or SHED_WAIT
+ */
+int admission_check(size_t depth, long long now) {
+  if (depth >= QUEUE_SIZE) return SHED_FULL;
+  if (QUEUE_TARGET <= 0) return ADMIT;
+  long long target = (long long)QUEUE_TARGET * 1000;
+
+  /**
+   * Once an interval, see whether the queue stood above the target the
+   * whole time. No worker taking a connection while some waited counts
+   * as standing too.
+   */
+  if (now >= admission.interval_end) {
+    long long min_wait = atomic_exchange_explicit(&admission.min_wait, LLONG_MAX, memory_order_relaxed);
+    int standing = min_wait == LLONG_MAX ? depth > 0 : min_wait > target;
+    if (standing && !admission.dropping) {
+      // Back soon after the last episode, pick up near its rate
+      int recent = now - admission.drop_next < 16 * (long long)QUEUE_INTERVAL * 1000;
+      admission.count = recent && admission.count > 2 ? admission.count - 2 : 1;
+      admission.drop_next = now;
+      admission.dropping = 1;
+    }else if (!standing) {
+      admission.dropping = 0;
+    }
+    admission.interval_end = now + (long long)QUEUE_INTERVAL * 1000;
+  }
+  if (!admission.dropping) return ADMIT;
+
+  long long service = atomic_load_explicit(&admission.service_us, memory_order_relaxed);
+  if ((long long)depth * service / NUM_THREADS > target) return SHED_WAIT;
+  if (now >= admission.drop_next) {
+    admission.count++;
+    admission.drop_next = admission_next(now);
+    return SHED_WAIT;
+  }
+  return ADMIT;
+}
+
+/**
+ * Turn a connection away with the canned 503 without blocking the
+ * acceptor. Whatever request the client already sent is read first, so
+ * closing doesn't reset the connection before the client reads the
+ * response.
+ * @param client Client socket
+ */
+void shed_connection(int client) {
+  char discard[BUFFER_SIZE * 8];
+  if (recv(client, discard, sizeof(discard), MSG_DONTWAIT) < 0 && errno != EAGAIN) {
+    close(client);
+    return;
+  }
+  send(client, shed_response, shed_response_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+  shutdown(client, SHUT_WR);
+  close(client);
+}
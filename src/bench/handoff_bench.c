@@ -0,0 +1,172 @@
+/**
+ * Microbenchmark for the acceptor -> worker socket handoff
+ * Measures the time from enqueue until a worker holds the item, for the
+ * lock-free queue in socket_queue.h and for a mutex + condition variable
+ * queue like the one it replaced.
+ *
+ * Usage: ./handoff_bench [consumers] [items]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../socket_queue.h"
+
+#define STOP -1
+
+/**
+ * Mutex + condition variable ring, woken with a broadcast like the
+ * original thread pool
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t nonempty;
+  int *items;
+  size_t head, tail, size, cap;
+} locked_queue_t;
+
+typedef struct {
+  const char *name;
+  int (*push)(void *queue, int item);
+  int (*pop_wait)(void *queue);
+  void *queue;
+} queue_ops_t;
+
+typedef struct {
+  queue_ops_t *ops;
+  long long *latencies;
+  size_t count;
+} consumer_t;
+
+long long *enqueued_at;
+
+long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int lockfree_push(void *queue, int item) {
+  return socket_queue_push((socket_queue_t *)queue, item, 0);
+}
+
+int lockfree_pop_wait(void *queue) {
+  long long stamp;
+  return socket_queue_pop_wait((socket_queue_t *)queue, &stamp);
+}
+
+int locked_push(void *arg, int item) {
+  locked_queue_t *queue = (locked_queue_t *)arg;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->size == queue->cap) {
+    pthread_mutex_unlock(&queue->lock);
+    return -1;
+  }
+  queue->items[queue->tail] = item;
+  queue->tail = (queue->tail + 1) % queue->cap;
+  queue->size++;
+  pthread_cond_broadcast(&queue->nonempty);
+  pthread_mutex_unlock(&queue->lock);
+  return 0;
+}
+
+int locked_pop_wait(void *arg) {
+  locked_queue_t *queue = (locked_queue_t *)arg;
+  pthread_mutex_lock(&queue->lock);
+  while (queue->size == 0) pthread_cond_wait(&queue->nonempty, &queue->lock);
+  int item = queue->items[queue->head];
+  queue->head = (queue->head + 1) % queue->cap;
+  queue->size--;
+  pthread_mutex_unlock(&queue->lock);
+  return item;
+}
+
+void *consumer_thread(void *arg) {
+  consumer_t *consumer = (consumer_t *)arg;
+  while (1) {
+    int item = consumer->ops->pop_wait(consumer->ops->queue);
+    if (item == STOP) break;
+    consumer->latencies[consumer->count++] = now_ns() - enqueued_at[item];
+  }
+  return NULL;
+}
+
+int compare_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Run one scenario and print its latency percentiles
+ * @param ops       Queue under test
+ * @param scenario  Scenario name
+ * @param consumers Number of consumer threads
+ * @param items     Number of items to hand off
+ * @param gap_us    Pause between items, 0 to push as fast as possible
+ */
+void run(queue_ops_t *ops, const char *scenario, int consumers, int items, int gap_us) {
+  consumer_t workers[consumers];
+  pthread_t threads[consumers];
+  for (int i = 0; i < consumers; i++) {
+    workers[i].ops = ops;
+    workers[i].latencies = malloc(sizeof(long long) * items);
+    workers[i].count = 0;
+    pthread_create(&threads[i], NULL, consumer_thread, &workers[i]);
+  }
+
+  long long start = now_ns();
+  for (int i = 0; i < items; i++) {
+    enqueued_at[i] = now_ns();
+    while (ops->push(ops->queue, i) < 0) sched_yield();
+    if (gap_us) usleep(gap_us);
+  }
+  for (int i = 0; i < consumers; i++) {
+    while (ops->push(ops->queue, STOP) < 0) sched_yield();
+  }
+  for (int i = 0; i < consumers; i++) pthread_join(threads[i], NULL);
+  double seconds = (now_ns() - start) / 1e9;
+
+  long long *all = malloc(sizeof(long long) * items);
+  size_t n = 0;
+  for (int i = 0; i < consumers; i++) {
+    memcpy(all + n, workers[i].latencies, sizeof(long long) * workers[i].count);
+    n += workers[i].count;
+    free(workers[i].latencies);
+  }
+  qsort(all, n, sizeof(long long), compare_ll);
+
+  printf("queue=%s scenario=%s consumers=%d items=%zu rate=%.0f/s "
+    "p50_ns=%lld p90_ns=%lld p99_ns=%lld p999_ns=%lld max_ns=%lld\n",
+    ops->name, scenario, consumers, n, n / seconds,
+    all[n * 50 / 100], all[n * 90 / 100], all[n * 99 / 100],
+    all[n * 999 / 1000], all[n - 1]);
+  free(all);
+}
+
+int main(int argc, char *argv[]) {
+  int consumers = argc > 1 ? atoi(argv[1]) : 4;
+  int items = argc > 2 ? atoi(argv[2]) : 200000;
+  int sparse = items / 20 > 0 ? items / 20 : 1;
+  enqueued_at = malloc(sizeof(long long) * items);
+
+  socket_queue_t lockfree;
+  socket_queue_init(&lockfree, 1024);
+  locked_queue_t locked = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    malloc(sizeof(int) * 1024), 0, 0, 0, 1024 };
+
+  queue_ops_t queues[] = {
+    { "lockfree", lockfree_push, lockfree_pop_wait, &lockfree },
+    { "mutex_cond", locked_push, locked_pop_wait, &locked }
+  };
+
+  for (size_t q = 0; q < sizeof(queues) / sizeof(*queues); q++) {
+    run(&queues[q], "saturated", consumers, items, 0);
+    run(&queues[q], "sparse", consumers, sparse, 50);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,734 @@
+/**
+ * Loopback load benchmark for the server
+ * Starts the server binary afresh for each scenario, drives it with
+ * keep-alive client threads and prints one JSON object per scenario:
+ * requests per second, latency percentiles, server CPU time per request
+ * and server memory. Two result files can be compared to catch
+ * regressions between builds. With --syscalls the server runs under
+ * ptrace and the system calls it makes per request are counted too.
+ *
+ * Usage: ./load_bench [server] [site] [options] [-- server options]
+ *        ./load_bench --compare old.json new.json [--threshold=PCT]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../metrics.h"
+
+#define SITE_EXAMPLE 0  // The site given on the command line
+#define SITE_SCRATCH 1  // A temporary directory holding one big file
+
+#define BIG_FILE_SIZE (100 << 20)
+#define READ_BUFFER 65536
+
+#define PHASE_WARMUP  0
+#define PHASE_MEASURE 1
+#define PHASE_STOP    2
+
+/**
+ * A load pattern. Fast clients are measured; idle connections and slow
+ * clients only add pressure.
+ */
+typedef struct {
+  const char *name;
+  const char *path;        // Request target, %d gets a counter for paths that are all different
+  int site;
+  int connections;         // Fast clients
+  int idle;                // Connections opened and left idle
+  int slow;                // Clients that trickle requests and read slowly
+} scenario_t;
+
+scenario_t scenarios[] = {
+  { "small_files",       "/test.html",        SITE_EXAMPLE, 16, 0,    0  },
+  { "large_files",       "/big.bin",          SITE_SCRATCH, 4,  0,    0  },
+  { "directory_listing", "/assets/",          SITE_EXAMPLE, 16, 0,    0  },
+  { "not_found",         "/missing-%d.html",  SITE_EXAMPLE, 16, 0,    0  },
+  { "idle_connections",  "/test.html",        SITE_EXAMPLE, 16, 1000, 0  },
+  { "slow_clients",      "/test.html",        SITE_EXAMPLE, 16, 0,    32 },
+};
+#define SCENARIOS (int)(sizeof(scenarios) / sizeof(scenarios[0]))
+
+const char *SLOW_PATH = "/assets/TURKEYCOSTUMEMODEL.jpg";
+
+/**
+ * One client thread and what it measured
+ */
+typedef struct {
+  scenario_t *scenario;
+  int id;
+  int slow;
+  unsigned long long requests;
+  unsigned long long bytes;
+  unsigned long long errors;
+  unsigned long long non_2xx;
+  histogram_t latency;
+  pthread_t thread;
+} client_t;
+
+struct sockaddr_in server_addr;
+atomic_int phase;
+
+/**
+ * --syscalls: the server runs under a tracer process of its own, see
+ * trace_server()
+ */
+int count_syscalls = 0;
+pid_t tracer_pid = -1;
+int tracer_fd = -1;
+volatile sig_atomic_t trace_request;
+
+long long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void sleep_us(long long us) {
+  struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+  nanosleep(&ts, NULL);
+}
+
+/**
+ * Connect to the server under test
+ * @param  slow Shrink the receive buffer, so the server sees a slow reader
+ * @return Socket, -1 on error
+ */
+int connect_server(int slow) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (slow) {
+    int size = 4096;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  }
+  struct timeval tv = { 5, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Send all of a buffer, optionally a byte at a time
+ * @return 0 on success, -1 on error
+ */
+int send_all(int fd, const char *data, size_t len, int slow) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, slow ? 1 : len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    data += n;
+    len -= n;
+    if (slow) sleep_us(1000);
+  }
+  return 0;
+}
+
+/**
+ * Make one request and read the whole response
+ * @param  fd     Connected socket
+ * @param  path   Request target
+ * @param  slow   Trickle the request and read the response slowly
+ * @param  buf    READ_BUFFER bytes of scratch space
+ * @param  status Set to the status code
+ * @param  bytes  Set to the response length, headers included
+ * @return 0 if the connection can be reused, 1 if the server is closing
+ *         it, -1 on error
+ */
+int fetch(int fd, const char *path, int slow, char *buf, int *status, unsigned long long *bytes) {
+  char request[512];
+  int len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: bench\r\n\r\n", path);
+  if (send_all(fd, request, len, slow) < 0) return -1;
+
+  size_t have = 0;
+  char *end = NULL;
+  while (end == NULL) {
+    if (have == READ_BUFFER - 1) return -1;
+    ssize_t n = recv(fd, buf + have, READ_BUFFER - 1 - have, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    have += n;
+    buf[have] = '\0';
+    end = strstr(buf, "\r\n\r\n");
+  }
+  size_t header_len = end + 4 - buf;
+  *end = '\0';
+  if (sscanf(buf, "HTTP/1.1 %d", status) != 1) return -1;
+  char *field = strcasestr(buf, "\r\nContent-Length:");
+  unsigned long long body = field ? strtoull(field + 17, NULL, 10) : 0;
+  int closing = strcasestr(buf, "\r\nConnection: close") != NULL;
+
+  unsigned long long received = have - header_len;
+  while (received < body) {
+    size_t want = slow ? 1024 : READ_BUFFER;
+    if (want > body - received) want = body - received;
+    ssize_t n = recv(fd, buf, want, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    received += n;
+    if (slow) sleep_us(5000);
+  }
+  *bytes = header_len + body;
+  return closing;
+}
+
+/**
+ * Client thread: request the scenario's path over a keep-alive
+ * connection, reconnecting whenever the server closes it, and record
+ * the latency of each response while measuring
+ * @param arg Client
+ */
+void *client_thread(void *arg) {
+  client_t *client = (client_t *)arg;
+  char *buf = malloc(READ_BUFFER);
+  char path[256];
+  int fd = -1;
+  unsigned int counter = client->id * 1000003u;
+  while (atomic_load(&phase) != PHASE_STOP) {
+    int measuring = atomic_load(&phase) == PHASE_MEASURE && !client->slow;
+    if (fd < 0 && (fd = connect_server(client->slow)) < 0) {
+      if (measuring) client->errors++;
+      sleep_us(1000);
+      continue;
+    }
+    snprintf(path, sizeof(path), client->slow ? SLOW_PATH : client->scenario->path, counter++);
+
+    int status;
+    unsigned long long bytes;
+    long long start = now_us();
+    int rc = fetch(fd, path, client->slow, buf, &status, &bytes);
+    long long us = now_us() - start;
+    if (rc != 0) {
+      close(fd);
+      fd = -1;
+    }
+    if (!measuring) continue;
+    if (rc < 0) {
+      client->errors++;
+      continue;
+    }
+    client->requests++;
+    client->bytes += bytes;
+    if (status < 200 || status > 299) client->non_2xx++;
+    client->latency.buckets[histogram_index(us > 0 ? us - 1 : 0)]++;
+    client->latency.count++;
+    client->latency.sum += us;
+  }
+  if (fd > -1) close(fd);
+  free(buf);
+  return NULL;
+}
+
+/**
+ * Find a free port on the loopback interface
+ * @return Port, -1 on error
+ */
+int free_port() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+  socklen_t len = sizeof(addr);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+    if (fd > -1) close(fd);
+    return -1;
+  }
+  close(fd);
+  return ntohs(addr.sin_port);
+}
+
+void trace_signal(int sig) {
+  trace_request = sig;
+}
+
+/**
+ * Run the server under ptrace and count its system calls. This runs in
+ * a process between the benchmark and the server, since a tracer gets
+ * every wait status of its tracees. SIGUSR1 restarts the count, SIGUSR2
+ * writes it to out. Each call stops its thread on entry and on exit, so
+ * calls are half the syscall stops.
+ * @param argv Server command line
+ * @param out  Pipe to the benchmark: the server's PID, then the counts
+ */
+void trace_server(char *argv[], int out) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = trace_signal;
+  sigaction(SIGUSR1, &action, NULL);
+  sigaction(SIGUSR2, &action, NULL);
+
+  pid_t pid = fork();
+  if (pid < 0) _exit(127);
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    raise(SIGSTOP);
+    execv(argv[0], argv);
+    _exit(127);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || ptrace(PTRACE_SETOPTIONS, pid, NULL,
+      PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL) < 0) {
+    kill(pid, SIGKILL);
+    _exit(127);
+  }
+  if (write(out, &pid, sizeof(pid)) != sizeof(pid)) _exit(127);
+  ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+  unsigned long long stops = 0;
+  while (1) {
+    if (trace_request == SIGUSR1) stops = 0;
+    if (trace_request == SIGUSR2) {
+      unsigned long long calls = stops / 2;
+      if (write(out, &calls, sizeof(calls)) != sizeof(calls)) break;
+    }
+    trace_request = 0;
+
+    pid_t tid = waitpid(-1, &status, __WALL);
+    if (tid < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (!WIFSTOPPED(status)) continue;
+
+    /**
+     * Let any signal but our own stops through, so SIGTERM still ends
+     * the server
+     */
+    int sig = WSTOPSIG(status);
+    if (sig == (SIGTRAP | 0x80)) stops++;
+    if (sig == (SIGTRAP | 0x80) || sig == SIGTRAP || sig == SIGSTOP || status >> 16) sig = 0;
+    ptrace(PTRACE_SYSCALL, tid, NULL, sig);
+  }
+  _exit(0);
+}
+
+/**
+ * Ask the tracer for the server's system calls since the last reset
+ * @param  sig SIGUSR1 to reset the count, SIGUSR2 to read it
+ * @return Calls counted, on SIGUSR2
+ */
+unsigned long long tracer_count(int sig) {
+  unsigned long long calls = 0;
+  kill(tracer_pid, sig);
+  if (sig == SIGUSR2 && read(tracer_fd, &calls, sizeof(calls)) != sizeof(calls)) return 0;
+  return calls;
+}
+
+/**
+ * Wait for the server, and its tracer, to exit
+ * @param pid Server PID
+ */
+void stop_server(pid_t pid) {
+  waitpid(pid, NULL, 0);
+  if (tracer_pid > 0) {
+    waitpid(tracer_pid, NULL, 0);
+    close(tracer_fd);
+    tracer_pid = tracer_fd = -1;
+  }
+}
+
+/**
+ * Start the server under test and wait until it accepts connections
+ * @param  binary  Server binary
+ * @param  threads Server thread count
+ * @param  root    Directory to serve
+ * @param  extra   Extra server options
+ * @param  count   Number of extra options
+ * @return Server PID, -1 if it didn't come up
+ */
+pid_t start_server(const char *binary, int threads, const char *root, char **extra, int count) {
+  int port = free_port();
+  if (port < 0) return -1;
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(port);
+  server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  char thread_arg[16], port_arg[16];
+  snprintf(thread_arg, sizeof(thread_arg), "%d", threads);
+  snprintf(port_arg, sizeof(port_arg), "%d", port);
+  char *argv[count + 6];
+  argv[0] = (char *)binary;
+  argv[1] = thread_arg;
+  argv[2] = port_arg;
+  argv[3] = (char *)root;
+  argv[4] = "--access-log=off";
+  for (int i = 0; i < count; i++) argv[5 + i] = extra[i];
+  argv[5 + count] = NULL;
+
+  pid_t pid;
+  if (count_syscalls) {
+    int fds[2];
+    if (pipe(fds) < 0 || (tracer_pid = fork()) < 0) return -1;
+    if (tracer_pid == 0) {
+      close(fds[0]);
+      trace_server(argv, fds[1]);
+    }
+    close(fds[1]);
+    tracer_fd = fds[0];
+    if (read(tracer_fd, &pid, sizeof(pid)) != sizeof(pid)) pid = -1;
+  }else{
+    pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+      int null = open("/dev/null", O_WRONLY);
+      dup2(null, STDOUT_FILENO);
+      dup2(null, STDERR_FILENO);
+      execv(binary, argv);
+      _exit(127);
+    }
+  }
+
+  pid_t child = count_syscalls ? tracer_pid : pid;
+  for (int i = 0; pid > 0 && i < 300; i++) {
+    int fd = connect_server(0);
+    if (fd > -1) {
+      close(fd);
+      return pid;
+    }
+    if (waitpid(child, NULL, WNOHANG) == child) return -1;
+    sleep_us(10000);
+  }
+  if (pid > 0) kill(pid, SIGKILL);
+  stop_server(pid);
+  return -1;
+}
+
+/**
+ * CPU time a process has used, user and system
+ * @param  pid Process
+ * @return Microseconds, -1 if it can't be read
+ */
+long long process_cpu_us(pid_t pid) {
+  char path[64], line[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE *file = fopen(path, "r");
+  if (file == NULL) return -1;
+  char *ok = fgets(line, sizeof(line), file);
+  fclose(file);
+  char *p = ok ? strrchr(line, ')') : NULL;
+  unsigned long long utime, stime;
+  if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+      &utime, &stime) != 2) return -1;
+  return (long long)(utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * Read a kB field of /proc/PID/status, such as VmRSS or VmHWM
+ * @param  pid   Process
+ * @param  field Field name, with the colon
+ * @return kB, -1 if it can't be read
+ */
+long long process_status_kb(pid_t pid, const char *field) {
+  char path[64], line[256];
+  long long kb = -1;
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  FILE *file = fopen(path, "r");
+  if (file == NULL) return -1;
+  while (fgets(line, sizeof(line), file)) {
+    if (strncmp(line, field, strlen(field)) == 0) {
+      kb = atoll(line + strlen(field));
+      break;
+    }
+  }
+  fclose(file);
+  return kb;
+}
+
+/**
+ * Make a directory holding one big file, sparse so it's quick to make
+ * @param  dir Filled with the directory's path
+ * @return 0 on success, -1 on error
+ */
+int make_scratch_site(char dir[]) {
+  strcpy(dir, "/tmp/servette-bench-XXXXXX");
+  if (mkdtemp(dir) == NULL) return -1;
+  char path[64];
+  snprintf(path, sizeof(path), "%s/big.bin", dir);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return -1;
+  int rc = ftruncate(fd, BIG_FILE_SIZE);
+  close(fd);
+  return rc;
+}
+
+/**
+ * Remove the scratch site
+ * @param dir Directory
+ */
+void remove_scratch_site(const char *dir) {
+  char path[64];
+  snprintf(path, sizeof(path), "%s/big.bin", dir);
+  unlink(path);
+  rmdir(dir);
+}
+
+/**
+ * Run one scenario against a fresh server and print its results
+ * @param  scenario Scenario
+ * @param  binary   Server binary
+ * @param  threads  Server thread count
+ * @param  root     Directory to serve
+ * @param  seconds  Measured duration
+ * @param  extra    Extra server options
+ * @param  count    Number of extra options
+ * @return 0 on success, -1 if the server didn't start
+ */
+int run_scenario(scenario_t *scenario, const char *binary, int threads, const char *root,
+    double seconds, char **extra, int count) {
+  pid_t pid = start_server(binary, threads, root, extra, count);
+  if (pid < 0) {
+    fprintf(stderr, "%s: server did not start\n", scenario->name);
+    return -1;
+  }
+
+  int idle[scenario->idle];
+  for (int i = 0; i < scenario->idle; i++) idle[i] = connect_server(0);
+
+  int clients_count = scenario->connections + scenario->slow;
+  client_t *clients = calloc(clients_count, sizeof(client_t));
+  atomic_store(&phase, PHASE_WARMUP);
+  for (int i = 0; i < clients_count; i++) {
+    clients[i].scenario = scenario;
+    clients[i].id = i;
+    clients[i].slow = i >= scenario->connections;
+    pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]);
+  }
+
+  /**
+   * Warm the caches, then measure
+   */
+  sleep_us(seconds * 200000);
+  long long cpu_start = process_cpu_us(pid);
+  if (count_syscalls) tracer_count(SIGUSR1);
+  long long start = now_us();
+  atomic_store(&phase, PHASE_MEASURE);
+  sleep_us(seconds * 1000000);
+  atomic_store(&phase, PHASE_STOP);
+  long long elapsed = now_us() - start;
+  unsigned long long syscalls = count_syscalls ? tracer_count(SIGUSR2) : 0;
+  long long cpu = process_cpu_us(pid) - cpu_start;
+  long long rss = process_status_kb(pid, "VmRSS:");
+  long long peak_rss = process_status_kb(pid, "VmHWM:");
+
+  histogram_t latency;
+  memset(&latency, 0, sizeof(latency));
+  unsigned long long requests = 0, bytes = 0, errors = 0, non_2xx = 0;
+  for (int i = 0; i < clients_count; i++) {
+    pthread_join(clients[i].thread, NULL);
+    requests += clients[i].requests;
+    bytes += clients[i].bytes;
+    errors += clients[i].errors;
+    non_2xx += clients[i].non_2xx;
+    for (int b = 0; b < HIST_BUCKETS; b++) latency.buckets[b] += clients[i].latency.buckets[b];
+    latency.count += clients[i].latency.count;
+    latency.sum += clients[i].latency.sum;
+  }
+  free(clients);
+  for (int i = 0; i < scenario->idle; i++) if (idle[i] > -1) close(idle[i]);
+  kill(pid, SIGTERM);
+  stop_server(pid);
+
+  double secs = elapsed / 1e6;
+  printf("{\"scenario\":\"%s\",\"server_threads\":%d,\"connections\":%d,\"idle\":%d,\"slow\":%d,"
+    "\"duration_s\":%.2f,\"requests\":%llu,\"errors\":%llu,\"non_2xx\":%llu,"
+    "\"rps\":%.1f,\"mb_per_s\":%.2f,\"p50_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,"
+    "\"cpu_us_per_request\":%.2f,\"rss_kb\":%lld,\"peak_rss_kb\":%lld",
+    scenario->name, threads, scenario->connections, scenario->idle, scenario->slow,
+    secs, requests, errors, non_2xx, requests / secs, bytes / secs / (1 << 20),
+    histogram_quantile(&latency, 0.5), histogram_quantile(&latency, 0.99),
+    histogram_quantile(&latency, 0.999), requests ? (double)cpu / requests : 0, rss, peak_rss);
+  if (count_syscalls) printf(",\"syscalls_per_request\":%.2f", requests ? (double)syscalls / requests : 0);
+  printf("}\n");
+  fflush(stdout);
+  return 0;
+}
+
+/**
+ * Read a number from a result line
+ * @param  line  JSON object
+ * @param  key   Key
+ * @param  value Set to the number
+ * @return 0 on success, -1 if the key is missing
+ */
+int json_number(const char *line, const char *key, double *value) {
+  char quoted[64];
+  snprintf(quoted, sizeof(quoted), "\"%s\":", key);
+  const char *p = strstr(line, quoted);
+  if (p == NULL) return -1;
+  *value = strtod(p + strlen(quoted), NULL);
+  return 0;
+}
+
+/**
+ * Compare two result files scenario by scenario
+ * @param  old_path  Baseline results
+ * @param  new_path  Results to check
+ * @param  threshold Percent change counted as a regression
+ * @return 0 if nothing regressed, 1 if something did, -1 on error
+ */
+int compare(const char *old_path, const char *new_path, double threshold) {
+  static const struct { const char *key; int higher_is_better; } metrics[] = {
+    { "rps", 1 }, { "mb_per_s", 1 }, { "p50_us", 0 }, { "p99_us", 0 }, { "p999_us", 0 },
+    { "cpu_us_per_request", 0 }, { "peak_rss_kb", 0 }, { "syscalls_per_request", 0 },
+  };
+  FILE *new_file = fopen(new_path, "r"), *old_file = fopen(old_path, "r");
+  if (new_file == NULL || old_file == NULL) {
+    perror("Could not open results");
+    return -1;
+  }
+
+  int regressions = 0;
+  char line[2048], old_line[2048], name[64], old_name[64];
+  printf("%-18s %-20s %12s %12s %8s\n", "scenario", "metric", "old", "new", "change");
+  while (fgets(line, sizeof(line), new_file)) {
+    if (sscanf(line, "{\"scenario\":\"%63[^\"]\"", name) != 1) continue;
+    int found = 0;
+    rewind(old_file);
+    while (!found && fgets(old_line, sizeof(old_line), old_file)) {
+      found = sscanf(old_line, "{\"scenario\":\"%63[^\"]\"", old_name) == 1 && strcmp(name, old_name) == 0;
+    }
+    if (!found) continue;
+
+    for (size_t i = 0; i < sizeof(metrics) / sizeof(metrics[0]); i++) {
+      double old_value, new_value;
+      if (json_number(old_line, metrics[i].key, &old_value) < 0 ||
+          json_number(line, metrics[i].key, &new_value) < 0 || old_value == 0) continue;
+      double change = 100 * (new_value - old_value) / old_value;
+      int worse = metrics[i].higher_is_better ? change < -threshold : change > threshold;
+      regressions += worse;
+      printf("%-18s %-20s %12.2f %12.2f %+7.1f%%%s\n", name, metrics[i].key, old_value, new_value,
+        change, worse ? "  REGRESSION" : "");
+    }
+  }
+  fclose(new_file);
+  fclose(old_file);
+  return regressions > 0;
+}
+
+void print_usage() {
+  puts("Usage: ./load_bench [server] [site] [options] [-- server options]");
+  puts("       ./load_bench --compare old.json new.json [--threshold=PCT]");
+  puts("Options:");
+  puts("  --duration=SECS    measured time per scenario (default 3)");
+  puts("  --threads=N        server threads (default 4)");
+  puts("  --scenario=NAME    run only this scenario, may be repeated");
+  puts("  --syscalls         run the server under ptrace and count its system calls");
+  puts("                     per request, which slows it down a lot");
+  puts("  --threshold=PCT    with --compare, change that counts as a regression (default 10)");
+  printf("Scenarios:");
+  for (int i = 0; i < SCENARIOS; i++) printf(" %s", scenarios[i].name);
+  puts("");
+}
+
+int main(int argc, char *argv[]) {
+  static struct option long_options[] = {
+    {"duration",  required_argument, NULL, 'd'},
+    {"threads",   required_argument, NULL, 't'},
+    {"scenario",  required_argument, NULL, 's'},
+    {"compare",   no_argument,       NULL, 'c'},
+    {"threshold", required_argument, NULL, 'r'},
+    {"syscalls",  no_argument,       NULL, 'y'},
+    {"help",      no_argument,       NULL, 'h'},
+    {NULL,        0,                 NULL,  0 }
+  };
+  double seconds = 3, threshold = 10;
+  int threads = 4, comparing = 0, selected[SCENARIOS], any_selected = 0;
+  memset(selected, 0, sizeof(selected));
+
+  int c;
+  while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'd':
+        seconds = atof(optarg);
+        break;
+      case 't':
+        threads = atoi(optarg);
+        break;
+      case 's':
+        for (int i = 0; i < SCENARIOS; i++) {
+          if (strcmp(optarg, scenarios[i].name) == 0) selected[i] = any_selected = 1;
+        }
+        if (!any_selected) {
+          fprintf(stderr, "Unknown scenario: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'c':
+        comparing = 1;
+        break;
+      case 'r':
+        threshold = atof(optarg);
+        break;
+      case 'y':
+        count_syscalls = 1;
+        break;
+      default:
+        print_usage();
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (comparing) {
+    if (argc - optind < 2) {
+      print_usage();
+      return EXIT_FAILURE;
+    }
+    int rc = compare(argv[optind], argv[optind + 1], threshold);
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  const char *binary = optind < argc ? argv[optind++] : "./server";
+  const char *site = optind < argc ? argv[optind++] : "../example_site";
+  char **extra = argv + optind;
+  int extra_count = argc - optind;
+
+  /**
+   * Idle connections need file descriptors, on both ends
+   */
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  char scratch[64];
+  if (make_scratch_site(scratch) < 0) {
+    perror("Could not make scratch site");
+    return EXIT_FAILURE;
+  }
+
+  int failed = 0;
+  for (int i = 0; i < SCENARIOS; i++) {
+    if (any_selected && !selected[i]) continue;
+    fprintf(stderr, "Running %s for %.1fs\n", scenarios[i].name, seconds);
+    const char *root = scenarios[i].site == SITE_SCRATCH ? scratch : site;
+    if (run_scenario(&scenarios[i], binary, threads, root, seconds, extra, extra_count) < 0) failed = 1;
+  }
+  remove_scratch_site(scratch);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
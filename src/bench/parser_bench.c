@@ -0,0 +1,264 @@
+/**
+ * Throughput benchmark for the request parser
+ * Compares the incremental parser in http_parser.h with a copy of the
+ * strtok/sscanf parse_headers() it replaced, on whole requests and on
+ * requests that arrive a few bytes at a time.
+ *
+ * Usage: ./parser_bench [iterations]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define MAX_HEADERS 255
+#define MAX_HEADER_KEY_LEN 255
+#define MAX_HEADER_VALUE_LEN 4096
+#define MAX_METHOD_LEN 32
+#define MAX_URI_LEN 4096
+#define MAX_PROTOCOL_LEN 32
+
+size_t HEADER_SIZE_LIMIT = 8 << 10, BODY_SIZE_LIMIT = 64 << 10;
+int HEADER_COUNT_LIMIT = 100;
+
+#include "../http_parser.h"
+
+/**
+ * Requests to parse: a minimal client and a typical browser
+ */
+const char *curl_request =
+  "GET /assets/TURKEYCOSTUMEMODEL.jpg HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "User-Agent: curl/8.5.0\r\n"
+  "Accept: */*\r\n"
+  "\r\n";
+
+const char *browser_request =
+  "GET /assets/WE%20MUST%20GO%20DEEPER/index.html?page=2&sort=name HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "Connection: keep-alive\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "sec-ch-ua: \"Chromium\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+  "sec-ch-ua-mobile: ?0\r\n"
+  "sec-ch-ua-platform: \"Linux\"\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+  "Sec-Fetch-Site: same-origin\r\n"
+  "Sec-Fetch-Mode: navigate\r\n"
+  "Sec-Fetch-User: ?1\r\n"
+  "Sec-Fetch-Dest: document\r\n"
+  "Referer: http://localhost:8080/assets/\r\n"
+  "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+  "Accept-Language: en-GB,en;q=0.9\r\n"
+  "If-Modified-Since: Tue, 14 May 2024 09:12:44 GMT\r\n"
+  "\r\n";
+
+/**
+ * The original parser, as it was, except that it frees the strings it
+ * used to leak so a long run fits in memory. The strdup()s are still
+ * timed.
+ */
+typedef struct {
+  char *key;
+  char *value;
+} header[MAX_HEADERS];
+
+typedef struct {
+  int well_formed;
+  char method[MAX_METHOD_LEN];
+  char uri[MAX_URI_LEN];
+  char path[MAX_URI_LEN];
+  char querystring[MAX_URI_LEN];
+  char protocol[MAX_PROTOCOL_LEN];
+  int keep_alive;
+} request;
+
+void legacy_url_decode(char *str) {
+  unsigned int i;
+  char tmp[BUFSIZ];
+  char *ptr = tmp;
+  memset(tmp, 0, sizeof(tmp));
+  for (i=0; i < strlen(str); i++) {
+    if (str[i] != '%') {
+      *ptr++ = str[i];
+      continue;
+    }
+    if (!isdigit(str[i+1]) || !isdigit(str[i+2])) {
+      *ptr++ = str[i];
+      continue;
+    }
+    *ptr++ = ((str[i+1] - '0') << 4) | (str[i+2] - '0');
+    i += 2;
+  }
+  *ptr = '\0';
+  strcpy(str, tmp);
+}
+
+request legacy_parse_headers(char header_str[], int *header_count) {
+  int well_formed = 1;
+  char ending[5];
+  strcpy(ending, "\r\n");
+
+  int hc = -1;
+  const char *ptr, *last = NULL;
+  for (ptr = header_str; (last = strstr(ptr, ending)); ptr = last+1) {
+    hc++;
+  }
+  *header_count = hc;
+  if (hc <= 0) {
+    request rq = {0};
+    return rq;
+  }
+
+  char *line = strtok(header_str, ending);
+  char method[MAX_METHOD_LEN], uri[MAX_URI_LEN], protocol[MAX_PROTOCOL_LEN];
+  memset(method, 0, MAX_METHOD_LEN);
+  memset(uri, 0, MAX_URI_LEN);
+  memset(protocol, 0, MAX_PROTOCOL_LEN);
+  sscanf(line, "%s %s %s", method, uri, protocol);
+
+  if (strlen(method) < 1)               well_formed = 0;
+  if (strlen(uri) < 1 || uri[0] != '/') well_formed = 0;
+  if (strlen(protocol) < 1)             well_formed = 0;
+
+  header headers[hc];
+  char format_str[32];
+  sprintf(format_str, "%s[^:]: %s%ic", "%", "%", MAX_HEADER_VALUE_LEN);
+  char key[MAX_HEADER_KEY_LEN], value[MAX_HEADER_VALUE_LEN];
+  int j = 0;
+  int keep_alive = strcmp(protocol, "HTTP/1.1") == 0;
+  do {
+    line = strtok(NULL, ending);
+    if (line != NULL) {
+      memset(&key, 0, MAX_HEADER_KEY_LEN);
+      memset(&value, 0, MAX_HEADER_VALUE_LEN);
+      sscanf(line, format_str, key, value);
+      headers[j]->key = strdup(key);
+      headers[j]->value = strdup(value);
+      if (strcasecmp(key, "Connection") == 0) {
+        if (strcasestr(value, "close") != NULL)      keep_alive = 0;
+        if (strcasestr(value, "keep-alive") != NULL) keep_alive = 1;
+      }
+      j++;
+    }
+  } while (line != NULL && j < hc);
+
+  char path[MAX_URI_LEN], querystring[MAX_URI_LEN];
+  char format_string[255];
+  memset(path, 0, MAX_URI_LEN);
+  memset(querystring, 0, MAX_URI_LEN);
+  memset(format_string, 0, 255);
+  if (strstr(uri, "?") != NULL) {
+    sprintf(format_string, "%%%d[^?]%%%d[^\r\n]", MAX_URI_LEN, MAX_URI_LEN);
+    sscanf(uri, format_string, path, querystring);
+  }else{
+    sprintf(format_string, "%%%d[^?\r\n]", MAX_URI_LEN);
+    sscanf(uri, format_string, path);
+  }
+  legacy_url_decode(path);
+
+  request rq = {0};
+  rq.well_formed = well_formed;
+  memcpy(rq.method, method, sizeof(rq.method));
+  memcpy(rq.uri, uri, sizeof(rq.uri));
+  memcpy(rq.path, path, sizeof(rq.path));
+  memcpy(rq.querystring, querystring, sizeof(rq.querystring));
+  memcpy(rq.protocol, protocol, sizeof(rq.protocol));
+  rq.keep_alive = keep_alive;
+
+  for (int k = 0; k < j; k++) {
+    free(headers[k]->key);
+    free(headers[k]->value);
+  }
+  return rq;
+}
+
+long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Both parsers see the request arrive in chunk-sized reads, as the
+ * server would. The old server ran strstr() over everything received
+ * after each read and parsed once the blank line showed up; the new
+ * one resumes the parser where it stopped.
+ */
+volatile int sink;
+
+void parse_legacy(char *buf, const char *req, size_t len, size_t chunk) {
+  size_t have = 0;
+  while (1) {
+    size_t n = len - have < chunk ? len - have : chunk;
+    memcpy(buf + have, req + have, n);
+    have += n;
+    buf[have] = '\0';
+    if (strstr(buf, "\r\n\r\n") != NULL) break;
+  }
+  int header_count;
+  request rq = legacy_parse_headers(buf, &header_count);
+  sink += rq.well_formed + rq.path[1];
+}
+
+void parse_incremental(char *buf, const char *req, size_t len, size_t chunk) {
+  static http_request_t rq;
+  char path[MAX_URI_LEN];
+  size_t have = 0;
+  http_request_reset(&rq);
+  while (1) {
+    size_t n = len - have < chunk ? len - have : chunk;
+    memcpy(buf + have, req + have, n);
+    have += n;
+    if (http_parse(&rq, buf, have) != HTTP_PARSE_AGAIN) break;
+  }
+  url_decode(path, buf + rq.path.offset, rq.path.length);
+  sink += rq.state + path[1];
+}
+
+/**
+ * Run one parser over one request and print its throughput
+ * @param name       Parser name
+ * @param parse      Parser
+ * @param scenario   Scenario name
+ * @param req        Request
+ * @param chunk      Bytes per simulated read
+ * @param iterations Number of requests to parse
+ */
+void run(const char *name, void (*parse)(char *, const char *, size_t, size_t),
+    const char *scenario, const char *req, size_t chunk, int iterations) {
+  size_t len = strlen(req);
+  char *buf = malloc(len + 1);
+  long long start = now_ns();
+  for (int i = 0; i < iterations; i++) parse(buf, req, len, chunk);
+  double seconds = (now_ns() - start) / 1e9;
+  printf("parser=%s scenario=%s bytes=%zu chunk=%zu requests=%d rate=%.0f/s "
+    "ns_per_request=%.0f mb_per_s=%.1f\n",
+    name, scenario, len, chunk, iterations, iterations / seconds,
+    seconds * 1e9 / iterations, len * (double)iterations / seconds / 1e6);
+  free(buf);
+}
+
+int main(int argc, char *argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+
+  struct {
+    const char *scenario;
+    const char *req;
+    size_t chunk;
+  } cases[] = {
+    { "curl",             curl_request,    4096 },
+    { "browser",          browser_request, 4096 },
+    { "browser_trickled", browser_request, 64 },
+  };
+
+  for (size_t c = 0; c < sizeof(cases) / sizeof(*cases); c++) {
+    run("incremental", parse_incremental, cases[c].scenario, cases[c].req, cases[c].chunk, iterations);
+    run("legacy", parse_legacy, cases[c].scenario, cases[c].req, cases[c].chunk, iterations);
+  }
+  return EXIT_SUCCESS;
+}
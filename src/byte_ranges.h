@@ -0,0 +1,131 @@
+/**
+ * Return values for parse_ranges()
+ */
+#define RANGE_NONE          0  // Send the whole body
+#define RANGE_PARTIAL       1  // Send the ranges
+#define RANGE_UNSATISFIABLE 2  // Send 416
+
+/**
+ * Does If-Range, if any, still describe the file? If it doesn't, the
+ * client's partial copy is stale and it must get the whole file.
+ * @param conn  Client connection, with its request parsed
+ * @param mtime Modification time of the file
+ * @param etag  Entity tag of the file
+ * @see validators.h
+ */
+int if_range_matches(connection_t *conn, struct timespec *mtime, const char *etag) {
+  http_header_t *header = http_find_header(conn->in, &conn->request, "If-Range");
+  if (header == NULL) return 1;
+
+  /**
+   * Entity tags must match exactly, a weak one never does
+   */
+  const char *value = conn->in + header->value.offset;
+  if (value[0] == '"') return header->value.length == strlen(etag) && memcmp(value, etag, strlen(etag)) == 0;
+  if (header->value.length > 1 && value[0] == 'W' && value[1] == '/') return 0;
+
+  time_t date;
+  return parse_http_date(value, header->value.length, &date) == 0 && date == mtime->tv_sec;
+}
+
+/**
+ * Parse a decimal byte position
+ * @param  p   Position, advanced past the digits
+ * @param  end End of the value
+ * @param  pos Set to the number, capped so it can't overflow
+ * @return 0 on success, -1 if there are no digits
+ */
+int parse_byte_pos(const char **p, const char *end, off_t *pos) {
+  const char *start = *p;
+  *pos = 0;
+  while (*p < end && **p >= '0' && **p <= '9') {
+    if (*pos < ((off_t)1 << 53)) *pos = *pos * 10 + (**p - '0');
+    (*p)++;
+  }
+  return *p > start ? 0 : -1;
+}
+
+/**
+ * Work out which bytes of a body the request's Range header asks for.
+ * Overlapping and adjacent ranges are merged, so a client can't make us
+ * send the same bytes many times over.
+ * @param  conn   Client connection, with its request parsed
+ * @param  size   Body length
+ * @param  mtime  Modification time of the file, for If-Range
+ * @param  etag   Entity tag of the file, for If-Range
+ * @param  ranges Filled with the ranges to send, in file order
+ * @param  count  Set to the number of ranges
+ * @return RANGE_NONE if there is no usable Range header, RANGE_PARTIAL,
+ *         or RANGE_UNSATISFIABLE if none of the ranges exist
+ */
+int parse_ranges(connection_t *conn, off_t size, struct timespec *mtime, const char *etag,
+    byte_range_t ranges[MAX_RANGES], int *count) {
+  http_header_t *header = http_find_header(conn->in, &conn->request, "Range");
+  *count = 0;
+  if (header == NULL) return RANGE_NONE;
+
+  const char *p = conn->in + header->value.offset;
+  const char *end = p + header->value.length;
+  if (end - p < 6 || strncasecmp(p, "bytes=", 6) != 0) return RANGE_NONE;
+  p += 6;
+
+  /**
+   * A header we can't parse, or with more ranges than we serve, is
+   * ignored and the whole body sent
+   */
+  int specs = 0;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    if (p == end) break;
+
+    off_t first, last = size - 1;
+    if (*p == '-') {
+      p++;
+      off_t suffix;
+      if (parse_byte_pos(&p, end, &suffix) < 0) return RANGE_NONE;
+      first = suffix < size ? size - suffix : 0;
+      if (suffix == 0) first = size;
+    }else{
+      if (parse_byte_pos(&p, end, &first) < 0 || p == end || *p++ != '-') return RANGE_NONE;
+      if (p < end && *p >= '0' && *p <= '9') {
+        parse_byte_pos(&p, end, &last);
+        if (last < first) return RANGE_NONE;
+        if (last > size - 1) last = size - 1;
+      }
+    }
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p < end && *p != ',') return RANGE_NONE;
+    if (++specs > MAX_RANGES) return RANGE_NONE;
+    if (first >= size) continue;
+
+    /**
+     * Insert in file order
+     */
+    int i = (*count)++;
+    while (i > 0 && ranges[i-1].start > first) {
+      ranges[i] = ranges[i-1];
+      i--;
+    }
+    ranges[i].start = first;
+    ranges[i].length = last - first + 1;
+  }
+  if (specs == 0) return RANGE_NONE;
+  if (!if_range_matches(conn, mtime, etag)) {
+    *count = 0;
+    return RANGE_NONE;
+  }
+  if (*count == 0) return RANGE_UNSATISFIABLE;
+
+  int merged = 0;
+  for (int i = 1; i < *count; i++) {
+    byte_range_t *last = &ranges[merged];
+    if (ranges[i].start <= last->start + last->length) {
+      off_t end_pos = ranges[i].start + ranges[i].length;
+      if (end_pos > last->start + last->length) last->length = end_pos - last->start;
+    }else{
+      ranges[++merged] = ranges[i];
+    }
+  }
+  *count = merged + 1;
+  return RANGE_PARTIAL;
+}
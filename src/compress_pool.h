@@ -0,0 +1,412 @@
+#include <semaphore.h>
+
+/**
+ * Finished jobs are staged like any other file response
+ * @see serve_file.h
+ */
+void send_file_headers(connection_t *conn, long long unsigned int size, const char *mime_type, int encoding);
+void serve_cached_file(connection_t *conn, cache_entry_t *entry);
+void send_file_body(connection_t *conn, off_t size, const char *mime_type, int encoding,
+    struct timespec *mtime, const char *etag, const char *body, void (*release)(void *), void *owner, int fd);
+void serve_file_as(connection_t *conn, char cache_key[], char file_path[], struct stat *file_info,
+    const char *mime_type, int encoding, int variants);
+
+/**
+ * A response body waiting to be compressed. The I/O thread that handled
+ * the request fills in the input and parks the connection; a compression
+ * thread does the CPU work and hands the job back through notify, and the
+ * I/O thread stages the response with compress_finish().
+ */
+typedef struct _compress_job_t {
+  struct _compress_job_t *next;
+  connection_t *conn;
+  int encoding;
+  const char *mime_type;
+
+  // A file, read by the compression thread
+  char *path;
+  struct stat file_info;
+  char *cache_key;      // Key for the compressed body
+  char *identity_key;   // Key for the file itself, to fall back on
+  int variants;
+  int not_modified;     // The request already has the file itself, as checked before it was consumed
+
+  // Or bytes built by the I/O thread, e.g. a directory listing
+  char *input;
+  size_t input_len;
+
+  // Result: a cache entry, or a body only this response uses
+  cache_entry_t *entry;
+  char *output;
+  size_t output_len;
+  int failed;
+
+  // How the compression thread tells the I/O thread it is done
+  void (*notify)(struct _compress_job_t *);
+  void *owner;
+  sem_t done;
+} compress_job_t;
+
+/**
+ * FIFO of jobs for the compression threads. Each job is milliseconds of
+ * CPU, so a plain mutex costs nothing next to it.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  compress_job_t *head;
+  compress_job_t *tail;
+  int length;
+  int threads;
+} compress_queue_t;
+
+compress_queue_t compress_queue = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0
+};
+
+/**
+ * Counters for the stats report, to tune the level and minimum size by
+ */
+struct {
+  atomic_ulong jobs;
+  atomic_ulong reused;       // Found already compressed by an earlier job
+  atomic_ulong not_smaller;
+  atomic_ulong queue_full;
+  atomic_ulong cache_hits;   // Responses served from an earlier compression
+  atomic_ullong bytes_in;
+  atomic_ullong bytes_out;
+  atomic_ullong cpu_ns;
+} compress_stats;
+
+/**
+ * Can a response be compressed on the fly with this coding?
+ * @param encoding  Content coding the client accepts
+ * @param mime_type Content-Type of the response
+ * @param size      Uncompressed body length
+ */
+int compress_eligible(int encoding, const char *mime_type, size_t size) {
+  return COMPRESS && compress_queue.threads > 0 &&
+    size >= COMPRESS_MIN && size <= COMPRESS_MAX_FILE &&
+    encoding_bound(encoding, 1) > 0 && mime_compressible(mime_type);
+}
+
+/**
+ * Thread CPU clock in nanoseconds
+ */
+long long thread_cpu_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Read a whole file, if it is still the one that was stat()ed
+ * @param  job Job with path and file_info set
+ * @return Contents from malloc(), NULL on error or if the file changed
+ */
+char *compress_read_file(compress_job_t *job) {
+  int fd = open(job->path, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size != job->file_info.st_size ||
+      st.st_mtim.tv_sec != job->file_info.st_mtim.tv_sec ||
+      st.st_mtim.tv_nsec != job->file_info.st_mtim.tv_nsec) {
+    close(fd);
+    return NULL;
+  }
+  char *data = malloc(st.st_size ? st.st_size : 1);
+  size_t got = 0;
+  while (data && got < (size_t)st.st_size) {
+    ssize_t n = read(fd, data + got, st.st_size - got);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    got += n;
+  }
+  close(fd);
+  if (data && got != (size_t)st.st_size) {
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+
+/**
+ * Do the work for one job, on a compression thread
+ * @param job Job
+ */
+void compress_run(compress_job_t *job) {
+  long long start = thread_cpu_ns();
+
+  /**
+   * Jobs for a popular file queue up behind each other while the first
+   * is running; later ones pick up its result instead of redoing it
+   */
+  if (job->cache_key && (job->entry = file_cache_get(job->cache_key)) != NULL) {
+    atomic_fetch_add(&compress_stats.reused, 1);
+    return;
+  }
+
+  size_t len = job->path ? (size_t)job->file_info.st_size : job->input_len;
+  char *input = job->path ? compress_read_file(job) : job->input;
+  char *output = input ? malloc(encoding_bound(job->encoding, len)) : NULL;
+  ssize_t out_len = output ?
+    encode_buffer(job->encoding, COMPRESS_LEVEL, input, len, output, encoding_bound(job->encoding, len)) : -1;
+  if (job->path) free(input);
+
+  atomic_fetch_add(&compress_stats.jobs, 1);
+  atomic_fetch_add(&compress_stats.cpu_ns, thread_cpu_ns() - start);
+  if (out_len < 0 || (size_t)out_len >= len) {
+    if (out_len >= 0) atomic_fetch_add(&compress_stats.not_smaller, 1);
+    free(output);
+    job->failed = 1;
+    return;
+  }
+  atomic_fetch_add(&compress_stats.bytes_in, len);
+  atomic_fetch_add(&compress_stats.bytes_out, out_len);
+
+  /**
+   * Static files are compressed once, the cache keeps the result until
+   * the file changes. Listings are built per request and not kept.
+   * @see file_cache.h
+   */
+  if (job->cache_key) {
+    job->entry = file_cache_insert(job->cache_key, job->path, &job->file_info,
+      job->mime_type, job->encoding, 0, output, out_len);
+    if (job->entry) return;
+  }
+  job->output = output;
+  job->output_len = out_len;
+}
+
+/**
+ * Compression thread: run jobs until the process exits
+ * @param arg Unused
+ */
+void *compress_thread(void *arg) {
+  compress_queue_t *queue = &compress_queue;
+  while (1) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->head == NULL) pthread_cond_wait(&queue->ready, &queue->lock);
+    compress_job_t *job = queue->head;
+    queue->head = job->next;
+    if (queue->head == NULL) queue->tail = NULL;
+    queue->length--;
+    pthread_mutex_unlock(&queue->lock);
+
+    compress_run(job);
+    job->notify(job);
+  }
+  pthread_exit(NULL);
+}
+
+/**
+ * Start the compression threads
+ * @param  threads Number of threads
+ * @return Number of threads started
+ */
+int start_compress_pool(int threads) {
+  for (int i = 0; i < threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, compress_thread, NULL) != 0) break;
+    pthread_detach(thread);
+    compress_queue.threads++;
+  }
+  return compress_queue.threads;
+}
+
+/**
+ * Queue a job. The caller sets notify first.
+ * @param  job Job
+ * @return 0 on success, -1 if the queue is full and the response
+ *         should go out uncompressed rather than wait
+ */
+int compress_submit(compress_job_t *job) {
+  compress_queue_t *queue = &compress_queue;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->length >= COMPRESS_QUEUE_MAX) {
+    pthread_mutex_unlock(&queue->lock);
+    atomic_fetch_add(&compress_stats.queue_full, 1);
+    job->failed = 1;
+    return -1;
+  }
+  job->next = NULL;
+  if (queue->tail) queue->tail->next = job;
+  else queue->head = job;
+  queue->tail = job;
+  queue->length++;
+  pthread_cond_signal(&queue->ready);
+  pthread_mutex_unlock(&queue->lock);
+  return 0;
+}
+
+/**
+ * Allocate a job and attach it to the connection
+ * @param  conn      Client connection
+ * @param  mime_type Content-Type of the response
+ * @param  encoding  Content coding to produce
+ * @return Job, NULL if out of memory
+ */
+compress_job_t *compress_job_new(connection_t *conn, const char *mime_type, int encoding) {
+  compress_job_t *job = calloc(1, sizeof(compress_job_t));
+  if (job == NULL) return NULL;
+  job->conn = conn;
+  job->mime_type = mime_type;
+  job->encoding = encoding;
+  sem_init(&job->done, 0, 0);
+  conn->compress_job = job;
+  return job;
+}
+
+/**
+ * Free a job and whatever it still owns
+ * @param job Job
+ */
+void compress_job_free(compress_job_t *job) {
+  if (job->conn) job->conn->compress_job = NULL;
+  sem_destroy(&job->done);
+  free(job->path);
+  free(job->cache_key);
+  free(job->identity_key);
+  free(job->input);
+  free(job->output);
+  free(job);
+}
+
+/**
+ * Have a static file compressed for this response. Strings are copied,
+ * the job outlives the request's arena.
+ * @param  conn         Client connection
+ * @param  cache_key    Key for the compressed body
+ * @param  identity_key Key the file is served under uncompressed
+ * @param  path         File
+ * @param  file_info    stat() result for path
+ * @param  mime_type    Content-Type
+ * @param  encoding     Content coding to produce
+ * @param  variants     Precompressed sidecars of the file
+ * @return 0 if the response is now waiting on the job, -1 on error
+ */
+int compress_file_later(connection_t *conn, const char *cache_key, const char *identity_key,
+    const char *path, struct stat *file_info, const char *mime_type, int encoding, int variants) {
+  compress_job_t *job = compress_job_new(conn, mime_type, encoding);
+  if (job == NULL) return -1;
+  job->path = strdup(path);
+  job->cache_key = strdup(cache_key);
+  job->identity_key = strdup(identity_key);
+  job->file_info = *file_info;
+  job->variants = variants;
+
+  /**
+   * A failed job falls back on the file itself after the request has
+   * been consumed, so whether the client has that already is decided now
+   */
+  char etag[ETAG_LEN];
+  make_etag(etag, path, file_info->st_dev, file_info->st_ino, file_info->st_size,
+    &file_info->st_mtim, ENCODING_IDENTITY);
+  job->not_modified = request_not_modified(conn, etag, &file_info->st_mtim);
+  if (!job->path || !job->cache_key || !job->identity_key) {
+    compress_job_free(job);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Have a generated body compressed for this response
+ * @param  conn      Client connection
+ * @param  body      Body bytes, copied
+ * @param  len       Body length
+ * @param  mime_type Content-Type
+ * @param  encoding  Content coding to produce
+ * @return 0 if the response is now waiting on the job, -1 on error
+ */
+int compress_body_later(connection_t *conn, const char *body, size_t len, const char *mime_type, int encoding) {
+  compress_job_t *job = compress_job_new(conn, mime_type, encoding);
+  if (job == NULL) return -1;
+  if ((job->input = malloc(len)) == NULL) {
+    compress_job_free(job);
+    return -1;
+  }
+  memcpy(job->input, body, len);
+  job->input_len = len;
+  return 0;
+}
+
+/**
+ * Stage the response for a finished job and free it. Runs on the I/O
+ * thread that owns the connection. A job that failed, or never ran
+ * because the queue was full, sends the body uncompressed, or a 304 if
+ * the request had it already.
+ * @param conn Client connection
+ * @param job  Finished job
+ */
+void compress_finish(connection_t *conn, compress_job_t *job) {
+  conn->response_start = conn->out_len;
+  if (job->entry) {
+    serve_cached_file(conn, job->entry);
+  }else if (job->failed && job->path && job->not_modified) {
+    char etag[ETAG_LEN];
+    make_etag(etag, job->path, job->file_info.st_dev, job->file_info.st_ino, job->file_info.st_size,
+      &job->file_info.st_mtim, ENCODING_IDENTITY);
+    send_not_modified(conn, etag, &job->file_info.st_mtim, job->mime_type);
+  }else if (job->failed && job->path) {
+    serve_file_as(conn, job->identity_key, job->path, &job->file_info,
+      job->mime_type, ENCODING_IDENTITY, job->variants);
+  }else if (job->failed) {
+    send_file_headers(conn, job->input_len, job->mime_type, ENCODING_IDENTITY);
+    conn_append(conn, job->input, job->input_len);
+  }else if (job->path) {
+    char etag[ETAG_LEN];
+    make_etag(etag, job->path, job->file_info.st_dev, job->file_info.st_ino, job->file_info.st_size,
+      &job->file_info.st_mtim, job->encoding);
+    send_file_body(conn, job->output_len, job->mime_type, job->encoding, &job->file_info.st_mtim, etag,
+      job->output, free, job->output, -1);
+    job->output = NULL;
+  }else{
+    send_file_headers(conn, job->output_len, job->mime_type, job->encoding);
+    conn_send_memory(conn, job->output, job->output_len, free, job->output);
+    job->output = NULL;
+  }
+  if (conn->head_only) conn_strip_body(conn);
+  access_log_staged(conn);
+  compress_job_free(job);
+}
+
+/**
+ * Blocking drivers wait on a semaphore
+ * @param job Finished job
+ */
+void compress_post(compress_job_t *job) {
+  sem_post(&job->done);
+}
+
+/**
+ * Run the connection's pending job and wait for it, for the thread pool
+ * where each connection has a thread to itself anyway
+ * @param conn Client connection
+ */
+void compress_wait(connection_t *conn) {
+  compress_job_t *job = conn->compress_job;
+  job->notify = compress_post;
+  if (compress_submit(job) == 0) {
+    while (sem_wait(&job->done) < 0 && errno == EINTR);
+  }
+  compress_finish(conn, job);
+}
+
+/**
+ * Print what compression cost and what it saved
+ * @param out Stream to print to
+ */
+void compress_report(FILE *out) {
+  if (!COMPRESS) return;
+  unsigned long long in = atomic_load(&compress_stats.bytes_in);
+  unsigned long long saved = in - atomic_load(&compress_stats.bytes_out);
+  unsigned long long cpu_ns = atomic_load(&compress_stats.cpu_ns);
+  fprintf(out,
+    "Compression: %lu jobs (%lu reused, %lu not smaller, %lu queue full), "
+    "%lu cache hits, %llu KB in, %llu KB saved, %.1f ms CPU, %.2f ns CPU per byte saved\n",
+    atomic_load(&compress_stats.jobs), atomic_load(&compress_stats.reused),
+    atomic_load(&compress_stats.not_smaller), atomic_load(&compress_stats.queue_full),
+    atomic_load(&compress_stats.cache_hits), in >> 10, saved >> 10,
+    cpu_ns / 1e6, saved ? (double)cpu_ns / saved : 0);
+}
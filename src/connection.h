@@ -0,0 +1,772 @@
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+/**
+ * Connection states
+ */
+#define CONN_READING 0
+#define CONN_SENDING 1
+#define CONN_CLOSING 2
+#define CONN_WAITING 3  // Response is being compressed, see compress_pool.h
+
+/**
+ * Return values for conn_read() and conn_flush()
+ */
+#define CONN_IO_DONE   1
+#define CONN_IO_AGAIN  0
+#define CONN_IO_ERROR -1
+
+/**
+ * How a file body gets to the socket, each falls back to the next
+ */
+#define FILE_BODY_SENDFILE 0
+#define FILE_BODY_SPLICE   1
+#define FILE_BODY_COPY     2
+
+struct _connection_t;
+void access_log_first_byte(struct _connection_t *conn);
+void access_log_sent(struct _connection_t *conn);
+
+/**
+ * A satisfiable byte range of a file body
+ */
+typedef struct {
+  off_t start;
+  off_t length;
+} byte_range_t;
+
+/**
+ * Per-connection state, shared by the thread pool and the epoll loops.
+ * Responses are staged in the output buffer (and optionally a file
+ * body) and then flushed, so the same routing code works for both
+ * blocking and nonblocking sockets.
+ */
+typedef struct _connection_t {
+  int fd;
+  int state;
+  char client_ip[INET6_ADDRSTRLEN];
+  int client_port;
+
+  // Keep-alive bookkeeping
+  int keep_alive;
+  int requests_served;
+  long long last_active;
+
+  // Deadline the connection is up against, see conn_deadline()
+  wheel_timer_t timer;
+  int deadline;                       // TIMEOUT_* the timer is armed for
+  long long response_us;              // When the request being answered started arriving
+  long long progress_ms;              // When the response last made progress
+  unsigned long long progress_bytes;  // bytes_sent then
+  void (*progress)(struct _connection_t *conn);  // Told as a request starts arriving and as a
+                                                 // response goes out, for owners blocked in I/O
+
+  // Receive buffer, grown up to the request size limits
+  char *in;
+  size_t in_len;
+  size_t in_cap;
+  size_t request_len;
+  http_request_t request;
+
+  // Scratch memory for the request being handled
+  arena_t arena;
+
+  // HEAD: responses are staged as for GET, then their bodies dropped
+  int head_only;
+
+  // Staged response bytes, possibly several pipelined responses
+  char *out;
+  size_t out_len;
+  size_t out_sent;
+  size_t out_cap;
+  size_t response_start;
+
+  // In-memory body sent after the staged bytes, released once sent
+  const char *body;
+  size_t body_len;
+  size_t body_sent;
+  void (*body_release)(void *);
+  void *body_owner;
+
+  // File body sent after the staged bytes
+  int file_fd;
+  int file_mode;
+  off_t file_offset;
+  off_t file_remaining;
+
+  // Pipe for splice(), only created when sendfile() is unsupported or
+  // there is no sendfile(), as on an io_uring
+  int pipe_fds[2];
+  size_t pipe_pending;
+  size_t pipe_size;                   // Capacity, set by uring_pipe()
+
+  // Ranges of the file body sent as multipart/byteranges parts
+  byte_range_t ranges[MAX_RANGES];
+  int range_count;
+  int range_next;
+  const char *range_type;
+  off_t range_total;
+  char boundary[32];
+
+  // Compression the response is waiting on, see compress_pool.h
+  struct _compress_job_t *compress_job;
+
+  // Access log entries of responses not yet sent, see access_log.h
+  struct _access_entry_t *log_pending;
+  int log_count;
+  int log_cap;
+  int log_first;                      // First entry whose response hasn't started going out
+  unsigned long long log_staged;      // Bytes of response staged so far
+  unsigned long long bytes_sent;      // Bytes of response sent so far
+  long long request_us;               // When the next request started arriving
+
+  // Operations in flight on an io_uring, see uring_loop.h
+  int uring_recv;                     // Receive armed
+  int uring_ops;                      // Sends, splices and reads not yet completed
+  int uring_eof;                      // Client stopped sending, or sent too much
+  struct msghdr uring_msg;
+  struct iovec uring_iov[2];
+} connection_t;
+
+/**
+ * Monotonic clock in milliseconds
+ */
+long long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Monotonic clock in microseconds
+ */
+long long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Initialize a connection for a freshly accepted client socket
+ * @param conn Connection
+ * @param fd   Client socket
+ */
+void conn_init(connection_t *conn, int fd) {
+  memset(conn, 0, sizeof(connection_t));
+  conn->fd = fd;
+  conn->state = CONN_READING;
+  conn->file_fd = -1;
+  conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+  conn->last_active = now_ms();
+  conn->request_us = now_us(); // Until the first byte, the header deadline counts from here
+  http_request_reset(&conn->request);
+  metric_add(&metrics_local()->connections_opened, 1);
+
+  /**
+   * Get client IP and port
+   */
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof addr;
+  memset(&addr, 0, sizeof addr);
+  getpeername(fd, (struct sockaddr*)&addr, &len);
+  if (addr.ss_family == AF_INET6) {
+    struct sockaddr_in6 *s = (struct sockaddr_in6 *)&addr;
+    conn->client_port = ntohs(s->sin6_port);
+    inet_ntop(AF_INET6, &s->sin6_addr, conn->client_ip, sizeof conn->client_ip);
+  } else {
+    struct sockaddr_in *s = (struct sockaddr_in *)&addr;
+    conn->client_port = ntohs(s->sin_port);
+    inet_ntop(AF_INET, &s->sin_addr, conn->client_ip, sizeof conn->client_ip);
+  }
+}
+
+/**
+ * The deadline a connection is up against in its current state. A
+ * request must arrive within HEADER_TIMEOUT of its first byte (of the
+ * accept, for the first one), the next must start within
+ * KEEPALIVE_TIMEOUT of the last response, and a response must keep
+ * moving at least every SEND_TIMEOUT. REQUEST_TIMEOUT bounds a request
+ * and its response together. 0 disables each.
+ * @param  conn Connection
+ * @param  when Set to the deadline in ms
+ * @return TIMEOUT_*, -1 if none applies
+ */
+int conn_deadline(connection_t *conn, long long *when) {
+  int kind = -1;
+  long long start;
+  switch (conn->state) {
+    case CONN_READING:
+      if (conn->in_len == 0 && conn->requests_served > 0) {
+        if (KEEPALIVE_TIMEOUT <= 0) return -1;
+        *when = conn->last_active + KEEPALIVE_TIMEOUT * 1000LL;
+        return TIMEOUT_IDLE;
+      }
+      start = conn->request_us / 1000;
+      if (HEADER_TIMEOUT > 0) {
+        kind = TIMEOUT_HEADER;
+        *when = start + HEADER_TIMEOUT * 1000LL;
+      }
+      break;
+    case CONN_SENDING:
+      start = conn->response_us / 1000;
+      if (SEND_TIMEOUT > 0) {
+        kind = TIMEOUT_SEND;
+        *when = conn->progress_ms + SEND_TIMEOUT * 1000LL;
+      }
+      break;
+    default:
+      return -1; // Compressing, or already closing
+  }
+  if (REQUEST_TIMEOUT > 0 && (kind < 0 || start + REQUEST_TIMEOUT * 1000LL < *when)) {
+    kind = TIMEOUT_REQUEST;
+    *when = start + REQUEST_TIMEOUT * 1000LL;
+  }
+  return kind;
+}
+
+/**
+ * Arm the connection's timer for its current deadline, or disarm it if
+ * none applies. The timer is left alone while the deadline stays put,
+ * as it does on every read while a request arrives.
+ * @param wheel Wheel of the connection's owner
+ * @param conn  Connection
+ * @param now   Current time in ms
+ * @see timer_wheel.h
+ */
+void conn_arm_deadline(wheel_t *wheel, connection_t *conn, long long now) {
+  if (conn->bytes_sent != conn->progress_bytes) {
+    conn->progress_bytes = conn->bytes_sent;
+    conn->progress_ms = now;
+  }
+  long long when;
+  int kind = conn_deadline(conn, &when);
+  if (kind < 0) {
+    wheel_cancel(wheel, &conn->timer);
+    return;
+  }
+  conn->deadline = kind;
+  if (!wheel_armed(&conn->timer) || conn->timer.expires != when) wheel_arm(wheel, &conn->timer, when);
+}
+
+/**
+ * The connection whose timer expired, counted as timed out
+ * @param  timer Expired timer
+ * @return Connection
+ */
+connection_t *conn_timed_out(wheel_timer_t *timer) {
+  connection_t *conn = (connection_t *)((char *)timer - offsetof(connection_t, timer));
+  metric_add(&metrics_local()->timeouts[conn->deadline], 1);
+  return conn;
+}
+
+/**
+ * Hand a borrowed in-memory body back to its owner
+ * @param conn Connection
+ */
+void conn_release_body(connection_t *conn) {
+  if (conn->body_release) conn->body_release(conn->body_owner);
+  conn->body = NULL;
+  conn->body_len = conn->body_sent = 0;
+  conn->body_release = NULL;
+  conn->body_owner = NULL;
+}
+
+/**
+ * Is a body (file or memory) still to be sent after the staged bytes,
+ * or still being compressed? Nothing more can be staged behind it until
+ * it has gone out.
+ * @param conn Connection
+ */
+int conn_body_pending(connection_t *conn) {
+  return conn->file_fd > -1 || conn->body != NULL || conn->compress_job != NULL;
+}
+
+/**
+ * Close the client socket and release everything the connection holds
+ * @param conn Connection
+ */
+void conn_close(connection_t *conn) {
+  access_log_sent(conn);
+  free(conn->log_pending);
+  conn->log_pending = NULL;
+  conn->log_cap = 0;
+  conn_release_body(conn);
+  if (conn->file_fd > -1) {
+    close(conn->file_fd);
+    conn->file_fd = -1;
+  }
+  if (conn->pipe_fds[0] > -1) {
+    close(conn->pipe_fds[0]);
+    close(conn->pipe_fds[1]);
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+  }
+  pool_free(conn->out, conn->out_cap);
+  conn->out = NULL;
+  conn->out_len = conn->out_sent = conn->out_cap = 0;
+  pool_free(conn->in, conn->in_cap);
+  conn->in = NULL;
+  conn->in_len = conn->in_cap = 0;
+  arena_release(&conn->arena);
+  if (conn->fd > -1) metric_add(&metrics_local()->connections_closed, 1);
+  if (conn->fd > -1 && close(conn->fd) < 0) {
+    perror("Could not close client socket");
+  }
+  conn->fd = -1;
+  conn->state = CONN_CLOSING;
+}
+
+/**
+ * Make room for bytes at the end of the staged output
+ * @param  conn Connection
+ * @param  len  Number of bytes
+ * @return Where to write them, NULL if the buffer could not grow
+ */
+char *conn_extend(connection_t *conn, size_t len) {
+  if (conn->out_len + len > conn->out_cap) {
+    size_t cap = conn->out_cap ? conn->out_cap : BUFFER_SIZE;
+    while (cap < conn->out_len + len) cap *= 2;
+    char *out = pool_grow(conn->out, conn->out_len, &conn->out_cap, cap);
+    if (out == NULL) return NULL;
+    conn->out = out;
+  }
+  conn->out_len += len;
+  return conn->out + conn->out_len - len;
+}
+
+/**
+ * Stage bytes to be sent to the client
+ * @param  conn Connection
+ * @param  data Bytes to send
+ * @param  len  Number of bytes
+ * @return 0 on success, -1 if the buffer could not grow
+ */
+int conn_append(connection_t *conn, const void *data, size_t len) {
+  char *p = conn_extend(conn, len);
+  if (p == NULL) return -1;
+  memcpy(p, data, len);
+  return 0;
+}
+
+/**
+ * Insert bytes into the staged output, e.g. headers in front of a body
+ * that had to be built first
+ * @param  conn   Connection
+ * @param  offset Position in the output buffer
+ * @param  data   Bytes to insert
+ * @param  len    Number of bytes
+ * @return 0 on success, -1 if the buffer could not grow
+ */
+int conn_insert(connection_t *conn, size_t offset, const void *data, size_t len) {
+  size_t tail = conn->out_len - offset;
+  if (conn_append(conn, data, len) < 0) return -1;
+  memmove(conn->out + offset + len, conn->out + offset, tail);
+  memcpy(conn->out + offset, data, len);
+  return 0;
+}
+
+/**
+ * Drop the response currently being staged, e.g. to replace it with an
+ * error. Earlier pipelined responses are kept.
+ * @param conn Connection
+ */
+void conn_reset_response(connection_t *conn) {
+  conn->out_len = conn->response_start;
+  conn_release_body(conn);
+  if (conn->file_fd > -1) {
+    close(conn->file_fd);
+    conn->file_fd = -1;
+  }
+  conn->file_remaining = 0;
+  conn->range_count = 0;
+}
+
+/**
+ * Send a file after the staged bytes. The connection takes ownership of fd.
+ * @param conn   Connection
+ * @param fd     Open file descriptor
+ * @param offset First byte to send
+ * @param len    Number of bytes to send
+ */
+void conn_send_fd(connection_t *conn, int fd, off_t offset, off_t len) {
+  if (conn->head_only) {
+    if (fd > -1) close(fd);
+    return;
+  }
+  conn->file_fd = fd;
+  conn->file_mode = FILE_BODY_SENDFILE;
+  conn->file_offset = offset;
+  conn->file_remaining = len;
+  conn->range_count = 0;
+}
+
+/**
+ * Format the header of one multipart/byteranges part
+ * @param  buf      Output
+ * @param  cap      Size of buf
+ * @param  boundary Multipart boundary
+ * @param  type     Content-Type of the file
+ * @param  range    Byte range
+ * @param  total    File size
+ * @return Length of the header
+ */
+int range_part_header(char *buf, size_t cap, const char *boundary, const char *type,
+    byte_range_t *range, off_t total) {
+  return snprintf(buf, cap, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+    boundary, type, (long long)range->start, (long long)(range->start + range->length - 1),
+    (long long)total);
+}
+
+/**
+ * Send several ranges of a file as multipart/byteranges after the staged
+ * bytes. Each part's header is staged as the previous part finishes, so
+ * the file data still goes out zero-copy. The connection takes ownership
+ * of fd.
+ * @param conn     Connection
+ * @param fd       Open file descriptor
+ * @param ranges   Ranges to send, in order
+ * @param count    Number of ranges
+ * @param type     Content-Type of the file, must outlive the response
+ * @param total    File size
+ * @param boundary Multipart boundary
+ */
+void conn_send_ranges(connection_t *conn, int fd, byte_range_t ranges[], int count,
+    const char *type, off_t total, const char *boundary) {
+  conn_send_fd(conn, fd, 0, 0);
+  if (conn->head_only) return;
+  memcpy(conn->ranges, ranges, sizeof(byte_range_t) * count);
+  conn->range_count = count;
+  conn->range_next = 0;
+  conn->range_type = type;
+  conn->range_total = total;
+  snprintf(conn->boundary, sizeof(conn->boundary), "%s", boundary);
+}
+
+/**
+ * Stage the header of the next multipart part and point the file body
+ * at its range, or stage the closing boundary after the last one
+ * @param  conn Connection
+ * @return 0 on success, -1 if the buffer could not grow
+ */
+int conn_next_range(connection_t *conn) {
+  char part[512];
+  int len;
+  if (conn->range_next < conn->range_count) {
+    byte_range_t *range = &conn->ranges[conn->range_next++];
+    len = range_part_header(part, sizeof(part), conn->boundary, conn->range_type, range, conn->range_total);
+    conn->file_offset = range->start;
+    conn->file_remaining = range->length;
+  }else{
+    len = snprintf(part, sizeof(part), "\r\n--%s--\r\n", conn->boundary);
+    conn->range_count = 0;
+  }
+  return conn_append(conn, part, len);
+}
+
+/**
+ * Send borrowed memory after the staged bytes, in the same write
+ * @param conn    Connection
+ * @param body    Bytes to send, must stay valid until release is called
+ * @param len     Number of bytes
+ * @param release Called with owner once the body is no longer needed
+ * @param owner   Argument for release
+ */
+void conn_send_memory(connection_t *conn, const char *body, size_t len, void (*release)(void *), void *owner) {
+  if (conn->head_only) {
+    if (release) release(owner);
+    return;
+  }
+  conn->body = body;
+  conn->body_len = len;
+  conn->body_sent = 0;
+  conn->body_release = release;
+  conn->body_owner = owner;
+}
+
+/**
+ * Drop the body of the response just staged, keeping its headers, for
+ * HEAD. Bodies sent from memory or a file were never attached.
+ * @param conn Connection
+ */
+void conn_strip_body(connection_t *conn) {
+  char *start = conn->out + conn->response_start;
+  char *end = memmem(start, conn->out_len - conn->response_start, "\r\n\r\n", 4);
+  if (end != NULL) conn->out_len = end + 4 - conn->out;
+}
+
+/**
+ * Has a complete request, or one we must reject, been received? Parses
+ * whatever arrived since the last call and sets request_len to the
+ * length of the first request in the buffer. A rejected request takes
+ * the whole buffer, since we can't tell where the next one starts.
+ * @param conn Connection
+ * @see http_parser.h
+ */
+int conn_request_ready(connection_t *conn) {
+  switch (http_parse(&conn->request, conn->in, conn->in_len)) {
+    case HTTP_PARSE_DONE:
+      conn->request_len = conn->request.length;
+      return 1;
+    case HTTP_PARSE_ERROR:
+      conn->request_len = conn->in_len;
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Discard the request that was just handled, keeping any pipelined
+ * bytes that arrived after it
+ * @param conn Connection
+ */
+void conn_consume_request(connection_t *conn) {
+  conn->in_len -= conn->request_len;
+  memmove(conn->in, conn->in + conn->request_len, conn->in_len);
+  conn->request_len = 0;
+  conn->request_us = conn->in_len > 0 ? now_us() : 0;
+  http_request_reset(&conn->request);
+  arena_reset(&conn->arena);
+}
+
+/**
+ * Make room in the receive buffer. It starts small and doubles, but
+ * never past what the largest acceptable request needs.
+ * @param  conn Connection
+ * @return 0 on success, -1 if out of memory
+ */
+int conn_grow_in(connection_t *conn) {
+  size_t limit = HEADER_SIZE_LIMIT + BODY_SIZE_LIMIT;
+  size_t cap = conn->in_cap ? conn->in_cap * 2 : BUFFER_SIZE;
+  if (cap > limit) cap = limit;
+  if (cap <= conn->in_cap) return -1;
+  char *in = pool_grow(conn->in, conn->in_len, &conn->in_cap, cap);
+  if (in == NULL) return -1;
+  conn->in = in;
+  return 0;
+}
+
+/**
+ * Read from the client until a request is ready
+ * @param  conn Connection
+ * @return CONN_IO_DONE when a request is ready, CONN_IO_AGAIN if the
+ *         socket would block, CONN_IO_ERROR on EOF or error
+ */
+int conn_read(connection_t *conn) {
+  while (!conn_request_ready(conn)) {
+    if (conn->in_len == conn->in_cap && conn_grow_in(conn) < 0) return CONN_IO_ERROR;
+    ssize_t n = read(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len);
+    if (n == 0) return CONN_IO_ERROR;
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return CONN_IO_AGAIN;
+      return CONN_IO_ERROR;
+    }
+    int first = conn->in_len == 0;
+    if (first) conn->request_us = now_us();
+    conn->in_len += n;
+    if (first && conn->progress) conn->progress(conn);
+  }
+  return CONN_IO_DONE;
+}
+
+/**
+ * Account for bytes of the staged output, then the in-memory body,
+ * having been written to the client
+ * @param conn Connection
+ * @param n    Number of bytes written
+ */
+void conn_wrote_out(connection_t *conn, size_t n) {
+  conn->bytes_sent += n;
+  if (conn->progress) conn->progress(conn);
+  if (conn->log_first < conn->log_count) access_log_first_byte(conn);
+  size_t staged = conn->out_len - conn->out_sent;
+  if (n <= staged) {
+    conn->out_sent += n;
+  }else{
+    conn->out_sent = conn->out_len;
+    conn->body_sent += n - staged;
+  }
+}
+
+/**
+ * Empty the output buffer once everything in it, and the in-memory body,
+ * has been written
+ * @param conn Connection
+ */
+void conn_out_done(connection_t *conn) {
+  conn->out_len = conn->out_sent = conn->response_start = 0;
+  conn_release_body(conn);
+}
+
+/**
+ * Write the staged bytes, and any in-memory body, to the client in one
+ * call. When a file body follows, MSG_MORE holds back a partial packet
+ * of headers so they go out together with the start of the file.
+ * @param  conn Connection
+ * @return CONN_IO_DONE, CONN_IO_AGAIN or CONN_IO_ERROR
+ */
+int conn_write_out(connection_t *conn) {
+  int flags = conn->file_fd > -1 && conn->file_remaining > 0 ? MSG_MORE : 0;
+  while (conn->out_sent < conn->out_len || conn->body_sent < conn->body_len) {
+    struct iovec iov[2];
+    int iovcnt = 0;
+    if (conn->out_sent < conn->out_len) {
+      iov[iovcnt].iov_base = conn->out + conn->out_sent;
+      iov[iovcnt++].iov_len = conn->out_len - conn->out_sent;
+    }
+    if (conn->body_sent < conn->body_len) {
+      iov[iovcnt].iov_base = (void *)(conn->body + conn->body_sent);
+      iov[iovcnt++].iov_len = conn->body_len - conn->body_sent;
+    }
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+    ssize_t n = sendmsg(conn->fd, &msg, flags);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return CONN_IO_AGAIN;
+      return CONN_IO_ERROR;
+    }
+    conn_wrote_out(conn, n);
+  }
+  conn_out_done(conn);
+  return CONN_IO_DONE;
+}
+
+/**
+ * Last resort: copy the file body through the output buffer
+ * @param  conn Connection
+ * @return CONN_IO_DONE, CONN_IO_AGAIN or CONN_IO_ERROR
+ */
+int conn_copy_file(connection_t *conn) {
+  while (1) {
+    int rc = conn_write_out(conn);
+    if (rc != CONN_IO_DONE || conn->file_remaining <= 0) return rc;
+
+    if (conn->out_cap < FILE_READ_BUFFER) {
+      char *out = pool_grow(conn->out, 0, &conn->out_cap, FILE_READ_BUFFER);
+      if (out == NULL) return CONN_IO_ERROR;
+      conn->out = out;
+    }
+    size_t want = FILE_READ_BUFFER;
+    if ((off_t)want > conn->file_remaining) want = conn->file_remaining;
+    ssize_t nread = pread(conn->file_fd, conn->out, want, conn->file_offset);
+    if (nread < 0 && errno == EINTR) continue;
+    if (nread <= 0) return CONN_IO_ERROR;
+    conn->out_len = nread;
+    conn->file_offset += nread;
+    conn->file_remaining -= nread;
+  }
+}
+
+/**
+ * Move the file body to the socket through a pipe with splice(), for
+ * files whose filesystem can't sendfile() to a socket
+ * @param  conn Connection
+ * @return CONN_IO_DONE, CONN_IO_AGAIN or CONN_IO_ERROR
+ */
+int conn_splice_file(connection_t *conn) {
+  if (conn->pipe_fds[0] < 0 && pipe2(conn->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+    conn->file_mode = FILE_BODY_COPY;
+    return conn_copy_file(conn);
+  }
+
+  while (conn->file_remaining > 0 || conn->pipe_pending > 0) {
+    ssize_t n;
+
+    /**
+     * Fill the pipe from the page cache. The pipe is only refilled once
+     * the socket has drained it, so this never blocks.
+     */
+    if (conn->pipe_pending == 0) {
+      size_t want = conn->file_remaining > SENDFILE_CHUNK ? SENDFILE_CHUNK : conn->file_remaining;
+      n = splice(conn->file_fd, &conn->file_offset, conn->pipe_fds[1], NULL,
+        want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EINVAL) {
+          conn->file_mode = FILE_BODY_COPY;
+          return conn_copy_file(conn);
+        }
+        return CONN_IO_ERROR;
+      }
+      if (n == 0) return CONN_IO_ERROR; // File shrank under us
+      conn->file_remaining -= n;
+      conn->pipe_pending = n;
+    }
+
+    /**
+     * Drain the pipe into the socket, possibly only partially
+     */
+    n = splice(conn->pipe_fds[0], NULL, conn->fd, NULL, conn->pipe_pending,
+      SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (conn->file_remaining > 0 ? SPLICE_F_MORE : 0));
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return CONN_IO_AGAIN;
+      return CONN_IO_ERROR;
+    }
+    conn->bytes_sent += n;
+    conn->pipe_pending -= n;
+    if (conn->progress) conn->progress(conn);
+  }
+  return CONN_IO_DONE;
+}
+
+/**
+ * Send the file body straight from the page cache with sendfile()
+ * @param  conn Connection
+ * @return CONN_IO_DONE, CONN_IO_AGAIN or CONN_IO_ERROR
+ */
+int conn_sendfile(connection_t *conn) {
+  while (conn->file_remaining > 0) {
+    size_t want = conn->file_remaining > SENDFILE_CHUNK ? SENDFILE_CHUNK : conn->file_remaining;
+    ssize_t n = sendfile(conn->fd, conn->file_fd, &conn->file_offset, want);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return CONN_IO_AGAIN;
+      if (errno == EINVAL || errno == ENOSYS) {
+        conn->file_mode = FILE_BODY_SPLICE;
+        return conn_splice_file(conn);
+      }
+      return CONN_IO_ERROR;
+    }
+    if (n == 0) return CONN_IO_ERROR; // File shrank under us
+    conn->bytes_sent += n;
+    conn->file_remaining -= n;
+    if (conn->progress) conn->progress(conn);
+  }
+  return CONN_IO_DONE;
+}
+
+/**
+ * Write staged bytes, then the file body, to the client. Partial writes
+ * leave the offsets where they stopped, so this can simply be called
+ * again once the socket is writable.
+ * @param  conn Connection
+ * @return CONN_IO_DONE when everything was sent, CONN_IO_AGAIN if the
+ *         socket would block, CONN_IO_ERROR on error
+ */
+int conn_flush(connection_t *conn) {
+  while (1) {
+    int rc = conn_write_out(conn);
+    if (rc != CONN_IO_DONE) return rc;
+    if (conn->file_fd < 0) break;
+
+    switch (conn->file_mode) {
+      case FILE_BODY_SENDFILE: rc = conn_sendfile(conn);    break;
+      case FILE_BODY_SPLICE:   rc = conn_splice_file(conn); break;
+      default:                 rc = conn_copy_file(conn);   break;
+    }
+    if (rc != CONN_IO_DONE) return rc;
+
+    /**
+     * More multipart/byteranges parts to go
+     */
+    if (conn->range_count == 0) {
+      close(conn->file_fd);
+      conn->file_fd = -1;
+      break;
+    }
+    if (conn_next_range(conn) < 0) return CONN_IO_ERROR;
+  }
+  access_log_sent(conn);
+  return CONN_IO_DONE;
+}
@@ -0,0 +1,217 @@
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/**
+ * Content codings, in the order the server prefers them when the
+ * client likes several equally. A bit per coding makes up a mask.
+ */
+#define ENCODING_IDENTITY 0
+#define ENCODING_BR       1
+#define ENCODING_ZSTD     2
+#define ENCODING_GZIP     3
+#define ENCODINGS         4
+
+#define ENCODING_BIT(e) (1 << (e))
+
+typedef struct {
+  const char *name;    // Content-Encoding token
+  const char *suffix;  // Precompressed sidecar extension
+} encoding_t;
+
+const encoding_t encodings[ENCODINGS] = {
+  { "identity", ""     },
+  { "br",       ".br"  },
+  { "zstd",     ".zst" },
+  { "gzip",     ".gz"  },
+};
+
+/**
+ * Would compressing this type of file pay off? Media and archives are
+ * already compressed.
+ * @param mime_type Content-Type
+ */
+int mime_compressible(const char *mime_type) {
+  static const char *types[] = {
+    "application/javascript", "application/json", "application/xml",
+    "application/xhtml+xml", "application/rss+xml", "application/atom+xml",
+    "application/wasm", "application/x-javascript", "application/manifest+json",
+    "image/svg+xml", "image/x-icon", "image/bmp", "font/ttf", "font/otf",
+    "application/vnd.ms-fontobject", NULL
+  };
+  if (strncmp(mime_type, "text/", 5) == 0) return 1;
+  for (int i = 0; types[i]; i++) {
+    if (strcmp(mime_type, types[i]) == 0) return 1;
+  }
+  return 0;
+}
+
+/**
+ * Parse a q-value, "q=0.5", into thousandths
+ * @param  p   Start of the parameter
+ * @param  end End of the list element
+ * @return Weight from 0 to 1000, 1000 if the parameter isn't a q-value
+ */
+int parse_qvalue(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+  if (end - p < 2 || (p[0] != 'q' && p[0] != 'Q') || p[1] != '=') return 1000;
+  p += 2;
+  int weight = 0, scale = 1000;
+  if (p < end && *p == '1') return 1000;
+  if (p < end && *p == '0') p++;
+  if (p < end && *p == '.') p++;
+  while (p < end && *p >= '0' && *p <= '9' && scale > 1) {
+    scale /= 10;
+    weight += (*p++ - '0') * scale;
+  }
+  return weight;
+}
+
+/**
+ * Rank the codings the client accepts, from its Accept-Encoding header
+ * @param  conn  Client connection, with its request parsed
+ * @param  order Filled with acceptable codings, most wanted first
+ * @return Number of codings in order. Identity is always acceptable and
+ *         listed, the client would rather have something than a 406.
+ */
+int negotiate_encodings(connection_t *conn, int order[ENCODINGS]) {
+  int weight[ENCODINGS] = { 1, 0, 0, 0 };  // q-value + 1, identity is acceptable by default
+  http_header_t *header = http_find_header(conn->in, &conn->request, "Accept-Encoding");
+
+  if (header != NULL) {
+    const char *p = conn->in + header->value.offset;
+    const char *end = p + header->value.length;
+    int star = -1, seen = 0;
+    while (p < end) {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+      const char *token = p;
+      while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+      size_t len = p - token;
+      const char *element_end = memchr(p, ',', end - p);
+      if (element_end == NULL) element_end = end;
+      const char *params = memchr(p, ';', element_end - p);
+      int q = params ? parse_qvalue(params + 1, element_end) : 1000;
+      p = element_end;
+      if (len == 0) continue;
+
+      if (len == 1 && *token == '*') {
+        star = q;
+        continue;
+      }
+      for (int e = 0; e < ENCODINGS; e++) {
+        if (strlen(encodings[e].name) == len && strncasecmp(token, encodings[e].name, len) == 0) {
+          weight[e] = q + 1;
+          seen |= ENCODING_BIT(e);
+        }
+      }
+    }
+
+    /**
+     * "*" covers every coding not named. Weights are offset by one, so
+     * 1 means q=0: the coding is refused, except identity which stays
+     * as the last resort.
+     */
+    for (int e = 1; e < ENCODINGS; e++) {
+      if (!(seen & ENCODING_BIT(e)) && star >= 0) weight[e] = star + 1;
+      if (weight[e] == 1) weight[e] = 0;
+    }
+  }
+
+  /**
+   * Highest weight first. Ties go to the server's order, with identity
+   * after any compressed coding.
+   */
+  int count = 0;
+  for (int e = 1; e <= ENCODINGS; e++) {
+    int coding = e % ENCODINGS;
+    if (weight[coding] == 0) continue;
+    int i = count++;
+    while (i > 0 && weight[order[i-1]] < weight[coding]) {
+      order[i] = order[i-1];
+      i--;
+    }
+    order[i] = coding;
+  }
+  return count;
+}
+
+/**
+ * Upper bound on the compressed size of len bytes
+ * @param encoding Content coding
+ * @param len      Input length
+ * @return Bound, 0 if this build can't produce the coding
+ */
+size_t encoding_bound(int encoding, size_t len) {
+  switch (encoding) {
+#ifdef HAVE_BROTLI
+    case ENCODING_BR:   return BrotliEncoderMaxCompressedSize(len);
+#endif
+#ifdef HAVE_ZSTD
+    case ENCODING_ZSTD: return ZSTD_compressBound(len);
+#endif
+#ifdef HAVE_ZLIB
+    case ENCODING_GZIP: return compressBound(len) + 18;
+#endif
+  }
+  return 0;
+}
+
+/**
+ * Compress a buffer
+ * @param  encoding Content coding, one that encoding_bound() supports
+ * @param  level    1 (fastest) to 9 (smallest), as for gzip. Brotli and
+ *                  zstd use their own maximum for 9.
+ * @param  in       Input
+ * @param  len      Input length
+ * @param  out      Output, encoding_bound() bytes
+ * @param  cap      Size of out
+ * @return Compressed length, -1 on error
+ */
+ssize_t encode_buffer(int encoding, int level, const char *in, size_t len, char *out, size_t cap) {
+  switch (encoding) {
+#ifdef HAVE_BROTLI
+    case ENCODING_BR: {
+      size_t out_len = cap;
+      if (!BrotliEncoderCompress(level >= 9 ? BROTLI_MAX_QUALITY : level, BROTLI_DEFAULT_WINDOW,
+          BROTLI_MODE_TEXT, len, (const uint8_t *)in, &out_len, (uint8_t *)out)) {
+        return -1;
+      }
+      return out_len;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case ENCODING_ZSTD: {
+      size_t out_len = ZSTD_compress(out, cap, in, len, level >= 9 ? 19 : level);
+      return ZSTD_isError(out_len) ? -1 : (ssize_t)out_len;
+    }
+#endif
+#ifdef HAVE_ZLIB
+    case ENCODING_GZIP: {
+
+      /**
+       * windowBits 15 + 16 writes a gzip header and trailer
+       */
+      z_stream stream;
+      memset(&stream, 0, sizeof(stream));
+      if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+      }
+      stream.next_in = (Bytef *)in;
+      stream.avail_in = len;
+      stream.next_out = (Bytef *)out;
+      stream.avail_out = cap;
+      int rc = deflate(&stream, Z_FINISH);
+      size_t out_len = stream.total_out;
+      deflateEnd(&stream);
+      return rc == Z_STREAM_END ? (ssize_t)out_len : -1;
+    }
+#endif
+  }
+  return -1;
+}
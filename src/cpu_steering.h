@@ -0,0 +1,93 @@
+#include <sched.h>
+#include <linux/filter.h>
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+#define STEER_NONE         0
+#define STEER_CBPF         1
+#define STEER_INCOMING_CPU 2
+
+/**
+ * Number of CPUs this process may run on
+ */
+int usable_cpus() {
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) < 0) return 1;
+  int count = CPU_COUNT(&set);
+  return count > 0 ? count : 1;
+}
+
+/**
+ * CPU that worker index runs on: the index-th CPU we are allowed to use
+ * @param index Worker index
+ */
+int worker_cpu(int index) {
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) < 0) return index;
+  int n = index % usable_cpus();
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set) && n-- == 0) return cpu;
+  }
+  return index;
+}
+
+/**
+ * Pin a worker thread to its CPU
+ * @param thread Thread handle
+ * @param index  Worker index
+ */
+void pin_thread(pthread_t thread, int index) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(worker_cpu(index), &set);
+  int rc = pthread_setaffinity_np(thread, sizeof(set), &set);
+  if (rc != 0) {
+    fprintf(stderr, "Could not pin thread %d, rc: %d\n", index, rc);
+  }
+}
+
+/**
+ * Make the kernel hand each connection to the listener of the worker on
+ * the CPU that received its packets
+ * @param  servers Reuseport listeners, in bind order
+ * @param  count   Number of listeners
+ * @param  mode    STEER_CBPF or STEER_INCOMING_CPU
+ * @return 0 on success, -1 on error
+ */
+int steer_connections(int servers[], int count, int mode) {
+  if (mode == STEER_CBPF) {
+
+    /**
+     * Classic BPF: return (receiving CPU % count), the index of the
+     * listener in the reuseport group. Exact when count equals the CPU
+     * count and workers are pinned in order.
+     */
+    struct sock_filter code[] = {
+      { BPF_LD  | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+      { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (unsigned int)count },
+      { BPF_RET | BPF_A,           0, 0, 0 },
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(*code), code };
+    if (setsockopt(servers[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+      perror("Could not attach reuseport CBPF program");
+      return -1;
+    }
+    return 0;
+  }
+
+  if (mode == STEER_INCOMING_CPU) {
+    for (int i = 0; i < count; i++) {
+      int cpu = worker_cpu(i);
+      if (setsockopt(servers[i], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+        perror("Could not set SO_INCOMING_CPU");
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,357 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define MAX_EVENTS 256
+
+/**
+ * Event loop argument struct for passing to event_loop_thread()
+ */
+typedef struct _event_loop_t {
+  int tid;
+  int epfd;
+  int server;
+  atomic_int available;  // Waiting for events
+
+  // Deadlines of this loop's connections, see timer_wheel.h
+  wheel_t wheel;
+
+  // Compression jobs handed back by the compression threads
+  int wake_fd;
+  pthread_mutex_t done_lock;
+  compress_job_t *done;
+
+  // Submission and completion rings in --mode=uring, see uring_loop.h
+  struct _uring_t *uring;
+} event_loop_t;
+
+/**
+ * Loops, for the busy and idle gauges
+ * @see stats.h
+ */
+event_loop_t *event_loops;
+
+/**
+ * Connections are recycled through a per-thread slab pool
+ * @see memory_pool.h
+ */
+__thread slab_t connection_pool = { (sizeof(connection_t) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1), NULL };
+
+/**
+ * Put a socket into nonblocking mode
+ * @param  fd Socket
+ * @return 0 on success, -1 on error
+ */
+int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Arm a connection's timer for the deadline of the state it is waiting
+ * in, before going back to waiting for its socket
+ * @param loop Event loop
+ * @param conn Client connection
+ * @see conn_deadline()
+ */
+void loop_arm(event_loop_t *loop, connection_t *conn) {
+  conn_arm_deadline(&loop->wheel, conn, conn->last_active);
+}
+
+/**
+ * Close connections whose deadline has passed
+ * @param  loop Event loop
+ * @param  now  Current time in ms
+ * @return ms until the wheel next needs turning, -1 if no timer is armed
+ */
+int loop_expire(event_loop_t *loop, long long now) {
+  wheel_timer_t *timer;
+  while ((timer = wheel_expired(&loop->wheel, now))) {
+    connection_t *conn = conn_timed_out(timer);
+    conn_close(conn);
+    slab_free(&connection_pool, conn);
+  }
+  return wheel_next(&loop->wheel, now);
+}
+
+/**
+ * Accept every pending client and register it with this loop
+ * @param loop Event loop
+ */
+void loop_accept(event_loop_t *loop) {
+  while (1) {
+    int client = accept4(loop->server, NULL, NULL, SOCK_NONBLOCK);
+    if (client < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("Could not accept client");
+      }
+      return;
+    }
+
+    connection_t *conn = slab_alloc(&connection_pool);
+    if (conn == NULL) {
+      close(client);
+      continue;
+    }
+    conn_init(conn, client);
+    loop_arm(loop, conn);
+
+    /**
+     * Edge-triggered: we are told once per readiness change, so every
+     * handler below drains the socket until it would block
+     */
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, client, &ev) < 0) {
+      perror("Could not watch client socket");
+      wheel_cancel(&loop->wheel, &conn->timer);
+      conn_close(conn);
+      slab_free(&connection_pool, conn);
+    }
+  }
+}
+
+/**
+ * Compression thread side: give a finished job back to its loop and
+ * wake the loop up
+ * @param job Finished job
+ */
+void loop_compress_done(compress_job_t *job) {
+  event_loop_t *loop = (event_loop_t *)job->owner;
+  pthread_mutex_lock(&loop->done_lock);
+  job->next = loop->done;
+  loop->done = job;
+  pthread_mutex_unlock(&loop->done_lock);
+  uint64_t one = 1;
+  if (write(loop->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    perror("Could not wake event loop");
+  }
+}
+
+/**
+ * Hand a connection's response to the compression threads. The
+ * connection's timer is disarmed, so it can't time out while it waits,
+ * and its socket events are ignored until loop_resume().
+ * @param  loop Event loop
+ * @param  conn Client connection with a compress_job
+ * @return 1 if the connection is now waiting, 0 if the response was
+ *         staged uncompressed right away
+ * @see compress_pool.h
+ */
+int loop_park(event_loop_t *loop, connection_t *conn) {
+  compress_job_t *job = conn->compress_job;
+  job->notify = loop_compress_done;
+  job->owner = loop;
+  if (compress_submit(job) < 0) {
+    compress_finish(conn, job);
+    return 0;
+  }
+  wheel_cancel(&loop->wheel, &conn->timer);
+  conn->state = CONN_WAITING;
+  return 1;
+}
+
+/**
+ * Advance a connection's state machine as far as its socket allows
+ * @param loop Event loop
+ * @param conn Client connection
+ */
+void loop_drive(event_loop_t *loop, connection_t *conn) {
+  while (1) {
+    switch (conn->state) {
+
+      case CONN_READING:
+        switch (conn_read(conn)) {
+          case CONN_IO_AGAIN: loop_arm(loop, conn); return;
+          case CONN_IO_ERROR: conn->state = CONN_CLOSING; continue;
+        }
+
+        /**
+         * Route the request, and any pipelined behind it, and stage
+         * the responses
+         * @see handle_request.h
+         */
+        handle_requests(conn);
+        if (conn->compress_job && loop_park(loop, conn)) return;
+        conn->state = CONN_SENDING;
+        continue;
+
+      case CONN_WAITING:
+        return;
+
+      case CONN_SENDING:
+        switch (conn_flush(conn)) {
+          case CONN_IO_AGAIN: loop_arm(loop, conn); return;
+          case CONN_IO_ERROR: conn->state = CONN_CLOSING; continue;
+        }
+
+        /**
+         * Wait for the next request, which may already be buffered
+         */
+        conn->state = conn->keep_alive ? CONN_READING : CONN_CLOSING;
+        continue;
+
+      case CONN_CLOSING:
+        wheel_cancel(&loop->wheel, &conn->timer);
+        conn_close(conn);
+        slab_free(&connection_pool, conn);
+        return;
+    }
+  }
+}
+
+/**
+ * Stage the responses of every finished compression job and carry on
+ * sending them
+ * @param loop Event loop
+ * @param now  Current time in ms
+ */
+void loop_resume(event_loop_t *loop, long long now) {
+  uint64_t count;
+  if (read(loop->wake_fd, &count, sizeof(count)) < 0) return;
+
+  pthread_mutex_lock(&loop->done_lock);
+  compress_job_t *job = loop->done;
+  loop->done = NULL;
+  pthread_mutex_unlock(&loop->done_lock);
+
+  while (job) {
+    compress_job_t *next = job->next;
+    connection_t *conn = job->conn;
+    compress_finish(conn, job);
+    conn->state = CONN_SENDING;
+    conn->last_active = now;
+    loop_drive(loop, conn);
+    job = next;
+  }
+}
+
+/**
+ * Wait for socket events and drive the connections they belong to
+ * @param  arg Event loop
+ */
+void *event_loop_thread(void *arg) {
+  event_loop_t *loop = (event_loop_t *)arg;
+  struct epoll_event events[MAX_EVENTS];
+
+  /**
+   * Every loop watches the listening socket. EPOLLEXCLUSIVE wakes only
+   * one of them per incoming connection.
+   */
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->server, &ev) < 0) {
+    perror("Could not watch server socket");
+    pthread_exit(NULL);
+  }
+
+  /**
+   * The compression threads wake the loop through an eventfd
+   * @see compress_pool.h
+   */
+  ev.events = EPOLLIN;
+  ev.data.ptr = &loop->wake_fd;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+    perror("Could not watch wakeup eventfd");
+    pthread_exit(NULL);
+  }
+
+  while (1) {
+    int timeout = loop_expire(loop, now_ms());
+    atomic_store_explicit(&loop->available, 1, memory_order_relaxed);
+    int n = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout);
+    atomic_store_explicit(&loop->available, 0, memory_order_relaxed);
+    if (n < 0) {
+      if (errno != EINTR) perror("epoll_wait");
+      continue;
+    }
+
+    long long now = now_ms();
+    int woken = 0;
+    for (int i = 0; i < n; i++) {
+      connection_t *conn = events[i].data.ptr;
+      if (conn == NULL) {
+        loop_accept(loop);
+        continue;
+      }
+      if (events[i].data.ptr == &loop->wake_fd) {
+        woken = 1;
+        continue;
+      }
+
+      /**
+       * A hangup while the response is being compressed shows up as a
+       * write error once it is sent
+       */
+      if (conn->state == CONN_WAITING) continue;
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        conn->state = CONN_CLOSING;
+      }
+      conn->last_active = now;
+      loop_drive(loop, conn);
+    }
+
+    /**
+     * Resuming may close and free a connection, which later events of
+     * this batch could still point at, so it waits for the batch to end
+     */
+    if (woken) loop_resume(loop, now);
+  }
+  pthread_exit(NULL);
+}
+
+/**
+ * Set up the state every loop has, whatever it waits with
+ * @param  loop   Event loop
+ * @param  tid    Loop number
+ * @param  server Listening socket
+ * @return 0 on success, -1 on error
+ */
+int event_loop_init(event_loop_t *loop, int tid, int server) {
+  loop->tid = tid;
+  loop->epfd = -1;
+  loop->server = server;
+  wheel_init(&loop->wheel, now_ms());
+  atomic_init(&loop->available, 0);
+  loop->done = NULL;
+  loop->uring = NULL;
+  pthread_mutex_init(&loop->done_lock, NULL);
+  if ((loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    perror("Could not create wakeup eventfd");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Start count event loop threads
+ * @param servers Listening socket for each loop, may all be the same one
+ * @param count   Number of loop threads
+ * @param loops   Storage for count loop structs
+ * @param threads Storage for count thread handles
+ * @return 0 on success, -1 on error
+ */
+int start_event_loops(int servers[], int count, event_loop_t loops[], pthread_t threads[]) {
+  for (int i = 0; i < count; i++) {
+    if (set_nonblocking(servers[i]) < 0) {
+      perror("Could not make server socket nonblocking");
+      return -1;
+    }
+    if (event_loop_init(&loops[i], i, servers[i]) < 0) return -1;
+    if ((loops[i].epfd = epoll_create1(0)) < 0) {
+      perror("Could not create epoll instance");
+      return -1;
+    }
+    int rc;
+    if ((rc = pthread_create(&threads[i], NULL, event_loop_thread, &loops[i]))) {
+      fprintf(stderr, "error: pthread_create, rc: %d\n", rc);
+      return -1;
+    }
+    if (PIN_CPUS) pin_thread(threads[i], i);
+  }
+  event_loops = loops;
+  return 0;
+}
@@ -0,0 +1,463 @@
+#include <stdint.h>
+
+#define FILE_CACHE_SHARDS 16
+#define FILE_CACHE_BUCKETS 1024
+#define FILE_CACHE_REVALIDATE_MS 1000
+#define FILE_CACHE_DOORKEEPER_BITS 16384
+#define FILE_CACHE_PROTECTED_PCT 80
+
+#define SEGMENT_NONE      0
+#define SEGMENT_PROBATION 1
+#define SEGMENT_PROTECTED 2
+
+/**
+ * A cached file body. Entries are reference counted, an evicted entry
+ * stays alive until the last connection sending it lets go.
+ */
+typedef struct _cache_entry_t {
+  char *key;
+  char *path;
+  uint64_t hash;
+  char *body;
+  size_t size;
+  const char *mime_type;
+  int encoding;         // Content coding of body
+  int variants;         // Fresh precompressed sidecars, a mask of encodings
+
+  // Validators, checked against stat() at most every FILE_CACHE_REVALIDATE_MS.
+  // file_size is the size of path, which differs from size once compressed.
+  off_t file_size;
+  struct timespec mtime;
+  ino_t ino;
+  dev_t dev;
+  long long validated_ms;
+
+  int refs;
+  int segment;
+  struct _cache_entry_t *bucket_next;
+  struct _cache_entry_t *prev;
+  struct _cache_entry_t *next;
+  struct _file_cache_shard_t *shard;
+} cache_entry_t;
+
+/**
+ * One segment of the segmented LRU, most recently used at the head
+ */
+typedef struct _cache_segment_t {
+  cache_entry_t *head;
+  cache_entry_t *tail;
+  size_t bytes;
+} cache_segment_t;
+
+/**
+ * The cache is split into shards by key hash, each with its own lock,
+ * so concurrent lookups for different files rarely meet
+ */
+typedef struct _file_cache_shard_t {
+  pthread_mutex_t lock;
+  cache_entry_t *buckets[FILE_CACHE_BUCKETS];
+  cache_segment_t probation;
+  cache_segment_t protected;
+
+  // Admission filter: a file is only cached the second time it is seen
+  unsigned char doorkeeper[FILE_CACHE_DOORKEEPER_BITS / 8];
+  int doorkeeper_count;
+
+  // Counters, guarded by the shard lock
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long admitted;
+  unsigned long long rejected;
+  unsigned long long evicted;
+  unsigned long long invalidated;
+} file_cache_shard_t;
+
+file_cache_shard_t file_cache[FILE_CACHE_SHARDS];
+
+/**
+ * FNV-1a hash of a cache key
+ * @param key Cache key
+ */
+uint64_t file_cache_hash(const char *key) {
+  uint64_t hash = 14695981039346656037ULL;
+  while (*key) {
+    hash ^= (unsigned char)*key++;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * Initialize every shard
+ */
+void file_cache_init() {
+  memset(file_cache, 0, sizeof(file_cache));
+  for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+    pthread_mutex_init(&file_cache[i].lock, NULL);
+  }
+}
+
+/**
+ * Bytes an entry counts against the cache size
+ * @param entry Cache entry
+ */
+size_t cache_entry_cost(cache_entry_t *entry) {
+  return sizeof(cache_entry_t) + entry->size + strlen(entry->key) + strlen(entry->path) + 2;
+}
+
+/**
+ * Free an entry nobody references anymore
+ * @param entry Cache entry
+ */
+void cache_entry_free(cache_entry_t *entry) {
+  free(entry->body);
+  free(entry->path);
+  free(entry->key);
+  free(entry);
+}
+
+/**
+ * Unlink an entry from its segment list. Caller holds the shard lock.
+ * @param shard Cache shard
+ * @param entry Cache entry
+ */
+void cache_segment_remove(file_cache_shard_t *shard, cache_entry_t *entry) {
+  cache_segment_t *seg = entry->segment == SEGMENT_PROTECTED ? &shard->protected : &shard->probation;
+  if (entry->prev) entry->prev->next = entry->next;
+  else seg->head = entry->next;
+  if (entry->next) entry->next->prev = entry->prev;
+  else seg->tail = entry->prev;
+  entry->prev = entry->next = NULL;
+  seg->bytes -= cache_entry_cost(entry);
+  entry->segment = SEGMENT_NONE;
+}
+
+/**
+ * Link an entry at the head of a segment. Caller holds the shard lock.
+ * @param shard   Cache shard
+ * @param entry   Cache entry
+ * @param segment SEGMENT_PROBATION or SEGMENT_PROTECTED
+ */
+void cache_segment_push(file_cache_shard_t *shard, cache_entry_t *entry, int segment) {
+  cache_segment_t *seg = segment == SEGMENT_PROTECTED ? &shard->protected : &shard->probation;
+  entry->segment = segment;
+  entry->prev = NULL;
+  entry->next = seg->head;
+  if (seg->head) seg->head->prev = entry;
+  else seg->tail = entry;
+  seg->head = entry;
+  seg->bytes += cache_entry_cost(entry);
+}
+
+/**
+ * Drop an entry from the shard, freeing it once unreferenced.
+ * Caller holds the shard lock.
+ * @param shard Cache shard
+ * @param entry Cache entry
+ */
+void cache_entry_detach(file_cache_shard_t *shard, cache_entry_t *entry) {
+  cache_entry_t **link = &shard->buckets[entry->hash % FILE_CACHE_BUCKETS];
+  while (*link && *link != entry) link = &(*link)->bucket_next;
+  if (*link) *link = entry->bucket_next;
+  if (entry->segment != SEGMENT_NONE) cache_segment_remove(shard, entry);
+  if (--entry->refs == 0) cache_entry_free(entry);
+}
+
+/**
+ * Evict from the probation tail until the shard fits its budget.
+ * Caller holds the shard lock.
+ * @param shard Cache shard
+ */
+void cache_shard_trim(file_cache_shard_t *shard) {
+  size_t budget = CACHE_SIZE / FILE_CACHE_SHARDS;
+  while (shard->probation.bytes + shard->protected.bytes > budget) {
+    cache_entry_t *victim = shard->probation.tail ? shard->probation.tail : shard->protected.tail;
+    if (victim == NULL) break;
+    cache_entry_detach(shard, victim);
+    shard->evicted++;
+  }
+}
+
+/**
+ * Record a hit: probation entries graduate to the protected segment,
+ * which demotes its own least recently used entries back to probation
+ * when it outgrows its share. Caller holds the shard lock.
+ * @param shard Cache shard
+ * @param entry Cache entry
+ */
+void cache_entry_touch(file_cache_shard_t *shard, cache_entry_t *entry) {
+  cache_segment_remove(shard, entry);
+  cache_segment_push(shard, entry, SEGMENT_PROTECTED);
+
+  size_t protected_budget = CACHE_SIZE / FILE_CACHE_SHARDS * FILE_CACHE_PROTECTED_PCT / 100;
+  while (shard->protected.bytes > protected_budget && shard->protected.tail != entry) {
+    cache_entry_t *demoted = shard->protected.tail;
+    cache_segment_remove(shard, demoted);
+    cache_segment_push(shard, demoted, SEGMENT_PROBATION);
+  }
+}
+
+/**
+ * Does the file on disk still match the cached copy?
+ * @param entry Cache entry
+ * @param st    Fresh stat result
+ */
+int cache_entry_matches(cache_entry_t *entry, struct stat *st) {
+  return S_ISREG(st->st_mode) &&
+    st->st_size == entry->file_size &&
+    st->st_ino == entry->ino &&
+    st->st_dev == entry->dev &&
+    st->st_mtim.tv_sec == entry->mtime.tv_sec &&
+    st->st_mtim.tv_nsec == entry->mtime.tv_nsec;
+}
+
+/**
+ * Let go of an entry returned by file_cache_get() or file_cache_put()
+ * @param arg Cache entry
+ */
+void file_cache_release(void *arg) {
+  cache_entry_t *entry = (cache_entry_t *)arg;
+  file_cache_shard_t *shard = entry->shard;
+  pthread_mutex_lock(&shard->lock);
+  int refs = --entry->refs;
+  pthread_mutex_unlock(&shard->lock);
+  if (refs == 0) cache_entry_free(entry);
+}
+
+/**
+ * Look up a cached file. Entries are revalidated against the file on
+ * disk at most once every FILE_CACHE_REVALIDATE_MS, so a warm hit makes
+ * no syscalls at all.
+ * @param  key Request file path
+ * @return Referenced entry, or NULL on a miss
+ */
+cache_entry_t *file_cache_get(const char *key) {
+  if (CACHE_SIZE == 0) return NULL;
+
+  uint64_t hash = file_cache_hash(key);
+  file_cache_shard_t *shard = &file_cache[hash % FILE_CACHE_SHARDS];
+
+  pthread_mutex_lock(&shard->lock);
+  cache_entry_t *entry = shard->buckets[hash % FILE_CACHE_BUCKETS];
+  while (entry && (entry->hash != hash || strcmp(entry->key, key) != 0)) {
+    entry = entry->bucket_next;
+  }
+  if (entry == NULL) {
+    shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+  }
+  entry->refs++;
+  long long now = now_ms();
+  int stale = now - entry->validated_ms >= FILE_CACHE_REVALIDATE_MS;
+  if (!stale) {
+    shard->hits++;
+    cache_entry_touch(shard, entry);
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  if (!stale) return entry;
+
+  /**
+   * Revalidate outside the lock
+   */
+  struct stat st;
+  int valid = stat(entry->path, &st) == 0 && cache_entry_matches(entry, &st);
+
+  pthread_mutex_lock(&shard->lock);
+  if (valid) {
+    entry->validated_ms = now;
+    shard->hits++;
+    if (entry->segment != SEGMENT_NONE) cache_entry_touch(shard, entry);
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+  }
+  shard->misses++;
+  shard->invalidated++;
+  if (entry->segment != SEGMENT_NONE) cache_entry_detach(shard, entry);
+  pthread_mutex_unlock(&shard->lock);
+  file_cache_release(entry);
+  return NULL;
+}
+
+/**
+ * Test-and-set the doorkeeper bit for a key. The filter is cleared
+ * once half full so stale sightings age out. Caller holds the shard lock.
+ * @param  shard Cache shard
+ * @param  hash  Key hash
+ * @return 1 if the key had been seen before
+ */
+int cache_doorkeeper_seen(file_cache_shard_t *shard, uint64_t hash) {
+  unsigned int bit = (hash >> 32) % FILE_CACHE_DOORKEEPER_BITS;
+  if (shard->doorkeeper[bit / 8] & (1 << (bit % 8))) return 1;
+  shard->doorkeeper[bit / 8] |= 1 << (bit % 8);
+  if (++shard->doorkeeper_count > FILE_CACHE_DOORKEEPER_BITS / 2) {
+    memset(shard->doorkeeper, 0, sizeof(shard->doorkeeper));
+    shard->doorkeeper_count = 0;
+  }
+  return 0;
+}
+
+/**
+ * Add a body that has already been produced, e.g. a compressed copy of
+ * path. It skips the doorkeeper: the work is done, and keeping the
+ * result is what saves redoing it.
+ * @param  key       Cache key
+ * @param  path      File the body was made from, revalidated like any entry
+ * @param  st        stat() result for path when the body was made
+ * @param  mime_type MIME type to serve it with
+ * @param  encoding  Content coding of body
+ * @param  variants  Precompressed sidecars, see content_encoding.h
+ * @param  body      Body from malloc(), the cache takes it over on success
+ * @param  size      Body length
+ * @return Referenced entry, or NULL if not cached and body is still the caller's
+ */
+cache_entry_t *file_cache_insert(const char *key, const char *path, struct stat *st,
+    const char *mime_type, int encoding, int variants, char *body, size_t size) {
+  if (CACHE_SIZE == 0 || size > CACHE_MAX_FILE) return NULL;
+
+  uint64_t hash = file_cache_hash(key);
+  file_cache_shard_t *shard = &file_cache[hash % FILE_CACHE_SHARDS];
+  cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+  if (entry == NULL) return NULL;
+  entry->key = strdup(key);
+  entry->path = strdup(path);
+  if (entry->key == NULL || entry->path == NULL) {
+    free(entry->key);
+    free(entry->path);
+    free(entry);
+    return NULL;
+  }
+  entry->hash = hash;
+  entry->body = body;
+  entry->size = size;
+  entry->mime_type = mime_type;
+  entry->encoding = encoding;
+  entry->variants = variants;
+  entry->file_size = st->st_size;
+  entry->mtime = st->st_mtim;
+  entry->ino = st->st_ino;
+  entry->dev = st->st_dev;
+  entry->validated_ms = now_ms();
+  entry->shard = shard;
+  entry->refs = 2; // One for the cache, one for the caller
+
+  pthread_mutex_lock(&shard->lock);
+
+  /**
+   * Another thread may have cached the same file in the meantime
+   */
+  cache_entry_t **bucket = &shard->buckets[hash % FILE_CACHE_BUCKETS];
+  cache_entry_t *existing = *bucket;
+  while (existing && (existing->hash != hash || strcmp(existing->key, key) != 0)) {
+    existing = existing->bucket_next;
+  }
+  if (existing) {
+    existing->refs++;
+    pthread_mutex_unlock(&shard->lock);
+    cache_entry_free(entry);
+    return existing;
+  }
+
+  entry->bucket_next = *bucket;
+  *bucket = entry;
+  cache_segment_push(shard, entry, SEGMENT_PROBATION);
+  shard->admitted++;
+  cache_shard_trim(shard);
+  pthread_mutex_unlock(&shard->lock);
+  return entry;
+}
+
+/**
+ * Read a file into the cache, if it is small enough and has been asked
+ * for before. New entries start on probation, so a crawler touching
+ * every file once can't push out the hot set.
+ * @param  key       Request file path
+ * @param  path      File to read, differs from key for index files
+ * @param  st        stat() result for path
+ * @param  mime_type MIME type to serve it with
+ * @param  encoding  Content coding of the file
+ * @param  variants  Precompressed sidecars the file has, see content_encoding.h
+ * @return Referenced entry, or NULL if it was not admitted
+ */
+cache_entry_t *file_cache_put(const char *key, const char *path, struct stat *st,
+    const char *mime_type, int encoding, int variants) {
+  if (CACHE_SIZE == 0 || (size_t)st->st_size > CACHE_MAX_FILE) return NULL;
+
+  uint64_t hash = file_cache_hash(key);
+  file_cache_shard_t *shard = &file_cache[hash % FILE_CACHE_SHARDS];
+
+  pthread_mutex_lock(&shard->lock);
+  int admit = cache_doorkeeper_seen(shard, hash);
+  if (!admit) shard->rejected++;
+  pthread_mutex_unlock(&shard->lock);
+  if (!admit) return NULL;
+
+  /**
+   * Read the body without holding the lock
+   */
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat fst;
+  if (fstat(fd, &fst) < 0 || fst.st_size != st->st_size) {
+    close(fd);
+    return NULL;
+  }
+  char *body = malloc(fst.st_size ? fst.st_size : 1);
+  size_t got = 0;
+  while (body && got < (size_t)fst.st_size) {
+    ssize_t n = read(fd, body + got, fst.st_size - got);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    got += n;
+  }
+  close(fd);
+  if (body == NULL || got != (size_t)fst.st_size) {
+    free(body);
+    return NULL;
+  }
+  cache_entry_t *cached = file_cache_insert(key, path, &fst, mime_type, encoding, variants, body, got);
+  if (cached == NULL) free(body);
+  return cached;
+}
+
+/**
+ * Lookups that found and didn't find a body, over every shard
+ * @param hits   Set to the hits
+ * @param misses Set to the misses
+ */
+void file_cache_counts(unsigned long long *hits, unsigned long long *misses) {
+  *hits = *misses = 0;
+  for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+    pthread_mutex_lock(&file_cache[i].lock);
+    *hits += file_cache[i].hits;
+    *misses += file_cache[i].misses;
+    pthread_mutex_unlock(&file_cache[i].lock);
+  }
+}
+
+/**
+ * Print hit ratio and occupancy
+ * @param out Stream to print to
+ */
+void file_cache_report(FILE *out) {
+  unsigned long long hits = 0, misses = 0, admitted = 0, rejected = 0, evicted = 0, invalidated = 0;
+  size_t bytes = 0;
+  for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+    file_cache_shard_t *shard = &file_cache[i];
+    pthread_mutex_lock(&shard->lock);
+    hits += shard->hits;
+    misses += shard->misses;
+    admitted += shard->admitted;
+    rejected += shard->rejected;
+    evicted += shard->evicted;
+    invalidated += shard->invalidated;
+    bytes += shard->probation.bytes + shard->protected.bytes;
+    pthread_mutex_unlock(&shard->lock);
+  }
+  double ratio = hits + misses ? 100.0 * hits / (hits + misses) : 0;
+  fprintf(out,
+    "File cache: %.1f%% hit ratio (%llu hits, %llu misses), %zu/%zu bytes, "
+    "%llu admitted, %llu rejected, %llu evicted, %llu invalidated\n",
+    ratio, hits, misses, bytes, CACHE_SIZE, admitted, rejected, evicted, invalidated);
+}
@@ -1,3 +1,14 @@
+#define STATUS_CODE_MIN 100
+#define STATUS_CODES    500  // 100 to 599
+
+/**
+ * Constant bytes of a response, generated into status_table.h
+ */
+typedef struct {
+  const char *data;
+  size_t len;
+} http_blob_t;
+
 const char * get_status_message(int code) {
   switch (code) {
     // 1×× Informational
@@ -1,390 +1,317 @@
 #include <sys/stat.h>
 
-typedef struct {
-  char *key;
-  char *value;
-} header[MAX_HEADERS];
-
-typedef struct {
-  int well_formed;
-  char *method;
-  char *uri;
-  char *path;
-  char *querystring;
-  char *protocol;
-  header *headers;
-} request;
-
-request parse_headers(char header_str[], int *header_count);
-void send_http_error(int socket, int code);
-void close_client_socket(int socket);
-void send_http_status(int socket, int code);
-void send_http_header(int socket, char key[], char value[]);
-int method_supported(char method[]);
-void log_request(char ip[], int port, char method[], char uri[]);
-void handle_request(const int client);
-void url_decode(char *str);
-int dir_has_index(char path[]);
+void send_http_error(connection_t *conn, int code);
+void send_http_status(connection_t *conn, int code);
+void send_http_header(connection_t *conn, char key[], char value[]);
+void send_connection_header(connection_t *conn);
+int method_supported(const char *buf, http_view_t method);
+void log_request(connection_t *conn);
+void handle_request(connection_t *conn);
+void handle_requests(connection_t *conn);
+void serve_metrics(connection_t *conn);
 
 #include "get_status_message.h"
+#include "status_table.h"
 #include "mime_types.h"
+#include "content_encoding.h"
+#include "validators.h"
+#include "byte_ranges.h"
+#include "file_cache.h"
+#include "compress_pool.h"
+#include "meta_cache.h"
 #include "serve_file.h"
 #include "serve_directory.h"
+#include "site_bundle.h"
 
 /**
- * Parse an HTTP header string into a request struct
- * @param  header_str   Raw HTTP header string
- * @param  header_count Number of headers
- * @return struct request
+ * Stage the initial HTTP status message, rendered at build time for
+ * every known status code
+ * @param conn Client connection
+ * @param code HTTP status code
+ * @see status_gen.c
  */
-request parse_headers(char header_str[], int *header_count) {
-  int well_formed = 1;
-  char ending[5];
-  strcpy(ending, "\r\n");
-
-  /**
-   * Count number of headers, -1 to subtract first line
-   */
-  int hc = -1;
-  const char *ptr, *last = NULL;
-  for (ptr = header_str; (last = strstr(ptr, ending)); ptr = last+1) {
-    hc++;
-  }
-  *header_count = hc;
-
-  /**
-   *  This means no complete lines were sent
-   *  Consider malformed and abort to avoid segfault
-   */
-  if (hc <= 0) {
-    request rq = {0};
-    return rq;
-  }
-
-  /**
-   *  Split raw headers into lines
-   */
-  char *line = strtok(header_str, ending);
-
-  /**
-   *  Parse first line: [METHOD] [URI] [PROTOCOL]
-   */
-  char method[MAX_METHOD_LEN], uri[MAX_URI_LEN], protocol[MAX_PROTOCOL_LEN];
-  memset(method, 0, MAX_METHOD_LEN);
-  memset(uri, 0, MAX_URI_LEN);
-  memset(protocol, 0, MAX_PROTOCOL_LEN);
-  sscanf(line, "%s %s %s", method, uri, protocol);
-
-  if (strlen(method) < 1)               well_formed = 0;
-  if (strlen(uri) < 1 || uri[0] != '/') well_formed = 0;
-  if (strlen(protocol) < 1)             well_formed = 0;
-
-  /**
-   * Parse headers into header structs
-   */
-  header headers[hc];
-  char format_str[32];
-  sprintf(format_str, "%s[^:]: %s%ic", "%", "%", MAX_HEADER_VALUE_LEN);
-  char key[MAX_HEADER_KEY_LEN], value[MAX_HEADER_VALUE_LEN];
-  int j = 0;
-  do {
-    line = strtok(NULL, ending);
-    if (line != NULL) {
-      memset(&key, 0, MAX_HEADER_KEY_LEN);
-      memset(&value, 0, MAX_HEADER_VALUE_LEN);
-      sscanf(line, format_str, key, value);
-      headers[j]->key = strdup(key);
-      headers[j]->value = strdup(value);
-      j++;
-    }
-  } while (line != NULL && j < hc);
-
-  /**
-   *  Split path and querystring
-   */
-  char path[MAX_URI_LEN], querystring[MAX_URI_LEN];
-  char format_string[255];
-  memset(path, 0, MAX_URI_LEN);
-  memset(querystring, 0, MAX_URI_LEN);
-  memset(format_string, 0, 255);
-  if (strstr(uri, "?") != NULL) {
-    sprintf(format_string, "%%%d[^?]%%%d[^\r\n]", MAX_URI_LEN, MAX_URI_LEN);
-    sscanf(uri, format_string, path, querystring);
-  }else{
-    sprintf(format_string, "%%%d[^?\r\n]", MAX_URI_LEN);
-    sscanf(uri, format_string, path);
+void send_http_status(connection_t *conn, int code) {
+  int index = code - STATUS_CODE_MIN;
+  if (index >= 0 && index < STATUS_CODES && status_lines[index].len) {
+    conn_append(conn, status_lines[index].data, status_lines[index].len);
+    return;
   }
-
-  url_decode(path);
-
-  request rq = {
-    well_formed,
-    method,
-    uri,
-    path,
-    querystring,
-    protocol,
-    headers
-  };
-
-  return rq;
+  char out[255];
+  int len = sprintf(out, "HTTP/1.1 %d %s\r\n", code, get_status_message(code));
+  conn_append(conn, out, len);
 }
 
 /**
- * Decode URL-encoded characters
- * @param str String to decode
+ * Stage a single HTTP header, copied straight into the output buffer
+ * @param conn  Client connection
+ * @param key   Header name
+ * @param value Header value
  */
-void url_decode(char *str) {
-  unsigned int i;
-  char tmp[BUFSIZ];
-  char *ptr = tmp;
-  memset(tmp, 0, sizeof(tmp));
-  for (i=0; i < strlen(str); i++) {
-    if (str[i] != '%') {
-      *ptr++ = str[i];
-      continue;
-    }
-    if (!isdigit(str[i+1]) || !isdigit(str[i+2])) {
-      *ptr++ = str[i];
-      continue;
-    }
-    *ptr++ = ((str[i+1] - '0') << 4) | (str[i+2] - '0');
-    i += 2;
-  }
-  *ptr = '\0';
-  strcpy(str, tmp);
+void send_http_header(connection_t *conn, char key[], char value[]) {
+  size_t key_len = strlen(key), value_len = strlen(value);
+  char *p = conn_extend(conn, key_len + 2 + value_len + 2);
+  if (p == NULL) return;
+  p = mempcpy(p, key, key_len);
+  p = mempcpy(p, ": ", 2);
+  p = mempcpy(p, value, value_len);
+  memcpy(p, "\r\n", 2);
 }
 
 /**
- * Close the client socket if it's still open
- * @param socket Client socket
+ * Stage the Connection header (and Keep-Alive parameters) for this response
+ * @param conn Client connection
  */
-void close_client_socket(int socket) {
-  int val;
-  socklen_t len = sizeof(val);
-  // Try writing to it first...
-  if (getsockopt(socket, SOL_SOCKET, SO_ACCEPTCONN, &val, &len) != -1){
-    if (close(socket) < 0) {
-      perror("Could not close client socket");
-    }
+void send_connection_header(connection_t *conn) {
+  if (!conn->keep_alive) {
+    send_http_header(conn, "Connection", "close");
+    return;
   }
+  char params[64];
+  snprintf(params, sizeof(params), "timeout=%d, max=%d",
+    KEEPALIVE_TIMEOUT, KEEPALIVE_MAX - conn->requests_served);
+  send_http_header(conn, "Connection", "keep-alive");
+  send_http_header(conn, "Keep-Alive", params);
 }
 
 /**
- * Send the initial HTTP status message
- * @param socket Client socket
- * @param code   HTTP status code
- * @see get_status_message.h
+ * Replace the response being staged with an HTTP error and body message.
+ * Earlier pipelined responses on the connection are kept.
+ * @param conn Client connection
+ * @param code HTTP status code
  */
-void send_http_status(int socket, int code) {
+void send_http_error(connection_t *conn, int code) {
   const char *message = get_status_message(code);
-  char out[255];
-  sprintf(out, "HTTP/1.1 %d %s\r\n", code, message);
-  write(socket, out, strlen(out));
-}
+  char output[1024], body_len[32];
 
-/**
- * Send a single HTTP header
- * @param socket Client socket
- * @param key    Header name
- * @param value  Header value
- */
-void send_http_header(int socket, char key[], char value[]) {
-  char out[strlen(key)+strlen(value)+32];
-  sprintf(out, "%s: %s\r\n", key, value);
-  write(socket, out, strlen(out));
-}
+  /**
+   * After a bad request we can't tell where the next one starts
+   */
+  if (code == 400) conn->keep_alive = 0;
+  conn_reset_response(conn);
 
-/**
- * Send an HTTP error header with body message and close connection
- * @param socket Client socket
- * @param code   HTTP status code
- */
-void send_http_error(int socket, int code) {
-  const char *message = get_status_message(code);
-  char header[255], output[1024];
-  sprintf(header, "HTTP/1.1 %d %s\r\n", code, message);
-  write(socket, header, strlen(header));
-  send_http_header(socket, "Content-Type", "text/html");
-  send_http_header(client, "Connection", "close");
-  write(socket, "\r\n\r\n", 4);
-  sprintf(output,
+  /**
+   * Known errors are rendered at build time, only the Connection
+   * header is staged here
+   * @see status_gen.c
+   */
+  int index = code - STATUS_CODE_MIN;
+  if (index >= 0 && index < STATUS_CODES && error_heads[index].len) {
+    conn_append(conn, error_heads[index].data, error_heads[index].len);
+    send_connection_header(conn);
+    conn_append(conn, "\r\n", 2);
+    conn_append(conn, error_bodies[index].data, error_bodies[index].len);
+    return;
+  }
+
+  int len = sprintf(output,
     "<h1>HTTP %i: %s</h1><br>",
     code,
     message
   );
-  write(socket, output, strlen(output));
-  close_client_socket(socket);
+  snprintf(body_len, sizeof(body_len), "%d", len);
+
+  send_http_status(conn, code);
+  send_http_header(conn, "Content-Type", "text/html");
+  send_http_header(conn, "Content-Length", body_len);
+  send_connection_header(conn);
+  conn_append(conn, "\r\n", 2);
+  conn_append(conn, output, len);
 }
 
 /**
  * Is request method supported?
+ * @param  buf    Receive buffer
  * @param  method Request method
  */
-int method_supported(char method[]) {
-  char str[strlen(method)];
-  strcpy(str, method);
-  for(int i = 0; method[i]; i++) str[i] = toupper(method[i]);
-  if (strcmp(str, "GET") == 0)     return 1;
-  if (strcmp(str, "POST") == 0)    return 0;
-  if (strcmp(str, "HEAD") == 0)    return 0;
-  if (strcmp(str, "PUT") == 0)     return 0;
-  if (strcmp(str, "DELETE") == 0)  return 0;
-  if (strcmp(str, "OPTIONS") == 0) return 0;
-  if (strcmp(str, "CONNECT") == 0) return 0;
-  return 0;
-}
-
-/**
- * Check if a given directory has a file matching INDEX_FILE
- * @param  path Path to check
- */
-int dir_has_index(char path[]) {
-  struct stat stat_result;
-  char index_path[strlen(path) + 1 + sizeof(INDEX_FILE)];
-  memset(index_path, 0, sizeof(index_path));
-  strcat(index_path, path);
-  if (index_path[strlen(index_path)-1] != '/') strcat(index_path, "/");
-  strcat(index_path, INDEX_FILE);
-  if (stat(index_path, &stat_result) > -1) {
-    return 1;
-  }
+int method_supported(const char *buf, http_view_t method) {
+  if (http_view_is(buf, method, "GET"))     return 1;
+  if (http_view_is(buf, method, "POST"))    return 0;
+  if (http_view_is(buf, method, "HEAD"))    return 1;
+  if (http_view_is(buf, method, "PUT"))     return 0;
+  if (http_view_is(buf, method, "DELETE"))  return 0;
+  if (http_view_is(buf, method, "OPTIONS")) return 0;
+  if (http_view_is(buf, method, "CONNECT")) return 0;
   return 0;
 }
 
 /**
- * Print request into to the terminal
- * @param ip     Client IP
- * @param method HTTP method
- * @param uri    Requested URI
+ * Start the request's access log entry, and print it to the terminal
+ * at --verbose=2
+ * @param conn Client connection, with its request parsed
+ * @see access_log.h
  */
-void log_request(char ip[], int port, char method[], char uri[]) {
-  printf("Request [%s:%i] %s %s\n", ip, port, method, uri);
+void log_request(connection_t *conn) {
+  http_request_t *rq = &conn->request;
+  access_log_begin(conn);
+  if (VERBOSE < 2) return;
+  printf("Request [%s:%i] %.*s %.*s\n", conn->client_ip, conn->client_port,
+    rq->method.length, conn->in + rq->method.offset,
+    rq->uri.length, conn->in + rq->uri.offset);
 }
 
 /**
- * Handle the client's request
- * @param client      Client socket
+ * Handle the client's request and stage the response on the connection
+ * @param conn Client connection, with a complete request in its buffer
  */
-void handle_request(const int client) {
-
-  char client_buffer[BUFFER_SIZE]; // Stores the request headers
-  memset(client_buffer, 0, sizeof(client_buffer));
+void handle_request(connection_t *conn) {
 
   /**
-   *  Read headers and determine what they want
+   *  The request was parsed as it arrived, its fields are views
+   *  into the receive buffer
+   *  @see http_parser.h
    */
-  memset(client_buffer, 0, sizeof(client_buffer));
-  read(client, client_buffer, BUFFER_SIZE);
-  int header_count = 0;
-  request rq = parse_headers(client_buffer, &header_count);
+  http_request_t *rq = &conn->request;
 
   /**
-   * Get client IP and port
+   *  Decide up front whether the connection outlives this response,
+   *  the Connection header is staged along with the others
    */
-  socklen_t len;
-  struct sockaddr_storage addr;
-  char client_ip[INET6_ADDRSTRLEN];
-  int client_port;
-  len = sizeof addr;
-  getpeername(client, (struct sockaddr*)&addr, &len);
-  if (addr.ss_family == AF_INET) {
-    // IPv4
-    struct sockaddr_in *s = (struct sockaddr_in *)&addr;
-    client_port = ntohs(s->sin_port);
-    inet_ntop(AF_INET, &s->sin_addr, client_ip, sizeof client_ip);
-  } else {
-    // IPv6
-    struct sockaddr_in6 *s = (struct sockaddr_in6 *)&addr;
-    client_port = ntohs(s->sin6_port);
-    inet_ntop(AF_INET6, &s->sin6_addr, client_ip, sizeof client_ip);
-  }
+  conn->requests_served++;
+  conn->response_start = conn->out_len;
+  conn->head_only = 0;
+  conn->keep_alive = rq->keep_alive &&
+    rq->state == HTTP_STATE_DONE &&
+    KEEPALIVE_TIMEOUT > 0 &&
+    conn->requests_served < KEEPALIVE_MAX;
 
   /**
    *  Print the basic request info
    */
-  log_request(client_ip, client_port, rq.method, rq.uri);
+  log_request(conn);
 
   /**
-   *  Is request malformed?
+   *  Is request malformed, or over one of the size limits?
    */
-  if (rq.well_formed != 1) {
-    // Send HTTP 400 Bad Request
-    send_http_error(client, 400);
+  if (rq->state != HTTP_STATE_DONE) {
+    // Send HTTP 400, 411, 413, 414, 431 or 505
+    send_http_error(conn, rq->error);
     return;
   }
 
   /**
    * Is request method supported?
    */
-  if (method_supported(rq.method) != 1) {
+  if (method_supported(conn->in, rq->method) != 1) {
     // Send HTTP 405 Method Not Supported
-    send_http_error(client, 405);
+    send_http_error(conn, 405);
+    return;
+  }
+
+  /**
+   * HEAD takes the same path as GET, the body is dropped at the end
+   * @see handle_requests()
+   */
+  conn->head_only = http_view_is(conn->in, rq->method, "HEAD");
+
+  /**
+   * The metrics endpoint, if enabled, shadows any file at its path
+   * @see stats.h
+   */
+  if (METRICS_PATH != NULL && rq->path.length == strlen(METRICS_PATH) &&
+      memcmp(conn->in + rq->path.offset, METRICS_PATH, rq->path.length) == 0) {
+    serve_metrics(conn);
+    return;
+  }
+
+  /**
+   *  With --bundle every path is looked up in the packed site
+   *  @see site_bundle.h
+   */
+  if (BUNDLE) {
+    char *path = arena_alloc(&conn->arena, rq->path.length + 1);
+    if (path == NULL) {
+      send_http_error(conn, 500);
+      return;
+    }
+    if (url_decode(path, conn->in + rq->path.offset, rq->path.length) < 0) {
+      send_http_error(conn, 400);
+      return;
+    }
+    serve_bundle(conn, path);
     return;
   }
 
   /**
    *  Build file path
    */
-  char file_path[sizeof(rq.path) + sizeof(SERVER_ROOT)];
-  memset(file_path, 0, sizeof(file_path));
-  strcat(file_path, SERVER_ROOT);
-  strcat(file_path, rq.path);
+  size_t root_len = strlen(SERVER_ROOT);
+  char *file_path = arena_alloc(&conn->arena, root_len + rq->path.length + 1);
+  if (file_path == NULL) {
+    send_http_error(conn, 500);
+    return;
+  }
+  memcpy(file_path, SERVER_ROOT, root_len);
+  if (url_decode(file_path + root_len, conn->in + rq->path.offset, rq->path.length) < 0) {
+    send_http_error(conn, 400);
+    return;
+  }
+
+  /**
+   *  Hot files are served straight from memory
+   *  @see file_cache.h
+   */
+  if (serve_from_cache(conn, file_path)) {
+    return;
+  }
 
   /**
-   *  Stat path to determine what we're working with
+   *  Work out what we're working with, from the metadata cache once
+   *  the path is warm
+   *  @see meta_cache.h
    */
-  struct stat *file_info;
-  file_info = malloc(sizeof(struct stat));
-  if (stat(file_path, file_info) < 0) {
-    send_http_error(client, 404);
+  file_meta_t meta;
+  long long resolve_start = now_us();
+  int status = meta_resolve(conn, file_path, &meta);
+  metrics_observe(HIST_STAT, now_us() - resolve_start);
+  if (status != 200) {
+    send_http_error(conn, status);
     return;
   }
 
-  if (S_ISREG(file_info->st_mode)) {
+  if (meta.type == META_FILE) {
 
     /**
      *  If it's a regular file, serve it
      *  @see serve_file.h
      */
-    serve_file(client, file_path, file_info);
+    serve_file(conn, file_path, &meta);
 
-  }else{
+  }else if (meta.type == META_INDEX) {
 
     /**
      *  If it's a directory with an index.html, serve that instead
      *  @see serve_file.h
      */
-    if (dir_has_index(file_path)) {
-      char new_file_path[sizeof(file_path) + sizeof(INDEX_FILE) + 1];
-      memset(new_file_path, 0, sizeof(new_file_path));
+    if (VERBOSE >= 2) printf("Serving index file: %s\n", INDEX_FILE);
+    serve_file(conn, file_path, &meta);
 
-      strcat(new_file_path, file_path);
-      if (new_file_path[strlen(new_file_path)-1] != '/') strcat(new_file_path, "/");
-      strcat(new_file_path, INDEX_FILE);
-
-      file_info = malloc(sizeof(struct stat));
-      if (stat(new_file_path, file_info) < 0) {
-        printf("Failed reading: %s\n", new_file_path);
-        send_http_error(client, 500);
-        return;
-      }
-
-      printf("Serving index file: %s\n", INDEX_FILE);
-      serve_file(client, new_file_path, file_info);
-    }
+  }else{
 
     /**
      *  If it's a directory with no index, build directory view
      *  @see serve_directory.h
      */
-     serve_directory(client, file_path);
+    serve_directory(conn, file_path, &meta.file_info);
   }
+}
 
-  free(file_info);
-
-  /**
-   *  Close the client socket (if it's still open)
-   */
-  close_client_socket(client);
+/**
+ * Stage responses, in order, for every complete request in the receive
+ * buffer. Stops early when a file body must be sent before the next
+ * response can be staged, or when enough output has built up.
+ * @param conn Client connection, with at least one complete request
+ */
+void handle_requests(connection_t *conn) {
+  // The send and request deadlines count from here
+  conn->response_us = conn->request_us;
+  conn->progress_ms = now_ms();
+  do {
+    handle_request(conn);
+    if (conn->head_only) conn_strip_body(conn);
+    if (conn->compress_job == NULL) access_log_staged(conn);
+    conn_consume_request(conn);
+  } while (conn->keep_alive &&
+           !conn_body_pending(conn) &&
+           conn->out_len < PIPELINE_FLUSH_SIZE &&
+           conn_request_ready(conn));
 }
@@ -0,0 +1,303 @@
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Return values for http_parse()
+ */
+#define HTTP_PARSE_DONE   1
+#define HTTP_PARSE_AGAIN  0
+#define HTTP_PARSE_ERROR -1
+
+/**
+ * Parser states, in the order a request passes through them
+ */
+#define HTTP_STATE_REQUEST_LINE 0
+#define HTTP_STATE_HEADERS      1
+#define HTTP_STATE_BODY         2
+#define HTTP_STATE_DONE         3
+#define HTTP_STATE_ERROR        4
+
+/**
+ * A slice of the receive buffer. Header blocks are capped at
+ * MAX_HEADER_SIZE, so 16 bits are enough and a header costs 8 bytes.
+ */
+typedef struct {
+  uint16_t offset;
+  uint16_t length;
+} http_view_t;
+
+typedef struct {
+  http_view_t key;
+  http_view_t value;
+} http_header_t;
+
+/**
+ * Parsed request, and the state needed to resume parsing when more
+ * bytes arrive. Nothing is copied: every field is a view into the
+ * buffer that was parsed.
+ */
+typedef struct {
+  int state;
+  int error;            // HTTP status to answer with when state is ERROR
+  size_t scanned;       // Bytes already searched for a line end
+  size_t line_start;    // Start of the line being parsed
+
+  http_view_t method;
+  http_view_t uri;
+  http_view_t path;
+  http_view_t query;
+  http_view_t protocol;
+  http_header_t headers[MAX_HEADERS];
+  int header_count;
+
+  int keep_alive;
+  size_t header_len;    // Request line and headers, including the blank line
+  size_t content_length;
+  size_t length;        // Whole request, set once state is DONE
+} http_request_t;
+
+/**
+ * Get ready to parse a new request
+ * @param rq Request
+ */
+void http_request_reset(http_request_t *rq) {
+  memset(rq, 0, offsetof(http_request_t, headers));
+  rq->header_count = 0;
+  rq->keep_alive = 0;
+  rq->header_len = rq->content_length = rq->length = 0;
+}
+
+/**
+ * Stop parsing and remember which error to answer with
+ * @param  rq   Request
+ * @param  code HTTP status code
+ * @return HTTP_PARSE_ERROR
+ */
+int http_fail(http_request_t *rq, int code) {
+  rq->state = HTTP_STATE_ERROR;
+  rq->error = code;
+  return HTTP_PARSE_ERROR;
+}
+
+/**
+ * Make a view
+ * @param start Offset of the first byte
+ * @param end   Offset one past the last byte
+ */
+static inline http_view_t http_view(size_t start, size_t end) {
+  http_view_t view = { (uint16_t)start, (uint16_t)(end - start) };
+  return view;
+}
+
+/**
+ * Compare a view with a string, ignoring case
+ * @param buf  Parsed buffer
+ * @param view View
+ * @param str  String to compare with
+ */
+int http_view_is(const char *buf, http_view_t view, const char *str) {
+  return strlen(str) == view.length && strncasecmp(buf + view.offset, str, view.length) == 0;
+}
+
+/**
+ * Does a comma separated header value contain a token, ignoring case?
+ * @param buf   Parsed buffer
+ * @param view  Header value
+ * @param token Token to look for
+ */
+int http_view_has_token(const char *buf, http_view_t view, const char *token) {
+  size_t len = strlen(token);
+  const char *p = buf + view.offset, *end = p + view.length;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    const char *start = p;
+    while (p < end && *p != ',') p++;
+    const char *stop = p;
+    while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t')) stop--;
+    if ((size_t)(stop - start) == len && strncasecmp(start, token, len) == 0) return 1;
+  }
+  return 0;
+}
+
+/**
+ * Find a header by name
+ * @param  buf  Parsed buffer
+ * @param  rq   Parsed request
+ * @param  name Header name, case is ignored
+ * @return The header, NULL if the request doesn't have it
+ */
+http_header_t *http_find_header(const char *buf, http_request_t *rq, const char *name) {
+  for (int i = 0; i < rq->header_count; i++) {
+    if (http_view_is(buf, rq->headers[i].key, name)) return &rq->headers[i];
+  }
+  return NULL;
+}
+
+/**
+ * Decode URL-encoded characters
+ * @param  dst Decoded string, NUL terminated, room for len + 1 bytes
+ * @param  src Encoded bytes
+ * @param  len Number of encoded bytes
+ * @return Length of the decoded string, -1 if it would contain a control
+ *         character. Cache keys use them as separators.
+ */
+ssize_t url_decode(char *dst, const char *src, size_t len) {
+  size_t j = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (src[i] == '%' && i + 2 < len && isxdigit(src[i+1]) && isxdigit(src[i+2])) {
+      char hex[3] = { src[i+1], src[i+2], '\0' };
+      dst[j] = (char)strtol(hex, NULL, 16);
+      i += 2;
+    }else{
+      dst[j] = src[i];
+    }
+    if ((unsigned char)dst[j] < 0x20 || dst[j] == 0x7f) return -1;
+    j++;
+  }
+  dst[j] = '\0';
+  return j;
+}
+
+/**
+ * Parse "METHOD URI PROTOCOL"
+ * @param  rq    Request
+ * @param  buf   Buffer
+ * @param  start Start of the line
+ * @param  end   End of the line, without the line ending
+ * @return HTTP_PARSE_AGAIN, or HTTP_PARSE_ERROR
+ */
+int http_parse_request_line(http_request_t *rq, const char *buf, size_t start, size_t end) {
+  const char *sp1 = memchr(buf + start, ' ', end - start);
+  if (sp1 == NULL) return http_fail(rq, 400);
+  size_t uri_start = sp1 + 1 - buf;
+  const char *sp2 = memchr(buf + uri_start, ' ', end - uri_start);
+  if (sp2 == NULL) return http_fail(rq, 400);
+  size_t uri_end = sp2 - buf;
+
+  if (uri_start - 1 == start || uri_start - 1 - start >= MAX_METHOD_LEN) return http_fail(rq, 400);
+  if (uri_end - uri_start >= MAX_URI_LEN) return http_fail(rq, 414);
+  if (uri_end == uri_start || buf[uri_start] != '/') return http_fail(rq, 400);
+  if (end - uri_end - 1 >= MAX_PROTOCOL_LEN || end - uri_end - 1 < 8) return http_fail(rq, 400);
+  if (strncmp(buf + uri_end + 1, "HTTP/1.", 7) != 0) return http_fail(rq, 505);
+
+  rq->method = http_view(start, uri_start - 1);
+  rq->uri = http_view(uri_start, uri_end);
+  rq->protocol = http_view(uri_end + 1, end);
+
+  /**
+   * Split path and querystring
+   */
+  const char *question = memchr(buf + uri_start, '?', uri_end - uri_start);
+  size_t path_end = question ? (size_t)(question - buf) : uri_end;
+  rq->path = http_view(uri_start, path_end);
+  rq->query = http_view(question ? path_end + 1 : uri_end, uri_end);
+
+  /**
+   * HTTP/1.1 connections persist unless the client says otherwise
+   */
+  rq->keep_alive = buf[end - 1] == '1';
+  rq->state = HTTP_STATE_HEADERS;
+  return HTTP_PARSE_AGAIN;
+}
+
+/**
+ * Parse "Key: value" and act on the headers that frame the request
+ * @param  rq    Request
+ * @param  buf   Buffer
+ * @param  start Start of the line
+ * @param  end   End of the line, without the line ending
+ * @return HTTP_PARSE_AGAIN, or HTTP_PARSE_ERROR
+ */
+int http_parse_header(http_request_t *rq, const char *buf, size_t start, size_t end) {
+  if (buf[start] == ' ' || buf[start] == '\t') return http_fail(rq, 400); // Obsolete line folding
+  if (rq->header_count >= HEADER_COUNT_LIMIT || rq->header_count >= MAX_HEADERS) {
+    return http_fail(rq, 431);
+  }
+
+  const char *colon = memchr(buf + start, ':', end - start);
+  if (colon == NULL || colon == buf + start) return http_fail(rq, 400);
+  size_t key_end = colon - buf, value_start = key_end + 1, value_end = end;
+  if (buf[key_end - 1] == ' ' || buf[key_end - 1] == '\t') return http_fail(rq, 400);
+  while (value_start < value_end && (buf[value_start] == ' ' || buf[value_start] == '\t')) value_start++;
+  while (value_end > value_start && (buf[value_end - 1] == ' ' || buf[value_end - 1] == '\t')) value_end--;
+
+  http_header_t *header = &rq->headers[rq->header_count++];
+  header->key = http_view(start, key_end);
+  header->value = http_view(value_start, value_end);
+
+  if (http_view_is(buf, header->key, "Connection")) {
+    if (http_view_has_token(buf, header->value, "close"))      rq->keep_alive = 0;
+    if (http_view_has_token(buf, header->value, "keep-alive")) rq->keep_alive = 1;
+  }else if (http_view_is(buf, header->key, "Content-Length")) {
+    size_t length = 0;
+    if (header->value.length == 0) return http_fail(rq, 400);
+    for (size_t i = value_start; i < value_end; i++) {
+      if (buf[i] < '0' || buf[i] > '9') return http_fail(rq, 400);
+      if (length > BODY_SIZE_LIMIT) return http_fail(rq, 413);
+      length = length * 10 + (buf[i] - '0');
+    }
+    if (length > BODY_SIZE_LIMIT) return http_fail(rq, 413);
+    rq->content_length = length;
+  }else if (http_view_is(buf, header->key, "Transfer-Encoding")) {
+
+    /**
+     * We only serve GETs, so a chunked body can't be meant for us and
+     * would need decoding just to find where the next request starts
+     */
+    return http_fail(rq, 411);
+  }
+  return HTTP_PARSE_AGAIN;
+}
+
+/**
+ * Parse as much of a request as has arrived. Call again with the same
+ * buffer, grown, to resume: bytes already scanned are not looked at again.
+ * @param  rq  Request, reset with http_request_reset() before the first call
+ * @param  buf Received bytes, the request starts at buf[0]
+ * @param  len Number of received bytes
+ * @return HTTP_PARSE_DONE once the whole request (and any body) is in
+ *         the buffer, HTTP_PARSE_AGAIN if more bytes are needed, or
+ *         HTTP_PARSE_ERROR with rq->error set to the status to send
+ */
+int http_parse(http_request_t *rq, const char *buf, size_t len) {
+  while (rq->state == HTTP_STATE_REQUEST_LINE || rq->state == HTTP_STATE_HEADERS) {
+    const char *newline = memchr(buf + rq->scanned, '\n', len - rq->scanned);
+    if (newline == NULL) {
+      rq->scanned = len;
+      if (len > HEADER_SIZE_LIMIT) {
+        return http_fail(rq, rq->state == HTTP_STATE_REQUEST_LINE ? 414 : 431);
+      }
+      return HTTP_PARSE_AGAIN;
+    }
+
+    size_t start = rq->line_start, end = newline - buf;
+    rq->scanned = rq->line_start = end + 1;
+    if (rq->scanned > HEADER_SIZE_LIMIT) {
+      return http_fail(rq, rq->state == HTTP_STATE_REQUEST_LINE ? 414 : 431);
+    }
+    if (end > start && buf[end - 1] == '\r') end--;
+
+    if (rq->state == HTTP_STATE_REQUEST_LINE) {
+
+      /**
+       * Ignore blank lines before a request, e.g. a stray CRLF after
+       * the previous request's body
+       */
+      if (end == start) continue;
+      if (http_parse_request_line(rq, buf, start, end) < 0) return HTTP_PARSE_ERROR;
+    }else if (end == start) {
+      rq->header_len = rq->scanned;
+      rq->state = HTTP_STATE_BODY;
+    }else if (http_parse_header(rq, buf, start, end) < 0) {
+      return HTTP_PARSE_ERROR;
+    }
+  }
+
+  if (rq->state == HTTP_STATE_BODY) {
+    if (len < rq->header_len + rq->content_length) return HTTP_PARSE_AGAIN;
+    rq->length = rq->header_len + rq->content_length;
+    rq->state = HTTP_STATE_DONE;
+  }
+  return rq->state == HTTP_STATE_DONE ? HTTP_PARSE_DONE : HTTP_PARSE_ERROR;
+}
@@ -0,0 +1,250 @@
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#define POOL_MIN_SHIFT 10          // Smallest buffer class, 1 KB
+#define POOL_CLASSES 8             // 1 KB to 128 KB
+#define POOL_SLAB_SIZE (64 << 10)  // Memory carved up per slab refill
+#define ARENA_BLOCK_SIZE (4 << 10)
+#define POOL_ALIGN 16
+
+/**
+ * Per-thread slab pools. Each pool hands out objects of one size from
+ * a free list, and refills the list by carving up one larger malloc()
+ * when it runs dry. Freed objects go back on the list of the thread
+ * that frees them and are never returned to the system, so once the
+ * pools have grown to the peak working set, serving requests does no
+ * malloc() or free() at all.
+ */
+typedef struct _slab_object_t {
+  struct _slab_object_t *next;
+} slab_object_t;
+
+typedef struct {
+  size_t size;
+  slab_object_t *free;
+} slab_t;
+
+/**
+ * Bytes obtained from malloc() by all pools, for the stats report.
+ * Flat while serving means the pools are recycling everything.
+ */
+atomic_size_t pool_reserved;
+
+/**
+ * I/O buffers, one pool per power of two size class
+ */
+__thread slab_t buffer_pools[POOL_CLASSES];
+
+/**
+ * Round a size up to the pool alignment
+ * @param size Size in bytes
+ */
+static inline size_t pool_align(size_t size) {
+  return (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+}
+
+/**
+ * Take an object from a slab pool
+ * @param  slab Pool, its size must be a multiple of POOL_ALIGN
+ * @return Object, NULL if out of memory
+ */
+void *slab_alloc(slab_t *slab) {
+  if (slab->free == NULL) {
+    size_t count = POOL_SLAB_SIZE / slab->size;
+    if (count == 0) count = 1;
+    char *memory = aligned_alloc(POOL_ALIGN, slab->size * count);
+    if (memory == NULL) return NULL;
+    atomic_fetch_add_explicit(&pool_reserved, slab->size * count, memory_order_relaxed);
+    for (size_t i = 0; i < count; i++) {
+      slab_object_t *object = (slab_object_t *)(memory + i * slab->size);
+      object->next = slab->free;
+      slab->free = object;
+    }
+  }
+  slab_object_t *object = slab->free;
+  slab->free = object->next;
+  return object;
+}
+
+/**
+ * Give an object back to a slab pool
+ * @param slab   Pool it was taken from, or one of the same size
+ * @param object Object
+ */
+void slab_free(slab_t *slab, void *object) {
+  slab_object_t *head = (slab_object_t *)object;
+  head->next = slab->free;
+  slab->free = head;
+}
+
+/**
+ * Size class for a buffer
+ * @param  size Bytes needed
+ * @return Class index, -1 if larger than the largest class
+ */
+int pool_class(size_t size) {
+  int index = 0;
+  while (((size_t)1 << (POOL_MIN_SHIFT + index)) < size) {
+    if (++index == POOL_CLASSES) return -1;
+  }
+  return index;
+}
+
+/**
+ * Take a buffer of at least size bytes from this thread's pools.
+ * Buffers larger than the largest class come from malloc().
+ * @param  size Bytes needed
+ * @param  cap  Set to the buffer's real size, pass it to pool_free()
+ * @return Buffer, NULL if out of memory
+ */
+void *pool_alloc(size_t size, size_t *cap) {
+  int index = pool_class(size);
+  if (index < 0) {
+    *cap = size;
+    return malloc(size);
+  }
+  slab_t *slab = &buffer_pools[index];
+  if (slab->size == 0) slab->size = (size_t)1 << (POOL_MIN_SHIFT + index);
+  *cap = slab->size;
+  return slab_alloc(slab);
+}
+
+/**
+ * Give a buffer back to this thread's pools
+ * @param buffer Buffer from pool_alloc(), may be NULL
+ * @param cap    Size pool_alloc() reported
+ */
+void pool_free(void *buffer, size_t cap) {
+  if (buffer == NULL) return;
+  int index = pool_class(cap);
+  if (index < 0 || ((size_t)1 << (POOL_MIN_SHIFT + index)) != cap) {
+    free(buffer);
+    return;
+  }
+  slab_t *slab = &buffer_pools[index];
+  if (slab->size == 0) slab->size = cap;
+  slab_free(slab, buffer);
+}
+
+/**
+ * Move a buffer's contents into a larger one
+ * @param  buffer Buffer from pool_alloc(), may be NULL
+ * @param  used   Bytes to keep
+ * @param  cap    In: the buffer's size. Out: the new buffer's size
+ * @param  size   Bytes needed
+ * @return New buffer, NULL (leaving the old one alone) if out of memory
+ */
+void *pool_grow(void *buffer, size_t used, size_t *cap, size_t size) {
+  size_t new_cap;
+  void *grown = pool_alloc(size, &new_cap);
+  if (grown == NULL) return NULL;
+  if (used) memcpy(grown, buffer, used);
+  pool_free(buffer, *cap);
+  *cap = new_cap;
+  return grown;
+}
+
+/**
+ * Request-scoped bump allocator. Everything a request needs while it is
+ * being handled comes from here, and is dropped all at once by
+ * arena_reset() when the request is done. Blocks are kept for the next
+ * request until the connection closes.
+ */
+typedef struct _arena_block_t {
+  struct _arena_block_t *next;
+  size_t cap;
+  alignas(POOL_ALIGN) char data[];
+} arena_block_t;
+
+typedef struct {
+  arena_block_t *first;
+  arena_block_t *current;
+  size_t used;
+} arena_t;
+
+/**
+ * Allocate from an arena
+ * @param  arena Arena
+ * @param  size  Bytes needed
+ * @return Memory, valid until the next arena_reset(), NULL if out of memory
+ */
+void *arena_alloc(arena_t *arena, size_t size) {
+  size = pool_align(size);
+  arena_block_t *block = arena->current;
+  if (block && arena->used + size <= block->cap) {
+    void *memory = block->data + arena->used;
+    arena->used += size;
+    return memory;
+  }
+
+  /**
+   * Move on to the next kept block, or add one big enough after the
+   * current block
+   */
+  if (block && block->next && size <= block->next->cap) {
+    block = block->next;
+  }else{
+    size_t cap;
+    size_t want = sizeof(arena_block_t) + size;
+    arena_block_t *added = pool_alloc(want < ARENA_BLOCK_SIZE ? ARENA_BLOCK_SIZE : want, &cap);
+    if (added == NULL) return NULL;
+    added->cap = cap - sizeof(arena_block_t);
+    if (block) {
+      added->next = block->next;
+      block->next = added;
+    }else{
+      added->next = arena->first;
+      arena->first = added;
+    }
+    block = added;
+  }
+  arena->current = block;
+  arena->used = size;
+  return block->data;
+}
+
+/**
+ * Copy a string into an arena
+ * @param  arena Arena
+ * @param  str   String
+ * @return Copy, NULL if out of memory
+ */
+char *arena_strdup(arena_t *arena, const char *str) {
+  size_t len = strlen(str) + 1;
+  char *copy = arena_alloc(arena, len);
+  if (copy) memcpy(copy, str, len);
+  return copy;
+}
+
+/**
+ * Drop everything allocated from an arena, keeping its blocks
+ * @param arena Arena
+ */
+void arena_reset(arena_t *arena) {
+  arena->current = arena->first;
+  arena->used = 0;
+}
+
+/**
+ * Give an arena's blocks back to the buffer pools
+ * @param arena Arena
+ */
+void arena_release(arena_t *arena) {
+  arena_block_t *block = arena->first;
+  while (block) {
+    arena_block_t *next = block->next;
+    pool_free(block, block->cap + sizeof(arena_block_t));
+    block = next;
+  }
+  arena->first = arena->current = NULL;
+  arena->used = 0;
+}
+
+/**
+ * Print how much memory the pools hold
+ * @param out Stream to print to
+ */
+void pool_report(FILE *out) {
+  fprintf(out, "Memory pools: %zu KB reserved\n",
+    atomic_load_explicit(&pool_reserved, memory_order_relaxed) >> 10);
+}
@@ -0,0 +1,744 @@
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <limits.h>
+
+#define META_READERS    256   // Threads that can read the cache
+#define META_LOG        1024  // Recent invalidations, inserts made before them are dropped
+#define META_BATCH_MAX  64    // Invalidations applied one by one, past that the cache is emptied
+#define META_WATCH_BUCKETS 4096
+
+#define META_FILE  1  // Regular file
+#define META_INDEX 2  // Directory served by its index file
+#define META_DIR   3  // Directory served as a listing
+
+#define META_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+  IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+const char *file_mime_type(char file_path[]);
+int file_newer_or_same(struct stat *a, struct stat *b);
+
+/**
+ * What routing a request needs to know about its path
+ */
+typedef struct {
+  int type;
+  char *file_path;                      // File to send: the path itself or its index file
+  struct stat file_info;                // stat() result for file_path
+  const char *mime_type;                // Of file_path
+  int variants;                         // Fresh precompressed sidecars
+  struct stat sidecar_info[ENCODINGS];  // stat() results for them
+} file_meta_t;
+
+/**
+ * A cached resolution. Entries never change once published: a changed
+ * path is dropped, and resolved and inserted again on its next request.
+ */
+typedef struct _meta_entry_t {
+  char *path;
+  uint64_t hash;
+  unsigned long long gen;     // meta_gen before the stat() calls
+  int type;
+  char *file_path;
+  struct stat file_info;
+  const char *mime_type;
+  int variants;
+  struct stat *sidecar_info;  // ENCODINGS results when there are variants
+  struct _meta_entry_t *next; // Insert queue
+} meta_entry_t;
+
+/**
+ * Open addressed table of entries. Readers use whichever table is
+ * current, the watcher replaces it as a whole.
+ */
+typedef struct {
+  size_t mask;
+  size_t count;
+  meta_entry_t *slots[];
+} meta_table_t;
+
+/**
+ * Epoch a thread entered the cache in, 0 while it is outside. Each on
+ * its own cache line, a lookup writes nothing other threads read often.
+ */
+typedef struct {
+  _Alignas(64) atomic_ullong epoch;
+} meta_reader_t;
+
+/**
+ * A path whose entries are stale, and the generation it was seen in
+ */
+typedef struct {
+  char *path;                 // "" for everything
+  int subtree;                // The path and everything under it, else only the directory itself
+  unsigned long long gen;
+} meta_change_t;
+
+/**
+ * A table or entry to free once no reader can still see it
+ */
+typedef struct _meta_retired_t {
+  void *ptr;
+  int is_table;
+  unsigned long long epoch;
+  struct _meta_retired_t *next;
+} meta_retired_t;
+
+/**
+ * A watched directory. Paths that lead to the same directory share a
+ * watch descriptor.
+ */
+typedef struct _meta_watch_t {
+  int wd;
+  char *path;
+  struct _meta_watch_t *next;
+} meta_watch_t;
+
+_Atomic(meta_table_t *) meta_table;
+meta_reader_t meta_readers[META_READERS];
+atomic_int meta_reader_count;
+__thread int meta_reader_slot = -1;
+atomic_ullong meta_epoch = 1;
+atomic_ullong meta_gen = 1;
+_Atomic(meta_entry_t *) meta_inserts;
+int meta_inotify = -1, meta_wake = -1;
+atomic_ullong meta_hits, meta_misses, meta_invalidated;
+atomic_int meta_watch_count;
+
+// Only the watcher thread touches these
+meta_change_t meta_log[META_LOG];
+unsigned long long meta_log_next;
+meta_retired_t *meta_retired;
+meta_watch_t *meta_watches[META_WATCH_BUCKETS];
+
+/**
+ * Enter a read section
+ * @return This thread's reader, NULL if there are too many threads to
+ *         read the cache
+ */
+meta_reader_t *meta_enter() {
+  if (meta_reader_slot == -1) {
+    meta_reader_slot = atomic_fetch_add(&meta_reader_count, 1);
+  }
+  if (meta_reader_slot >= META_READERS) return NULL;
+  meta_reader_t *reader = &meta_readers[meta_reader_slot];
+  atomic_store(&reader->epoch, atomic_load(&meta_epoch));
+  return reader;
+}
+
+/**
+ * Look a path up without taking a lock or making a syscall
+ * @param  conn Client connection, copies live in its arena
+ * @param  path Request file path
+ * @param  meta Filled in on a hit
+ * @return 1 on a hit, 0 on a miss
+ */
+int meta_lookup(connection_t *conn, char path[], file_meta_t *meta) {
+  meta_reader_t *reader = meta_enter();
+  if (reader == NULL) return 0;
+
+  /**
+   * Nothing in the table can be freed until the reader leaves
+   */
+  meta_table_t *table = atomic_load(&meta_table);
+  meta_entry_t *entry = NULL;
+  uint64_t hash = file_cache_hash(path);
+  if (table != NULL) {
+    for (size_t i = hash & table->mask; (entry = table->slots[i]) != NULL; i = (i + 1) & table->mask) {
+      if (entry->hash == hash && strcmp(entry->path, path) == 0) break;
+    }
+  }
+  int hit = 0;
+  if (entry != NULL) {
+    meta->type = entry->type;
+    meta->file_info = entry->file_info;
+    meta->mime_type = entry->mime_type;
+    meta->variants = entry->variants;
+    if (entry->variants) {
+      memcpy(meta->sidecar_info, entry->sidecar_info, sizeof(meta->sidecar_info));
+    }
+    meta->file_path = path;
+    if (entry->type == META_INDEX) {
+      meta->file_path = arena_alloc(&conn->arena, strlen(entry->file_path) + 1);
+      if (meta->file_path) strcpy(meta->file_path, entry->file_path);
+    }
+    hit = meta->file_path != NULL;
+  }
+  atomic_store(&reader->epoch, 0);
+  return hit;
+}
+
+/**
+ * Can a path be cached? Its directories are watched by name, so it
+ * must be spelled the one way inotify events will name it: no empty,
+ * "." or ".." segments.
+ * @param path Request file path
+ */
+int meta_path_cacheable(const char *path) {
+  const char *rel = path + strlen(SERVER_ROOT);
+  if (rel[0] != '/') return 0;
+  for (const char *p = rel; *p; p++) {
+    if (*p != '/') continue;
+    if (p[1] == '/') return 0;
+    if (p[1] == '.' && (p[2] == '/' || p[2] == '\0')) return 0;
+    if (p[1] == '.' && p[2] == '.' && (p[3] == '/' || p[3] == '\0')) return 0;
+  }
+  return 1;
+}
+
+/**
+ * Find the fresh precompressed sidecars of a compressible file
+ * @param conn Client connection, sidecar paths live in its arena
+ * @param meta Resolution, with file_path and file_info set
+ */
+void meta_find_sidecars(connection_t *conn, file_meta_t *meta) {
+  size_t len = strlen(meta->file_path);
+  meta->variants = 0;
+  for (int e = 1; e < ENCODINGS; e++) {
+    char *sidecar_path = arena_alloc(&conn->arena, len + strlen(encodings[e].suffix) + 1);
+    if (sidecar_path == NULL) continue;
+    memcpy(sidecar_path, meta->file_path, len);
+    strcpy(sidecar_path + len, encodings[e].suffix);
+    if (stat(sidecar_path, &meta->sidecar_info[e]) == 0 &&
+        S_ISREG(meta->sidecar_info[e].st_mode) &&
+        file_newer_or_same(&meta->sidecar_info[e], &meta->file_info)) {
+      meta->variants |= ENCODING_BIT(e);
+    }
+  }
+}
+
+/**
+ * Free an entry
+ * @param entry Metadata cache entry
+ */
+void meta_entry_free(meta_entry_t *entry) {
+  if (entry->file_path != entry->path) free(entry->file_path);
+  free(entry->path);
+  free(entry->sidecar_info);
+  free(entry);
+}
+
+/**
+ * Make an entry for a resolution
+ * @param  path Request file path
+ * @param  meta Its resolution
+ * @param  gen  meta_gen from before the resolution's stat() calls
+ * @return Entry, NULL if out of memory
+ */
+meta_entry_t *meta_entry_new(const char *path, file_meta_t *meta, unsigned long long gen) {
+  meta_entry_t *entry = calloc(1, sizeof(meta_entry_t));
+  if (entry == NULL) return NULL;
+  entry->path = strdup(path);
+  entry->file_path = meta->type == META_INDEX ? strdup(meta->file_path) : entry->path;
+  if (meta->variants) {
+    entry->sidecar_info = malloc(sizeof(meta->sidecar_info));
+    if (entry->sidecar_info) memcpy(entry->sidecar_info, meta->sidecar_info, sizeof(meta->sidecar_info));
+  }
+  if (entry->path == NULL || entry->file_path == NULL || (meta->variants && entry->sidecar_info == NULL)) {
+    meta_entry_free(entry);
+    return NULL;
+  }
+  entry->hash = file_cache_hash(path);
+  entry->gen = gen;
+  entry->type = meta->type;
+  entry->file_info = meta->file_info;
+  entry->mime_type = meta->mime_type;
+  entry->variants = meta->variants;
+  return entry;
+}
+
+/**
+ * Queue a resolution for the watcher to add to the cache
+ * @param path Request file path
+ * @param meta Its resolution
+ * @param gen  meta_gen from before the resolution's stat() calls
+ */
+void meta_insert(char path[], file_meta_t *meta, unsigned long long gen) {
+  meta_entry_t *entry = meta_entry_new(path, meta, gen);
+  if (entry == NULL) return;
+  entry->next = atomic_load(&meta_inserts);
+  while (!atomic_compare_exchange_weak(&meta_inserts, &entry->next, entry));
+  uint64_t one = 1;
+  write(meta_wake, &one, sizeof(one));
+}
+
+/**
+ * Work out what a request path is: a file, a directory with an index
+ * file, or a directory to list. A warm path is answered from the cache
+ * without touching the filesystem.
+ * @param  conn Client connection
+ * @param  path Request file path
+ * @param  meta Filled in with the resolution
+ * @return 200, or the HTTP error to send
+ */
+int meta_resolve(connection_t *conn, char path[], file_meta_t *meta) {
+  if (meta_lookup(conn, path, meta)) {
+    atomic_fetch_add(&meta_hits, 1);
+    return 200;
+  }
+  atomic_fetch_add(&meta_misses, 1);
+
+  /**
+   * Note the generation first: anything the watcher sees change after
+   * this may have been missed by the stat() calls below
+   */
+  unsigned long long gen = atomic_load(&meta_gen);
+  if (stat(path, &meta->file_info) < 0) return 404;
+  meta->file_path = path;
+  meta->mime_type = NULL;
+  meta->variants = 0;
+
+  if (S_ISREG(meta->file_info.st_mode)) {
+    meta->type = META_FILE;
+  }else{
+    char *index_path = arena_alloc(&conn->arena, strlen(path) + sizeof(INDEX_FILE) + 1);
+    if (index_path == NULL) return 500;
+    strcpy(index_path, path);
+    if (index_path[strlen(index_path)-1] != '/') strcat(index_path, "/");
+    strcat(index_path, INDEX_FILE);
+
+    struct stat index_info;
+    if (stat(index_path, &index_info) == 0) {
+      meta->type = META_INDEX;
+      meta->file_path = index_path;
+      meta->file_info = index_info;
+    }else{
+      meta->type = META_DIR;
+    }
+  }
+  if (meta->type != META_DIR) {
+    meta->mime_type = file_mime_type(meta->file_path);
+    if (mime_compressible(meta->mime_type)) meta_find_sidecars(conn, meta);
+  }
+
+  /**
+   * A symlinked file can change without an event in its directory
+   */
+  struct stat link_info;
+  if (meta_inotify < 0 || !meta_path_cacheable(path)) return 200;
+  if (meta->type == META_DIR && !S_ISDIR(meta->file_info.st_mode)) return 200;
+  if (meta->type != META_DIR && (lstat(meta->file_path, &link_info) < 0 || S_ISLNK(link_info.st_mode))) {
+    return 200;
+  }
+  meta_insert(path, meta, gen);
+  return 200;
+}
+
+/**
+ * Does a change make an entry stale?
+ * @param change Change
+ * @param path   Entry's request file path
+ */
+int meta_change_matches(meta_change_t *change, const char *path) {
+  size_t len = strlen(change->path);
+  if (len == 0) return 1;
+  if (strncmp(path, change->path, len) != 0) return 0;
+  if (change->subtree) return path[len] == '\0' || path[len] == '/';
+  return path[len] == '\0' || (path[len] == '/' && path[len+1] == '\0');
+}
+
+/**
+ * Record a change in the log, in a new generation
+ * @param path    Changed path, length len
+ * @param len     Length of path
+ * @param subtree Everything under path changed, else only the directory
+ */
+void meta_log_change(const char *path, size_t len, int subtree) {
+  meta_change_t *change = &meta_log[meta_log_next++ % META_LOG];
+  free(change->path);
+  change->path = strndup(path, len);
+  if (change->path == NULL) change->path = strdup("");
+  change->subtree = subtree;
+  change->gen = atomic_fetch_add(&meta_gen, 1) + 1;
+}
+
+/**
+ * Was an insert resolved before a change the watcher has since seen?
+ * An insert older than the whole log is assumed to be.
+ * @param entry Queued entry
+ */
+int meta_insert_stale(meta_entry_t *entry) {
+  unsigned long long oldest = meta_log_next > META_LOG ? meta_log_next - META_LOG : 0;
+  for (unsigned long long i = meta_log_next; i > oldest; i--) {
+    meta_change_t *change = &meta_log[(i - 1) % META_LOG];
+    if (change->gen <= entry->gen) return 0;
+    if (meta_change_matches(change, entry->path)) return 1;
+  }
+  return oldest > 0;
+}
+
+/**
+ * Find the watch on a directory
+ * @param path Directory, length len
+ * @param len  Length of path
+ */
+meta_watch_t **meta_watch_find(const char *path, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)path[i];
+    hash *= 1099511628211ULL;
+  }
+  meta_watch_t **link = &meta_watches[hash % META_WATCH_BUCKETS];
+  while (*link && (strlen((*link)->path) != len || memcmp((*link)->path, path, len) != 0)) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+/**
+ * Watch a directory, if it isn't already. Anything under it may have
+ * changed while it wasn't watched.
+ * @param  path Directory, length len
+ * @param  len  Length of path
+ * @return 0 on success, -1 if it can't be watched
+ */
+int meta_watch_dir(const char *path, size_t len) {
+  meta_watch_t **link = meta_watch_find(path, len);
+  if (*link != NULL) return 0;
+
+  meta_watch_t *watch = malloc(sizeof(meta_watch_t));
+  if (watch == NULL || (watch->path = strndup(path, len)) == NULL) {
+    free(watch);
+    return -1;
+  }
+  if ((watch->wd = inotify_add_watch(meta_inotify, watch->path, META_WATCH_MASK)) < 0) {
+    free(watch->path);
+    free(watch);
+    return -1;
+  }
+  watch->next = NULL;
+  *link = watch;
+  atomic_fetch_add(&meta_watch_count, 1);
+  meta_log_change(path, len, 1);
+  return 0;
+}
+
+/**
+ * Watch every directory an entry depends on: the root, the directories
+ * on the way down and, for a directory, the directory itself
+ * @param  entry Queued entry
+ * @return 0 on success, -1 if one can't be watched
+ */
+int meta_watch_entry(meta_entry_t *entry) {
+  const char *path = entry->path;
+  size_t root_len = strlen(SERVER_ROOT), len = strlen(path);
+  for (size_t i = root_len; i < len; i++) {
+    if (path[i] == '/' && meta_watch_dir(path, i) < 0) return -1;
+  }
+  if (entry->type != META_FILE && path[len-1] != '/') return meta_watch_dir(path, len);
+  return 0;
+}
+
+/**
+ * Stop watching a directory and every directory under it, they may
+ * no longer be where their names say
+ * @param path Directory, length len
+ * @param len  Length of path
+ */
+void meta_unwatch_tree(const char *path, size_t len) {
+  for (int b = 0; b < META_WATCH_BUCKETS; b++) {
+    meta_watch_t **link = &meta_watches[b];
+    while (*link) {
+      meta_watch_t *watch = *link;
+      if (strncmp(watch->path, path, len) == 0 && (watch->path[len] == '\0' || watch->path[len] == '/')) {
+        *link = watch->next;
+        inotify_rm_watch(meta_inotify, watch->wd);
+        atomic_fetch_sub(&meta_watch_count, 1);
+        free(watch->path);
+        free(watch);
+      }else{
+        link = &watch->next;
+      }
+    }
+  }
+}
+
+/**
+ * Log what one inotify event makes stale, for every path its watch
+ * goes by
+ * @param event inotify event
+ */
+void meta_handle_event(struct inotify_event *event) {
+  if (event->mask & IN_Q_OVERFLOW) {
+    meta_log_change("", 0, 1);
+    return;
+  }
+
+  /**
+   * Collect the watch's paths first, unwatching changes the table
+   */
+  char *paths[16];
+  int count = 0;
+  for (int b = 0; b < META_WATCH_BUCKETS && count < 16; b++) {
+    for (meta_watch_t *watch = meta_watches[b]; watch && count < 16; watch = watch->next) {
+      if (watch->wd == event->wd) paths[count++] = strdup(watch->path);
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    char *dir = paths[i];
+    if (dir == NULL) continue;
+    size_t dir_len = strlen(dir);
+    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT | IN_IGNORED)) {
+      meta_log_change(dir, dir_len, 1);
+      meta_unwatch_tree(dir, dir_len);
+    }else if (event->len > 0) {
+
+      /**
+       * The entry itself, what is under it if it is a directory, the
+       * file a sidecar belongs to, and the directory, whose index file
+       * or listing may have changed
+       */
+      size_t name_len = strlen(event->name);
+      char changed[dir_len + name_len + 2];
+      sprintf(changed, "%s/%s", dir, event->name);
+      meta_log_change(changed, dir_len + 1 + name_len, 1);
+      for (int e = 1; e < ENCODINGS; e++) {
+        size_t suffix = strlen(encodings[e].suffix);
+        if (name_len > suffix && strcmp(event->name + name_len - suffix, encodings[e].suffix) == 0) {
+          meta_log_change(changed, dir_len + 1 + name_len - suffix, 1);
+        }
+      }
+      meta_log_change(dir, dir_len, 0);
+      if (event->mask & IN_ISDIR) meta_unwatch_tree(changed, dir_len + 1 + name_len);
+    }
+    free(dir);
+  }
+}
+
+/**
+ * Hand something to the reclaimer
+ * @param ptr      Table or entry
+ * @param is_table Is it a table?
+ * @param epoch    Epoch it was unpublished in
+ */
+void meta_retire(void *ptr, int is_table, unsigned long long epoch) {
+  meta_retired_t *retired = malloc(sizeof(meta_retired_t));
+  if (retired == NULL) return;  // Leaked, rather than freed under a reader
+  retired->ptr = ptr;
+  retired->is_table = is_table;
+  retired->epoch = epoch;
+  retired->next = meta_retired;
+  meta_retired = retired;
+}
+
+/**
+ * Free what no reader can still see: readers that entered in an epoch
+ * after it was unpublished found the new table
+ */
+void meta_reclaim() {
+  unsigned long long oldest = ULLONG_MAX;
+  int readers = atomic_load(&meta_reader_count);
+  if (readers > META_READERS) readers = META_READERS;
+  for (int i = 0; i < readers; i++) {
+    unsigned long long epoch = atomic_load(&meta_readers[i].epoch);
+    if (epoch && epoch < oldest) oldest = epoch;
+  }
+
+  meta_retired_t **link = &meta_retired;
+  while (*link) {
+    meta_retired_t *retired = *link;
+    if (retired->epoch < oldest) {
+      *link = retired->next;
+      if (retired->is_table) free(retired->ptr);
+      else meta_entry_free(retired->ptr);
+      free(retired);
+    }else{
+      link = &retired->next;
+    }
+  }
+}
+
+/**
+ * Put an entry in a table being built
+ * @param  table Table
+ * @param  entry Entry
+ * @return 0, or -1 if the path is already in the table
+ */
+int meta_table_add(meta_table_t *table, meta_entry_t *entry) {
+  size_t i = entry->hash & table->mask;
+  for (; table->slots[i]; i = (i + 1) & table->mask) {
+    meta_entry_t *other = table->slots[i];
+    if (other->hash == entry->hash && strcmp(other->path, entry->path) == 0) return -1;
+  }
+  table->slots[i] = entry;
+  table->count++;
+  return 0;
+}
+
+/**
+ * Publish a table without the entries the changes logged since first
+ * made stale, and with the new entries
+ * @param first   First log record to apply
+ * @param inserts Entries to add, in a list
+ */
+void meta_publish(unsigned long long first, meta_entry_t *inserts) {
+  meta_table_t *old = atomic_load(&meta_table);
+  int flush = meta_log_next - first > META_BATCH_MAX;
+  size_t count = old ? old->count : 0;
+  for (meta_entry_t *entry = inserts; entry; entry = entry->next) count++;
+
+  size_t cap = 1024;
+  while (cap < count * 2) cap *= 2;
+  meta_table_t *table = calloc(1, sizeof(meta_table_t) + sizeof(meta_entry_t *) * cap);
+  if (table == NULL) {
+    while (inserts) {
+      meta_entry_t *next = inserts->next;
+      meta_entry_free(inserts);
+      inserts = next;
+    }
+    return;
+  }
+  table->mask = cap - 1;
+
+  meta_entry_t *stale = NULL;
+  for (size_t i = 0; old && i <= old->mask; i++) {
+    meta_entry_t *entry = old->slots[i];
+    if (entry == NULL) continue;
+    int dropped = flush;
+    for (unsigned long long c = first; c < meta_log_next && !dropped; c++) {
+      dropped = meta_change_matches(&meta_log[c % META_LOG], entry->path);
+    }
+    if (dropped) {
+      entry->next = stale;
+      stale = entry;
+      atomic_fetch_add(&meta_invalidated, 1);
+    }else{
+      meta_table_add(table, entry);
+    }
+  }
+  while (inserts) {
+    meta_entry_t *next = inserts->next;
+    if (table->count >= META_CACHE_ENTRIES || meta_table_add(table, inserts) < 0) {
+      meta_entry_free(inserts);
+    }
+    inserts = next;
+  }
+
+  /**
+   * Nothing under the changed paths was cached
+   */
+  if (stale == NULL && table->count == (old ? old->count : 0)) {
+    free(table);
+    return;
+  }
+
+  /**
+   * Readers that found the old table may still be using it and the
+   * entries dropped from it
+   */
+  atomic_store(&meta_table, table);
+  unsigned long long epoch = atomic_fetch_add(&meta_epoch, 1);
+  if (old) meta_retire(old, 1, epoch);
+  while (stale) {
+    meta_entry_t *next = stale->next;
+    meta_retire(stale, 0, epoch);
+    stale = next;
+  }
+}
+
+/**
+ * Watcher thread: the only writer. Applies inotify events and queued
+ * inserts by publishing a new table, and frees old ones once unused.
+ * @param arg Unused
+ */
+void *meta_watcher(void *arg) {
+  struct pollfd fds[2] = {
+    { .fd = meta_inotify, .events = POLLIN },
+    { .fd = meta_wake, .events = POLLIN },
+  };
+  char events[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (1) {
+    if (poll(fds, 2, meta_retired ? 10 : -1) < 0 && errno != EINTR) break;
+    unsigned long long first = meta_log_next;
+
+    ssize_t len;
+    while ((len = read(meta_inotify, events, sizeof(events))) > 0) {
+      for (char *p = events; p < events + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+        meta_handle_event((struct inotify_event *)p);
+      }
+    }
+
+    /**
+     * Inserts resolved before a change seen since are dropped, the
+     * next request resolves the path again
+     */
+    uint64_t wakes;
+    read(meta_wake, &wakes, sizeof(wakes));
+    meta_entry_t *queued = atomic_exchange(&meta_inserts, NULL), *inserts = NULL;
+    while (queued) {
+      meta_entry_t *entry = queued;
+      queued = entry->next;
+      if (meta_watch_entry(entry) < 0 || meta_insert_stale(entry)) {
+        meta_entry_free(entry);
+      }else{
+        entry->next = inserts;
+        inserts = entry;
+      }
+    }
+
+    if (meta_log_next != first || inserts) meta_publish(first, inserts);
+    meta_reclaim();
+  }
+  return NULL;
+}
+
+/**
+ * Set up change notification for the metadata cache. Without inotify
+ * every request resolves its path with stat().
+ */
+void meta_cache_init() {
+  if (META_CACHE_ENTRIES == 0) return;
+  meta_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  meta_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (meta_inotify < 0 || meta_wake < 0) {
+    perror("Note: metadata cache disabled");
+    if (meta_inotify > -1) close(meta_inotify);
+    meta_inotify = -1;
+  }
+}
+
+/**
+ * Fill the cache with resolutions made before the watcher started, by
+ * a crawl that watched each directory before reading it, so nothing
+ * could change unseen in between
+ * @param entries Entries, in a list
+ * @see prewarm.h
+ */
+void meta_preload(meta_entry_t *entries) {
+  meta_publish(meta_log_next, entries);
+}
+
+/**
+ * Start the watcher. Events queued since meta_cache_init() are applied
+ * first thing.
+ */
+void start_meta_cache() {
+  if (meta_inotify < 0) return;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, meta_watcher, NULL) != 0) {
+    perror("Note: metadata cache disabled");
+    close(meta_inotify);
+    meta_inotify = -1;
+    atomic_store(&meta_table, NULL);
+    return;
+  }
+  pthread_detach(thread);
+}
+
+/**
+ * Print the metadata cache hit ratio
+ * @param out Stream
+ */
+void meta_report(FILE *out) {
+  if (meta_inotify < 0) return;
+  unsigned long long hits = atomic_load(&meta_hits), misses = atomic_load(&meta_misses);
+  meta_reader_t *reader = meta_enter();
+  meta_table_t *table = reader ? atomic_load(&meta_table) : NULL;
+  size_t entries = table ? table->count : 0;
+  if (reader) atomic_store(&reader->epoch, 0);
+  fprintf(out, "Metadata cache: %.1f%% hit ratio (%llu hits, %llu misses), %zu entries, "
+    "%d directories watched, %llu invalidated\n",
+    hits + misses ? 100.0 * hits / (hits + misses) : 0, hits, misses,
+    entries, atomic_load(&meta_watch_count), atomic_load(&meta_invalidated));
+}
@@ -0,0 +1,176 @@
+#include <stddef.h>
+
+/**
+ * Latency histograms, in microseconds
+ */
+#define HIST_QUEUE      0  // Accepted to taken by a pool worker
+#define HIST_PARSE      1  // First byte of the request to parsed
+#define HIST_STAT       2  // Resolving the path on disk
+#define HIST_FIRST_BYTE 3  // First byte of the request to first byte of the response
+#define HIST_LAST_BYTE  4  // First byte of the request to last byte of the response
+#define HISTOGRAMS      5
+
+/**
+ * HDR-style buckets: exact below 8us, then 8 per power of two, so any
+ * value is known to within 12.5% up to 2^36us (19 hours)
+ */
+#define HIST_SUB_BITS 3
+#define HIST_MAX_BITS 36
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+#define METRIC_STATUS_MAX 600
+
+/**
+ * Connection deadlines, counted when they fire
+ * @see connection.h
+ */
+#define TIMEOUT_HEADER  0  // Receiving a request took too long
+#define TIMEOUT_IDLE    1  // Nothing came after the last response
+#define TIMEOUT_SEND    2  // The client stopped taking the response
+#define TIMEOUT_REQUEST 3  // Request and response together took too long
+#define TIMEOUTS        4
+
+typedef struct {
+  atomic_ullong buckets[HIST_BUCKETS];
+  atomic_ullong count;
+  atomic_ullong sum;
+} histogram_t;
+
+/**
+ * Counters of one thread. Only that thread writes them, so updates are
+ * plain loads and stores, never a locked instruction or a shared cache
+ * line. Readers add up every thread's block.
+ */
+typedef struct _thread_metrics_t {
+  atomic_ullong requests;
+  atomic_ullong bytes_sent;
+  atomic_ullong connections_opened;
+  atomic_ullong connections_closed;
+  atomic_ullong statuses[METRIC_STATUS_MAX];
+  atomic_ullong timeouts[TIMEOUTS];
+  histogram_t histograms[HISTOGRAMS];
+  struct _thread_metrics_t *next;
+} thread_metrics_t;
+
+_Atomic(thread_metrics_t *) all_metrics;
+__thread thread_metrics_t *local_metrics;
+thread_metrics_t metrics_fallback;  // For threads whose block could not be allocated
+
+/**
+ * This thread's counters, registered the first time it counts something
+ */
+thread_metrics_t *metrics_local() {
+  if (local_metrics) return local_metrics;
+  thread_metrics_t *metrics = calloc(1, sizeof(thread_metrics_t));
+  if (metrics == NULL) return local_metrics = &metrics_fallback;
+  metrics->next = atomic_load(&all_metrics);
+  while (!atomic_compare_exchange_weak(&all_metrics, &metrics->next, metrics));
+  return local_metrics = metrics;
+}
+
+/**
+ * Add to a counter of this thread's
+ * @param counter Counter
+ * @param n       Amount
+ */
+static inline void metric_add(atomic_ullong *counter, unsigned long long n) {
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * Bucket a value falls in
+ * @param value Microseconds
+ */
+int histogram_index(unsigned long long value) {
+  if (value < (1 << HIST_SUB_BITS)) return value;
+  int bits = 63 - __builtin_clzll(value);
+  if (bits >= HIST_MAX_BITS) return HIST_BUCKETS - 1;
+  return ((bits - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+    ((value >> (bits - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/**
+ * Smallest value in a bucket
+ * @param index Bucket
+ */
+unsigned long long histogram_floor(int index) {
+  if (index < (1 << HIST_SUB_BITS)) return index;
+  int bits = (index >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  unsigned long long sub = index & ((1 << HIST_SUB_BITS) - 1);
+  return ((1ULL << HIST_SUB_BITS) + sub) << (bits - HIST_SUB_BITS);
+}
+
+/**
+ * Record a latency on this thread. Values are bucketed one below
+ * themselves, so a power of two lands below the bucket edge of the same
+ * value, as Prometheus's inclusive "le" bounds expect.
+ * @param histogram HIST_*
+ * @param us        Microseconds
+ */
+void metrics_observe(int histogram, long long us) {
+  if (us < 0) us = 0;
+  histogram_t *h = &metrics_local()->histograms[histogram];
+  metric_add(&h->buckets[histogram_index(us > 0 ? us - 1 : 0)], 1);
+  metric_add(&h->count, 1);
+  metric_add(&h->sum, us);
+}
+
+/**
+ * Count a response once it has been sent
+ * @param status     HTTP status code
+ * @param bytes      Bytes sent
+ * @param first_us   Request to first byte, -1 if nothing was sent
+ * @param last_us    Request to last byte
+ */
+void metrics_response(int status, unsigned long long bytes, long long first_us, long long last_us) {
+  thread_metrics_t *metrics = metrics_local();
+  metric_add(&metrics->requests, 1);
+  metric_add(&metrics->bytes_sent, bytes);
+  if (status > 0 && status < METRIC_STATUS_MAX) metric_add(&metrics->statuses[status], 1);
+  if (first_us >= 0) metrics_observe(HIST_FIRST_BYTE, first_us);
+  metrics_observe(HIST_LAST_BYTE, last_us);
+}
+
+/**
+ * Sum one counter over every thread
+ * @param offset offsetof(thread_metrics_t, counter)
+ */
+unsigned long long metrics_total(size_t offset) {
+  unsigned long long total = 0;
+  for (thread_metrics_t *m = atomic_load(&all_metrics); m; m = m->next) {
+    total += atomic_load_explicit((atomic_ullong *)((char *)m + offset), memory_order_relaxed);
+  }
+  return total;
+}
+
+/**
+ * Sum one histogram over every thread
+ * @param histogram HIST_*
+ * @param out       Filled with the summed buckets, count and sum
+ */
+void metrics_histogram(int histogram, histogram_t *out) {
+  memset(out, 0, sizeof(histogram_t));
+  for (thread_metrics_t *m = atomic_load(&all_metrics); m; m = m->next) {
+    histogram_t *h = &m->histograms[histogram];
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+      out->buckets[i] += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    }
+    out->count += atomic_load_explicit(&h->count, memory_order_relaxed);
+    out->sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+  }
+}
+
+/**
+ * Value below which a fraction of a summed histogram's samples fall
+ * @param  h        Summed histogram
+ * @param  quantile 0 to 1
+ * @return Upper edge of the bucket holding that sample, in microseconds
+ */
+unsigned long long histogram_quantile(histogram_t *h, double quantile) {
+  unsigned long long rank = quantile * h->count, seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen > rank) return i + 1 < HIST_BUCKETS ? histogram_floor(i + 1) : histogram_floor(i);
+  }
+  return 0;
+}
@@ -0,0 +1,110 @@
+/**
+ * Build-time generator for mime_table.h
+ * Compiles mime_types.def into a perfect hash table of constant data,
+ * so the server does no work at startup and a lookup is a few instructions.
+ *
+ * Usage: ./mime_gen > mime_table.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mime_hash.h"
+
+typedef struct {
+  const char *name;
+  const char *mime_type;
+  const char *extension;
+} mime_def_t;
+
+#define MIME_TYPE(name, type, ext) { name, type, ext },
+const mime_def_t mime_defs[] = {
+#include "mime_types.def"
+};
+#undef MIME_TYPE
+
+#define NUM_MIME_DEFS (sizeof(mime_defs) / sizeof(*mime_defs))
+
+/**
+ * Print a C string literal
+ * @param str String
+ */
+void print_literal(const char *str) {
+  putchar('"');
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') putchar('\\');
+    putchar(*str);
+  }
+  putchar('"');
+}
+
+int main() {
+  const char *exts[NUM_MIME_DEFS], *types[NUM_MIME_DEFS];
+  int count = 0;
+
+  /**
+   * Lowercase the extensions and keep the first entry for each
+   */
+  for (size_t i = 0; i < NUM_MIME_DEFS; i++) {
+    char *ext = strdup(mime_defs[i].extension);
+    for (char *c = ext; *c; c++) *c = mime_lower(*c);
+    int duplicate = 0;
+    for (int j = 0; j < count && !duplicate; j++) {
+      duplicate = strcmp(exts[j], ext) == 0;
+    }
+    if (duplicate) {
+      free(ext);
+      continue;
+    }
+    exts[count] = ext;
+    types[count] = mime_defs[i].mime_type;
+    count++;
+  }
+
+  mime_table_t table;
+  if (mime_table_build(&table, exts, types, count) < 0) {
+    fprintf(stderr, "mime_gen: could not build a perfect hash\n");
+    return EXIT_FAILURE;
+  }
+
+  /**
+   * Make sure every extension finds its own type
+   */
+  for (int i = 0; i < count; i++) {
+    if (mime_table_lookup(&table, exts[i]) != types[i]) {
+      fprintf(stderr, "mime_gen: lookup failed for %s\n", exts[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  printf("/**\n * Generated by mime_gen from mime_types.def, do not edit\n");
+  printf(" * %d extensions, %u buckets, %u slots\n */\n\n",
+    count, table.bucket_mask + 1, table.slot_mask + 1);
+
+  printf("const unsigned int builtin_mime_seeds[%u] = {", table.bucket_mask + 1);
+  for (unsigned int b = 0; b <= table.bucket_mask; b++) {
+    printf("%s%u", b % 12 ? ", " : (b ? ",\n  " : "\n  "), table.seeds[b]);
+  }
+  printf("\n};\n\n");
+
+  printf("const mime_slot_t builtin_mime_slots[%u] = {\n", table.slot_mask + 1);
+  for (unsigned int s = 0; s <= table.slot_mask; s++) {
+    const mime_slot_t *slot = &table.slots[s];
+    if (slot->ext == NULL) {
+      printf("  { NULL, NULL },\n");
+      continue;
+    }
+    printf("  { ");
+    print_literal(slot->ext);
+    printf(", ");
+    print_literal(slot->mime_type);
+    printf(" },\n");
+  }
+  printf("};\n\n");
+
+  printf("const mime_table_t builtin_mime_table = {\n");
+  printf("  %uu, %uu, builtin_mime_seeds, builtin_mime_slots\n};\n",
+    table.bucket_mask, table.slot_mask);
+
+  return EXIT_SUCCESS;
+}
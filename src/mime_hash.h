@@ -0,0 +1,165 @@
+/**
+ * Perfect hash table from file extension to MIME type, shared by the
+ * build-time generator (mime_gen.c) and the runtime mime.types loader.
+ *
+ * Hash and displace: every extension hashes into a bucket, and each
+ * bucket stores the seed that sends all of its extensions to distinct
+ * free slots. A lookup is two short hashes and one comparison.
+ */
+
+typedef struct {
+  const char *ext;
+  const char *mime_type;
+} mime_slot_t;
+
+typedef struct {
+  unsigned int bucket_mask;
+  unsigned int slot_mask;
+  const unsigned int *seeds;
+  const mime_slot_t *slots;
+} mime_table_t;
+
+/**
+ * ASCII lowercase, extensions match case-insensitively
+ * @param c Character
+ */
+static inline unsigned char mime_lower(unsigned char c) {
+  return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/**
+ * Seeded, case-insensitive hash of an extension
+ * @param ext  Extension, including the dot
+ * @param seed Seed
+ */
+static inline unsigned int mime_hash(const char *ext, unsigned int seed) {
+  unsigned int h = 2166136261u ^ (seed * 0x9E3779B9u);
+  while (*ext) {
+    h ^= mime_lower(*ext++);
+    h *= 16777619u;
+  }
+  h ^= h >> 15;
+  h *= 0x2C1B3C6Du;
+  h ^= h >> 12;
+  return h;
+}
+
+/**
+ * Case-insensitive comparison against a lowercase table key
+ * @param key Table key, lowercase
+ * @param ext Extension being looked up
+ */
+static inline int mime_ext_equal(const char *key, const char *ext) {
+  while (*key && *key == mime_lower(*ext)) {
+    key++;
+    ext++;
+  }
+  return *key == '\0' && *ext == '\0';
+}
+
+/**
+ * Look up an extension
+ * @param  table Table
+ * @param  ext   Extension, including the dot
+ * @return MIME type, or NULL if the extension is unknown
+ */
+static inline const char * mime_table_lookup(const mime_table_t *table, const char *ext) {
+  unsigned int seed = table->seeds[mime_hash(ext, 0) & table->bucket_mask];
+  const mime_slot_t *slot = &table->slots[mime_hash(ext, seed) & table->slot_mask];
+  if (slot->ext != NULL && mime_ext_equal(slot->ext, ext)) return slot->mime_type;
+  return NULL;
+}
+
+/**
+ * Smallest power of two >= n
+ * @param n Number
+ */
+unsigned int mime_pow2(unsigned int n) {
+  unsigned int p = 1;
+  while (p < n) p <<= 1;
+  return p;
+}
+
+/**
+ * Build a table from parallel arrays of lowercase extensions and types.
+ * Extensions must be unique. The arrays are referenced, not copied.
+ * @param  table Table to fill, seeds and slots are malloc()ed
+ * @param  exts  Extensions, including the dot
+ * @param  types MIME types
+ * @param  count Number of entries
+ * @return 0 on success, -1 on failure
+ */
+int mime_table_build(mime_table_t *table, const char *exts[], const char *types[], int count) {
+  unsigned int num_buckets = mime_pow2(count / 4 + 1);
+  unsigned int num_slots = mime_pow2(count * 2 + 1);
+  unsigned int *seeds = calloc(num_buckets, sizeof(unsigned int));
+  mime_slot_t *slots = calloc(num_slots, sizeof(mime_slot_t));
+  int *bucket_of = malloc(sizeof(int) * (count + 1));
+  int *order = malloc(sizeof(int) * (num_buckets + 1));
+  int *sizes = calloc(num_buckets, sizeof(int));
+  unsigned int *taken = malloc(sizeof(unsigned int) * (count + 1));
+  int rc = -1;
+  if (!seeds || !slots || !bucket_of || !order || !sizes || !taken) goto done;
+
+  for (int i = 0; i < count; i++) {
+    bucket_of[i] = mime_hash(exts[i], 0) & (num_buckets - 1);
+    sizes[bucket_of[i]]++;
+  }
+
+  /**
+   * Place the fullest buckets first, while the table is still empty
+   */
+  for (unsigned int b = 0; b < num_buckets; b++) order[b] = b;
+  for (unsigned int i = 1; i < num_buckets; i++) {
+    int b = order[i], j = i;
+    while (j > 0 && sizes[order[j-1]] < sizes[b]) {
+      order[j] = order[j-1];
+      j--;
+    }
+    order[j] = b;
+  }
+
+  for (unsigned int o = 0; o < num_buckets && sizes[order[o]] > 0; o++) {
+    int b = order[o];
+    unsigned int seed;
+    for (seed = 1; seed < (1u << 24); seed++) {
+      int n = 0, ok = 1;
+      for (int i = 0; i < count && ok; i++) {
+        if (bucket_of[i] != b) continue;
+        unsigned int slot = mime_hash(exts[i], seed) & (num_slots - 1);
+        if (slots[slot].ext != NULL) ok = 0;
+        for (int k = 0; k < n && ok; k++) {
+          if (taken[k] == slot) ok = 0;
+        }
+        taken[n++] = slot;
+      }
+      if (ok) break;
+    }
+    if (seed == (1u << 24)) goto done;
+
+    seeds[b] = seed;
+    for (int i = 0; i < count; i++) {
+      if (bucket_of[i] != b) continue;
+      mime_slot_t *slot = &slots[mime_hash(exts[i], seed) & (num_slots - 1)];
+      slot->ext = exts[i];
+      slot->mime_type = types[i];
+    }
+  }
+
+  table->bucket_mask = num_buckets - 1;
+  table->slot_mask = num_slots - 1;
+  table->seeds = seeds;
+  table->slots = slots;
+  seeds = NULL;
+  slots = NULL;
+  rc = 0;
+
+done:
+  free(seeds);
+  free(slots);
+  free(bucket_of);
+  free(order);
+  free(sizes);
+  free(taken);
+  return rc;
+}
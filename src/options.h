@@ -0,0 +1,279 @@
+#include <getopt.h>
+
+/**
+ * Print command line usage
+ */
+void print_usage() {
+  puts("Usage: [thread count] [port] [directory] [options]");
+  puts("Options:");
+  puts("  --mode=epoll|pool|uring  epoll: event loops, one per thread (default)");
+  puts("                     pool:  blocking accept feeding a thread pool");
+  puts("                     uring: io_uring loops, one per thread, epoll if");
+  puts("                     the kernel can't run them");
+  puts("  --keepalive-timeout=SECS  idle time before a persistent connection");
+  puts("                     is closed, 0 disables keep-alive (default 5)");
+  puts("  --keepalive-max=N  requests served per connection (default 100)");
+  puts("  --header-timeout=SECS  time to receive a request, from its first byte or");
+  puts("                     the connection, 0 disables (default 10)");
+  puts("  --send-timeout=SECS  longest a response may stall, 0 disables (default 30)");
+  puts("  --request-timeout=SECS  time for a request and its response together,");
+  puts("                     0 disables (default 0)");
+  puts("  --queue-size=N     with --mode=pool, connections that can wait for a");
+  puts("                     worker, more are answered 503 (default 200)");
+  puts("  --queue-target=MS  with --mode=pool, answer 503 to new connections while");
+  puts("                     the queue wait stays above this, 0 disables (default 5)");
+  puts("  --cache-size=MB    memory for hot file bodies, 0 disables (default 64)");
+  puts("  --cache-max-file=KB  largest file kept in memory (default 256)");
+  puts("  --meta-cache=N     paths whose stat() results are kept, kept current");
+  puts("                     with inotify, 0 disables (default 65536)");
+  puts("  --mime-types=FILE  extra MIME types in /etc/mime.types format");
+  puts("  --max-header-size=KB  largest request line and headers, larger");
+  puts("                     requests get 431 or 414 (default 8, at most 63)");
+  puts("  --max-headers=N    most header fields in a request, more get 431");
+  puts("                     (default 100, at most 255)");
+  puts("  --max-body=KB      largest request body, larger get 413 (default 64)");
+  puts("  --precompress     write .br/.zst/.gz sidecars for text files under the");
+  puts("                     root in parallel before serving");
+  puts("  --precompress-only  write the sidecars and exit");
+  puts("  --prewarm          before serving, index every path under the root on");
+  puts("                     several threads and read small files into memory");
+  puts("  --prewarm-max=KB   largest file --prewarm reads in (default 256)");
+  puts("  --warm-list=FILE   with --prewarm, also read in the files an access log");
+  puts("                     (or a list of paths) asks for, whatever their size");
+  puts("  --prewarm-wait=PCT  start serving once this much is read in (default 100)");
+  puts("  --pack=FILE        compile [directory] into a bundle FILE and exit");
+  puts("  --bundle           [directory] is a bundle made with --pack, serve it");
+  puts("                     from memory and pick up replacements");
+  puts("  --compress         compress text responses without a sidecar on the fly,");
+  puts("                     caching compressed static files in memory");
+  puts("  --compress-level=N  1 (fastest) to 9 (smallest) (default 6)");
+  puts("  --compress-min=BYTES  smallest response worth compressing (default 1024)");
+  puts("  --compress-threads=N  compression threads (default: one per CPU)");
+  puts("  --etag=stat|content  make entity tags from inode, size and mtime, or");
+  puts("                     from a hash of the file (default stat)");
+  puts("  --reuseport        one SO_REUSEPORT listener per thread, threads accept");
+  puts("                     directly instead of sharing one listener");
+  puts("  --steer=cbpf|incoming-cpu  with --reuseport, hand each connection to");
+  puts("                     the thread on the CPU that received it");
+  puts("  --pin-cpus         pin each thread to its own CPU");
+  puts("  --access-log=FILE|-|off  where request lines go, - for stdout (default -)");
+  puts("  --log-format=clf|combined|json  access log line format (default combined)");
+  puts("  --log-rotate-size=MB  start a new access log file past this size");
+  puts("  --log-rotate-interval=SECS  start a new access log file this often");
+  puts("  --metrics=PATH     answer PATH, e.g. /metrics, with counters and latency");
+  puts("                     histograms in the Prometheus text format");
+  puts("  --verbose=N        1 prints each connection, 2 each request to the");
+  puts("                     terminal as well (default 0)");
+}
+
+/**
+ * Parse optional --flags into the server globals.
+ * Positional arguments are left for main() to read from argv.
+ * @param  argc Argument count
+ * @param  argv Arguments, permuted so positionals come last
+ * @return 0 on success, -1 on an invalid option
+ */
+int parse_options(int argc, char *argv[]) {
+  static struct option long_options[] = {
+    {"mode",              required_argument, NULL, 'm'},
+    {"keepalive-timeout", required_argument, NULL, 't'},
+    {"keepalive-max",     required_argument, NULL, 'k'},
+    {"header-timeout",    required_argument, NULL, 'A'},
+    {"send-timeout",      required_argument, NULL, 's'},
+    {"request-timeout",   required_argument, NULL, 'u'},
+    {"queue-size",        required_argument, NULL, 'q'},
+    {"queue-target",      required_argument, NULL, 'Q'},
+    {"cache-size",        required_argument, NULL, 'c'},
+    {"cache-max-file",    required_argument, NULL, 'f'},
+    {"meta-cache",        required_argument, NULL, 'M'},
+    {"mime-types",        required_argument, NULL, 'T'},
+    {"max-header-size",   required_argument, NULL, 'H'},
+    {"max-headers",       required_argument, NULL, 'N'},
+    {"max-body",          required_argument, NULL, 'B'},
+    {"precompress",       no_argument,       NULL, 'z'},
+    {"precompress-only",  no_argument,       NULL, 'Z'},
+    {"prewarm",           no_argument,       NULL, 'W'},
+    {"prewarm-max",       required_argument, NULL, 'X'},
+    {"warm-list",         required_argument, NULL, 'L'},
+    {"prewarm-wait",      required_argument, NULL, 'Y'},
+    {"pack",              required_argument, NULL, 'o'},
+    {"bundle",            no_argument,       NULL, 'b'},
+    {"compress",          no_argument,       NULL, 'x'},
+    {"compress-level",    required_argument, NULL, 'l'},
+    {"compress-min",      required_argument, NULL, 'n'},
+    {"compress-threads",  required_argument, NULL, 'w'},
+    {"etag",              required_argument, NULL, 'e'},
+    {"reuseport",         no_argument,       NULL, 'R'},
+    {"steer",             required_argument, NULL, 'S'},
+    {"pin-cpus",          no_argument,       NULL, 'P'},
+    {"access-log",        required_argument, NULL, 'a'},
+    {"log-format",        required_argument, NULL, 'g'},
+    {"log-rotate-size",   required_argument, NULL, 'r'},
+    {"log-rotate-interval", required_argument, NULL, 'i'},
+    {"metrics",           required_argument, NULL, 'p'},
+    {"verbose",           required_argument, NULL, 'v'},
+    {"help",              no_argument,       NULL, 'h'},
+    {NULL,                0,                 NULL,  0 }
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'm':
+        if (strcmp(optarg, "epoll") == 0) {
+          SERVER_MODE = MODE_EPOLL;
+        }else if (strcmp(optarg, "pool") == 0) {
+          SERVER_MODE = MODE_POOL;
+        }else if (strcmp(optarg, "uring") == 0) {
+          SERVER_MODE = MODE_URING;
+        }else{
+          fprintf(stderr, "Unknown mode: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 't':
+        KEEPALIVE_TIMEOUT = atoi(optarg);
+        break;
+      case 'k':
+        KEEPALIVE_MAX = atoi(optarg);
+        break;
+      case 'A':
+        HEADER_TIMEOUT = atoi(optarg);
+        break;
+      case 's':
+        SEND_TIMEOUT = atoi(optarg);
+        break;
+      case 'u':
+        REQUEST_TIMEOUT = atoi(optarg);
+        break;
+      case 'q':
+        QUEUE_SIZE = (size_t)atol(optarg);
+        if (QUEUE_SIZE < 1) QUEUE_SIZE = 1;
+        break;
+      case 'Q':
+        QUEUE_TARGET = atoi(optarg);
+        break;
+      case 'c':
+        CACHE_SIZE = (size_t)atol(optarg) << 20;
+        break;
+      case 'f':
+        CACHE_MAX_FILE = (size_t)atol(optarg) << 10;
+        break;
+      case 'M':
+        META_CACHE_ENTRIES = (size_t)atol(optarg);
+        break;
+      case 'T':
+        MIME_TYPES_FILE = optarg;
+        break;
+      case 'H':
+        HEADER_SIZE_LIMIT = (size_t)atol(optarg) << 10;
+        if (HEADER_SIZE_LIMIT > MAX_HEADER_SIZE) HEADER_SIZE_LIMIT = MAX_HEADER_SIZE;
+        if (HEADER_SIZE_LIMIT < BUFFER_SIZE) HEADER_SIZE_LIMIT = BUFFER_SIZE;
+        break;
+      case 'N':
+        HEADER_COUNT_LIMIT = atoi(optarg);
+        if (HEADER_COUNT_LIMIT > MAX_HEADERS) HEADER_COUNT_LIMIT = MAX_HEADERS;
+        break;
+      case 'B':
+        BODY_SIZE_LIMIT = (size_t)atol(optarg) << 10;
+        break;
+      case 'z':
+        PRECOMPRESS = PRECOMPRESS_STARTUP;
+        break;
+      case 'Z':
+        PRECOMPRESS = PRECOMPRESS_ONLY;
+        break;
+      case 'W':
+        PREWARM = 1;
+        break;
+      case 'X':
+        PREWARM_MAX = (size_t)atol(optarg) << 10;
+        break;
+      case 'L':
+        PREWARM = 1;
+        PREWARM_LIST = optarg;
+        break;
+      case 'Y':
+        PREWARM_WAIT = atoi(optarg);
+        if (PREWARM_WAIT < 0) PREWARM_WAIT = 0;
+        if (PREWARM_WAIT > 100) PREWARM_WAIT = 100;
+        break;
+      case 'o':
+        PACK_PATH = optarg;
+        break;
+      case 'b':
+        BUNDLE = 1;
+        break;
+      case 'x':
+        COMPRESS = 1;
+        break;
+      case 'l':
+        COMPRESS_LEVEL = atoi(optarg);
+        if (COMPRESS_LEVEL < 1) COMPRESS_LEVEL = 1;
+        if (COMPRESS_LEVEL > 9) COMPRESS_LEVEL = 9;
+        break;
+      case 'n':
+        COMPRESS_MIN = (size_t)atol(optarg);
+        break;
+      case 'w':
+        COMPRESS_THREADS = atoi(optarg);
+        break;
+      case 'e':
+        if (strcmp(optarg, "stat") == 0) {
+          ETAG_MODE = ETAG_STAT;
+        }else if (strcmp(optarg, "content") == 0) {
+          ETAG_MODE = ETAG_CONTENT;
+        }else{
+          fprintf(stderr, "Unknown ETag mode: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'R':
+        REUSEPORT = 1;
+        break;
+      case 'S':
+        if (strcmp(optarg, "cbpf") == 0) {
+          STEERING = STEER_CBPF;
+        }else if (strcmp(optarg, "incoming-cpu") == 0) {
+          STEERING = STEER_INCOMING_CPU;
+        }else{
+          fprintf(stderr, "Unknown steering: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'P':
+        PIN_CPUS = 1;
+        break;
+      case 'a':
+        ACCESS_LOG = strcmp(optarg, "off") == 0 ? NULL : optarg;
+        break;
+      case 'g':
+        if (strcmp(optarg, "clf") == 0) {
+          ACCESS_LOG_FORMAT = LOG_FORMAT_CLF;
+        }else if (strcmp(optarg, "combined") == 0) {
+          ACCESS_LOG_FORMAT = LOG_FORMAT_COMBINED;
+        }else if (strcmp(optarg, "json") == 0) {
+          ACCESS_LOG_FORMAT = LOG_FORMAT_JSON;
+        }else{
+          fprintf(stderr, "Unknown log format: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'r':
+        ACCESS_LOG_ROTATE_SIZE = (unsigned long long)atol(optarg) << 20;
+        break;
+      case 'i':
+        ACCESS_LOG_ROTATE_SECS = atoi(optarg);
+        break;
+      case 'p':
+        METRICS_PATH = optarg;
+        break;
+      case 'v':
+        VERBOSE = atoi(optarg);
+        break;
+      default:
+        return -1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,207 @@
+#include <ftw.h>
+#include <sys/mman.h>
+
+/**
+ * Work shared by the precompression threads. Files are handed out by
+ * bumping next, so a thread that draws a big file doesn't hold up the rest.
+ */
+typedef struct {
+  char **paths;
+  size_t count;
+  size_t cap;
+  atomic_size_t next;
+
+  atomic_ulong written;
+  atomic_ulong current;
+  atomic_ulong not_smaller;
+  atomic_ulong failed;
+  atomic_ullong saved;
+} precompress_job_t;
+
+/**
+ * nftw() has no argument for its callback
+ */
+precompress_job_t *precompress_collecting;
+
+/**
+ * Is this one of our own sidecars?
+ * @param path File path
+ */
+int is_sidecar(const char *path) {
+  size_t len = strlen(path);
+  for (int e = 1; e < ENCODINGS; e++) {
+    size_t suffix = strlen(encodings[e].suffix);
+    if (len > suffix && strcmp(path + len - suffix, encodings[e].suffix) == 0) return 1;
+  }
+  return 0;
+}
+
+/**
+ * nftw() callback: note every non-empty, compressible regular file
+ */
+int precompress_collect(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  precompress_job_t *job = precompress_collecting;
+  if (type != FTW_F || !S_ISREG(st->st_mode) || st->st_size == 0) return 0;
+  if (is_sidecar(path) || !mime_compressible(file_mime_type((char *)path))) return 0;
+
+  if (job->count == job->cap) {
+    size_t cap = job->cap ? job->cap * 2 : 256;
+    char **paths = realloc(job->paths, sizeof(char *) * cap);
+    if (paths == NULL) return -1;
+    job->paths = paths;
+    job->cap = cap;
+  }
+  if ((job->paths[job->count] = strdup(path)) == NULL) return -1;
+  job->count++;
+  return 0;
+}
+
+/**
+ * Write a sidecar next to its file. A temporary file is renamed into
+ * place, so a request never sees a half written sidecar.
+ * @param  path Sidecar path
+ * @param  data Compressed bytes
+ * @param  len  Number of bytes
+ * @return 0 on success, -1 on error
+ */
+int write_sidecar(const char *path, const char *data, size_t len) {
+  char tmp[strlen(path) + 32];
+  snprintf(tmp, sizeof(tmp), "%s.tmp%ld", path, (long)syscall(SYS_gettid));
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return -1;
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = write(fd, data + done, len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    done += n;
+  }
+  if (close(fd) < 0 || done != len || rename(tmp, path) < 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Compress one file into every coding this build supports
+ * @param job  Job, for the counters
+ * @param path File
+ * @param out  Scratch buffer, grown as needed
+ * @param cap  Size of *out
+ */
+void precompress_file(precompress_job_t *job, const char *path, char **out, size_t *cap) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+    if (fd > -1) close(fd);
+    atomic_fetch_add(&job->failed, 1);
+    return;
+  }
+  char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    atomic_fetch_add(&job->failed, 1);
+    return;
+  }
+
+  for (int e = 1; e < ENCODINGS; e++) {
+    size_t bound = encoding_bound(e, st.st_size);
+    if (bound == 0) continue;
+
+    /**
+     * Leave sidecars that are already up to date alone
+     */
+    char sidecar[strlen(path) + strlen(encodings[e].suffix) + 1];
+    sprintf(sidecar, "%s%s", path, encodings[e].suffix);
+    struct stat sidecar_info;
+    int exists = stat(sidecar, &sidecar_info) == 0;
+    if (exists && file_newer_or_same(&sidecar_info, &st)) {
+      atomic_fetch_add(&job->current, 1);
+      continue;
+    }
+
+    if (bound > *cap) {
+      char *grown = realloc(*out, bound);
+      if (grown == NULL) {
+        atomic_fetch_add(&job->failed, 1);
+        continue;
+      }
+      *out = grown;
+      *cap = bound;
+    }
+    ssize_t len = encode_buffer(e, 9, data, st.st_size, *out, *cap);
+    if (len < 0) {
+      atomic_fetch_add(&job->failed, 1);
+      continue;
+    }
+
+    /**
+     * A sidecar that isn't smaller is worse than none, and a stale
+     * one would never be served anyway
+     */
+    if (len >= st.st_size) {
+      if (exists) unlink(sidecar);
+      atomic_fetch_add(&job->not_smaller, 1);
+      continue;
+    }
+    if (write_sidecar(sidecar, *out, len) < 0) {
+      atomic_fetch_add(&job->failed, 1);
+      continue;
+    }
+    atomic_fetch_add(&job->written, 1);
+    atomic_fetch_add(&job->saved, st.st_size - len);
+  }
+  munmap(data, st.st_size);
+}
+
+/**
+ * Precompression thread: take files until there are none left
+ * @param arg Job
+ */
+void *precompress_thread(void *arg) {
+  precompress_job_t *job = (precompress_job_t *)arg;
+  char *out = NULL;
+  size_t cap = 0;
+  size_t i;
+  while ((i = atomic_fetch_add(&job->next, 1)) < job->count) {
+    precompress_file(job, job->paths[i], &out, &cap);
+  }
+  free(out);
+  return NULL;
+}
+
+/**
+ * Write .br/.zst/.gz sidecars for every compressible file under root
+ * whose sidecars are missing or older than the file
+ * @param  root    Directory to walk
+ * @param  threads Number of compression threads
+ * @return 0 on success, -1 if the tree could not be walked
+ */
+int precompress_tree(const char *root, int threads) {
+  precompress_job_t job;
+  memset(&job, 0, sizeof(job));
+  precompress_collecting = &job;
+  if (nftw(root, precompress_collect, 64, FTW_PHYS) != 0) {
+    perror("Could not walk server root");
+    return -1;
+  }
+
+  long long start = now_ms();
+  pthread_t workers[threads];
+  int started = 0;
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&workers[i], NULL, precompress_thread, &job) == 0) started++;
+  }
+  if (started == 0) precompress_thread(&job);
+  for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+
+  printf("Precompressed %zu files with %d threads in %lld ms: %lu written, "
+    "%lu up to date, %lu not smaller, %lu failed, %llu KB saved\n",
+    job.count, started ? started : 1, now_ms() - start,
+    job.written, job.current, job.not_smaller, job.failed, job.saved >> 10);
+
+  for (size_t i = 0; i < job.count; i++) free(job.paths[i]);
+  free(job.paths);
+  return 0;
+}
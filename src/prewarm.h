@@ -0,0 +1,445 @@
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+
+#define PREWARM_THREADS_MIN 4      // The crawl waits on the disk more than on CPUs
+#define PREWARM_DENTS (64 << 10)   // getdents64() buffer
+
+/**
+ * One entry of a directory being crawled
+ */
+typedef struct {
+  char *name;
+  struct stat info;
+} prewarm_child_t;
+
+/**
+ * Work shared by the crawl threads. Directories are handed out from a
+ * stack; once it's empty and no thread can add to it, the threads read
+ * the files picked for warming, taken by bumping next.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t more;
+  char **dirs;                // Directories still to read
+  size_t dir_count, dir_cap;
+  int busy;                   // Threads reading a directory
+  atomic_int crawled;         // Set once every directory has been read
+  atomic_int finished;        // Threads done warming too
+  int threads;
+
+  char **warm;                // Files to read into the page cache
+  size_t warm_count, warm_cap;
+  atomic_size_t next;
+  unsigned long long warm_bytes;
+  atomic_ullong warmed_bytes;
+  atomic_ulong warmed_files;
+
+  char **listed;              // Request paths from --warm-list, sorted
+  size_t listed_count;
+
+  meta_entry_t *entries;      // Resolutions for the metadata cache
+  unsigned long long dir_total, file_total;
+  atomic_int serving;         // main() has moved on to accepting connections
+  long long start;
+} prewarm_job_t;
+
+prewarm_job_t prewarm_job;
+
+int compare_prewarm_children(const void *a, const void *b) {
+  return strcmp(((prewarm_child_t *)a)->name, ((prewarm_child_t *)b)->name);
+}
+
+/**
+ * Find an entry of a directory by name
+ * @param children Entries, sorted by name
+ * @param count    Number of entries
+ * @param name     Name
+ * @return Entry, NULL if there is none
+ */
+prewarm_child_t *prewarm_find_child(prewarm_child_t *children, size_t count, const char *name) {
+  prewarm_child_t key = { .name = (char *)name };
+  return bsearch(&key, children, count, sizeof(prewarm_child_t), compare_prewarm_children);
+}
+
+/**
+ * The struct stat that stat() would have given
+ * @param st  Output
+ * @param stx statx() result
+ */
+void stat_from_statx(struct stat *st, struct statx *stx) {
+  memset(st, 0, sizeof(*st));
+  st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+  st->st_ino = stx->stx_ino;
+  st->st_mode = stx->stx_mode;
+  st->st_nlink = stx->stx_nlink;
+  st->st_uid = stx->stx_uid;
+  st->st_gid = stx->stx_gid;
+  st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+  st->st_size = stx->stx_size;
+  st->st_blksize = stx->stx_blksize;
+  st->st_blocks = stx->stx_blocks;
+  st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+  st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+  st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+  st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+  st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/**
+ * Is a request path on the --warm-list?
+ * @param job  Crawl
+ * @param path Request file path
+ */
+int prewarm_listed(prewarm_job_t *job, const char *path) {
+  const char *rel = path + strlen(SERVER_ROOT);
+  return job->listed_count &&
+    bsearch(&rel, job->listed, job->listed_count, sizeof(char *), compare_names) != NULL;
+}
+
+/**
+ * Pick a file to read into the page cache
+ * @param job  Crawl
+ * @param path File
+ * @param size Its size
+ */
+void prewarm_want(prewarm_job_t *job, const char *path, off_t size) {
+  pthread_mutex_lock(&job->lock);
+  if (path_list_add(&job->warm, &job->warm_count, &job->warm_cap, path) == 0) {
+    job->warm_bytes += size;
+  }
+  pthread_mutex_unlock(&job->lock);
+}
+
+/**
+ * Resolve one path of a directory the way meta_resolve() would, and
+ * keep the result for the metadata cache
+ * @param entries  List to add to
+ * @param path     Request file path
+ * @param meta     Resolution, sidecars still to be found
+ * @param children Entries of the directory meta's file is in, sorted by name
+ * @param count    Number of entries
+ * @param gen      meta_gen from before the directory was read
+ * @see meta_cache.h
+ */
+void prewarm_resolve(meta_entry_t **entries, const char *path, file_meta_t *meta,
+    prewarm_child_t *children, size_t count, unsigned long long gen) {
+  meta->variants = 0;
+  meta->mime_type = NULL;
+  if (meta->type != META_DIR) {
+    meta->mime_type = file_mime_type(meta->file_path);
+    const char *name = strrchr(meta->file_path, '/') + 1;
+    for (int e = 1; e < ENCODINGS && mime_compressible(meta->mime_type); e++) {
+      char sidecar[strlen(name) + strlen(encodings[e].suffix) + 1];
+      sprintf(sidecar, "%s%s", name, encodings[e].suffix);
+      prewarm_child_t *child = prewarm_find_child(children, count, sidecar);
+      if (child && S_ISREG(child->info.st_mode) && file_newer_or_same(&child->info, &meta->file_info)) {
+        meta->sidecar_info[e] = child->info;
+        meta->variants |= ENCODING_BIT(e);
+      }
+    }
+  }
+  if (meta_inotify < 0 || !meta_path_cacheable(path)) return;
+  meta_entry_t *entry = meta_entry_new(path, meta, gen);
+  if (entry == NULL) return;
+  entry->next = *entries;
+  *entries = entry;
+}
+
+/**
+ * Read one directory: stat() every entry with statx(), queue the
+ * directories under it, pick files to warm, and resolve its paths
+ * @param job Crawl
+ * @param dir Directory, SERVER_ROOT and a request path without a trailing slash
+ */
+void prewarm_dir(prewarm_job_t *job, char *dir) {
+  size_t dir_len = strlen(dir), root_len = strlen(SERVER_ROOT);
+
+  /**
+   * Watch it before reading it, a change from here on is an event
+   * @see meta_cache.h
+   */
+  int watched = 0;
+  unsigned long long gen = atomic_load(&meta_gen);
+  if (meta_inotify > -1) {
+    pthread_mutex_lock(&job->lock);
+    watched = meta_watch_dir(dir, dir_len) == 0;
+    pthread_mutex_unlock(&job->lock);
+  }
+
+  int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) return;
+  prewarm_child_t *children = NULL;
+  size_t count = 0, cap = 0;
+  char *dents = malloc(PREWARM_DENTS);
+  ssize_t len;
+  while (dents != NULL && (len = getdents64(dir_fd, dents, PREWARM_DENTS)) > 0) {
+    for (char *p = dents; p < dents + len; p += ((struct dirent64 *)p)->d_reclen) {
+      struct dirent64 *ent = (struct dirent64 *)p;
+      if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+      struct statx stx;
+      if (statx(dir_fd, ent->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_BASIC_STATS, &stx) < 0) {
+        continue;
+      }
+      if (count == cap) {
+        cap = cap ? cap * 2 : 64;
+        prewarm_child_t *grown = realloc(children, sizeof(prewarm_child_t) * cap);
+        if (grown == NULL) break;
+        children = grown;
+      }
+      if ((children[count].name = strdup(ent->d_name)) == NULL) break;
+      stat_from_statx(&children[count].info, &stx);
+      count++;
+    }
+  }
+  free(dents);
+  struct stat dir_info;
+  int dir_ok = fstat(dir_fd, &dir_info) == 0;
+  close(dir_fd);
+  qsort(children, count, sizeof(prewarm_child_t), compare_prewarm_children);
+
+  /**
+   * Symlinks are left to be resolved per request, as meta_resolve()
+   * leaves them, and aren't followed
+   */
+  meta_entry_t *entries = NULL;
+  char **subdirs = NULL;
+  size_t subdir_count = 0, subdir_cap = 0;
+  unsigned long long files = 0;
+  for (size_t i = 0; i < count; i++) {
+    prewarm_child_t *child = &children[i];
+    char path[dir_len + strlen(child->name) + 2];
+    sprintf(path, "%s/%s", dir, child->name);
+    if (S_ISDIR(child->info.st_mode)) {
+      if (path_list_add(&subdirs, &subdir_count, &subdir_cap, path) < 0) break;
+      continue;
+    }
+    if (!S_ISREG(child->info.st_mode)) continue;
+    files++;
+    file_meta_t meta = { .type = META_FILE, .file_path = path, .file_info = child->info };
+    if (watched) prewarm_resolve(&entries, path, &meta, children, count, gen);
+    if (child->info.st_size > 0 && (child->info.st_size <= (off_t)PREWARM_MAX || prewarm_listed(job, path))) {
+      prewarm_want(job, path, child->info.st_size);
+    }
+  }
+
+  /**
+   * The directory itself, by both spellings: its index file, or a
+   * listing. An index file that isn't a regular file is left to
+   * meta_resolve(). A directory on the --warm-list warms its index file.
+   */
+  prewarm_child_t *index = prewarm_find_child(children, count, INDEX_FILE);
+  char index_path[dir_len + sizeof(INDEX_FILE) + 1], slashed[dir_len + 2];
+  sprintf(index_path, "%s/%s", dir, INDEX_FILE);
+  sprintf(slashed, "%s/", dir);
+  if (watched && dir_ok && (index == NULL || S_ISREG(index->info.st_mode))) {
+    file_meta_t meta = { .type = META_DIR, .file_path = dir, .file_info = dir_info };
+    if (index) {
+      meta.type = META_INDEX;
+      meta.file_path = index_path;
+      meta.file_info = index->info;
+    }
+    if (dir_len > root_len) prewarm_resolve(&entries, dir, &meta, children, count, gen);
+    prewarm_resolve(&entries, slashed, &meta, children, count, gen);
+  }
+  if (index && S_ISREG(index->info.st_mode) && index->info.st_size > (off_t)PREWARM_MAX &&
+      !prewarm_listed(job, index_path) && (prewarm_listed(job, dir) || prewarm_listed(job, slashed))) {
+    prewarm_want(job, index_path, index->info.st_size);
+  }
+
+  pthread_mutex_lock(&job->lock);
+  for (size_t i = 0; i < subdir_count; i++) {
+    if (job->dir_count == job->dir_cap) {
+      size_t grown_cap = job->dir_cap ? job->dir_cap * 2 : 256;
+      char **grown = realloc(job->dirs, sizeof(char *) * grown_cap);
+      if (grown == NULL) {
+        free(subdirs[i]);
+        continue;
+      }
+      job->dirs = grown;
+      job->dir_cap = grown_cap;
+    }
+    job->dirs[job->dir_count++] = subdirs[i];
+  }
+  if (subdir_count) pthread_cond_broadcast(&job->more);
+  while (entries) {
+    meta_entry_t *next = entries->next;
+    entries->next = job->entries;
+    job->entries = entries;
+    entries = next;
+  }
+  job->dir_total++;
+  job->file_total += files;
+  pthread_mutex_unlock(&job->lock);
+
+  free(subdirs);
+  for (size_t i = 0; i < count; i++) free(children[i].name);
+  free(children);
+}
+
+/**
+ * Read a file into the page cache, all of it before returning
+ * @param  path File
+ * @return Bytes read, 0 on error
+ */
+off_t prewarm_file(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0) return 0;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return 0;
+  munmap(data, st.st_size);
+  return st.st_size;
+}
+
+/**
+ * Crawl thread: read directories until there are none left and none
+ * being read, then warm files until those run out
+ * @param arg Job
+ */
+void *prewarm_thread(void *arg) {
+  prewarm_job_t *job = (prewarm_job_t *)arg;
+  pthread_mutex_lock(&job->lock);
+  while (1) {
+    while (job->dir_count == 0 && job->busy > 0) pthread_cond_wait(&job->more, &job->lock);
+    if (job->dir_count == 0) break;
+    char *dir = job->dirs[--job->dir_count];
+    job->busy++;
+    pthread_mutex_unlock(&job->lock);
+    prewarm_dir(job, dir);
+    free(dir);
+    pthread_mutex_lock(&job->lock);
+    if (--job->busy == 0 && job->dir_count == 0) pthread_cond_broadcast(&job->more);
+  }
+  atomic_store(&job->crawled, 1);
+  pthread_mutex_unlock(&job->lock);
+
+  size_t i;
+  while ((i = atomic_fetch_add(&job->next, 1)) < job->warm_count) {
+    atomic_fetch_add(&job->warmed_bytes, prewarm_file(job->warm[i]));
+    atomic_fetch_add(&job->warmed_files, 1);
+    free(job->warm[i]);
+  }
+
+  /**
+   * Past the --prewarm-wait mark, the last thread out says when the
+   * rest was done
+   */
+  if (atomic_fetch_add(&job->finished, 1) + 1 == job->threads) {
+    free(job->warm);
+    if (atomic_load(&job->serving)) {
+      printf("Prewarm finished: %lu files, %llu KB in %lld ms\n", atomic_load(&job->warmed_files),
+        atomic_load(&job->warmed_bytes) >> 10, now_ms() - job->start);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Read the request paths of a --warm-list: an access log in any of
+ * the --log-format formats, or one path per line
+ * @param  job  Crawl
+ * @param  path File
+ * @return 0 on success, -1 if it can't be read
+ */
+int prewarm_load_list(prewarm_job_t *job, const char *path) {
+  FILE *in = fopen(path, "r");
+  if (in == NULL) return -1;
+  size_t cap = 0;
+  char *line = NULL;
+  size_t line_cap = 0;
+  while (getline(&line, &line_cap, in) > 0) {
+    char *uri = line[0] == '/' ? line : NULL, *p;
+    if (uri == NULL && (p = strstr(line, "\"uri\":\"")) != NULL) uri = p + 7;
+    if (uri == NULL && (p = strstr(line, "\"GET /")) != NULL) uri = p + 5;
+    if (uri == NULL && (p = strstr(line, "\"HEAD /")) != NULL) uri = p + 6;
+    if (uri == NULL) continue;
+    size_t len = strcspn(uri, "? \"\r\n");
+    char *decoded = malloc(len + 1);
+    if (decoded == NULL || url_decode(decoded, uri, len) < 0) {
+      free(decoded);
+      continue;
+    }
+    if (job->listed_count == cap) {
+      cap = cap ? cap * 2 : 256;
+      char **grown = realloc(job->listed, sizeof(char *) * cap);
+      if (grown == NULL) {
+        free(decoded);
+        break;
+      }
+      job->listed = grown;
+    }
+    job->listed[job->listed_count++] = decoded;
+  }
+  free(line);
+  fclose(in);
+  qsort(job->listed, job->listed_count, sizeof(char *), compare_names);
+  return 0;
+}
+
+/**
+ * Crawl the server root on several threads before serving: every path
+ * is resolved into the metadata cache, and small files and those on the
+ * --warm-list are read into the page cache. Returns once the crawl is
+ * done and PREWARM_WAIT percent of the bytes to warm are in, the rest
+ * is warmed in the background.
+ * @return 0 on success, -1 if the warm list can't be read
+ * @see meta_cache.h
+ */
+int prewarm_root() {
+  prewarm_job_t *job = &prewarm_job;
+  memset(job, 0, sizeof(*job));
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->more, NULL);
+  job->start = now_ms();
+  if (PREWARM_LIST != NULL && prewarm_load_list(job, PREWARM_LIST) < 0) {
+    perror("Could not read the warm list");
+    return -1;
+  }
+  if (path_list_add(&job->dirs, &job->dir_count, &job->dir_cap, SERVER_ROOT) < 0) return -1;
+
+  int threads = usable_cpus() < PREWARM_THREADS_MIN ? PREWARM_THREADS_MIN : usable_cpus();
+  for (int i = 0; i < threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, prewarm_thread, job) != 0) break;
+    pthread_detach(thread);
+    job->threads++;
+  }
+  if (job->threads == 0) {
+    job->threads = 1;
+    prewarm_thread(job);
+  }
+
+  /**
+   * The metadata cache's watcher isn't running yet, the table is
+   * published from here
+   */
+  while (!atomic_load(&job->crawled)) usleep(1000);
+  pthread_mutex_lock(&job->lock);
+  meta_entry_t *entries = job->entries;
+  job->entries = NULL;
+  unsigned long long dirs = job->dir_total, files = job->file_total, warm_bytes = job->warm_bytes;
+  size_t warm_count = job->warm_count;
+  pthread_mutex_unlock(&job->lock);
+  meta_preload(entries);
+  meta_table_t *table = atomic_load(&meta_table);
+  printf("Crawled %llu directories and %llu files with %d threads in %lld ms, %zu paths indexed\n",
+    dirs, files, job->threads, now_ms() - job->start, table ? table->count : 0);
+
+  while (atomic_load(&job->warmed_bytes) * 100 < warm_bytes * PREWARM_WAIT &&
+         atomic_load(&job->finished) < job->threads) {
+    usleep(1000);
+  }
+  atomic_store(&job->serving, 1);
+  printf("Prewarmed %llu of %llu KB (%zu files to warm) in %lld ms\n",
+    atomic_load(&job->warmed_bytes) >> 10, warm_bytes >> 10, warm_count, now_ms() - job->start);
+  for (size_t i = 0; i < job->listed_count; i++) free(job->listed[i]);
+  free(job->listed);
+  job->listed_count = 0;
+  return 0;
+}
@@ -1,13 +1,70 @@
 #include <dirent.h>
 #include <inttypes.h>
+#include <sys/inotify.h>
 
 #define DIM(x) (sizeof(x)/sizeof(*(x)))
 
-char * format_bytes(uint64_t size) {
+#define LISTING_CACHE_DIRS  256  // Directories whose listings are kept
+#define LISTING_PENDING_MAX 64   // Changed names kept per directory, past that it is reread
+
+#define LISTING_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+  IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/**
+ * One table row of a listing
+ */
+typedef struct {
+  char *name;
+  char *html;
+  size_t html_len;
+} listing_row_t;
+
+/**
+ * A rendered listing. Responses hold a reference while they send it,
+ * so a directory can change under a slow client.
+ */
+typedef struct {
+  atomic_int refs;
+  size_t len;
+  char data[];
+} listing_body_t;
+
+/**
+ * Cached listing of one directory. With inotify, events name the
+ * entries that changed and only those are stat()ed and rendered again.
+ * Without it, a new directory mtime means the directory is reread.
+ */
+typedef struct {
+  char *path;                         // Directory, NULL if the slot is free
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  int wd;                             // inotify watch, -1 if there is none
+  listing_row_t *rows;
+  size_t row_count;
+  size_t row_cap;
+  char *pending[LISTING_PENDING_MAX]; // Names reported changed
+  int pending_count;
+  int rescan;                         // Reread the whole directory
+  listing_body_t *body;               // Rendered rows, NULL once they change
+  unsigned long long used;            // Last use, for eviction
+} listing_t;
+
+listing_t listings[LISTING_CACHE_DIRS];
+pthread_mutex_t listings_lock = PTHREAD_MUTEX_INITIALIZER;
+int listings_inotify = -1;
+unsigned long long listings_clock, listing_hits, listing_updates, listing_rescans;
+
+/**
+ * Human readable file size
+ * @param  result Output, at least 20 bytes
+ * @param  size   Size in bytes
+ * @return result
+ */
+char * format_bytes(char result[], uint64_t size) {
   const char     *sizes[]   = { "EiB", "PiB", "TiB", "GiB", "MiB", "KiB", "B" };
   const uint64_t  exbibytes = 1024ULL * 1024ULL * 1024ULL *
                               1024ULL * 1024ULL * 1024ULL;
-  char *result = (char *) malloc(sizeof(char) * 20);
   uint64_t multiplier = exbibytes;
   int i;
   for (i = 0; i < DIM(sizes); i++, multiplier /= 1024) {
@@ -23,88 +80,403 @@ char * format_bytes(uint64_t size) {
   return result;
 }
 
-void get_html_file_list(int client, char file_path[]) {
-  DIR *dir;
-  struct dirent *ent;
+/**
+ * Set up change notification for cached listings. Without inotify,
+ * listings are checked against their directory's mtime instead.
+ */
+void listing_cache_init() {
+  listings_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (listings_inotify < 0) {
+    perror("Note: directory listings are revalidated by mtime, inotify failed");
+  }
+}
 
-  char *table_open = "<table><tr>"
-  "<td width=\"50\">TYPE</td>"
-  "<td width=\"75\">SIZE</td>"
-  "<td>FILE</td></tr>";
+/**
+ * Drop a response's reference to a listing
+ * @param owner Listing body
+ */
+void listing_body_release(void *owner) {
+  listing_body_t *body = (listing_body_t *)owner;
+  if (atomic_fetch_sub(&body->refs, 1) == 1) free(body);
+}
+
+/**
+ * Render the table row for one directory entry
+ * @param  listing Directory
+ * @param  row     Row, its name set
+ * @param  dir_fd  Open directory
+ * @return 0 on success, -1 if the entry is gone or out of memory
+ */
+int listing_render_row(listing_t *listing, listing_row_t *row, int dir_fd) {
+  struct stat stat_result;
+  if (fstatat(dir_fd, row->name, &stat_result, 0) < 0) return -1;
+
+  // Link path is full_path - SERVER_ROOT
+  const char *link_path = listing->path + strlen(SERVER_ROOT);
+  const char *slash = link_path[0] && link_path[strlen(link_path)-1] == '/' ? "" : "/";
+
+  char file_size[32];
+  const char *resource_type, *link_end;
+  if (S_ISREG(stat_result.st_mode)) {
+    format_bytes(file_size, stat_result.st_size);
+    resource_type = "FILE";
+    link_end = "";
+  }else{
+    strcpy(file_size, "----");
+    resource_type = "DIR";
+    // add trailing forward slash to link
+    link_end = "/";
+  }
+
+  char *html;
+  int len = asprintf(
+    &html,
+    "<tr>"
+    "<td>%s</td>"
+    "<td>%s</td>"
+    "<td><a href=\"%s%s%s%s\">%s</a></td>"
+    "</tr>",
+    resource_type,
+    file_size,
+    link_path, slash, row->name, link_end,
+    row->name
+  );
+  if (len < 0) return -1;
+  free(row->html);
+  row->html = html;
+  row->html_len = len;
+  return 0;
+}
 
-  write(client, table_open, strlen(table_open));
+/**
+ * Free a row's strings
+ * @param row Row
+ */
+void listing_row_free(listing_row_t *row) {
+  free(row->name);
+  free(row->html);
+}
 
-  if ((dir = opendir(file_path)) != NULL) {
-    struct stat *stat_result;
-    char line_buffer[4096], full_path[4096], link_path[4096], resource_type[5];
-    char file_size[32];
+/**
+ * Add a row for a new entry
+ * @param  listing Directory
+ * @param  name    Entry name
+ * @param  dir_fd  Open directory
+ * @return 0 on success, -1 if the entry is gone or out of memory
+ */
+int listing_add_row(listing_t *listing, const char *name, int dir_fd) {
+  if (listing->row_count == listing->row_cap) {
+    size_t cap = listing->row_cap ? listing->row_cap * 2 : 64;
+    listing_row_t *rows = realloc(listing->rows, sizeof(listing_row_t) * cap);
+    if (rows == NULL) return -1;
+    listing->rows = rows;
+    listing->row_cap = cap;
+  }
+  listing_row_t *row = &listing->rows[listing->row_count];
+  row->html = NULL;
+  if ((row->name = strdup(name)) == NULL) return -1;
+  if (listing_render_row(listing, row, dir_fd) < 0) {
+    free(row->name);
+    return -1;
+  }
+  listing->row_count++;
+  return 0;
+}
 
-    while ((ent = readdir(dir)) != NULL) {
+/**
+ * Forget the names inotify reported
+ * @param listing Directory
+ */
+void listing_clear_pending(listing_t *listing) {
+  for (int i = 0; i < listing->pending_count; i++) free(listing->pending[i]);
+  listing->pending_count = 0;
+}
 
-      memset(line_buffer, 0, sizeof(line_buffer));
-      memset(full_path, 0, sizeof(full_path));
-      memset(link_path, 0, sizeof(link_path));
-      memset(file_size, 0, sizeof(file_size));
-      memset(resource_type, 0, sizeof(resource_type));
+/**
+ * Reread a whole directory, stat()ing every entry
+ * @param  listing Directory
+ * @return 0 on success, -1 if it can't be read
+ */
+int listing_rescan(listing_t *listing) {
+  DIR *dir = opendir(listing->path);
+  if (dir == NULL) return -1;
+  for (size_t i = 0; i < listing->row_count; i++) listing_row_free(&listing->rows[i]);
+  listing->row_count = 0;
+  listing_clear_pending(listing);
 
-      strcat(full_path, file_path);
-      if (full_path[strlen(full_path)-1] != '/') strcat(full_path, "/");
-      strcat(full_path, ent->d_name);
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    // An entry removed since readdir() is left out
+    listing_add_row(listing, ent->d_name, dirfd(dir));
+  }
+  closedir(dir);
+  listing->rescan = 0;
+  listing_rescans++;
+  return 0;
+}
 
-      stat_result = malloc(sizeof(struct stat));
-      if (stat(full_path, stat_result) < 0) {
-        send_http_error(client, 500);
-        return;
+int compare_names(const void *a, const void *b) {
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+/**
+ * Bring the rows for the names inotify reported up to date: entries
+ * that still exist are rendered again, the rest removed, and names that
+ * weren't listed yet added
+ * @param  listing Directory
+ * @return 0 on success, -1 if the directory can't be read
+ */
+int listing_update(listing_t *listing) {
+  int dir_fd = open(listing->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) return -1;
+
+  char **pending = listing->pending;
+  int listed[LISTING_PENDING_MAX] = { 0 };
+  qsort(pending, listing->pending_count, sizeof(char *), compare_names);
+
+  size_t kept = 0;
+  for (size_t i = 0; i < listing->row_count; i++) {
+    listing_row_t *row = &listing->rows[i];
+    char **match = bsearch(&row->name, pending, listing->pending_count, sizeof(char *), compare_names);
+    if (match != NULL) {
+      listed[match - pending] = 1;
+      if (listing_render_row(listing, row, dir_fd) < 0) {
+        listing_row_free(row);
+        continue;
       }
+    }
+    listing->rows[kept++] = *row;
+  }
+  listing->row_count = kept;
+
+  for (int i = 0; i < listing->pending_count; i++) {
+    if (!listed[i]) listing_add_row(listing, pending[i], dir_fd);
+  }
+  close(dir_fd);
+  listing_clear_pending(listing);
+  listing_updates++;
+  return 0;
+}
+
+/**
+ * Note that an entry of a cached directory changed
+ * @param listing Directory
+ * @param name    Entry name, NULL to reread the whole directory
+ */
+void listing_changed(listing_t *listing, const char *name) {
+  if (listing->body != NULL) {
+    listing_body_release(listing->body);
+    listing->body = NULL;
+  }
+  if (listing->rescan) return;
+  if (name == NULL) {
+    listing_clear_pending(listing);
+    listing->rescan = 1;
+    return;
+  }
+  for (int i = 0; i < listing->pending_count; i++) {
+    if (strcmp(listing->pending[i], name) == 0) return;
+  }
+  char *copy = listing->pending_count < LISTING_PENDING_MAX ? strdup(name) : NULL;
+  if (copy == NULL) {
+    listing_clear_pending(listing);
+    listing->rescan = 1;
+    return;
+  }
+  listing->pending[listing->pending_count++] = copy;
+}
 
-      // Link path is full_path - SERVER_ROOT
-      strncpy(link_path, full_path+strlen(SERVER_ROOT), strlen(full_path));
-      link_path[strlen(full_path)] = '\0';
-
-      if (S_ISREG(stat_result->st_mode)) {
-        strcpy(file_size, format_bytes(stat_result->st_size));
-        strcpy(resource_type, "FILE");
-      }else{
-        strcpy(file_size, "----");
-        strcpy(resource_type, "DIR");
-        // add trailing forward slash to link
-        strcat(link_path, "/");
+/**
+ * Read the inotify events queued since the last listing was served.
+ * Several cached paths can name one directory and share its watch.
+ */
+void listing_read_events() {
+  char events[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  while ((len = read(listings_inotify, events, sizeof(events))) > 0) {
+    for (char *p = events; p < events + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+      struct inotify_event *event = (struct inotify_event *)p;
+      for (int i = 0; i < LISTING_CACHE_DIRS; i++) {
+        listing_t *listing = &listings[i];
+        if (listing->path == NULL) continue;
+        if (event->mask & IN_Q_OVERFLOW) {
+          listing_changed(listing, NULL);
+        }else if (listing->wd == event->wd) {
+          if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+            if (event->mask & IN_IGNORED) listing->wd = -1;
+            listing_changed(listing, NULL);
+          }else if (event->len > 0) {
+            listing_changed(listing, event->name);
+          }
+        }
       }
+    }
+  }
+}
+
+/**
+ * Empty a cache slot. The watch is removed unless another cached path
+ * names the same directory.
+ * @param listing Directory
+ */
+void listing_free(listing_t *listing) {
+  int shared = 0;
+  for (int i = 0; i < LISTING_CACHE_DIRS; i++) {
+    if (&listings[i] != listing && listings[i].path && listings[i].wd == listing->wd) shared = 1;
+  }
+  if (listing->wd > -1 && !shared) inotify_rm_watch(listings_inotify, listing->wd);
+  for (size_t i = 0; i < listing->row_count; i++) listing_row_free(&listing->rows[i]);
+  listing_clear_pending(listing);
+  if (listing->body) listing_body_release(listing->body);
+  free(listing->rows);
+  free(listing->path);
+  memset(listing, 0, sizeof(*listing));
+}
+
+/**
+ * Find a directory's cached listing, or the slot to cache it in
+ * @param  file_path Directory
+ * @return Listing, NULL if out of memory
+ */
+listing_t *listing_find(const char *file_path) {
+  listing_t *slot = NULL;
+  for (int i = 0; i < LISTING_CACHE_DIRS; i++) {
+    listing_t *listing = &listings[i];
+    if (listing->path && strcmp(listing->path, file_path) == 0) return listing;
+    if (slot == NULL || (slot->path && (!listing->path || listing->used < slot->used))) slot = listing;
+  }
+
+  /**
+   * Take a free slot, or the least recently used one
+   */
+  if (slot->path) listing_free(slot);
+  if ((slot->path = strdup(file_path)) == NULL) return NULL;
+  slot->wd = listings_inotify < 0 ? -1 :
+    inotify_add_watch(listings_inotify, file_path, LISTING_WATCH_MASK);
+  slot->rescan = 1;
+  return slot;
+}
+
+/**
+ * Put a listing's rows together into a page
+ * @param  listing Directory, its rows rendered
+ * @return Body with one reference, NULL if out of memory
+ */
+listing_body_t *listing_render(listing_t *listing) {
+  char *table_open = "<table><tr>"
+  "<td width=\"50\">TYPE</td>"
+  "<td width=\"75\">SIZE</td>"
+  "<td>FILE</td></tr>";
+  char *table_close = "</table>";
+
+  size_t len = strlen(table_open) + strlen(table_close);
+  for (size_t i = 0; i < listing->row_count; i++) len += listing->rows[i].html_len;
+  listing_body_t *body = malloc(sizeof(listing_body_t) + len);
+  if (body == NULL) return NULL;
+  atomic_init(&body->refs, 1);
+  body->len = len;
+  char *p = body->data;
+  p = mempcpy(p, table_open, strlen(table_open));
+  for (size_t i = 0; i < listing->row_count; i++) {
+    p = mempcpy(p, listing->rows[i].html, listing->rows[i].html_len);
+  }
+  memcpy(p, table_close, strlen(table_close));
+  return body;
+}
+
+/**
+ * Get the rendered listing of a directory, bringing it up to date first
+ * @param  file_path Directory
+ * @param  file_info Its stat() result
+ * @param  result    Set to the listing, with a reference for the caller
+ * @return 200, or the HTTP error to send
+ */
+int listing_get(const char *file_path, struct stat *file_info, listing_body_t **result) {
+  pthread_mutex_lock(&listings_lock);
+  if (listings_inotify > -1) listing_read_events();
 
-      sprintf(
-        line_buffer,
-        "<tr>"
-        "<td>%s</td>"
-        "<td>%s</td>"
-        "<td><a href=\"%s\">%s</a></td>"
-        "</tr>",
-        resource_type,
-        file_size,
-        link_path,
-        ent->d_name
-      );
-
-      write(client, line_buffer, strlen(line_buffer));
+  listing_t *listing = listing_find(file_path);
+  if (listing == NULL) {
+    pthread_mutex_unlock(&listings_lock);
+    return 500;
+  }
+  listing->used = ++listings_clock;
 
+  /**
+   * A directory replaced by another, or changed while it wasn't
+   * watched, is read again
+   */
+  if (listing->dev != file_info->st_dev || listing->ino != file_info->st_ino ||
+      (listing->wd < 0 && (listing->mtime.tv_sec != file_info->st_mtim.tv_sec ||
+                           listing->mtime.tv_nsec != file_info->st_mtim.tv_nsec))) {
+    if (listing->wd < 0 && listings_inotify > -1) {
+      listing->wd = inotify_add_watch(listings_inotify, file_path, LISTING_WATCH_MASK);
     }
+    listing_changed(listing, NULL);
+  }
 
-    closedir(dir);
-    free(stat_result);
-  } else {
-    // could not open directory
-    send_http_error(client, 403);
-    return;
+  if (listing->body == NULL) {
+    int failed = listing->rescan ? listing_rescan(listing) :
+      listing->pending_count ? listing_update(listing) : 0;
+    if (failed) {
+      listing_free(listing);
+      pthread_mutex_unlock(&listings_lock);
+      return 403;
+    }
+    listing->dev = file_info->st_dev;
+    listing->ino = file_info->st_ino;
+    listing->mtime = file_info->st_mtim;
+
+    if ((listing->body = listing_render(listing)) == NULL) {
+      pthread_mutex_unlock(&listings_lock);
+      return 500;
+    }
+  }else{
+    listing_hits++;
   }
 
-  write(client, "</table>", strlen("</table>"));
+  atomic_fetch_add(&listing->body->refs, 1);
+  *result = listing->body;
+  pthread_mutex_unlock(&listings_lock);
+  return 200;
 }
 
-void serve_directory(int client, char file_path[]) {
+/**
+ * Print how often listings were served from the cache
+ * @param out Stream
+ */
+void listing_report(FILE *out) {
+  pthread_mutex_lock(&listings_lock);
+  size_t cached = 0;
+  for (int i = 0; i < LISTING_CACHE_DIRS; i++) cached += listings[i].path != NULL;
+  fprintf(out, "Listings: %zu cached, %llu hits, %llu updated, %llu reread\n",
+    cached, listing_hits, listing_updates, listing_rescans);
+  pthread_mutex_unlock(&listings_lock);
+}
 
-  send_http_status(client, 200);
-  send_http_header(client, "Content-Type", "text/html");
-  send_http_header(client, "Connection", "close");
-  write(client, "\r\n", 2);
+void serve_directory(connection_t *conn, char file_path[], struct stat *file_info) {
+  listing_body_t *body;
+  int status = listing_get(file_path, file_info, &body);
+  if (status != 200) {
+    send_http_error(conn, status);
+    return;
+  }
+
+  /**
+   * Large listings go to the compression threads, which stage the
+   * response once they are done. HEAD too, for its exact length.
+   * @see compress_pool.h
+   */
+  int on_the_fly;
+  int encoding = pick_encoding(conn, "text/html", body->len, 0, &on_the_fly);
+  if (on_the_fly && compress_body_later(conn, body->data, body->len, "text/html", encoding) == 0) {
+    listing_body_release(body);
+    return;
+  }
 
-  get_html_file_list(client, file_path);
+  /**
+   * The listing goes out from the cache, behind its headers
+   */
+  send_file_headers(conn, body->len, "text/html", ENCODING_IDENTITY);
+  conn_send_memory(conn, body->data, body->len, listing_body_release, body);
 }
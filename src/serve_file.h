@@ -1,61 +1,430 @@
-void serve_file(int client, char file_path[], struct stat *file_info) {
+/**
+ * Look up the MIME type for a file by its extension
+ * @param  file_path Path to the file
+ * @see mime_types.h
+ */
+const char * file_mime_type(char file_path[]) {
+  char file_ext[32];
+  memset(file_ext, 0, 32);
+  if (strchr(file_path, '.') != NULL) {
+    strncpy(file_ext, strrchr(file_path, '.'), sizeof(file_ext) - 1);
+  }
+  return ext_to_mime_type(file_ext);
+}
+
+/**
+ * Stage the headers that describe a body
+ * @param conn         Client connection
+ * @param size         Body length
+ * @param content_type Content-Type, differs from mime_type for multipart bodies
+ * @param mime_type    Type of the file
+ * @param encoding     Content coding of the body
+ * @see content_encoding.h
+ */
+void send_content_headers(connection_t *conn, long long unsigned int size, const char *content_type,
+    const char *mime_type, int encoding) {
+  char file_size[32], type[255];
+  snprintf(file_size, 32, "%llu", size);
+  snprintf(type, sizeof(type), "%s", content_type);
+
+  send_http_header(conn, "Content-Length", file_size);
+  send_http_header(conn, "Content-Type", type);
+  if (encoding != ENCODING_IDENTITY) {
+    send_http_header(conn, "Content-Encoding", (char *)encodings[encoding].name);
+  }
+  if (mime_compressible(mime_type)) {
+    send_http_header(conn, "Vary", "Accept-Encoding");
+  }
+}
+
+/**
+ * Stage the headers for a 200 response with a body of the given size
+ * @param conn      Client connection
+ * @param size      Body length
+ * @param mime_type Content-Type
+ * @param encoding  Content coding of the body
+ */
+void send_file_headers(connection_t *conn, long long unsigned int size, const char *mime_type, int encoding) {
+  send_http_status(conn, 200);
+  send_content_headers(conn, size, mime_type, mime_type, encoding);
+  send_connection_header(conn);
+  conn_append(conn, "\r\n", 2);
+}
+
+/**
+ * Stage a 416 for a Range header none of whose ranges exist
+ * @param conn Client connection
+ * @param size Body length
+ */
+void send_range_not_satisfiable(connection_t *conn, off_t size) {
+  char content_range[48];
+  snprintf(content_range, sizeof(content_range), "bytes */%lld", (long long)size);
+  conn_reset_response(conn);
+  send_http_status(conn, 416);
+  send_http_header(conn, "Content-Range", content_range);
+  send_http_header(conn, "Content-Length", "0");
+  send_connection_header(conn);
+  conn_append(conn, "\r\n", 2);
+}
+
+/**
+ * Stage a file response: the whole body with 200, or with 206 the byte
+ * ranges the request asks for, a single range as is and several as
+ * multipart/byteranges. Ranges are offered on the identity coding only.
+ * @param conn      Client connection
+ * @param size      Body length
+ * @param mime_type Content-Type
+ * @param encoding  Content coding of the body
+ * @param mtime     Modification time of the file
+ * @param etag      Entity tag of the representation
+ * @param body      Body in memory, NULL to send it from fd
+ * @param release   Called with owner once a memory body is no longer needed
+ * @param owner     Argument for release
+ * @param fd        Open file when body is NULL, the connection takes it over
+ * @see byte_ranges.h
+ */
+void send_file_body(connection_t *conn, off_t size, const char *mime_type, int encoding,
+    struct timespec *mtime, const char *etag, const char *body, void (*release)(void *), void *owner, int fd) {
+  byte_range_t ranges[MAX_RANGES];
+  int count = 0;
+  int ranged = encoding == ENCODING_IDENTITY ? parse_ranges(conn, size, mtime, etag, ranges, &count) : RANGE_NONE;
+
+  if (ranged == RANGE_UNSATISFIABLE || size == 0) {
+    if (body) release(owner);
+    else if (fd > -1) close(fd);
+    body = NULL;
+    fd = -1;
+    if (ranged == RANGE_UNSATISFIABLE) {
+      send_range_not_satisfiable(conn, size);
+      return;
+    }
+  }
+
+  off_t start = 0, length = size;
+  char content_type[300], boundary[32];
+  const char *type = mime_type;
+  if (ranged == RANGE_PARTIAL && count == 1) {
+    start = ranges[0].start;
+    length = ranges[0].length;
+  }else if (ranged == RANGE_PARTIAL) {
+
+    /**
+     * The multipart body's length is known up front: part headers,
+     * the ranges themselves and the closing boundary
+     */
+    static atomic_ulong boundaries;
+    snprintf(boundary, sizeof(boundary), "%08x%016lx",
+      (unsigned int)getpid(), atomic_fetch_add(&boundaries, 1));
+    snprintf(content_type, sizeof(content_type), "multipart/byteranges; boundary=%s", boundary);
+    type = content_type;
+    char part[512];
+    length = snprintf(part, sizeof(part), "\r\n--%s--\r\n", boundary);
+    for (int i = 0; i < count; i++) {
+      length += range_part_header(part, sizeof(part), boundary, mime_type, &ranges[i], size) + ranges[i].length;
+    }
+  }
+
+  send_http_status(conn, ranged == RANGE_PARTIAL ? 206 : 200);
+  send_content_headers(conn, length, type, mime_type, encoding);
+  send_validator_headers(conn, etag, mtime);
+  if (encoding == ENCODING_IDENTITY) {
+    send_http_header(conn, "Accept-Ranges", "bytes");
+  }
+  if (ranged == RANGE_PARTIAL && count == 1) {
+    char content_range[96];
+    snprintf(content_range, sizeof(content_range), "bytes %lld-%lld/%lld",
+      (long long)start, (long long)(start + length - 1), (long long)size);
+    send_http_header(conn, "Content-Range", content_range);
+  }
+  send_connection_header(conn);
+  conn_append(conn, "\r\n", 2);
+  if (size == 0) return; // Don't bother sending them nothing
+
   /**
-   *  Setup file handling
+   * Several ranges of a file are sent part by part, zero-copy. A body
+   * in memory is small enough to copy the parts out of.
+   * @see connection.h
    */
-  char buf[FILE_READ_BUFFER];
-  memset(buf, 0, FILE_READ_BUFFER);
-  FILE *file;
-  size_t nread;
+  if (ranged == RANGE_PARTIAL && count > 1) {
+    if (body == NULL) {
+      conn_send_ranges(conn, fd, ranges, count, mime_type, size, boundary);
+      return;
+    }
+    char part[512];
+    for (int i = 0; i < count; i++) {
+      conn_append(conn, part, range_part_header(part, sizeof(part), boundary, mime_type, &ranges[i], size));
+      conn_append(conn, body + ranges[i].start, ranges[i].length);
+    }
+    conn_append(conn, part, snprintf(part, sizeof(part), "\r\n--%s--\r\n", boundary));
+    release(owner);
+    return;
+  }
+
+  if (body) {
+    conn_send_memory(conn, body + start, length, release, owner);
+  }else{
+    conn_send_fd(conn, fd, start, length);
+  }
+}
+
+/**
+ * Cache key for a precompressed variant of a file. The separator can't
+ * appear in a request path, see url_decode().
+ * @param  conn     Client connection, the key lives in its arena
+ * @param  key      Cache key of the file
+ * @param  encoding Content coding
+ * @return Key, NULL if out of memory
+ */
+char *variant_key(connection_t *conn, const char *key, int encoding) {
+  size_t len = strlen(key);
+  char *variant = arena_alloc(&conn->arena, len + strlen(encodings[encoding].name) + 2);
+  if (variant == NULL) return NULL;
+  memcpy(variant, key, len);
+  variant[len] = '\n';
+  strcpy(variant + len + 1, encodings[encoding].name);
+  return variant;
+}
+
+/**
+ * Cache key for a copy of a file compressed on the fly. It names the
+ * file's mtime, so an edited file is never answered with the old copy.
+ * @param  conn     Client connection, the key lives in its arena
+ * @param  key      Cache key of the file
+ * @param  encoding Content coding
+ * @param  mtime    Modification time of the file
+ * @return Key, NULL if out of memory
+ */
+char *compressed_key(connection_t *conn, const char *key, int encoding, struct timespec *mtime) {
+  size_t len = strlen(key) + strlen(encodings[encoding].name) + 48;
+  char *compressed = arena_alloc(&conn->arena, len);
+  if (compressed == NULL) return NULL;
+  snprintf(compressed, len, "%s\n%s@%lld.%09ld", key, encodings[encoding].name,
+    (long long)mtime->tv_sec, mtime->tv_nsec);
+  return compressed;
+}
+
+/**
+ * Pick the coding to send a file in: the client's favourite among the
+ * sidecars the file has and, with --compress, the codings we can
+ * produce on the fly
+ * @param  conn       Client connection
+ * @param  mime_type  Content-Type of the file
+ * @param  size       Size of the file
+ * @param  variants   Fresh precompressed sidecars
+ * @param  on_the_fly Set to 1 if the coding must be produced on the fly
+ * @return Content coding, ENCODING_IDENTITY to send the file as is
+ * @see compress_pool.h
+ */
+int pick_encoding(connection_t *conn, const char *mime_type, size_t size, int variants, int *on_the_fly) {
+  *on_the_fly = 0;
+  if (!mime_compressible(mime_type)) return ENCODING_IDENTITY;
 
   /**
-   *  Get MIME type
-   *  @see mime_types.h
+   * Byte ranges are served from the file as is
+   * @see byte_ranges.h
    */
-  char mime_type[255], file_ext[32];
-  memset(mime_type, 0, 255);
-  memset(file_ext, 0, 32);
-  if (strchr(file_path, '.') != NULL) {
-    strcpy(file_ext, strrchr(file_path, '.'));
+  if (http_find_header(conn->in, &conn->request, "Range")) return ENCODING_IDENTITY;
+  if (!variants && !compress_eligible(ENCODING_GZIP, mime_type, size) &&
+      !compress_eligible(ENCODING_BR, mime_type, size) &&
+      !compress_eligible(ENCODING_ZSTD, mime_type, size)) {
+    return ENCODING_IDENTITY;
   }
-  strcpy(mime_type, ext_to_mime_type(file_ext));
 
-  long long unsigned int fs_int = file_info->st_size;
-  char file_size[32];
-  snprintf(file_size, 32, "%llu", fs_int);
+  int order[ENCODINGS];
+  int count = negotiate_encodings(conn, order);
+  for (int i = 0; i < count && order[i] != ENCODING_IDENTITY; i++) {
+    if (variants & ENCODING_BIT(order[i])) return order[i];
+    if (compress_eligible(order[i], mime_type, size)) {
+      *on_the_fly = 1;
+      return order[i];
+    }
+  }
+  return ENCODING_IDENTITY;
+}
 
-  send_http_status(client, 200);
-  send_http_header(client, "Content-Length", file_size);
-  send_http_header(client, "Content-Type", mime_type);
-  send_http_header(client, "Connection", "close");
-  write(client, "\r\n", 2);
+/**
+ * Serve a file body from the in-memory cache, written together with
+ * the headers. The connection holds the entry until it has been sent.
+ * @param conn  Client connection
+ * @param entry Referenced cache entry
+ * @see file_cache.h
+ */
+void serve_cached_file(connection_t *conn, cache_entry_t *entry) {
+  char etag[ETAG_LEN];
+  make_etag(etag, entry->path, entry->dev, entry->ino, entry->file_size, &entry->mtime, entry->encoding);
+  if (serve_not_modified(conn, etag, &entry->mtime, entry->mime_type)) {
+    file_cache_release(entry);
+    return;
+  }
+  send_file_body(conn, entry->size, entry->mime_type, entry->encoding, &entry->mtime, etag,
+    entry->body, file_cache_release, entry, -1);
+}
 
-  if (file_size == 0) {
-    /**
-     * Don't bother sending them nothing
-     */
-    close_client_socket(client);
+/**
+ * Serve a file from the in-memory cache, compressed if the client
+ * accepts a coding it has a sidecar or a compressed copy for
+ * @param  conn Client connection
+ * @param  key  Request file path
+ * @return 1 if served, 0 if it must be served from disk
+ */
+int serve_from_cache(connection_t *conn, char key[]) {
+  cache_entry_t *entry = file_cache_get(key);
+  if (entry == NULL) return 0;
+
+  int on_the_fly;
+  int encoding = pick_encoding(conn, entry->mime_type, entry->size, entry->variants, &on_the_fly);
+  if (encoding == ENCODING_IDENTITY) {
+    serve_cached_file(conn, entry);
+    return 1;
+  }
+
+  /**
+   * The client wants a variant, serve it from memory if it is hot
+   * or let serve_file() find or make it
+   */
+  char *key_variant = on_the_fly ?
+    compressed_key(conn, key, encoding, &entry->mtime) : variant_key(conn, key, encoding);
+  cache_entry_t *variant = key_variant ? file_cache_get(key_variant) : NULL;
+  file_cache_release(entry);
+  if (variant == NULL) return 0;
+  if (on_the_fly) atomic_fetch_add(&compress_stats.cache_hits, 1);
+  serve_cached_file(conn, variant);
+  return 1;
+}
+
+/**
+ * Serve one representation of a file from disk, caching it if it is
+ * hot and small enough
+ * @param conn      Client connection
+ * @param cache_key Cache key for this representation
+ * @param file_path File to send
+ * @param file_info stat() result for file_path
+ * @param mime_type Content-Type of the original file
+ * @param encoding  Content coding of file_path
+ * @param variants  Precompressed sidecars of the original, for the cache
+ */
+void serve_file_as(connection_t *conn, char cache_key[], char file_path[], struct stat *file_info,
+    const char *mime_type, int encoding, int variants) {
+
+  /**
+   * Revalidation is answered from the stat() result alone
+   * @see validators.h
+   */
+  char etag[ETAG_LEN];
+  make_etag(etag, file_path, file_info->st_dev, file_info->st_ino, file_info->st_size,
+    &file_info->st_mtim, encoding);
+  if (serve_not_modified(conn, etag, &file_info->st_mtim, mime_type)) {
     return;
   }
 
   /**
-   * Send response body
+   * HEAD only needs the stat() result, the file isn't read or opened
    */
-  file = fopen(file_path, "r");
-  if (file) {
-    while ((nread = fread(buf, 1, sizeof buf, file)) > 0) {
-      write(client, buf, sizeof(buf));
-      memset(buf, 0, FILE_READ_BUFFER);
+  if (conn->head_only) {
+    send_file_body(conn, file_info->st_size, mime_type, encoding, &file_info->st_mtim, etag,
+      NULL, NULL, NULL, -1);
+    return;
+  }
+
+  cache_entry_t *cached = file_cache_put(cache_key, file_path, file_info, mime_type, encoding, variants);
+  if (cached != NULL) {
+    send_file_body(conn, cached->size, mime_type, encoding, &cached->mtime, etag,
+      cached->body, file_cache_release, cached, -1);
+    return;
+  }
+
+  /**
+   *  Open the file before committing to a status code
+   */
+  int fd = open(file_path, O_RDONLY);
+  if (fd < 0) {
+    if (VERBOSE >= 2) puts("File not found");
+    send_http_error(conn, 404);
+    return;
+  }
+
+  /**
+   * Send response body once the headers are out
+   * @see connection.h
+   */
+  send_file_body(conn, file_info->st_size, mime_type, encoding, &file_info->st_mtim, etag, NULL, NULL, NULL, fd);
+}
+
+/**
+ * Is a file at least as new as another?
+ * @param a stat() result
+ * @param b stat() result
+ */
+int file_newer_or_same(struct stat *a, struct stat *b) {
+  if (a->st_mtim.tv_sec != b->st_mtim.tv_sec) return a->st_mtim.tv_sec > b->st_mtim.tv_sec;
+  return a->st_mtim.tv_nsec >= b->st_mtim.tv_nsec;
+}
+
+/**
+ * Serve a file from disk. Compressible files are sent as the best
+ * precompressed sidecar (file.br, file.zst, file.gz) the client accepts,
+ * as long as it is not older than the file itself, or compressed on the
+ * fly if there is no sidecar for the coding the client prefers.
+ * @param conn      Client connection
+ * @param cache_key Request file path the file is served for
+ * @param meta      What the path resolved to, with the fresh sidecars
+ * @see meta_cache.h
+ */
+void serve_file(connection_t *conn, char cache_key[], file_meta_t *meta) {
+  char *file_path = meta->file_path;
+  struct stat *file_info = &meta->file_info;
+  const char *mime_type = meta->mime_type;
+  int variants = meta->variants;
+  if (!mime_compressible(mime_type)) {
+    serve_file_as(conn, cache_key, file_path, file_info, mime_type, ENCODING_IDENTITY, 0);
+    return;
+  }
+
+  int on_the_fly;
+  int e = pick_encoding(conn, mime_type, file_info->st_size, variants, &on_the_fly);
+  if (e != ENCODING_IDENTITY && !on_the_fly) {
+    char *key = variant_key(conn, cache_key, e);
+    char *sidecar_path = arena_alloc(&conn->arena, strlen(file_path) + strlen(encodings[e].suffix) + 1);
+    if (key != NULL && sidecar_path != NULL) {
+      sprintf(sidecar_path, "%s%s", file_path, encodings[e].suffix);
+      serve_file_as(conn, key, sidecar_path, &meta->sidecar_info[e], mime_type, e, 0);
+      return;
     }
+  }else if (on_the_fly) {
+    char etag[ETAG_LEN];
+    make_etag(etag, file_path, file_info->st_dev, file_info->st_ino, file_info->st_size,
+      &file_info->st_mtim, e);
+    if (serve_not_modified(conn, etag, &file_info->st_mtim, mime_type)) {
+      return;
+    }
+
+    char *key = compressed_key(conn, cache_key, e, &file_info->st_mtim);
+    cache_entry_t *compressed = key ? file_cache_get(key) : NULL;
+    if (compressed != NULL) {
 
-    if (ferror(file)) {
-      /* deal with error */
-      puts("error!");
+      /**
+       * Cache the file itself too once it is hot, so the next request
+       * is answered from memory without a stat()
+       */
+      cache_entry_t *identity = file_cache_put(cache_key, file_path, file_info, mime_type,
+        ENCODING_IDENTITY, variants);
+      if (identity != NULL) file_cache_release(identity);
+      atomic_fetch_add(&compress_stats.cache_hits, 1);
+      serve_cached_file(conn, compressed);
+      return;
     }
 
-    fclose(file);
-  }else{
-    puts("File not found");
+    /**
+     * Hand the work to the compression threads. The response is staged
+     * once they are done. HEAD waits for the same job so it describes
+     * what GET would send, and the result is cached for both.
+     * @see compress_pool.h
+     */
+    if (key != NULL && compress_file_later(conn, key, cache_key, file_path, file_info,
+        mime_type, e, variants) == 0) {
+      return;
+    }
   }
 
-
+  serve_file_as(conn, cache_key, file_path, file_info, mime_type, ENCODING_IDENTITY, variants);
 }
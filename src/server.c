@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <ctype.h>
 #include <sys/types.h>
@@ -10,70 +11,283 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <signal.h>
+#include <time.h>
 
 #define INDEX_FILE "index.html"
 #define BUFFER_SIZE 1024
 #define MAX_HEADERS 255
-#define MAX_CONNECTIONS 200
-#define MAX_HEADER_KEY_LEN 255
-#define MAX_HEADER_VALUE_LEN 4096
-#define FILE_READ_BUFFER 1024
+#define MAX_HEADER_SIZE 65535
+#define FILE_READ_BUFFER 65536
+#define SENDFILE_CHUNK (1 << 20)
 #define MAX_METHOD_LEN 32
 #define MAX_URI_LEN 4096
 #define MAX_PROTOCOL_LEN 32
-#define ITER_SLEEP_TIME 2000
+#define PIPELINE_FLUSH_SIZE 65536
+#define MAX_RANGES 16
+#define MODE_POOL 0
+#define MODE_EPOLL 1
+#define MODE_URING 2
+#define PRECOMPRESS_NONE 0
+#define PRECOMPRESS_STARTUP 1
+#define PRECOMPRESS_ONLY 2
+#define ETAG_STAT 0
+#define ETAG_CONTENT 1
+#define COMPRESS_MAX_FILE (4 << 20)
+#define COMPRESS_QUEUE_MAX 1024
+#define LOG_FORMAT_CLF 0
+#define LOG_FORMAT_COMBINED 1
+#define LOG_FORMAT_JSON 2
+#define QUEUE_INTERVAL 100
+#define SHED_RETRY_AFTER 1
 
 int server, client, SERVER_PORT, NUM_THREADS;
+int SERVER_MODE = MODE_EPOLL;
+int KEEPALIVE_TIMEOUT = 5, KEEPALIVE_MAX = 100;
+int HEADER_TIMEOUT = 10, SEND_TIMEOUT = 30, REQUEST_TIMEOUT = 0;
+size_t QUEUE_SIZE = 200;
+int QUEUE_TARGET = 5;
+size_t CACHE_SIZE = 64 << 20, CACHE_MAX_FILE = 256 << 10;
+size_t META_CACHE_ENTRIES = 65536;
+char *MIME_TYPES_FILE = NULL;
+size_t HEADER_SIZE_LIMIT = 8 << 10, BODY_SIZE_LIMIT = 64 << 10;
+int HEADER_COUNT_LIMIT = 100;
+int REUSEPORT = 0, PIN_CPUS = 0, STEERING = 0;
+int PRECOMPRESS = PRECOMPRESS_NONE;
+int BUNDLE = 0;
+char *PACK_PATH = NULL;
+int PREWARM = 0, PREWARM_WAIT = 100;
+size_t PREWARM_MAX = 256 << 10;
+char *PREWARM_LIST = NULL;
+int COMPRESS = 0, COMPRESS_LEVEL = 6, COMPRESS_THREADS = 0;
+size_t COMPRESS_MIN = 1024;
+int ETAG_MODE = ETAG_STAT;
+char *ACCESS_LOG = "-";
+int ACCESS_LOG_FORMAT = LOG_FORMAT_COMBINED;
+unsigned long long ACCESS_LOG_ROTATE_SIZE = 0;
+int ACCESS_LOG_ROTATE_SECS = 0;
+int VERBOSE = 0;
+char *METRICS_PATH = NULL;
 char SERVER_ROOT[4096];
 
+#include "cpu_steering.h"
+#include "options.h"
 #include "start_server.h"
+#include "memory_pool.h"
+#include "http_parser.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+#include "connection.h"
+#include "access_log.h"
 #include "handle_request.h"
 #include "thread_pool.h"
+#include "event_loop.h"
+#include "uring_loop.h"
+#include "precompress.h"
+#include "prewarm.h"
+#include "stats.h"
 
-int main(int argc, char const *argv[]) {
+int main(int argc, char *argv[]) {
 
   /**
-   *  Check argument count
+   *  Read --options, then check positional argument count
    */
-  if (argc < 3) {
-    puts("Usage: [thread count] [port] [directory]");
+  if (parse_options(argc, argv) < 0 || argc - optind < 3) {
+    print_usage();
     return 0;
   }
+  argv += optind - 1;
 
   NUM_THREADS = atoi(argv[1]);
   SERVER_PORT = atoi(argv[2]);
-  strcpy(SERVER_ROOT, argv[3]);
+  strncpy(SERVER_ROOT, argv[3], sizeof(SERVER_ROOT) - 1);
 
   /**
-   * Initialize mutex that blocks for socket_queue struct
+   * Writes to a client that hung up must not kill the server
    */
-  pthread_mutex_init(&lock_sq, NULL);
+  signal(SIGPIPE, SIG_IGN);
 
   /**
-   * Build mime type data
+   * Initialize the lock-free socket_queue
+   * @see socket_queue.h
+   */
+  if (socket_queue_init(&socket_queue, QUEUE_SIZE) < 0) {
+    perror("Could not allocate socket queue");
+    return EXIT_FAILURE;
+  }
+  admission_init();
+
+  /**
+   * MIME types are compiled in, optionally merge local overrides
    * @see mime_types.h
    */
-  assemble_mime_types();
+  if (MIME_TYPES_FILE != NULL) {
+    int overrides = load_mime_types(MIME_TYPES_FILE);
+    if (overrides < 0) return EXIT_FAILURE;
+    printf("Loaded %d MIME types from %s\n", overrides, MIME_TYPES_FILE);
+  }
+
+  /**
+   * Write compressed sidecars for text files, using every core
+   * @see precompress.h
+   */
+  if (PRECOMPRESS != PRECOMPRESS_NONE) {
+    if (precompress_tree(SERVER_ROOT, usable_cpus()) < 0) return EXIT_FAILURE;
+    if (PRECOMPRESS == PRECOMPRESS_ONLY) return EXIT_SUCCESS;
+  }
+
+  /**
+   * Compile the directory into one file to serve with --bundle, and exit
+   * @see site_bundle.h
+   */
+  if (PACK_PATH != NULL) {
+    return pack_site(SERVER_ROOT, PACK_PATH) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  /**
+   * Set up the hot file, directory listing and path metadata caches,
+   * SIGUSR1 prints their hit ratios
+   * @see file_cache.h
+   * @see serve_directory.h
+   * @see meta_cache.h
+   * @see stats.h
+   */
+  file_cache_init();
+  listing_cache_init();
+  start_stats_reporter();
+  meta_cache_init();
+
+  /**
+   * Crawl the root into the metadata cache and the page cache before
+   * accepting connections
+   * @see prewarm.h
+   */
+  if (PREWARM && BUNDLE) {
+    puts("Note: --prewarm has no effect with --bundle");
+  }else if (PREWARM && prewarm_root() < 0) {
+    return EXIT_FAILURE;
+  }
+  start_meta_cache();
+
+  /**
+   * Content tags for large files are worked out off the I/O threads
+   * @see validators.h
+   */
+  if (ETAG_MODE == ETAG_CONTENT && !BUNDLE) start_etag_hasher();
+
+  /**
+   * With --bundle the directory argument names a packed site, which is
+   * mapped rather than read, and swapped whenever it's replaced
+   * @see site_bundle.h
+   */
+  if (BUNDLE) {
+    if (start_bundle(SERVER_ROOT) < 0) return EXIT_FAILURE;
+    if (COMPRESS) puts("Note: --compress has no effect with --bundle, variants are packed");
+    COMPRESS = 0;
+  }
+
+  /**
+   * Request lines are formatted and written by their own thread, the
+   * I/O threads only hand entries over
+   * @see access_log.h
+   */
+  if (start_access_log() < 0) return EXIT_FAILURE;
 
   /**
-   *  Create worker threads
+   * Compression runs on its own threads, never on the I/O threads
+   * @see compress_pool.h
+   */
+  if (COMPRESS) {
+    int threads = start_compress_pool(COMPRESS_THREADS > 0 ? COMPRESS_THREADS : usable_cpus());
+    if (encoding_bound(ENCODING_GZIP, 1) + encoding_bound(ENCODING_BR, 1) + encoding_bound(ENCODING_ZSTD, 1) == 0) {
+      puts("Note: --compress has no effect, built without zlib, brotli or zstd");
+    }else{
+      printf("Compressing on the fly at level %d with %d threads\n", COMPRESS_LEVEL, threads);
+    }
+  }
+
+  /**
+   *  Start server: one shared listener, or one per worker thread
+   *  @see start_server.h
+   */
+  int server, client, servers[NUM_THREADS];
+  if (REUSEPORT) {
+    start_reuseport_servers(SERVER_PORT, NUM_THREADS, servers);
+    if (STEERING != STEER_NONE && steer_connections(servers, NUM_THREADS, STEERING) < 0) {
+      return EXIT_FAILURE;
+    }
+    if (STEERING == STEER_CBPF && NUM_THREADS != usable_cpus()) {
+      printf("Note: CBPF steering is exact only with one thread per CPU (%d)\n", usable_cpus());
+    }
+    server = -1;
+  }else{
+    if (STEERING != STEER_NONE) puts("Note: --steer has no effect without --reuseport");
+    server = start_server(SERVER_PORT, "/");
+    for (int i = 0; i < NUM_THREADS; ++i) servers[i] = server;
+  }
+
+  if (SERVER_MODE == MODE_URING && uring_probe() < 0) {
+    printf("Note: io_uring is unavailable (%s), serving with epoll\n", strerror(errno));
+    SERVER_MODE = MODE_EPOLL;
+  }
+
+  if (SERVER_MODE == MODE_EPOLL || SERVER_MODE == MODE_URING) {
+
+    /**
+     *  Hand the listening sockets to the event loops and wait on them
+     *  @see event_loop.h
+     *  @see uring_loop.h
+     */
+    event_loop_t loops[NUM_THREADS];
+    pthread_t loop_threads[NUM_THREADS];
+    if (SERVER_MODE == MODE_URING) {
+      if (start_uring_loops(servers, NUM_THREADS, loops, loop_threads) < 0) return EXIT_FAILURE;
+      printf("Serving with %d io_uring loops\n", NUM_THREADS);
+    }else{
+      if (start_event_loops(servers, NUM_THREADS, loops, loop_threads) < 0) return EXIT_FAILURE;
+      printf("Serving with %d event loops\n", NUM_THREADS);
+    }
+    for (int i = 0; i < NUM_THREADS; ++i) {
+      pthread_join(loop_threads[i], NULL);
+    }
+    return EXIT_SUCCESS;
+  }
+
+  /**
+   *  Start the thread that enforces the workers' deadlines, then the
+   *  workers
    */
   thread_data_t thread_data[NUM_THREADS];
   pthread_t thread[NUM_THREADS];
   int i, rc;
   for (i = 0; i < NUM_THREADS; ++i) {
     thread_data[i].tid = i;
+    atomic_init(&thread_data[i].available, 0);
+    thread_data[i].server = REUSEPORT ? servers[i] : -1;
+  }
+  pool_threads = thread_data; // Before any worker runs, a scrape may come at once
+  if (start_pool_timer(thread_data) < 0) return EXIT_FAILURE;
+  for (i = 0; i < NUM_THREADS; ++i) {
     if ((rc = pthread_create(&thread[i], NULL, worker_thread, &thread_data[i]))) {
       fprintf(stderr, "error: pthread_create, rc: %d\n", rc);
       return EXIT_FAILURE;
     }
+    if (PIN_CPUS) pin_thread(thread[i], i);
   }
 
   /**
-   *  Start server and listen forever
+   *  With --reuseport the workers accept for themselves
+   */
+  if (REUSEPORT) {
+    for (i = 0; i < NUM_THREADS; ++i) {
+      pthread_join(thread[i], NULL);
+    }
+    return EXIT_SUCCESS;
+  }
+
+  /**
+   *  Listen forever
    */
-  int server, client;
-  server = start_server(SERVER_PORT, "/");
   while (1) {
     struct sockaddr_in client_addr;
 
@@ -87,10 +301,14 @@ int main(int argc, char const *argv[]) {
     }
 
     /**
-     * Someone connected, add client socket to the socket queue
+     * Someone connected, add client socket to the socket queue.
+     * If it is full or standing, answer 503 right here.
      * @see thread_pool.h
+     * @see admission.h
      */
-    enqueue_socket(client);
+    if (enqueue_socket(client) < 0) {
+      shed_connection(client);
+    }
   }
 
   /**
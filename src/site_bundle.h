@@ -0,0 +1,746 @@
+#include <ftw.h>
+#include <sys/mman.h>
+
+#define BUNDLE_MAGIC    "SRVBNDL1"
+#define BUNDLE_VERSION  1
+#define BUNDLE_PAGE     4096  // Body alignment
+#define BUNDLE_CHECK_MS 1000  // How often the bundle file is checked for a replacement
+
+/**
+ * A bundle is one file: this header in the first page, then the bodies,
+ * then the hash index of request paths, the entries and the strings
+ * they point into. Offsets are from the start of the file, string
+ * offsets from the start of the strings.
+ */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_count;
+  uint32_t slot_count;      // Power of two
+  uint32_t reserved;
+  uint64_t slots_offset;    // Entry number + 1 per slot, 0 if the slot is empty
+  uint64_t entries_offset;
+  uint64_t strings_offset;
+  uint64_t strings_len;
+  uint64_t size;            // Of the whole file, to catch a truncated copy
+  int64_t built;
+} bundle_header_t;
+
+/**
+ * One representation of a path
+ */
+typedef struct {
+  uint64_t offset;
+  uint64_t size;
+  uint32_t etag;            // String, quoted
+  uint32_t headers;         // String, Content-Length through Accept-Ranges of a 200
+  uint32_t headers_len;
+  uint32_t reserved;
+} bundle_body_t;
+
+/**
+ * One request path: a file, or a directory as its index file or listing
+ */
+typedef struct {
+  uint64_t hash;            // Of path
+  uint32_t path;            // String, "/" or without a trailing slash
+  uint32_t mime_type;       // String
+  uint32_t variants;        // Compressed bodies, a mask of ENCODING_BIT()s
+  uint32_t reserved;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  bundle_body_t bodies[ENCODINGS];
+} bundle_entry_t;
+
+/**
+ * A mapped bundle. Responses hold a reference while they send from it,
+ * so a replaced bundle stays mapped until its last response is out.
+ */
+typedef struct {
+  atomic_int refs;
+  char *base;
+  size_t size;
+  struct stat file_info;
+  bundle_header_t *header;
+  uint32_t *slots;
+  bundle_entry_t *entries;
+  const char *strings;
+} bundle_t;
+
+bundle_t *bundle_current;
+pthread_mutex_t bundle_lock = PTHREAD_MUTEX_INITIALIZER;
+atomic_ulong bundle_reloads;
+
+/**
+ * Drop a reference to a bundle, unmapping it after the last one
+ * @param owner Bundle
+ */
+void bundle_release(void *owner) {
+  bundle_t *bundle = (bundle_t *)owner;
+  if (atomic_fetch_sub(&bundle->refs, 1) == 1) {
+    munmap(bundle->base, bundle->size);
+    free(bundle);
+  }
+}
+
+/**
+ * Take a reference to the bundle being served
+ * @return Bundle
+ */
+bundle_t *bundle_acquire() {
+  pthread_mutex_lock(&bundle_lock);
+  bundle_t *bundle = bundle_current;
+  atomic_fetch_add(&bundle->refs, 1);
+  pthread_mutex_unlock(&bundle_lock);
+  return bundle;
+}
+
+/**
+ * Map a bundle and check its header. The entries are only looked at
+ * when they are served, so this costs the same for any size of site.
+ * @param  path Bundle file
+ * @return Bundle with one reference, NULL with errno set on error
+ */
+bundle_t *bundle_open(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat file_info;
+  if (fd < 0) return NULL;
+  if (fstat(fd, &file_info) < 0 || (size_t)file_info.st_size < sizeof(bundle_header_t)) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  char *base = mmap(NULL, file_info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return NULL;
+
+  bundle_header_t *header = (bundle_header_t *)base;
+  uint64_t size = file_info.st_size;
+  uint64_t slots_end = header->slots_offset + (uint64_t)header->slot_count * sizeof(uint32_t);
+  uint64_t entries_end = header->entries_offset + (uint64_t)header->entry_count * sizeof(bundle_entry_t);
+  uint64_t strings_end = header->strings_offset + header->strings_len;
+  if (memcmp(header->magic, BUNDLE_MAGIC, 8) != 0 || header->version != BUNDLE_VERSION ||
+      header->size != size || header->slot_count == 0 ||
+      (header->slot_count & (header->slot_count - 1)) != 0 ||
+      header->slots_offset % 8 || slots_end > size ||
+      header->entries_offset % 8 || entries_end > size ||
+      header->strings_len == 0 || strings_end > size || base[strings_end - 1] != '\0') {
+    munmap(base, size);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  bundle_t *bundle = calloc(1, sizeof(bundle_t));
+  if (bundle == NULL) {
+    munmap(base, size);
+    return NULL;
+  }
+  atomic_init(&bundle->refs, 1);
+  bundle->base = base;
+  bundle->size = size;
+  bundle->file_info = file_info;
+  bundle->header = header;
+  bundle->slots = (uint32_t *)(base + header->slots_offset);
+  bundle->entries = (bundle_entry_t *)(base + header->entries_offset);
+  bundle->strings = base + header->strings_offset;
+  return bundle;
+}
+
+/**
+ * Find a path in a bundle's index
+ * @param  bundle Bundle
+ * @param  path   Request path, as bundle_path() leaves it
+ * @return Entry, NULL if the path isn't in the bundle
+ */
+bundle_entry_t *bundle_find(bundle_t *bundle, const char *path) {
+  uint64_t hash = file_cache_hash(path);
+  uint32_t mask = bundle->header->slot_count - 1;
+  uint32_t slot = hash & mask;
+  for (uint32_t probes = 0; probes <= mask; probes++, slot = (slot + 1) & mask) {
+    uint32_t n = bundle->slots[slot];
+    if (n == 0 || n > bundle->header->entry_count) return NULL;
+    bundle_entry_t *entry = &bundle->entries[n - 1];
+    if (entry->hash == hash && entry->path < bundle->header->strings_len &&
+        strcmp(bundle->strings + entry->path, path) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Does everything an entry points at lie inside the bundle?
+ * @param bundle Bundle
+ * @param entry  Entry
+ */
+int bundle_entry_valid(bundle_t *bundle, bundle_entry_t *entry) {
+  uint64_t strings_len = bundle->header->strings_len;
+  if (entry->mime_type >= strings_len) return 0;
+  for (int e = 0; e < ENCODINGS; e++) {
+    if (e != ENCODING_IDENTITY && !(entry->variants & ENCODING_BIT(e))) continue;
+    bundle_body_t *body = &entry->bodies[e];
+    if (body->offset > bundle->size || body->size > bundle->size - body->offset ||
+        body->etag >= strings_len || (uint64_t)body->headers + body->headers_len > strings_len) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Spell a request path the way the bundle index does: one slash
+ * between segments and none at the end, so "/docs/" finds "/docs"
+ * @param path Decoded request path, rewritten in place
+ */
+void bundle_path(char path[]) {
+  char *out = path;
+  for (char *p = path; *p; p++) {
+    if (*p == '/' && out > path && out[-1] == '/') continue;
+    *out++ = *p;
+  }
+  if (out - path > 1 && out[-1] == '/') out--;
+  *out = '\0';
+}
+
+/**
+ * Serve a request from the bundle. The body is sent straight out of
+ * the mapping, behind headers that were written when it was packed.
+ * @param conn Client connection
+ * @param path Decoded request path
+ */
+void serve_bundle(connection_t *conn, char path[]) {
+  bundle_t *bundle = bundle_acquire();
+  bundle_path(path);
+  bundle_entry_t *entry = bundle_find(bundle, path);
+  if (entry == NULL || !bundle_entry_valid(bundle, entry)) {
+    bundle_release(bundle);
+    send_http_error(conn, 404);
+    return;
+  }
+
+  const char *mime_type = bundle->strings + entry->mime_type;
+  int on_the_fly;
+  int encoding = pick_encoding(conn, mime_type, entry->bodies[ENCODING_IDENTITY].size,
+    entry->variants, &on_the_fly);
+  bundle_body_t *body = &entry->bodies[encoding];
+  const char *etag = bundle->strings + body->etag;
+  struct timespec mtime = { entry->mtime_sec, entry->mtime_nsec };
+  if (serve_not_modified(conn, etag, &mtime, mime_type)) {
+    bundle_release(bundle);
+    return;
+  }
+
+  /**
+   * Only a range request needs its headers worked out
+   * @see serve_file.h
+   */
+  if (http_find_header(conn->in, &conn->request, "Range") != NULL) {
+    send_file_body(conn, body->size, mime_type, encoding, &mtime, etag,
+      bundle->base + body->offset, bundle_release, bundle, -1);
+    return;
+  }
+  send_http_status(conn, 200);
+  conn_append(conn, bundle->strings + body->headers, body->headers_len);
+  send_connection_header(conn);
+  conn_append(conn, "\r\n", 2);
+  conn_send_memory(conn, bundle->base + body->offset, body->size, bundle_release, bundle);
+}
+
+/**
+ * Swap in the bundle file whenever it is replaced, so a deploy is a
+ * rename() over it. Responses in flight finish from the old mapping.
+ * @param arg Bundle file
+ */
+void *bundle_watcher(void *arg) {
+  const char *path = (const char *)arg;
+  struct stat failed;
+  memset(&failed, 0, sizeof(failed));
+  while (1) {
+    usleep(BUNDLE_CHECK_MS * 1000);
+    struct stat file_info;
+    if (stat(path, &file_info) < 0) continue;
+    struct stat *current = &bundle_current->file_info;
+    if (file_info.st_ino == current->st_ino && file_info.st_dev == current->st_dev &&
+        file_info.st_size == current->st_size &&
+        file_info.st_mtim.tv_sec == current->st_mtim.tv_sec &&
+        file_info.st_mtim.tv_nsec == current->st_mtim.tv_nsec) {
+      continue;
+    }
+
+    /**
+     * A broken replacement is reported once, the old bundle is kept
+     */
+    bundle_t *bundle = bundle_open(path);
+    if (bundle == NULL) {
+      if (file_info.st_ino != failed.st_ino || file_info.st_size != failed.st_size ||
+          file_info.st_mtim.tv_sec != failed.st_mtim.tv_sec) {
+        fprintf(stderr, "Could not reload bundle %s: %s\n", path, strerror(errno));
+      }
+      failed = file_info;
+      continue;
+    }
+    pthread_mutex_lock(&bundle_lock);
+    bundle_t *old = bundle_current;
+    bundle_current = bundle;
+    pthread_mutex_unlock(&bundle_lock);
+    bundle_release(old);
+    atomic_fetch_add(&bundle_reloads, 1);
+    printf("Reloaded bundle %s: %u paths\n", path, bundle->header->entry_count);
+  }
+  return NULL;
+}
+
+/**
+ * Map the bundle to serve and start watching it for replacements
+ * @param  path Bundle file
+ * @return 0 on success, -1 if it isn't a readable bundle
+ */
+int start_bundle(const char *path) {
+  if ((bundle_current = bundle_open(path)) == NULL) {
+    fprintf(stderr, "Could not open bundle %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  printf("Serving %u paths from bundle %s\n", bundle_current->header->entry_count, path);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, bundle_watcher, (void *)path) == 0) {
+    pthread_detach(thread);
+  }else{
+    perror("Note: bundle replacements won't be picked up");
+  }
+  return 0;
+}
+
+/**
+ * Print the bundle's size and how often it was replaced
+ * @param out Stream
+ */
+void bundle_report(FILE *out) {
+  if (bundle_current == NULL) return;
+  bundle_t *bundle = bundle_acquire();
+  fprintf(out, "Bundle: %u paths, %zu KB, %lu reloads\n",
+    bundle->header->entry_count, bundle->size >> 10, atomic_load(&bundle_reloads));
+  bundle_release(bundle);
+}
+
+/**
+ * A bundle being written
+ */
+typedef struct {
+  int fd;
+  uint64_t end;               // Past the last body written
+  bundle_header_t header;
+  uint32_t *slots;
+  bundle_entry_t *entries;
+  uint32_t entry_cap;
+  char *strings;
+  size_t strings_cap;
+  char **files;               // Collected by the walk
+  size_t file_count, file_cap;
+  char **dirs;
+  size_t dir_count, dir_cap;
+  unsigned long long bytes, variants;
+} bundle_pack_t;
+
+/**
+ * nftw() has no argument for its callback
+ */
+bundle_pack_t *bundle_packing;
+
+/**
+ * Append a path to a growing list
+ * @return 0 on success, -1 if out of memory
+ */
+int path_list_add(char ***list, size_t *count, size_t *cap, const char *path) {
+  if (*count == *cap) {
+    size_t grown_cap = *cap ? *cap * 2 : 256;
+    char **grown = realloc(*list, sizeof(char *) * grown_cap);
+    if (grown == NULL) return -1;
+    *list = grown;
+    *cap = grown_cap;
+  }
+  if (((*list)[*count] = strdup(path)) == NULL) return -1;
+  (*count)++;
+  return 0;
+}
+
+/**
+ * nftw() callback: note every regular file and readable directory.
+ * Symlinks are followed, as they are when the tree is served.
+ */
+int pack_collect(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  bundle_pack_t *pack = bundle_packing;
+  if (type == FTW_F && S_ISREG(st->st_mode)) {
+    return path_list_add(&pack->files, &pack->file_count, &pack->file_cap, path);
+  }
+  if (type == FTW_D) {
+    return path_list_add(&pack->dirs, &pack->dir_count, &pack->dir_cap, path);
+  }
+  return 0;
+}
+
+/**
+ * Write all of a buffer at an offset
+ * @return 0 on success, -1 on error
+ */
+int pack_write(bundle_pack_t *pack, const void *data, size_t len, uint64_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pwrite(pack->fd, (const char *)data + done, len - done, offset + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    done += n;
+  }
+  return 0;
+}
+
+/**
+ * Add a NUL terminated string
+ * @return Its offset, 0 if out of memory (the first string is never added here)
+ */
+uint32_t pack_string(bundle_pack_t *pack, const char *s, size_t len) {
+  if (pack->header.strings_len + len + 1 > pack->strings_cap) {
+    size_t cap = pack->strings_cap ? pack->strings_cap * 2 : 65536;
+    while (cap < pack->header.strings_len + len + 1) cap *= 2;
+    char *grown = realloc(pack->strings, cap);
+    if (grown == NULL) return 0;
+    pack->strings = grown;
+    pack->strings_cap = cap;
+  }
+  uint32_t offset = pack->header.strings_len;
+  memcpy(pack->strings + offset, s, len);
+  pack->strings[offset + len] = '\0';
+  pack->header.strings_len += len + 1;
+  return offset;
+}
+
+/**
+ * The bundle so far, to look paths up in while it's being written
+ */
+bundle_t pack_view(bundle_pack_t *pack) {
+  bundle_t view;
+  memset(&view, 0, sizeof(view));
+  view.header = &pack->header;
+  view.slots = pack->slots;
+  view.entries = pack->entries;
+  view.strings = pack->strings;
+  return view;
+}
+
+/**
+ * Add an entry for a request path and index it
+ * @param  pack      Bundle being written
+ * @param  path      Request path
+ * @param  mime_type Content-Type
+ * @param  mtime     Modification time
+ * @return Entry number, -1 if out of memory
+ */
+int pack_entry(bundle_pack_t *pack, const char *path, const char *mime_type, struct timespec *mtime) {
+  if (pack->header.entry_count == pack->entry_cap) {
+    uint32_t cap = pack->entry_cap ? pack->entry_cap * 2 : 256;
+    bundle_entry_t *grown = realloc(pack->entries, sizeof(bundle_entry_t) * cap);
+    if (grown == NULL) return -1;
+    pack->entries = grown;
+    pack->entry_cap = cap;
+  }
+  int n = pack->header.entry_count;
+  bundle_entry_t *entry = &pack->entries[n];
+  memset(entry, 0, sizeof(*entry));
+  entry->hash = file_cache_hash(path);
+  entry->path = pack_string(pack, path, strlen(path));
+  entry->mime_type = pack_string(pack, mime_type, strlen(mime_type));
+  entry->mtime_sec = mtime->tv_sec;
+  entry->mtime_nsec = mtime->tv_nsec;
+  if (entry->path == 0 || entry->mime_type == 0) return -1;
+
+  uint32_t mask = pack->header.slot_count - 1, slot = entry->hash & mask;
+  while (pack->slots[slot]) slot = (slot + 1) & mask;
+  pack->slots[slot] = n + 1;
+  pack->header.entry_count++;
+  return n;
+}
+
+/**
+ * Write one body of an entry, with its entity tag and 200 headers.
+ * A body of a page or more starts on a page; a smaller one is placed so
+ * that it doesn't straddle two, so sending it touches a single page.
+ * @param  pack     Bundle being written
+ * @param  n        Entry number
+ * @param  encoding Content coding of the body
+ * @param  data     Body
+ * @param  len      Length of the body
+ * @param  hash     Content hash of the identity body, for the entity tag
+ * @return 0 on success, -1 on error
+ */
+int pack_body(bundle_pack_t *pack, int n, int encoding, const char *data, size_t len, uint64_t hash) {
+  uint64_t offset = pack->end;
+  if (len >= BUNDLE_PAGE || offset / BUNDLE_PAGE != (offset + len - 1) / BUNDLE_PAGE) {
+    offset = (offset + BUNDLE_PAGE - 1) & ~(uint64_t)(BUNDLE_PAGE - 1);
+  }
+  if (pack_write(pack, data, len, offset) < 0) return -1;
+  pack->end = offset + len;
+  pack->bytes += len;
+
+  /**
+   * The tag is the one --etag=content gives the same file
+   * @see validators.h
+   */
+  bundle_entry_t *entry = &pack->entries[n];
+  const char *mime_type = pack->strings + entry->mime_type;
+  char etag[ETAG_LEN], date[32], headers[1024];
+  int etag_len = snprintf(etag, ETAG_LEN, "\"%016llx", (unsigned long long)hash);
+  if (encoding != ENCODING_IDENTITY) {
+    etag_len += snprintf(etag + etag_len, ETAG_LEN - etag_len, "-%s", encodings[encoding].name);
+  }
+  etag_len += snprintf(etag + etag_len, ETAG_LEN - etag_len, "\"");
+  format_http_date(date, entry->mtime_sec);
+
+  /**
+   * The same headers send_file_body() stages for a 200
+   * @see serve_file.h
+   */
+  int headers_len = snprintf(headers, sizeof(headers), "Content-Length: %zu\r\nContent-Type: %.254s\r\n", len, mime_type);
+  if (encoding != ENCODING_IDENTITY) {
+    headers_len += snprintf(headers + headers_len, sizeof(headers) - headers_len,
+      "Content-Encoding: %s\r\n", encodings[encoding].name);
+  }
+  if (mime_compressible(mime_type)) {
+    headers_len += snprintf(headers + headers_len, sizeof(headers) - headers_len, "Vary: Accept-Encoding\r\n");
+  }
+  headers_len += snprintf(headers + headers_len, sizeof(headers) - headers_len,
+    "ETag: %s\r\nLast-Modified: %s\r\n", etag, date);
+  if (encoding == ENCODING_IDENTITY) {
+    headers_len += snprintf(headers + headers_len, sizeof(headers) - headers_len, "Accept-Ranges: bytes\r\n");
+  }
+
+  uint32_t etag_offset = pack_string(pack, etag, etag_len);
+  uint32_t headers_offset = pack_string(pack, headers, headers_len);
+  if (etag_offset == 0 || headers_offset == 0) return -1;
+  entry = &pack->entries[n];
+  bundle_body_t *body = &entry->bodies[encoding];
+  body->offset = offset;
+  body->size = len;
+  body->etag = etag_offset;
+  body->headers = headers_offset;
+  body->headers_len = headers_len;
+  if (encoding != ENCODING_IDENTITY) {
+    entry->variants |= ENCODING_BIT(encoding);
+    pack->variants++;
+  }
+  return 0;
+}
+
+/**
+ * FNV-1a hash of a body
+ */
+uint64_t pack_hash(const char *data, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * Map a whole file for reading
+ * @param  path File
+ * @param  size Set to its size
+ * @return Its bytes, "" for an empty file, NULL on error
+ */
+char *pack_map(const char *path, size_t *size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+  *size = st.st_size;
+  char *data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : (char *)"";
+  close(fd);
+  return data == MAP_FAILED ? NULL : data;
+}
+
+/**
+ * Add a file with the sidecars that are fresh and smaller, as they
+ * would be served from the tree. --precompress writes them first.
+ * @param  pack Bundle being written
+ * @param  path File
+ * @param  rel  Request path
+ * @return 0 on success, -1 on error
+ */
+int pack_file(bundle_pack_t *pack, const char *path, const char *rel) {
+  struct stat file_info;
+  size_t size;
+  if (stat(path, &file_info) < 0) return -1;
+  char *data = pack_map(path, &size);
+  if (data == NULL) return -1;
+
+  const char *mime_type = file_mime_type((char *)path);
+  int n = pack_entry(pack, rel, mime_type, &file_info.st_mtim);
+  uint64_t hash = pack_hash(data, size);
+  int failed = n < 0 || pack_body(pack, n, ENCODING_IDENTITY, data, size, hash) < 0;
+  if (size) munmap(data, size);
+
+  for (int e = 1; e < ENCODINGS && !failed && mime_compressible(mime_type); e++) {
+    char sidecar[strlen(path) + strlen(encodings[e].suffix) + 1];
+    sprintf(sidecar, "%s%s", path, encodings[e].suffix);
+    struct stat sidecar_info;
+    size_t sidecar_size;
+    if (stat(sidecar, &sidecar_info) < 0 || !S_ISREG(sidecar_info.st_mode) ||
+        !file_newer_or_same(&sidecar_info, &file_info) || (size_t)sidecar_info.st_size >= size) {
+      continue;
+    }
+    char *compressed = pack_map(sidecar, &sidecar_size);
+    if (compressed == NULL) continue;
+    failed = pack_body(pack, n, e, compressed, sidecar_size, hash) < 0;
+    if (sidecar_size) munmap(compressed, sidecar_size);
+  }
+  return failed ? -1 : 0;
+}
+
+/**
+ * Add a directory: its index file's entry under the directory's path,
+ * or else its listing, rendered now and compressed into every coding
+ * this build supports
+ * @param  pack Bundle being written
+ * @param  path Directory
+ * @param  rel  Request path
+ * @return 0 on success, -1 on error
+ * @see serve_directory.h
+ */
+int pack_directory(bundle_pack_t *pack, const char *path, const char *rel) {
+  char index_path[strlen(rel) + strlen(INDEX_FILE) + 2];
+  sprintf(index_path, "%s/%s", strcmp(rel, "/") == 0 ? "" : rel, INDEX_FILE);
+  bundle_t view = pack_view(pack);
+  bundle_entry_t *index = bundle_find(&view, index_path);
+  if (index != NULL) {
+    bundle_entry_t copy = *index;
+    struct timespec mtime = { copy.mtime_sec, copy.mtime_nsec };
+    int n = pack_entry(pack, rel, pack->strings + copy.mime_type, &mtime);
+    if (n < 0) return -1;
+    copy.hash = pack->entries[n].hash;
+    copy.path = pack->entries[n].path;
+    pack->entries[n] = copy;
+    return 0;
+  }
+
+  /**
+   * Links in a listing are made relative to SERVER_ROOT, from the path
+   * the directory was requested by
+   */
+  struct stat file_info;
+  if (stat(path, &file_info) < 0) return -1;
+  listing_t listing;
+  memset(&listing, 0, sizeof(listing));
+  listing.wd = -1;
+  if (asprintf(&listing.path, "%s%s", SERVER_ROOT, rel) < 0) return -1;
+  listing_body_t *body = listing_rescan(&listing) < 0 ? NULL : listing_render(&listing);
+  listing_free(&listing);
+  if (body == NULL) return -1;
+
+  int n = pack_entry(pack, rel, "text/html", &file_info.st_mtim);
+  uint64_t hash = pack_hash(body->data, body->len);
+  int failed = n < 0 || pack_body(pack, n, ENCODING_IDENTITY, body->data, body->len, hash) < 0;
+  for (int e = 1; e < ENCODINGS && !failed; e++) {
+    size_t bound = encoding_bound(e, body->len);
+    char *out = bound ? malloc(bound) : NULL;
+    if (out == NULL) continue;
+    ssize_t len = encode_buffer(e, 9, body->data, body->len, out, bound);
+    if (len > 0 && (size_t)len < body->len) failed = pack_body(pack, n, e, out, len, hash) < 0;
+    free(out);
+  }
+  listing_body_release(body);
+  return failed ? -1 : 0;
+}
+
+/**
+ * Compile a directory into a bundle. It's written next to out and
+ * renamed over it, so a server watching out switches over in one step.
+ * @param  root Directory
+ * @param  out  Bundle file
+ * @return 0 on success, -1 on error
+ */
+int pack_site(const char *root, const char *out) {
+  bundle_pack_t pack;
+  memset(&pack, 0, sizeof(pack));
+  bundle_packing = &pack;
+  long long start = now_ms();
+  if (nftw(root, pack_collect, 64, 0) != 0) {
+    perror("Could not walk server root");
+    return -1;
+  }
+
+  /**
+   * Half the slots stay empty, so a miss ends after a probe or two
+   */
+  pack.header.slot_count = 16;
+  while (pack.header.slot_count < (pack.file_count + pack.dir_count) * 2) pack.header.slot_count *= 2;
+  pack.slots = calloc(pack.header.slot_count, sizeof(uint32_t));
+  pack.header.strings_len = 1;
+  pack.strings = calloc(1, 1);
+  pack.strings_cap = 1;
+
+  char tmp[strlen(out) + 32];
+  snprintf(tmp, sizeof(tmp), "%s.tmp%d", out, (int)getpid());
+  pack.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  int failed = pack.fd < 0 || pack.slots == NULL || pack.strings == NULL;
+  if (failed) perror("Could not create bundle");
+  pack.end = BUNDLE_PAGE;
+
+  /**
+   * Files go first, so each directory can find its index file
+   */
+  size_t root_len = strlen(root);
+  for (size_t i = 0; i < pack.file_count + pack.dir_count && !failed; i++) {
+    const char *path = i < pack.file_count ? pack.files[i] : pack.dirs[i - pack.file_count];
+    char rel[strlen(path) + 2];
+    snprintf(rel, sizeof(rel), "/%s", path + root_len);
+    bundle_path(rel);
+    int status = i < pack.file_count ? pack_file(&pack, path, rel) : pack_directory(&pack, path, rel);
+    if (status < 0) {
+      fprintf(stderr, "Could not pack %s: %s\n", path, strerror(errno));
+      failed = 1;
+    }
+  }
+
+  /**
+   * Then the index and entries after the bodies, and the header last
+   */
+  if (!failed) {
+    bundle_header_t *header = &pack.header;
+    memcpy(header->magic, BUNDLE_MAGIC, 8);
+    header->version = BUNDLE_VERSION;
+    header->slots_offset = (pack.end + 7) & ~7ULL;
+    header->entries_offset = header->slots_offset + (uint64_t)header->slot_count * sizeof(uint32_t);
+    header->strings_offset = header->entries_offset + (uint64_t)header->entry_count * sizeof(bundle_entry_t);
+    header->size = header->strings_offset + header->strings_len;
+    header->built = time(NULL);
+    failed = pack_write(&pack, pack.slots, header->slot_count * sizeof(uint32_t), header->slots_offset) < 0 ||
+      pack_write(&pack, pack.entries, header->entry_count * sizeof(bundle_entry_t), header->entries_offset) < 0 ||
+      pack_write(&pack, pack.strings, header->strings_len, header->strings_offset) < 0 ||
+      pack_write(&pack, header, sizeof(*header), 0) < 0 ||
+      fsync(pack.fd) < 0;
+    if (failed) perror("Could not write bundle");
+  }
+  if (pack.fd > -1 && close(pack.fd) < 0) failed = 1;
+  if (!failed && rename(tmp, out) < 0) {
+    perror("Could not move bundle into place");
+    failed = 1;
+  }
+  if (failed && pack.fd > -1) unlink(tmp);
+
+  if (!failed) {
+    printf("Packed %u paths (%zu files, %llu compressed variants) into %s in %lld ms: %llu KB of bodies, %llu KB in all\n",
+      pack.header.entry_count, pack.file_count, pack.variants, out, now_ms() - start,
+      pack.bytes >> 10, (unsigned long long)pack.header.size >> 10);
+  }
+  for (size_t i = 0; i < pack.file_count; i++) free(pack.files[i]);
+  for (size_t i = 0; i < pack.dir_count; i++) free(pack.dirs[i]);
+  free(pack.files);
+  free(pack.dirs);
+  free(pack.slots);
+  free(pack.entries);
+  free(pack.strings);
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,188 @@
+#include <stdatomic.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define QUEUE_SPIN_MIN 16
+#define QUEUE_SPIN_MAX 4096
+#define CACHE_LINE 64
+
+/**
+ * Bounded lock-free multi-producer multi-consumer queue of sockets
+ * (Dmitry Vyukov's array queue). Each cell's sequence number tells a
+ * producer or consumer whether it is that cell's turn, so the only
+ * shared writes are one CAS per operation on enqueue_pos or dequeue_pos.
+ *
+ * Consumers that find it empty spin briefly, then park on a futex.
+ * Producers wake exactly one parked consumer, and only when there is one.
+ */
+typedef struct _socket_cell_t {
+  atomic_size_t sequence;
+  int client;
+  long long stamp;  // Caller's timestamp, handed over with the socket
+} socket_cell_t;
+
+typedef struct socket_queue_t {
+  socket_cell_t *cells;
+  size_t mask;
+  int spin;
+  _Alignas(CACHE_LINE) atomic_size_t enqueue_pos;
+  _Alignas(CACHE_LINE) atomic_size_t dequeue_pos;
+  _Alignas(CACHE_LINE) atomic_uint wake_seq;
+  atomic_int sleepers;
+} socket_queue_t;
+
+/**
+ * Per-thread spin budget, grows while spinning pays off and shrinks
+ * while it doesn't
+ */
+__thread int queue_spin_limit = QUEUE_SPIN_MIN;
+
+/**
+ * Tell the CPU we are busy-waiting
+ */
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * Initialize a queue
+ * @param  queue    Queue
+ * @param  capacity Minimum capacity, rounded up to a power of two
+ * @return 0 on success, -1 if out of memory
+ */
+int socket_queue_init(socket_queue_t *queue, size_t capacity) {
+  size_t size = 2;
+  while (size < capacity) size <<= 1;
+  queue->cells = malloc(sizeof(socket_cell_t) * size);
+  if (queue->cells == NULL) return -1;
+  for (size_t i = 0; i < size; i++) {
+    atomic_init(&queue->cells[i].sequence, i);
+  }
+  queue->mask = size - 1;
+
+  /**
+   * Spinning only helps when a producer can run at the same time
+   */
+  queue->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+  atomic_init(&queue->enqueue_pos, 0);
+  atomic_init(&queue->dequeue_pos, 0);
+  atomic_init(&queue->wake_seq, 0);
+  atomic_init(&queue->sleepers, 0);
+  return 0;
+}
+
+/**
+ * Add a socket to the queue and wake one parked consumer
+ * @param  queue  Queue
+ * @param  client Client socket
+ * @param  stamp  Handed to the consumer along with the socket
+ * @return 0 on success, -1 if the queue is full
+ */
+int socket_queue_push(socket_queue_t *queue, int client, long long stamp) {
+  socket_cell_t *cell;
+  size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+  while (1) {
+    cell = &queue->cells[pos & queue->mask];
+    size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+          memory_order_relaxed, memory_order_relaxed)) break;
+    }else if (diff < 0) {
+      return -1;
+    }else{
+      pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    }
+  }
+  cell->client = client;
+  cell->stamp = stamp;
+  atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+
+  /**
+   * Pairs with the sleepers increment in socket_queue_pop_wait(): either
+   * the consumer sees our item on its re-check, or we see it parked
+   */
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&queue->sleepers, memory_order_relaxed) > 0) {
+    atomic_fetch_add_explicit(&queue->wake_seq, 1, memory_order_release);
+    syscall(SYS_futex, &queue->wake_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+  return 0;
+}
+
+/**
+ * Take a socket from the queue without waiting
+ * @param  queue  Queue
+ * @param  client Set to the client socket
+ * @param  stamp  Set to the stamp it was pushed with
+ * @return 1 if a socket was taken, 0 if the queue is empty
+ */
+int socket_queue_pop(socket_queue_t *queue, int *client, long long *stamp) {
+  socket_cell_t *cell;
+  size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+  while (1) {
+    cell = &queue->cells[pos & queue->mask];
+    size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+          memory_order_relaxed, memory_order_relaxed)) break;
+    }else if (diff < 0) {
+      return 0;
+    }else{
+      pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    }
+  }
+  *client = cell->client;
+  *stamp = cell->stamp;
+  atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+  return 1;
+}
+
+/**
+ * Take a socket from the queue, spinning briefly and then sleeping
+ * until one arrives
+ * @param  queue Queue
+ * @param  stamp Set to the stamp it was pushed with
+ * @return Client socket
+ */
+int socket_queue_pop_wait(socket_queue_t *queue, long long *stamp) {
+  int client;
+  while (1) {
+    for (int i = 0; queue->spin && i < queue_spin_limit; i++) {
+      if (socket_queue_pop(queue, &client, stamp)) {
+        if (queue_spin_limit < QUEUE_SPIN_MAX) queue_spin_limit <<= 1;
+        return client;
+      }
+      cpu_relax();
+    }
+    if (queue_spin_limit > QUEUE_SPIN_MIN) queue_spin_limit >>= 1;
+
+    /**
+     * Announce ourselves, re-check, then park until a producer bumps
+     * wake_seq. A bump between the load and the wait makes it return.
+     */
+    unsigned int seq = atomic_load_explicit(&queue->wake_seq, memory_order_acquire);
+    atomic_fetch_add_explicit(&queue->sleepers, 1, memory_order_seq_cst);
+    if (socket_queue_pop(queue, &client, stamp)) {
+      atomic_fetch_sub_explicit(&queue->sleepers, 1, memory_order_relaxed);
+      return client;
+    }
+    syscall(SYS_futex, &queue->wake_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+    atomic_fetch_sub_explicit(&queue->sleepers, 1, memory_order_relaxed);
+  }
+}
+
+/**
+ * Approximate number of queued sockets
+ * @param queue Queue
+ */
+size_t socket_queue_depth(socket_queue_t *queue) {
+  size_t tail = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+  return tail > head ? tail - head : 0;
+}
@@ -1,16 +1,22 @@
-int start_server(int port, char path[]) {
+#include <netinet/tcp.h>
+
+/**
+ * Create a listening socket bound to port. Every listener sets
+ * SO_REUSEPORT, so several can share the port.
+ * @param  port Port to listen on
+ * @return Listening socket
+ */
+int create_listener(int port) {
   int server;
   struct sockaddr_in serv_addr;
 
-  puts("Starting server...");
-
   /**
    *  Fill the sockaddr_in struct
    */
   memset(&serv_addr, 0, sizeof(serv_addr));
   serv_addr.sin_family      = PF_INET;
   serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  serv_addr.sin_port        = htons(SERVER_PORT);
+  serv_addr.sin_port        = htons(port);
 
   /**
    *  Create a socket
@@ -22,52 +28,49 @@ int start_server(int port, char path[]) {
   }
 
   /**
-   *  Assign socket address
+   *  Make the address reusable, before bind() so it takes effect
    */
-  if (bind(server, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+  if (setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
     errno = 13;
-    perror("Could not bind to socket");
+    perror("Could not make address reusable");
     exit(EXIT_FAILURE);
   }
 
   /**
-   * Fill in local address
+   *  Make the port reusable
    */
-  socklen_t sa_len = sizeof(struct sockaddr_in);
-  getsockname(
-    server,
-    (struct sockaddr*) &serv_addr,
-    &sa_len
-  );
-
-  puts("Socket created");
+  if (setsockopt(server, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0) {
+    errno = 13;
+    perror("Could not make port reusable");
+    exit(EXIT_FAILURE);
+  }
 
   /**
-   * Begin listening, allow up to 1024 pending connections
+   *  Assign socket address
    */
-  if (listen(server, 1024) < 0) {
+  if (bind(server, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
     errno = 13;
-    perror("Could not make socket listen");
+    perror("Could not bind to socket");
     exit(EXIT_FAILURE);
   }
 
-  printf("Listening on port %i\n", ntohs(serv_addr.sin_port));
-
   /**
-   *  Make the address reusable
+   * A pool worker blocks on its client from the moment it takes it, so
+   * there, have the kernel hold back connections until a request starts
+   * arriving. Clients that connect and send nothing then never reach a
+   * worker.
    */
-  if (setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
-    errno = 13;
-    perror("Could not make address reusable");
-    exit(EXIT_FAILURE);
+  if (SERVER_MODE == MODE_POOL && HEADER_TIMEOUT > 0 &&
+      setsockopt(server, IPPROTO_TCP, TCP_DEFER_ACCEPT, &HEADER_TIMEOUT, sizeof(int)) < 0) {
+    perror("Note: could not defer accepting connections until they send");
   }
 
   /**
-   *  Make the port reusable
+   * Begin listening, allow up to 1024 pending connections
    */
-  if (setsockopt(server, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0) {
+  if (listen(server, 1024) < 0) {
     errno = 13;
-    perror("Could not make port reusable");
+    perror("Could not make socket listen");
     exit(EXIT_FAILURE);
   }
 
@@ -76,3 +79,42 @@ int start_server(int port, char path[]) {
    */
   return server;
 }
+
+/**
+ * Print the port a listener ended up on
+ * @param server Listening socket
+ */
+void print_listening_port(int server) {
+  struct sockaddr_in serv_addr;
+  socklen_t sa_len = sizeof(struct sockaddr_in);
+  getsockname(
+    server,
+    (struct sockaddr*) &serv_addr,
+    &sa_len
+  );
+  printf("Listening on port %i\n", ntohs(serv_addr.sin_port));
+}
+
+int start_server(int port, char path[]) {
+  puts("Starting server...");
+  int server = create_listener(port);
+  puts("Socket created");
+  print_listening_port(server);
+  return server;
+}
+
+/**
+ * Open one listener per worker on the same port. They are bound in
+ * order, so listener i is index i of the kernel's reuseport group.
+ * @param port    Port to listen on
+ * @param count   Number of listeners
+ * @param servers Filled with count listening sockets
+ */
+void start_reuseport_servers(int port, int count, int servers[]) {
+  puts("Starting server...");
+  for (int i = 0; i < count; i++) {
+    servers[i] = create_listener(port);
+  }
+  printf("Created %d SO_REUSEPORT listeners\n", count);
+  print_listening_port(servers[0]);
+}
@@ -0,0 +1,204 @@
+/**
+ * Histograms as exported, in the order of the HIST_* numbers
+ * @see metrics.h
+ */
+const struct {
+  const char *name;
+  const char *label;
+  const char *help;
+} histogram_info[HISTOGRAMS] = {
+  { "servette_queue_wait_seconds", "queue", "Time from accept to a pool worker taking the connection" },
+  { "servette_request_read_seconds", "read", "Time from the first byte of a request to having parsed it" },
+  { "servette_stat_seconds", "stat", "Time resolving a request path on disk" },
+  { "servette_first_byte_seconds", "first byte", "Time from the first byte of a request to the first byte of its response" },
+  { "servette_last_byte_seconds", "last byte", "Time from the first byte of a request to the last byte of its response" },
+};
+
+/**
+ * Print request counts and latency percentiles
+ * @param out Stream
+ */
+void metrics_report(FILE *out) {
+  unsigned long long requests = metrics_total(offsetof(thread_metrics_t, requests));
+  unsigned long long sent = metrics_total(offsetof(thread_metrics_t, bytes_sent));
+  fprintf(out, "Requests: %llu, %llu KB sent, latency p50/p99/p99.9 in us:", requests, sent >> 10);
+  for (int i = 0; i < HISTOGRAMS; i++) {
+    histogram_t h;
+    metrics_histogram(i, &h);
+    if (h.count == 0) continue;
+    fprintf(out, " %s %llu/%llu/%llu", histogram_info[i].label, histogram_quantile(&h, 0.5),
+      histogram_quantile(&h, 0.99), histogram_quantile(&h, 0.999));
+  }
+  fputc('\n', out);
+}
+
+/**
+ * Print one counter or gauge in the Prometheus text format
+ * @param out   Stream
+ * @param name  Metric name
+ * @param type  counter or gauge
+ * @param help  Description
+ * @param value Value
+ */
+void prometheus_metric(FILE *out, const char *name, const char *type, const char *help, unsigned long long value) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name, value);
+}
+
+/**
+ * Print one histogram in the Prometheus text format, with power of two
+ * bounds from 1us to 32s. They fall on bucket edges, so are exact.
+ * @param out       Stream
+ * @param histogram HIST_*
+ */
+void prometheus_histogram(FILE *out, int histogram) {
+  const char *name = histogram_info[histogram].name;
+  histogram_t h;
+  metrics_histogram(histogram, &h);
+  fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_info[histogram].help, name);
+  unsigned long long cumulative = 0;
+  int i = 0;
+  for (int bits = 0; bits <= 25; bits++) {
+    int edge = histogram_index(1ULL << bits);
+    while (i < edge) cumulative += h.buckets[i++];
+    fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", name, (1ULL << bits) / 1e6, cumulative);
+  }
+  fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.6f\n%s_count %llu\n",
+    name, (unsigned long long)h.count, name, h.sum / 1e6, name, (unsigned long long)h.count);
+}
+
+/**
+ * Print every metric in the Prometheus text format
+ * @param out Stream
+ */
+void prometheus_write(FILE *out) {
+  prometheus_metric(out, "servette_requests_total", "counter", "Responses sent, or abandoned when the client left",
+    metrics_total(offsetof(thread_metrics_t, requests)));
+  fputs("# HELP servette_responses_total Responses by status code\n# TYPE servette_responses_total counter\n", out);
+  for (int code = 100; code < METRIC_STATUS_MAX; code++) {
+    unsigned long long count = metrics_total(offsetof(thread_metrics_t, statuses[code]));
+    if (count) fprintf(out, "servette_responses_total{code=\"%d\"} %llu\n", code, count);
+  }
+  prometheus_metric(out, "servette_sent_bytes_total", "counter", "Response bytes sent, headers included",
+    metrics_total(offsetof(thread_metrics_t, bytes_sent)));
+
+  unsigned long long opened = metrics_total(offsetof(thread_metrics_t, connections_opened));
+  unsigned long long closed = metrics_total(offsetof(thread_metrics_t, connections_closed));
+  prometheus_metric(out, "servette_connections_total", "counter", "Connections accepted", opened);
+  prometheus_metric(out, "servette_connections_open", "gauge", "Connections open", opened - closed);
+
+  static const char *timeout_names[TIMEOUTS] = { "header", "idle", "send", "request" };
+  fputs("# HELP servette_timeouts_total Connections closed because a deadline passed, by deadline\n"
+    "# TYPE servette_timeouts_total counter\n", out);
+  for (int i = 0; i < TIMEOUTS; i++) {
+    fprintf(out, "servette_timeouts_total{deadline=\"%s\"} %llu\n", timeout_names[i],
+      metrics_total(offsetof(thread_metrics_t, timeouts[i])));
+  }
+
+  /**
+   * Threads waiting for work, either for a connection from the queue or
+   * in epoll_wait() or io_uring_enter()
+   */
+  int idle = 0;
+  for (int i = 0; i < NUM_THREADS; i++) {
+    if (SERVER_MODE == MODE_POOL && pool_threads) idle += atomic_load(&pool_threads[i].available);
+    if (SERVER_MODE != MODE_POOL && event_loops) idle += atomic_load(&event_loops[i].available);
+  }
+  fputs("# HELP servette_workers Worker threads or event loops by state\n# TYPE servette_workers gauge\n", out);
+  fprintf(out, "servette_workers{state=\"busy\"} %d\nservette_workers{state=\"idle\"} %d\n",
+    NUM_THREADS - idle, idle);
+  prometheus_metric(out, "servette_queue_depth", "gauge", "Accepted connections waiting for a pool worker",
+    SERVER_MODE == MODE_POOL ? socket_queue_depth(&socket_queue) : 0);
+  fputs("# HELP servette_queue_shed_total Connections the pool acceptor answered 503, by whether the queue was full or standing\n"
+    "# TYPE servette_queue_shed_total counter\n", out);
+  fprintf(out, "servette_queue_shed_total{reason=\"full\"} %llu\nservette_queue_shed_total{reason=\"wait\"} %llu\n",
+    atomic_load(&socket_queue_full), atomic_load(&socket_queue_shed));
+
+  /**
+   * Cache lookups, the hit ratio is hits over hits and misses
+   */
+  unsigned long long file_hits, file_misses;
+  file_cache_counts(&file_hits, &file_misses);
+  pthread_mutex_lock(&listings_lock);
+  unsigned long long listing_hits_now = listing_hits, listing_misses = listing_updates + listing_rescans;
+  pthread_mutex_unlock(&listings_lock);
+  fputs("# HELP servette_cache_lookups_total Cache lookups by cache and result\n"
+    "# TYPE servette_cache_lookups_total counter\n", out);
+  fprintf(out, "servette_cache_lookups_total{cache=\"file\",result=\"hit\"} %llu\n", file_hits);
+  fprintf(out, "servette_cache_lookups_total{cache=\"file\",result=\"miss\"} %llu\n", file_misses);
+  fprintf(out, "servette_cache_lookups_total{cache=\"meta\",result=\"hit\"} %llu\n", (unsigned long long)atomic_load(&meta_hits));
+  fprintf(out, "servette_cache_lookups_total{cache=\"meta\",result=\"miss\"} %llu\n", (unsigned long long)atomic_load(&meta_misses));
+  fprintf(out, "servette_cache_lookups_total{cache=\"listing\",result=\"hit\"} %llu\n", listing_hits_now);
+  fprintf(out, "servette_cache_lookups_total{cache=\"listing\",result=\"miss\"} %llu\n", listing_misses);
+
+  for (int i = 0; i < HISTOGRAMS; i++) {
+    prometheus_histogram(out, i);
+  }
+}
+
+/**
+ * Answer with every metric in the Prometheus text format
+ * @param conn Client connection
+ */
+void serve_metrics(connection_t *conn) {
+  char *body;
+  size_t len;
+  FILE *out = open_memstream(&body, &len);
+  if (out == NULL) {
+    send_http_error(conn, 500);
+    return;
+  }
+  prometheus_write(out);
+  fclose(out);
+  send_file_headers(conn, len, "text/plain; version=0.0.4", ENCODING_IDENTITY);
+  conn_send_memory(conn, body, len, free, body);
+}
+
+/**
+ * Print runtime statistics every time the process receives SIGUSR1
+ * @param  arg Signal set to wait on
+ */
+void *stats_thread(void *arg) {
+  sigset_t *set = (sigset_t *)arg;
+  int sig;
+  while (1) {
+    if (sigwait(set, &sig) != 0) continue;
+
+    /**
+     * @see file_cache.h
+     * @see memory_pool.h
+     * @see compress_pool.h
+     * @see serve_directory.h
+     * @see site_bundle.h
+     * @see meta_cache.h
+     * @see access_log.h
+     * @see metrics.h
+     */
+    file_cache_report(stdout);
+    pool_report(stdout);
+    compress_report(stdout);
+    listing_report(stdout);
+    bundle_report(stdout);
+    meta_report(stdout);
+    access_log_report(stdout);
+    metrics_report(stdout);
+    fflush(stdout);
+  }
+  pthread_exit(NULL);
+}
+
+/**
+ * Start the statistics thread. Must run before any other thread is
+ * created, so they all inherit the blocked SIGUSR1 and leave it to
+ * stats_thread().
+ */
+void start_stats_reporter() {
+  static sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, stats_thread, &set) == 0) {
+    pthread_detach(thread);
+  }
+}
@@ -0,0 +1,79 @@
+/**
+ * Build-time generator for status_table.h
+ * Renders the status line of every known status code, and the fixed
+ * part of every error response, as constant bytes, so staging one is a
+ * copy rather than a sprintf().
+ *
+ * Usage: ./status_gen > status_table.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "get_status_message.h"
+
+/**
+ * Print a blob initializer for a string
+ * @param code HTTP status code
+ * @param str  Bytes
+ */
+void print_blob(int code, const char *str) {
+  printf("  [%d - STATUS_CODE_MIN] = { \"", code);
+  for (const char *c = str; *c; c++) {
+    if (*c == '\r') printf("\\r");
+    else if (*c == '\n') printf("\\n");
+    else if (*c == '"' || *c == '\\') printf("\\%c", *c);
+    else putchar(*c);
+  }
+  printf("\", %zu },\n", strlen(str));
+}
+
+/**
+ * Is this a status code get_status_message() knows?
+ * @param code HTTP status code
+ */
+int known(int code) {
+  return strcmp(get_status_message(code), get_status_message(0)) != 0;
+}
+
+int main() {
+  char line[256], head[256], body[256];
+  int count = 0;
+
+  for (int code = STATUS_CODE_MIN; code < STATUS_CODE_MIN + STATUS_CODES; code++) count += known(code);
+  printf("/**\n * Generated by status_gen from get_status_message.h, do not edit\n");
+  printf(" * %d status codes\n */\n\n", count);
+
+  printf("const http_blob_t status_lines[STATUS_CODES] = {\n");
+  for (int code = STATUS_CODE_MIN; code < STATUS_CODE_MIN + STATUS_CODES; code++) {
+    if (!known(code)) continue;
+    snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n", code, get_status_message(code));
+    print_blob(code, line);
+  }
+  printf("};\n\n");
+
+  /**
+   * Error responses: everything up to the Connection header, which
+   * depends on the connection, and the body
+   * @see send_http_error()
+   */
+  printf("const http_blob_t error_heads[STATUS_CODES] = {\n");
+  for (int code = 400; code < STATUS_CODE_MIN + STATUS_CODES; code++) {
+    if (!known(code)) continue;
+    int len = snprintf(body, sizeof(body), "<h1>HTTP %i: %s</h1><br>", code, get_status_message(code));
+    snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Type: text/html\r\nContent-Length: %d\r\n",
+      code, get_status_message(code), len);
+    print_blob(code, head);
+  }
+  printf("};\n\n");
+
+  printf("const http_blob_t error_bodies[STATUS_CODES] = {\n");
+  for (int code = 400; code < STATUS_CODE_MIN + STATUS_CODES; code++) {
+    if (!known(code)) continue;
+    snprintf(body, sizeof(body), "<h1>HTTP %i: %s</h1><br>", code, get_status_message(code));
+    print_blob(code, body);
+  }
+  printf("};\n");
+
+  return EXIT_SUCCESS;
+}
@@ -3,57 +3,136 @@
  */
 typedef struct _thread_data_t {
   int tid;
-  int available;
+  atomic_int available;
+  int server; // Own listener with --reuseport, -1 to use socket_queue
+  wheel_t wheel;  // Deadline of the worker's connection
+  pthread_mutex_t wheel_lock;  // Shared only with the timer thread
 } thread_data_t;
 
+#include "socket_queue.h"
+#include "admission.h"
+
 /**
- * Socket queue
+ * Socket queue between the acceptor and the workers
+ * @see socket_queue.h
  */
-typedef struct socket_queue_t {
-  int head;
-  int tail;
-  int size;
-  int clients[MAX_CONNECTIONS];
-} socket_queue_t;
 socket_queue_t socket_queue;
-pthread_mutex_t lock_sq;
-pthread_cond_t append_queue;
-pthread_mutex_t append_queue_mx;
 
 /**
- * Add a socket to the queue
- * @param client Client socket
+ * Workers, for the busy and idle gauges
+ * @see stats.h
+ */
+thread_data_t *pool_threads;
+
+/**
+ * The worker running on this thread. Workers block in read() and
+ * sendfile(), so a timer thread turns each worker's wheel and shuts down
+ * the sockets of connections that run out of time, which wakes their
+ * worker. A wheel apiece keeps workers from contending with each other
+ * as they re-arm on every read and write.
+ * @see timer_wheel.h
+ */
+__thread thread_data_t *pool_worker;
+
+/**
+ * Arm a worker's connection timer for its current state. Also called
+ * from inside conn_read() and conn_flush() as a request starts arriving
+ * and as a response moves.
+ * @param conn Client connection
+ */
+void pool_arm(connection_t *conn) {
+  pthread_mutex_lock(&pool_worker->wheel_lock);
+  conn_arm_deadline(&pool_worker->wheel, conn, now_ms());
+  pthread_mutex_unlock(&pool_worker->wheel_lock);
+}
+
+/**
+ * Disarm a worker's connection timer. Done before the socket is closed,
+ * so the timer thread can't shut down a descriptor that has been reused.
+ * @param conn Client connection
+ */
+void pool_disarm(connection_t *conn) {
+  pthread_mutex_lock(&pool_worker->wheel_lock);
+  wheel_cancel(&pool_worker->wheel, &conn->timer);
+  pthread_mutex_unlock(&pool_worker->wheel_lock);
+}
+
+/**
+ * Turn every worker's wheel. Every deadline is at least a second out
+ * when armed, so sleeping up to a second never makes one late.
+ * @param arg Workers
  */
-void enqueue_socket(int client) {
-  pthread_cond_broadcast(&append_queue);
-  pthread_mutex_lock(&lock_sq);
-  if (socket_queue.size != MAX_CONNECTIONS) {
-    if (socket_queue.tail == MAX_CONNECTIONS-1) {
-       socket_queue.tail = -1;
+void *pool_timer_thread(void *arg) {
+  thread_data_t *threads = (thread_data_t *)arg;
+  while (1) {
+    long long now = now_ms();
+    int wait = 1000;
+    for (int i = 0; i < NUM_THREADS; i++) {
+      pthread_mutex_lock(&threads[i].wheel_lock);
+      wheel_timer_t *timer;
+      while ((timer = wheel_expired(&threads[i].wheel, now))) {
+        connection_t *conn = conn_timed_out(timer);
+        shutdown(conn->fd, SHUT_RDWR);
+      }
+      int next = wheel_next(&threads[i].wheel, now);
+      pthread_mutex_unlock(&threads[i].wheel_lock);
+      if (next >= 0 && next < wait) wait = next;
     }
-    socket_queue.clients[(int)++socket_queue.tail] = client;
-    socket_queue.size++;
+    struct timespec ts = { wait / 1000, (wait % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
   }
-  pthread_mutex_unlock(&lock_sq);
+  pthread_exit(NULL);
 }
 
 /**
- * Dequeue the first socket
+ * Give each worker its wheel and start the thread that turns them
+ * @param  threads Workers, not yet started
+ * @return 0 on success, -1 on error
  */
-int dequeue_socket() {
-  pthread_mutex_lock(&lock_sq);
-  if (socket_queue.size == 0) {
-    pthread_mutex_unlock(&lock_sq);
-    return 0;
+int start_pool_timer(thread_data_t *threads) {
+  for (int i = 0; i < NUM_THREADS; i++) {
+    wheel_init(&threads[i].wheel, now_ms());
+    pthread_mutex_init(&threads[i].wheel_lock, NULL);
   }
-  int client = socket_queue.clients[(int)socket_queue.head++];
-  if (client > 0) {
-    if (socket_queue.head == MAX_CONNECTIONS) {
-      socket_queue.head = 0;
-    }
-    socket_queue.size--;
+  pthread_t thread;
+  int rc;
+  if ((rc = pthread_create(&thread, NULL, pool_timer_thread, threads))) {
+    fprintf(stderr, "error: pthread_create, rc: %d\n", rc);
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+/**
+ * Add a socket to the queue, stamped with when it was accepted, unless
+ * admission control turns it away
+ * @param  client Client socket
+ * @return 0 on success, -1 if it should be shed
+ * @see admission.h
+ */
+int enqueue_socket(int client) {
+  long long now = now_us();
+  int verdict = admission_check(socket_queue_depth(&socket_queue), now);
+  if (verdict == ADMIT && socket_queue_push(&socket_queue, client, now) < 0) verdict = SHED_FULL;
+  if (verdict != ADMIT) {
+    atomic_fetch_add_explicit(verdict == SHED_FULL ? &socket_queue_full : &socket_queue_shed,
+      1, memory_order_relaxed);
+    return -1;
   }
-  pthread_mutex_unlock(&lock_sq);
+  return 0;
+}
+
+/**
+ * Dequeue the first socket, waiting for one if the queue is empty
+ * @param  dequeued Set to now_us() when it came off the queue
+ */
+int dequeue_socket(long long *dequeued) {
+  long long accepted;
+  int client = socket_queue_pop_wait(&socket_queue, &accepted);
+  *dequeued = now_us();
+  metrics_observe(HIST_QUEUE, *dequeued - accepted);
+  admission_waited(*dequeued - accepted);
   return client;
 }
 
@@ -64,32 +143,57 @@ int dequeue_socket() {
  */
 void *worker_thread(void *arg) {
   thread_data_t *thread = (thread_data_t *)arg;
+  pool_worker = thread;
   while(1) {
-    // Look for client sockets to dequeue
-    int client = dequeue_socket();
-    if (client > 0) {
-      // Client socket is now out of queue, serve them
-      thread->available = 0;
+    // Wait for a client socket
+    thread->available = 1;
+    int client;
+    long long dequeued = 0;
+    if (thread->server > -1) {
+      // Accept straight from this worker's own listener
+      if ((client = accept(thread->server, NULL, NULL)) < 0) {
+        if (errno != EINTR) perror("Could not accept client");
+        continue;
+      }
+    }else{
+      client = dequeue_socket(&dequeued);
+    }
+    // Client socket is now out of queue, serve them
+    thread->available = 0;
 
+    if (VERBOSE >= 1) {
       printf(
         "Serving client %i via thread #%d\n",
         client,
         thread->tid
       );
-
-      /**
-       * Serve the request
-       * @see handle_request.h
-       */
-      handle_request(client);
-
-      thread->available = 1;
-    } else {
-      // Queue was empty, block until something gets added
-      pthread_cond_wait(&append_queue, &append_queue_mx);
     }
 
-    usleep(ITER_SLEEP_TIME);
+    /**
+     * Read and serve requests, blocking until each response has been
+     * sent, for as long as the client keeps the connection alive. The
+     * timer is re-armed as each request starts arriving and as each
+     * response moves.
+     * @see connection.h
+     * @see handle_request.h
+     */
+    connection_t conn;
+    conn_init(&conn, client);
+    conn.progress = pool_arm;
+    pool_arm(&conn);
+    while (conn_read(&conn) == CONN_IO_DONE) {
+      handle_requests(&conn);
+      conn.state = CONN_SENDING;
+      pool_arm(&conn);
+      if (conn.compress_job) compress_wait(&conn);
+      if (conn_flush(&conn) != CONN_IO_DONE || !conn.keep_alive) break;
+      conn.state = CONN_READING;
+      conn.last_active = now_ms();
+      pool_arm(&conn);
+    }
+    pool_disarm(&conn);
+    conn_close(&conn);
+    if (dequeued) admission_served(now_us() - dequeued);
   }
   pthread_exit(NULL);
 }
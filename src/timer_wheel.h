@@ -0,0 +1,193 @@
+#include <stdint.h>
+#include <limits.h>
+
+/**
+ * Hierarchical timer wheel (Varghese and Lauck), in millisecond ticks.
+ * Level 0 has a slot per tick for the next 64 ms, and each level above
+ * has slots 64 times as wide. A timer goes in the lowest level its
+ * deadline fits in, and is moved down a level when the wheel turns past
+ * its slot, so arming and cancelling are a few pointer writes whatever
+ * the number of timers, and expiring one costs at most one move per
+ * level. Deadlines further out than the top level reaches are parked in
+ * its last slot and re-filed when they come round.
+ *
+ * A wheel belongs to one thread, or is used under the owner's lock.
+ */
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+typedef struct _wheel_timer_t {
+  struct _wheel_timer_t *next;
+  struct _wheel_timer_t **prev;  // Link that points at this timer, NULL when not armed
+  long long expires;             // Tick
+  int level;
+  int slot;
+} wheel_timer_t;
+
+typedef struct {
+  wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  uint64_t occupied[WHEEL_LEVELS];  // Bit per non-empty slot
+  long long tick;                   // Every slot before this one has been run
+  size_t count;
+} wheel_t;
+
+/**
+ * Initialize an empty wheel
+ * @param wheel Wheel
+ * @param now   Current time in ms
+ */
+void wheel_init(wheel_t *wheel, long long now) {
+  memset(wheel, 0, sizeof(wheel_t));
+  wheel->tick = now;
+}
+
+/**
+ * Is a timer armed?
+ * @param timer Timer
+ */
+static inline int wheel_armed(wheel_timer_t *timer) {
+  return timer->prev != NULL;
+}
+
+/**
+ * File a timer in the slot its deadline falls in, counted from the
+ * wheel's current tick
+ * @param wheel Wheel
+ * @param timer Timer, not armed
+ */
+void wheel_insert(wheel_t *wheel, wheel_timer_t *timer) {
+  long long expires = timer->expires;
+  if (expires < wheel->tick) expires = wheel->tick;
+  long long delta = expires - wheel->tick;
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 && delta >= 1LL << (WHEEL_BITS * (level + 1))) level++;
+  if (delta >= 1LL << (WHEEL_BITS * WHEEL_LEVELS)) {
+    expires = wheel->tick + (1LL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+  }
+  int slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+  wheel_timer_t **head = &wheel->slots[level][slot];
+  timer->next = *head;
+  if (*head) (*head)->prev = &timer->next;
+  *head = timer;
+  timer->prev = head;
+  timer->level = level;
+  timer->slot = slot;
+  wheel->occupied[level] |= 1ULL << slot;
+  wheel->count++;
+}
+
+/**
+ * Disarm a timer, if it is armed
+ * @param wheel Wheel
+ * @param timer Timer
+ */
+void wheel_cancel(wheel_t *wheel, wheel_timer_t *timer) {
+  if (timer->prev == NULL) return;
+  *timer->prev = timer->next;
+  if (timer->next) timer->next->prev = timer->prev;
+  if (wheel->slots[timer->level][timer->slot] == NULL) {
+    wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+  }
+  timer->next = NULL;
+  timer->prev = NULL;
+  wheel->count--;
+}
+
+/**
+ * Arm a timer, moving it if it is already armed
+ * @param wheel   Wheel
+ * @param timer   Timer
+ * @param expires Deadline in ms
+ */
+void wheel_arm(wheel_t *wheel, wheel_timer_t *timer, long long expires) {
+  wheel_cancel(wheel, timer);
+  timer->expires = expires;
+  wheel_insert(wheel, timer);
+}
+
+/**
+ * Move every timer in a slot of a higher level down to where it now
+ * belongs, as the wheel reaches it
+ * @param wheel Wheel
+ * @param level Level
+ */
+void wheel_cascade(wheel_t *wheel, int level) {
+  int slot = (wheel->tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+  wheel_timer_t *timer = wheel->slots[level][slot];
+  wheel->slots[level][slot] = NULL;
+  wheel->occupied[level] &= ~(1ULL << slot);
+  while (timer) {
+    wheel_timer_t *next = timer->next;
+    wheel->count--;
+    timer->prev = NULL;
+    wheel_insert(wheel, timer);
+    timer = next;
+  }
+}
+
+/**
+ * Take one timer that has expired off the wheel, turning the wheel up
+ * to now as needed. Call until it returns NULL.
+ * @param  wheel Wheel
+ * @param  now   Current time in ms
+ * @return Expired timer, now disarmed, or NULL if there are no more
+ */
+wheel_timer_t *wheel_expired(wheel_t *wheel, long long now) {
+  while (1) {
+    wheel_timer_t *timer = wheel->slots[0][wheel->tick & WHEEL_MASK];
+    if (timer) {
+      wheel_cancel(wheel, timer);
+      if (timer->expires <= wheel->tick) return timer;
+      wheel_insert(wheel, timer); // Parked beyond the top level
+      continue;
+    }
+    if (wheel->tick >= now) return NULL;
+    if (wheel->count == 0) {
+      wheel->tick = now;
+      return NULL;
+    }
+
+    /**
+     * Skip over empty slots, but stop where the level above cascades
+     */
+    uint64_t ahead = wheel->occupied[0] & (~0ULL << (wheel->tick & WHEEL_MASK));
+    long long next = ahead ? (wheel->tick & ~(long long)WHEEL_MASK) + __builtin_ctzll(ahead)
+                           : (wheel->tick | WHEEL_MASK) + 1;
+    wheel->tick = next < now ? next : now;
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+      if (wheel->tick & ((1LL << (WHEEL_BITS * level)) - 1)) break;
+      wheel_cascade(wheel, level);
+    }
+  }
+}
+
+/**
+ * How long the owner may sleep before the wheel needs turning. Until a
+ * timer is in level 0 this is when its slot cascades, which comes
+ * earlier than it expires.
+ * @param  wheel Wheel
+ * @param  now   Current time in ms
+ * @return ms, -1 if no timer is armed
+ */
+int wheel_next(wheel_t *wheel, long long now) {
+  if (wheel->count == 0) return -1;
+  long long when = -1;
+  for (int level = 0; level < WHEEL_LEVELS && when < 0; level++) {
+    int shift = WHEEL_BITS * level;
+    int current = (wheel->tick >> shift) & WHEEL_MASK;
+    uint64_t ahead = wheel->occupied[level] & (~0ULL << current);
+    if (level > 0) ahead &= ~(1ULL << current);
+    long long base = wheel->tick & ~((1LL << (shift + WHEEL_BITS)) - 1);
+    if (ahead) {
+      when = base + ((long long)__builtin_ctzll(ahead) << shift);
+    }else if (wheel->occupied[level]) {
+      when = base + (1LL << (shift + WHEEL_BITS)); // Comes round after the level above turns
+    }
+  }
+  if (when < 0) return -1;
+  if (when <= now) return 0;
+  return when - now > INT_MAX ? INT_MAX : (int)(when - now);
+}
@@ -0,0 +1,751 @@
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URING_ENTRIES     1024
+#define URING_BUFFERS     512   // Provided receive buffers per loop, a power of two
+#define URING_BUFFER_SIZE 4096
+#define URING_GROUP       0     // Buffer group id of the receive buffers
+
+/**
+ * What a completion is for, kept in the low bits of its user_data. The
+ * rest is the connection, which the slab pool aligns to POOL_ALIGN.
+ */
+#define URING_RECV    1
+#define URING_SEND    2
+#define URING_FILL    3  // File into the connection's pipe
+#define URING_DRAIN   4  // Pipe into the socket
+#define URING_READ    5  // File into the output buffer, when splice() is unsupported
+#define URING_ACCEPT  6
+#define URING_WAKE    7
+#define URING_OP_MASK 7
+
+/**
+ * Registered files, so the listening socket and the eventfd aren't
+ * looked up on every operation
+ */
+#define URING_FILE_SERVER 0
+#define URING_FILE_WAKE   1
+
+/**
+ * One ring per loop thread, only ever touched by that thread
+ */
+typedef struct _uring_t {
+  int fd;
+
+  // Submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local;    // Tail including SQEs not yet handed to the kernel
+  struct io_uring_sqe *sqes;
+
+  // Completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  // Mappings, for uring_destroy()
+  void *sq_map;
+  size_t sq_map_len;
+  void *cq_map;
+  size_t cq_map_len;
+  size_t sqes_len;
+
+  // Receive buffers the kernel picks from as data arrives
+  struct io_uring_buf_ring *buf_ring;
+  char *buffers;
+  unsigned short buf_tail;
+
+  uint64_t wake_count;  // Target of the eventfd read
+} uring_t;
+
+/**
+ * Cleared the first time the kernel rejects a multishot request, after
+ * which accepts and receives are re-armed after every completion
+ */
+atomic_int uring_multishot_accept = 1;
+atomic_int uring_multishot_recv = 1;
+
+/**
+ * Create a ring, map its queues and register the receive buffers and,
+ * when given, the listening socket and the eventfd
+ * @param  ring    Ring
+ * @param  server  Listening socket, -1 for none
+ * @param  wake_fd Eventfd of the loop, -1 for none
+ * @return 0 on success, -1 with errno set on error
+ */
+int uring_create(uring_t *ring, int server, int wake_fd) {
+  memset(ring, 0, sizeof(uring_t));
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+  ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (ring->fd < 0 && errno == EINVAL) {
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  }
+  if (ring->fd < 0) return -1;
+
+  /**
+   * Waiting with a timeout needs IORING_ENTER_EXT_ARG, 5.11
+   */
+  if (!(p.features & IORING_FEAT_EXT_ARG)) {
+    close(ring->fd);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_map_len > ring->sq_map_len) ring->sq_map_len = ring->cq_map_len;
+    ring->cq_map_len = 0;
+  }
+  ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED) {
+    ring->sq_map = NULL;
+    close(ring->fd);
+    return -1;
+  }
+  ring->cq_map = ring->sq_map;
+  if (ring->cq_map_len) {
+    ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring->fd, IORING_OFF_CQ_RING);
+  }
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    ring->fd, IORING_OFF_SQES);
+  if (ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) return -1;
+
+  char *sq = ring->sq_map, *cq = ring->cq_map;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_entries = p.sq_entries;
+  ring->sq_local = *ring->sq_tail;
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  /**
+   * SQE i always sits in slot i of the index array
+   */
+  unsigned *array = (unsigned *)(sq + p.sq_off.array);
+  for (unsigned i = 0; i < p.sq_entries; i++) array[i] = i;
+
+  if (server > -1) {
+    int files[2] = { server, wake_fd };
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, files, 2) < 0) return -1;
+  }
+
+  /**
+   * Provided buffer ring, 5.19. The kernel takes a buffer from it for
+   * each receive completion and we hand it back once copied out.
+   */
+  ring->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->buf_ring == MAP_FAILED) return -1;
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = URING_GROUP;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -1;
+  return 0;
+}
+
+/**
+ * Unmap and close a ring
+ * @param ring Ring
+ */
+void uring_destroy(uring_t *ring) {
+  close(ring->fd);
+  if (ring->buf_ring && ring->buf_ring != MAP_FAILED) {
+    munmap(ring->buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+  }
+  if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_map_len && ring->cq_map != MAP_FAILED) munmap(ring->cq_map, ring->cq_map_len);
+  munmap(ring->sq_map, ring->sq_map_len);
+  free(ring->buffers);
+}
+
+/**
+ * Can this kernel run the io_uring loops? Checks ring setup, provided
+ * buffer rings and every opcode used.
+ * @return 0 if so, -1 with errno set if not
+ */
+int uring_probe() {
+  uring_t ring;
+  if (uring_create(&ring, -1, -1) < 0) {
+    int error = errno;
+    if (ring.fd > -1 && ring.sq_map) uring_destroy(&ring);
+    errno = error;
+    return -1;
+  }
+  size_t len = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, len);
+  int rc = probe ? (int)syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) : -1;
+  int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_SPLICE, IORING_OP_READ };
+  for (size_t i = 0; rc == 0 && i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+      errno = ENOSYS;
+      rc = -1;
+    }
+  }
+  int error = errno;
+  free(probe);
+  uring_destroy(&ring);
+  errno = error;
+  return rc;
+}
+
+/**
+ * Hand the queued SQEs to the kernel and optionally wait for a completion
+ * @param  ring       Ring
+ * @param  wait       Wait for at least one completion
+ * @param  timeout_ms Longest wait, -1 for no limit
+ * @return As io_uring_enter()
+ */
+int uring_enter(uring_t *ring, int wait, int timeout_ms) {
+  unsigned submit = ring->sq_local - *ring->sq_tail;
+  __atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+  unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if (wait && timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    flags |= IORING_ENTER_EXT_ARG;
+  }
+  return syscall(__NR_io_uring_enter, ring->fd, submit, wait ? 1 : 0, flags,
+    flags & IORING_ENTER_EXT_ARG ? (void *)&arg : NULL, sizeof(arg));
+}
+
+/**
+ * Next free SQE, cleared. Submits what is queued if the ring is full.
+ * @param  ring      Ring
+ * @param  opcode    IORING_OP_*
+ * @param  fd        File the operation works on
+ * @param  user_data Returned with the completion
+ */
+struct io_uring_sqe *uring_sqe(uring_t *ring, int opcode, int fd, uint64_t user_data) {
+  while (ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+    if (uring_enter(ring, 0, 0) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+      perror("io_uring_enter");
+    }
+  }
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local++ & ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = user_data;
+  return sqe;
+}
+
+/**
+ * Return a receive buffer to the kernel
+ * @param ring Ring
+ * @param bid  Buffer id
+ */
+void uring_buffer_put(uring_t *ring, int bid) {
+  struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * URING_BUFFER_SIZE);
+  buf->len = URING_BUFFER_SIZE;
+  buf->bid = bid;
+  ring->buf_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Accept clients on the listening socket, all of them with one request
+ * where the kernel can
+ * @param ring Ring
+ */
+void uring_accept(uring_t *ring) {
+  struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_ACCEPT, URING_FILE_SERVER, URING_ACCEPT);
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  if (atomic_load_explicit(&uring_multishot_accept, memory_order_relaxed)) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/**
+ * Receive from a client into the provided buffers until it hangs up
+ * @param ring Ring
+ * @param conn Client connection
+ */
+void uring_recv(uring_t *ring, connection_t *conn) {
+  struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_RECV, conn->fd, (uintptr_t)conn | URING_RECV);
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_GROUP;
+  if (atomic_load_explicit(&uring_multishot_recv, memory_order_relaxed)) sqe->ioprio = IORING_RECV_MULTISHOT;
+  conn->uring_recv = 1;
+}
+
+/**
+ * Wait for the compression threads to hand jobs back
+ * @param ring Ring
+ */
+void uring_wake(uring_t *ring) {
+  struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_READ, URING_FILE_WAKE, URING_WAKE);
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->addr = (uint64_t)(uintptr_t)&ring->wake_count;
+  sqe->len = sizeof(ring->wake_count);
+}
+
+/**
+ * Queue a splice() between two files
+ * @param  ring    Ring
+ * @param  conn    Client connection
+ * @param  op      URING_FILL or URING_DRAIN
+ * @param  in      Source
+ * @param  off_in  Offset in the source, -1 for a pipe
+ * @param  out     Destination
+ * @param  len     Number of bytes
+ * @param  flags   SPLICE_F_*
+ */
+struct io_uring_sqe *uring_splice(uring_t *ring, connection_t *conn, int op, int in, off_t off_in,
+    int out, size_t len, unsigned flags) {
+  struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_SPLICE, out, (uintptr_t)conn | op);
+  sqe->splice_fd_in = in;
+  sqe->splice_off_in = (uint64_t)off_in;
+  sqe->off = (uint64_t)-1;
+  sqe->len = len;
+  sqe->splice_flags = flags;
+  conn->uring_ops++;
+  return sqe;
+}
+
+/**
+ * Create the connection's pipe, as large as the system allows up to a
+ * sendfile() chunk so each fill of it is one splice()
+ * @param  conn Client connection
+ * @return 0 on success, -1 on error
+ */
+int uring_pipe(connection_t *conn) {
+  if (pipe2(conn->pipe_fds, O_CLOEXEC) < 0) return -1;
+  fcntl(conn->pipe_fds[1], F_SETPIPE_SZ, SENDFILE_CHUNK);
+  int size = fcntl(conn->pipe_fds[1], F_GETPIPE_SZ);
+  conn->pipe_size = size > 0 ? size : 65536;
+  return 0;
+}
+
+/**
+ * Queue the next step of sending the staged responses. Staged bytes go
+ * out with one sendmsg(), linked to the splice()s that move the next
+ * chunk of a file body from the page cache to the socket through a
+ * pipe, so a response usually takes a single submission. A short fill
+ * cancels the rest of the chain. A linked send carries MSG_WAITALL, or
+ * a short one would complete normally and let the file bytes out ahead
+ * of its unsent tail; with it the ring retries partial sends and fails
+ * the link only on a real error. The next call carries on from wherever
+ * the completions left the offsets.
+ * @param  ring Ring
+ * @param  conn Client connection
+ * @return CONN_IO_DONE when everything was sent, CONN_IO_AGAIN when
+ *         operations were queued, CONN_IO_ERROR on error
+ */
+int uring_send(uring_t *ring, connection_t *conn) {
+  while (1) {
+    int staged = conn->out_sent < conn->out_len || conn->body_sent < conn->body_len;
+    if (!staged) conn_out_done(conn);
+
+    /**
+     * There is no sendfile() on a ring, file bodies are spliced
+     */
+    if (conn->file_fd > -1 && conn->file_mode == FILE_BODY_SENDFILE) conn->file_mode = FILE_BODY_SPLICE;
+    if (conn->file_fd > -1 && conn->file_mode == FILE_BODY_SPLICE && conn->pipe_fds[0] < 0 &&
+        uring_pipe(conn) < 0) {
+      conn->file_mode = FILE_BODY_COPY;
+    }
+    int more = conn->file_fd > -1 && (conn->file_remaining > 0 || conn->pipe_pending > 0);
+
+    if (staged) {
+      int iovcnt = 0;
+      if (conn->out_sent < conn->out_len) {
+        conn->uring_iov[iovcnt].iov_base = conn->out + conn->out_sent;
+        conn->uring_iov[iovcnt++].iov_len = conn->out_len - conn->out_sent;
+      }
+      if (conn->body_sent < conn->body_len) {
+        conn->uring_iov[iovcnt].iov_base = (void *)(conn->body + conn->body_sent);
+        conn->uring_iov[iovcnt++].iov_len = conn->body_len - conn->body_sent;
+      }
+      memset(&conn->uring_msg, 0, sizeof(conn->uring_msg));
+      conn->uring_msg.msg_iov = conn->uring_iov;
+      conn->uring_msg.msg_iovlen = iovcnt;
+      struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_SENDMSG, conn->fd, (uintptr_t)conn | URING_SEND);
+      sqe->addr = (uint64_t)(uintptr_t)&conn->uring_msg;
+      sqe->len = 1;
+      sqe->msg_flags = more ? MSG_MORE : 0;
+      conn->uring_ops++;
+      if (!more || conn->file_mode == FILE_BODY_COPY) return CONN_IO_AGAIN;
+      sqe->msg_flags |= MSG_WAITALL;
+      sqe->flags |= IOSQE_IO_LINK;
+    }
+    if (conn->file_fd < 0) return staged ? CONN_IO_AGAIN : CONN_IO_DONE;
+
+    if (!more) {
+
+      /**
+       * More multipart/byteranges parts to go
+       */
+      if (conn->range_count == 0) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+      }else if (conn_next_range(conn) < 0) {
+        return CONN_IO_ERROR;
+      }
+      continue;
+    }
+
+    /**
+     * Last resort: read the file through the output buffer, which is
+     * empty here since nothing was staged
+     */
+    if (conn->file_mode == FILE_BODY_COPY) {
+      if (conn->out_cap < FILE_READ_BUFFER) {
+        char *out = pool_grow(conn->out, 0, &conn->out_cap, FILE_READ_BUFFER);
+        if (out == NULL) return CONN_IO_ERROR;
+        conn->out = out;
+      }
+      size_t want = FILE_READ_BUFFER;
+      if ((off_t)want > conn->file_remaining) want = conn->file_remaining;
+      struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_READ, conn->file_fd, (uintptr_t)conn | URING_READ);
+      sqe->addr = (uint64_t)(uintptr_t)conn->out;
+      sqe->len = want;
+      sqe->off = conn->file_offset;
+      conn->uring_ops++;
+      return CONN_IO_AGAIN;
+    }
+
+    if (conn->pipe_pending == 0) {
+      size_t want = conn->file_remaining > (off_t)conn->pipe_size ? conn->pipe_size : conn->file_remaining;
+      struct io_uring_sqe *sqe = uring_splice(ring, conn, URING_FILL, conn->file_fd, conn->file_offset,
+        conn->pipe_fds[1], want, SPLICE_F_MOVE);
+      sqe->flags |= IOSQE_IO_LINK;
+      uring_splice(ring, conn, URING_DRAIN, conn->pipe_fds[0], -1, conn->fd, want,
+        SPLICE_F_MOVE | (conn->file_remaining > (off_t)want ? SPLICE_F_MORE : 0));
+    }else{
+      uring_splice(ring, conn, URING_DRAIN, conn->pipe_fds[0], -1, conn->fd, conn->pipe_pending,
+        SPLICE_F_MOVE | (conn->file_remaining > 0 ? SPLICE_F_MORE : 0));
+    }
+    return CONN_IO_AGAIN;
+  }
+}
+
+/**
+ * Advance a connection's state machine as far as the data received and
+ * the operations completed so far allow
+ * @param loop Event loop
+ * @param conn Client connection
+ */
+void uring_drive(event_loop_t *loop, connection_t *conn) {
+  while (1) {
+    switch (conn->state) {
+
+      case CONN_READING:
+        if (!conn_request_ready(conn)) {
+          if (conn->uring_eof) {
+            conn->state = CONN_CLOSING;
+            continue;
+          }
+          loop_arm(loop, conn);
+          return;
+        }
+        handle_requests(conn);
+        if (conn->compress_job && loop_park(loop, conn)) return;
+        conn->state = CONN_SENDING;
+        continue;
+
+      case CONN_WAITING:
+        return;
+
+      case CONN_SENDING:
+        if (conn->uring_ops) return;
+        switch (uring_send(loop->uring, conn)) {
+          case CONN_IO_AGAIN: loop_arm(loop, conn); return;
+          case CONN_IO_ERROR: conn->state = CONN_CLOSING; continue;
+        }
+        access_log_sent(conn);
+        conn->state = conn->keep_alive ? CONN_READING : CONN_CLOSING;
+        continue;
+
+      case CONN_CLOSING:
+        wheel_cancel(&loop->wheel, &conn->timer);
+
+        /**
+         * The kernel still holds operations on the socket. Shutting it
+         * down completes them, and the last completion frees the
+         * connection.
+         */
+        if (conn->uring_recv || conn->uring_ops) {
+          shutdown(conn->fd, SHUT_RDWR);
+          return;
+        }
+        conn_close(conn);
+        slab_free(&connection_pool, conn);
+        return;
+    }
+  }
+}
+
+/**
+ * Copy received bytes out of a provided buffer into the connection's
+ * receive buffer
+ * @param  conn Client connection
+ * @param  data Received bytes
+ * @param  len  Number of bytes
+ * @return 0 on success, -1 if they don't fit within the request size limits
+ */
+int uring_take(connection_t *conn, const char *data, size_t len) {
+  if (conn->in_len == 0) conn->request_us = now_us();
+  while (len > 0) {
+    if (conn->in_len == conn->in_cap && conn_grow_in(conn) < 0) return -1;
+    size_t n = conn->in_cap - conn->in_len;
+    if (n > len) n = len;
+    memcpy(conn->in + conn->in_len, data, n);
+    conn->in_len += n;
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+ * Handle a receive completion
+ * @param loop  Event loop
+ * @param conn  Client connection
+ * @param res   Bytes received, or -errno
+ * @param flags CQE flags
+ * @param now   Current time in ms
+ */
+void uring_received(event_loop_t *loop, connection_t *conn, int res, unsigned flags, long long now) {
+  uring_t *ring = loop->uring;
+  if (!(flags & IORING_CQE_F_MORE)) conn->uring_recv = 0;
+  if (res > 0) {
+    int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+    /**
+     * Data beyond what the receive buffer may hold can't be pushed back
+     * into the socket, so the connection ends after what fit
+     */
+    if (conn->state != CONN_CLOSING && !conn->uring_eof &&
+        uring_take(conn, ring->buffers + (size_t)bid * URING_BUFFER_SIZE, res) < 0) {
+      conn->uring_eof = 1;
+    }
+    uring_buffer_put(ring, bid);
+    if (conn->state == CONN_READING) conn->last_active = now;
+  }else if (res == -EINVAL && atomic_exchange(&uring_multishot_recv, 0)) {
+    puts("Note: this kernel has no multishot receive, re-arming after each one");
+  }else if (res != -ENOBUFS) {
+    conn->uring_eof = 1; // Hangup or error
+  }
+  if (!conn->uring_recv && !conn->uring_eof && conn->state != CONN_CLOSING) uring_recv(ring, conn);
+  if (conn->state == CONN_READING || conn->state == CONN_CLOSING) uring_drive(loop, conn);
+}
+
+/**
+ * Handle the completion of a send, splice or file read
+ * @param loop Event loop
+ * @param conn Client connection
+ * @param op   URING_SEND, URING_FILL, URING_DRAIN or URING_READ
+ * @param res  Bytes moved, or -errno
+ * @param now  Current time in ms
+ */
+void uring_sent(event_loop_t *loop, connection_t *conn, int op, int res, long long now) {
+  conn->uring_ops--;
+  if (res == -ECANCELED) {
+    // Linked behind a short or failed operation, nothing was moved
+  }else if (res == -EINVAL && op == URING_FILL) {
+    conn->file_mode = FILE_BODY_COPY;
+  }else if (res < 0 || (res == 0 && op != URING_SEND)) {
+    if (conn->state == CONN_SENDING) conn->state = CONN_CLOSING; // Error, or the file shrank under us
+  }else{
+    switch (op) {
+      case URING_SEND:
+        conn_wrote_out(conn, res);
+        break;
+      case URING_FILL:
+        conn->pipe_pending += res;
+        conn->file_offset += res;
+        conn->file_remaining -= res;
+        break;
+      case URING_DRAIN:
+        conn->bytes_sent += res;
+        conn->pipe_pending -= res;
+        break;
+      case URING_READ:
+        conn->out_len = res;
+        conn->file_offset += res;
+        conn->file_remaining -= res;
+        break;
+    }
+    if (conn->state == CONN_SENDING) {
+      conn->last_active = now;
+      loop_arm(loop, conn);
+    }
+  }
+  if (conn->uring_ops == 0) uring_drive(loop, conn);
+}
+
+/**
+ * Stage the responses of every finished compression job and carry on
+ * sending them
+ * @param loop Event loop
+ * @param now  Current time in ms
+ */
+void uring_resume(event_loop_t *loop, long long now) {
+  pthread_mutex_lock(&loop->done_lock);
+  compress_job_t *job = loop->done;
+  loop->done = NULL;
+  pthread_mutex_unlock(&loop->done_lock);
+
+  while (job) {
+    compress_job_t *next = job->next;
+    connection_t *conn = job->conn;
+    compress_finish(conn, job);
+    conn->state = CONN_SENDING;
+    conn->last_active = now;
+    uring_drive(loop, conn);
+    job = next;
+  }
+}
+
+/**
+ * Close connections whose deadline has passed. Operations still in
+ * flight are cancelled by the shutdown in uring_drive().
+ * @param  loop Event loop
+ * @param  now  Current time in ms
+ * @return ms until the wheel next needs turning, -1 if no timer is armed
+ */
+int uring_expire(event_loop_t *loop, long long now) {
+  wheel_timer_t *timer;
+  while ((timer = wheel_expired(&loop->wheel, now))) {
+    connection_t *conn = conn_timed_out(timer);
+    conn->state = CONN_CLOSING;
+    uring_drive(loop, conn);
+  }
+  return wheel_next(&loop->wheel, now);
+}
+
+/**
+ * Handle every completion posted so far
+ * @param loop Event loop
+ * @param now  Current time in ms
+ */
+void uring_reap(event_loop_t *loop, long long now) {
+  uring_t *ring = loop->uring;
+  unsigned head = *ring->cq_head;
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    uint64_t data = cqe->user_data;
+    int res = cqe->res;
+    unsigned flags = cqe->flags;
+    __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+
+    connection_t *conn = (connection_t *)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK);
+    switch (data & URING_OP_MASK) {
+      case URING_ACCEPT:
+        if (res >= 0) {
+          conn = slab_alloc(&connection_pool);
+          if (conn == NULL) {
+            close(res);
+          }else{
+            conn_init(conn, res);
+            loop_arm(loop, conn);
+            uring_recv(ring, conn);
+          }
+        }else if (res == -EINVAL && atomic_exchange(&uring_multishot_accept, 0)) {
+          puts("Note: this kernel has no multishot accept, re-arming after each one");
+        }else if (res != -EAGAIN && res != -EINTR) {
+          errno = -res;
+          perror("Could not accept client");
+        }
+        if (!(flags & IORING_CQE_F_MORE)) uring_accept(ring);
+        break;
+
+      case URING_WAKE:
+        uring_resume(loop, now);
+        uring_wake(ring);
+        break;
+
+      case URING_RECV:
+        uring_received(loop, conn, res, flags, now);
+        break;
+
+      default:
+        uring_sent(loop, conn, data & URING_OP_MASK, res, now);
+        break;
+    }
+  }
+}
+
+/**
+ * Wait for completions and drive the connections they belong to. Every
+ * submission and every wait of an iteration is a single io_uring_enter().
+ * @param  arg Event loop
+ */
+void *uring_loop_thread(void *arg) {
+  event_loop_t *loop = (event_loop_t *)arg;
+  uring_t ring;
+
+  /**
+   * Created here, as only the thread that creates a single-issuer ring
+   * may submit to it
+   */
+  if (uring_create(&ring, loop->server, loop->wake_fd) < 0 ||
+      (ring.buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE)) == NULL) {
+    perror("Could not set up io_uring");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < URING_BUFFERS; i++) uring_buffer_put(&ring, i);
+  loop->uring = &ring;
+  uring_accept(&ring);
+  uring_wake(&ring);
+
+  while (1) {
+    int timeout = uring_expire(loop, now_ms());
+    atomic_store_explicit(&loop->available, 1, memory_order_relaxed);
+    int rc = uring_enter(&ring, 1, timeout);
+    atomic_store_explicit(&loop->available, 0, memory_order_relaxed);
+    if (rc < 0 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+      perror("io_uring_enter");
+    }
+    uring_reap(loop, now_ms());
+  }
+  pthread_exit(NULL);
+}
+
+/**
+ * Start count io_uring loop threads
+ * @param servers Listening socket for each loop, may all be the same one
+ * @param count   Number of loop threads
+ * @param loops   Storage for count loop structs
+ * @param threads Storage for count thread handles
+ * @return 0 on success, -1 on error
+ */
+int start_uring_loops(int servers[], int count, event_loop_t loops[], pthread_t threads[]) {
+  for (int i = 0; i < count; i++) {
+    if (event_loop_init(&loops[i], i, servers[i]) < 0) return -1;
+
+    /**
+     * The ring reads the eventfd for the loop, and would be handed
+     * EAGAIN rather than wait if it were nonblocking
+     */
+    fcntl(loops[i].wake_fd, F_SETFL, fcntl(loops[i].wake_fd, F_GETFL) & ~O_NONBLOCK);
+    int rc;
+    if ((rc = pthread_create(&threads[i], NULL, uring_loop_thread, &loops[i]))) {
+      fprintf(stderr, "error: pthread_create, rc: %d\n", rc);
+      return -1;
+    }
+    if (PIN_CPUS) pin_thread(threads[i], i);
+  }
+  event_loops = loops;
+  return 0;
+}
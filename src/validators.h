@@ -0,0 +1,329 @@
+#define ETAG_LEN 80
+#define ETAG_MEMO_SLOTS 4096
+#define ETAG_QUEUE_MAX 64
+#define ETAG_HASH_INLINE (64 << 10)  // Largest file an event loop hashes itself
+
+/**
+ * Content hashes, remembered per file version so each version is read
+ * and hashed once
+ */
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  uint64_t hash;
+} etag_memo_t;
+
+etag_memo_t etag_memo[ETAG_MEMO_SLOTS];
+pthread_mutex_t etag_memo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Parse an IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT"
+ * @param  p    Date
+ * @param  len  Length of the date
+ * @param  time Set to the date
+ * @return 0 on success, -1 if it isn't a date
+ */
+int parse_http_date(const char *p, size_t len, time_t *time) {
+  char date[64];
+  struct tm tm;
+  if (len >= sizeof(date)) return -1;
+  memcpy(date, p, len);
+  date[len] = '\0';
+  memset(&tm, 0, sizeof(tm));
+  char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != '\0') return -1;
+  *time = timegm(&tm);
+  return 0;
+}
+
+/**
+ * Format a time as an IMF-fixdate
+ * @param out  Output, at least 32 bytes
+ * @param time Time
+ */
+void format_http_date(char out[], time_t time) {
+  static const char *days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+  static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  sprintf(out, "%s, %02d %s %04d %02d:%02d:%02d GMT", days[tm.tm_wday], tm.tm_mday,
+    months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/**
+ * FNV-1a hash of a file's contents, read in chunks, if it is still the
+ * version that was stat()ed
+ * @param  path  File
+ * @param  size  Its size
+ * @param  mtime Its modification time
+ * @return Hash, 0 if the file could not be read or has changed
+ */
+uint64_t content_hash(const char *path, off_t size, struct timespec *mtime) {
+  uint64_t hash = 14695981039346656037ULL;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size != size ||
+      st.st_mtim.tv_sec != mtime->tv_sec || st.st_mtim.tv_nsec != mtime->tv_nsec) {
+    close(fd);
+    return 0;
+  }
+  unsigned char chunk[16384];
+  off_t got = 0;
+  while (got < size) {
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    for (ssize_t i = 0; i < n; i++) {
+      hash ^= chunk[i];
+      hash *= 1099511628211ULL;
+    }
+    got += n;
+  }
+  close(fd);
+  return got == size ? hash : 0;
+}
+
+/**
+ * Look a file version up in the memo
+ * @return Hash, 0 if it hasn't been hashed
+ */
+uint64_t etag_memo_get(dev_t dev, ino_t ino, off_t size, struct timespec *mtime) {
+  etag_memo_t *slot = &etag_memo[(ino ^ (dev << 7)) % ETAG_MEMO_SLOTS];
+  pthread_mutex_lock(&etag_memo_lock);
+  int hit = slot->hash && slot->dev == dev && slot->ino == ino && slot->size == size &&
+    slot->mtime.tv_sec == mtime->tv_sec && slot->mtime.tv_nsec == mtime->tv_nsec;
+  uint64_t hash = hit ? slot->hash : 0;
+  pthread_mutex_unlock(&etag_memo_lock);
+  return hash;
+}
+
+/**
+ * Remember the hash of a file version
+ */
+void etag_memo_put(dev_t dev, ino_t ino, off_t size, struct timespec *mtime, uint64_t hash) {
+  etag_memo_t *slot = &etag_memo[(ino ^ (dev << 7)) % ETAG_MEMO_SLOTS];
+  pthread_mutex_lock(&etag_memo_lock);
+  slot->dev = dev;
+  slot->ino = ino;
+  slot->size = size;
+  slot->mtime = *mtime;
+  slot->hash = hash;
+  pthread_mutex_unlock(&etag_memo_lock);
+}
+
+/**
+ * Files waiting for the hasher thread, under etag_memo_lock
+ */
+typedef struct {
+  etag_memo_t version;
+  char *path;
+} etag_job_t;
+
+etag_job_t etag_queue[ETAG_QUEUE_MAX];
+int etag_queue_head, etag_queue_len;
+pthread_cond_t etag_queue_ready = PTHREAD_COND_INITIALIZER;
+int etag_hasher_running;
+
+/**
+ * Queue a file version for the hasher thread, unless it is already
+ * queued or the queue is full, in which case a later request asks again
+ */
+void etag_hash_later(const char *path, dev_t dev, ino_t ino, off_t size, struct timespec *mtime) {
+  pthread_mutex_lock(&etag_memo_lock);
+  for (int i = 0; i < etag_queue_len; i++) {
+    etag_memo_t *queued = &etag_queue[(etag_queue_head + i) % ETAG_QUEUE_MAX].version;
+    if (queued->dev == dev && queued->ino == ino && queued->size == size &&
+        queued->mtime.tv_sec == mtime->tv_sec && queued->mtime.tv_nsec == mtime->tv_nsec) {
+      pthread_mutex_unlock(&etag_memo_lock);
+      return;
+    }
+  }
+  char *copy;
+  if (etag_queue_len < ETAG_QUEUE_MAX && (copy = strdup(path)) != NULL) {
+    etag_job_t *job = &etag_queue[(etag_queue_head + etag_queue_len++) % ETAG_QUEUE_MAX];
+    job->version = (etag_memo_t){ dev, ino, size, *mtime, 0 };
+    job->path = copy;
+    pthread_cond_signal(&etag_queue_ready);
+  }
+  pthread_mutex_unlock(&etag_memo_lock);
+}
+
+/**
+ * Hasher thread: hash queued files into the memo
+ * @param arg Unused
+ */
+void *etag_hasher(void *arg) {
+  while (1) {
+    pthread_mutex_lock(&etag_memo_lock);
+    while (etag_queue_len == 0) pthread_cond_wait(&etag_queue_ready, &etag_memo_lock);
+    etag_job_t job = etag_queue[etag_queue_head];
+    etag_queue_head = (etag_queue_head + 1) % ETAG_QUEUE_MAX;
+    etag_queue_len--;
+    pthread_mutex_unlock(&etag_memo_lock);
+
+    etag_memo_t *v = &job.version;
+    uint64_t hash = content_hash(job.path, v->size, &v->mtime);
+    if (hash) etag_memo_put(v->dev, v->ino, v->size, &v->mtime, hash);
+    free(job.path);
+  }
+  pthread_exit(NULL);
+}
+
+/**
+ * Start the hasher thread for --etag=content. Without it, every file is
+ * hashed by the thread that serves it.
+ */
+void start_etag_hasher() {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, etag_hasher, NULL) != 0) {
+    perror("Note: hashing files on the I/O threads");
+    return;
+  }
+  pthread_detach(thread);
+  etag_hasher_running = 1;
+}
+
+/**
+ * Content hash of one version of a file, from the memo if it has been
+ * hashed before. Pool workers block on files anyway and hash a new
+ * version themselves, as do the event loops for small files; larger
+ * ones would stall every connection on the loop, so they go to the
+ * hasher thread and get the stat() tag until it is done.
+ * @param  path  File
+ * @param  dev   Device, from stat()
+ * @param  ino   Inode
+ * @param  size  Size
+ * @param  mtime Modification time
+ * @return Hash, 0 if the file could not be read or isn't hashed yet
+ */
+uint64_t memo_content_hash(const char *path, dev_t dev, ino_t ino, off_t size, struct timespec *mtime) {
+  uint64_t hash = etag_memo_get(dev, ino, size, mtime);
+  if (hash) return hash;
+  if (etag_hasher_running && SERVER_MODE != MODE_POOL && size > ETAG_HASH_INLINE) {
+    etag_hash_later(path, dev, ino, size, mtime);
+    return 0;
+  }
+  if ((hash = content_hash(path, size, mtime)) == 0) return 0;
+  etag_memo_put(dev, ino, size, mtime, hash);
+  return hash;
+}
+
+/**
+ * Make the entity tag for one representation of a file. Compressed
+ * representations get the coding appended, so they never share a tag
+ * with the identity bytes.
+ * @param etag     Output, ETAG_LEN bytes, including the quotes
+ * @param path     File the representation is read from or made from
+ * @param dev      Device of path, from stat()
+ * @param ino      Inode of path
+ * @param size     Size of path
+ * @param mtime    Modification time of path
+ * @param encoding Content coding of the representation
+ */
+void make_etag(char etag[], const char *path, dev_t dev, ino_t ino, off_t size,
+    struct timespec *mtime, int encoding) {
+  uint64_t hash = ETAG_MODE == ETAG_CONTENT ? memo_content_hash(path, dev, ino, size, mtime) : 0;
+  int len;
+  if (hash) {
+    len = snprintf(etag, ETAG_LEN, "\"%016llx", (unsigned long long)hash);
+  }else{
+    len = snprintf(etag, ETAG_LEN, "\"%llx-%llx-%llx.%lx", (unsigned long long)ino,
+      (unsigned long long)size, (unsigned long long)mtime->tv_sec, mtime->tv_nsec);
+  }
+  if (encoding != ENCODING_IDENTITY) {
+    len += snprintf(etag + len, ETAG_LEN - len, "-%s", encodings[encoding].name);
+  }
+  snprintf(etag + len, ETAG_LEN - len, "\"");
+}
+
+/**
+ * Does an If-None-Match list name an entity tag? Uses the weak
+ * comparison, as If-None-Match must.
+ * @param buf  Receive buffer
+ * @param list Header value
+ * @param etag Entity tag, quoted
+ */
+int etag_list_matches(const char *buf, http_view_t list, const char *etag) {
+  size_t len = strlen(etag);
+  const char *p = buf + list.offset, *end = p + list.length;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    if (p < end && *p == '*') return 1;
+    if (end - p > 2 && p[0] == 'W' && p[1] == '/') p += 2;
+    const char *start = p;
+    while (p < end && *p != ',') p++;
+    const char *stop = p;
+    while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t')) stop--;
+    if ((size_t)(stop - start) == len && memcmp(start, etag, len) == 0) return 1;
+  }
+  return 0;
+}
+
+/**
+ * Does the client already have this representation? If-None-Match wins
+ * over If-Modified-Since when both are sent.
+ * @param conn  Client connection, with its request parsed
+ * @param etag  Entity tag of the representation
+ * @param mtime Modification time of the file
+ */
+int request_not_modified(connection_t *conn, const char *etag, struct timespec *mtime) {
+  http_header_t *header = http_find_header(conn->in, &conn->request, "If-None-Match");
+  if (header != NULL) return etag_list_matches(conn->in, header->value, etag);
+
+  header = http_find_header(conn->in, &conn->request, "If-Modified-Since");
+  time_t since;
+  if (header == NULL || parse_http_date(conn->in + header->value.offset, header->value.length, &since) < 0) {
+    return 0;
+  }
+  return mtime->tv_sec <= since;
+}
+
+/**
+ * Stage the ETag and Last-Modified headers
+ * @param conn  Client connection
+ * @param etag  Entity tag
+ * @param mtime Modification time
+ */
+void send_validator_headers(connection_t *conn, const char *etag, struct timespec *mtime) {
+  char date[32];
+  format_http_date(date, mtime->tv_sec);
+  send_http_header(conn, "ETag", (char *)etag);
+  send_http_header(conn, "Last-Modified", date);
+}
+
+/**
+ * Stage a 304 for a representation the request was already found to
+ * have, e.g. once the request itself has been consumed
+ * @param conn      Client connection
+ * @param etag      Entity tag of the representation
+ * @param mtime     Modification time of the file
+ * @param mime_type Content-Type, for Vary
+ */
+void send_not_modified(connection_t *conn, const char *etag, struct timespec *mtime, const char *mime_type) {
+  send_http_status(conn, 304);
+  send_validator_headers(conn, etag, mtime);
+  if (mime_compressible(mime_type)) {
+    send_http_header(conn, "Vary", "Accept-Encoding");
+  }
+  send_connection_header(conn);
+  conn_append(conn, "\r\n", 2);
+}
+
+/**
+ * Answer a conditional GET for an unchanged representation with a
+ * body-less 304, before any file is opened
+ * @param  conn      Client connection
+ * @param  etag      Entity tag of the representation
+ * @param  mtime     Modification time of the file
+ * @param  mime_type Content-Type, for Vary
+ * @return 1 if a 304 was staged, 0 to send the representation
+ */
+int serve_not_modified(connection_t *conn, const char *etag, struct timespec *mtime, const char *mime_type) {
+  if (!request_not_modified(conn, etag, mtime)) return 0;
+  send_not_modified(conn, etag, mtime, mime_type);
+  return 1;
+}